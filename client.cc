@@ -5,6 +5,7 @@
 #include <openssl/rand.h>
 #include <time.h>
 #include "nanoclock.hpp"
+#include "metrics.hpp"
 #include "rng.hpp"
 
 #include "dfterm2_limits.hpp"
@@ -14,6 +15,10 @@ using namespace trankesbel;
 using namespace dfterm;
 using namespace boost;
 
+/* Writes to client at least this large are sent with zero copy,
+   if the socket supports it. Typically only full screen redraws. */
+static const size_t client_zero_copy_threshold = 32768;
+
 ClientTelnetSession::ClientTelnetSession() : TelnetSession()
 {
 };
@@ -59,6 +64,73 @@ bool ClientTelnetSession::writeRawData(const void* data, size_t* size)
     return true;
 }
 
+bool ClientTelnetSession::writeRawDataVector(const DataSpan* spans, size_t spans_count, size_t* size)
+{
+    return writeRawDataVectorZeroCopy(spans, spans_count, vector<SP<const void> >(), size);
+}
+
+bool ClientTelnetSession::writeRawDataVectorZeroCopy(const DataSpan* spans, size_t spans_count, const vector<SP<const void> > &owners, size_t* size)
+{
+    assert(size);
+
+    (*size) = 0;
+    SP<Client> spc = client.lock();
+    if (!spc) return false;
+
+    SP<Socket> s = spc->getSocket();
+    if (!s) return false;
+
+    if (!s->active()) return false;
+    if (spans_count == 0) return true;
+
+    if (owners.empty())
+        s->reapZeroCopyCompletions();
+
+    size_t total = 0;
+    size_t i1;
+    for (i1 = 0; i1 < spans_count; ++i1)
+        total += spans[i1].size;
+
+    /* Send until everything is out or socket can't take more. After a
+       short write, skip the spans that were sent and the written part of 
+       the next one. */
+    vector<DataSpan> remaining;
+    const DataSpan* send_spans = spans;
+    size_t send_spans_count = spans_count;
+    size_t result = 0;
+    do
+    {
+        if (!owners.empty())
+            result = s->sendvZeroCopy(send_spans, send_spans_count, owners);
+        else
+            result = s->sendv(send_spans, send_spans_count);
+        if (!s->active()) return false;
+        if (result == 0) break;
+
+        (*size) += result;
+        if ((*size) >= total) break;
+
+        if (remaining.empty())
+            remaining.assign(spans, spans + spans_count);
+        vector<DataSpan>::iterator i2 = remaining.begin();
+        while (i2 != remaining.end() && result >= i2->size)
+        {
+            result -= i2->size;
+            ++i2;
+        }
+        remaining.erase(remaining.begin(), i2);
+        if (!remaining.empty())
+        {
+            remaining.front().data = (const char*) remaining.front().data + result;
+            remaining.front().size -= result;
+        }
+        send_spans = &remaining[0];
+        send_spans_count = remaining.size();
+    } while(send_spans_count > 0);
+
+    return true;
+}
+
 bool ClientTelnetSession::readRawData(void* data, size_t* size)
 {
     assert(size);
@@ -103,6 +175,8 @@ Client::Client(SP<Socket> client_socket)
     refresh_per_second = 1000000000ULL;
 
     this->client_socket = client_socket;
+    if (client_socket && client_socket->enableZeroCopy())
+        ts.setZeroCopyThreshold(client_zero_copy_threshold);
     packet_pending = false;
     packet_pending_index = 0;
     do_full_redraw = false;
@@ -111,6 +185,11 @@ Client::Client(SP<Socket> client_socket)
 
     identified = false;
 
+    permission_user = (const User*) 0;
+    permission_slot = (const Slot*) 0;
+    permission_generation = 0;
+    permissions = 0;
+
     interface = SP<InterfaceTermemu>(new InterfaceTermemu);
     interface->initialize();
 
@@ -234,25 +313,27 @@ bool Client::cycleCheck()
 void Client::doCycleRefresh()
 {
     /* Check if client has resized their terminal, adjust
-       if necessary. */
+       if necessary. The telnet session tells us once per change. */
     do_full_redraw = false;
     ui32 w, h;
-    ts.getTerminalSize(&w, &h);
-    /* Clamp w and h to (10, 300) */
-    w = (w > 300) ? 300 : w;
-    h = (h > 300) ? 300 : h;
-    w = (w < 10) ? 10 : w;
-    h = (h < 10) ? 10 : h;
-
-    if (w != (ui32) buffer_terminal.getWidth() || h != (ui32) buffer_terminal.getHeight())
+    if (ts.checkTerminalResize(&w, &h))
     {
-        buffer_terminal.resize(w, h);
-        buffer_terminal.feedString("\x1b[2J", 4);
-        do_full_redraw = true;
+        /* Clamp w and h to (10, 300) */
+        w = (w > 300) ? 300 : w;
+        h = (h > 300) ? 300 : h;
+        w = (w < 10) ? 10 : w;
+        h = (h < 10) ? 10 : h;
 
-        ts.sendPacket("\x1b[2J", 4);
+        if (w != (ui32) buffer_terminal.getWidth() || h != (ui32) buffer_terminal.getHeight())
+        {
+            buffer_terminal.resize(w, h);
+            buffer_terminal.feedString("\x1b[2J", 4);
+            do_full_redraw = true;
 
-        interface->setTerminalSize(w, h);
+            ts.sendPacket("\x1b[2J", 4);
+
+            interface->setTerminalSize(w, h);
+        }
     }
 
     SP<Slot> sp_slot = slot.lock();
@@ -291,7 +372,10 @@ void Client::doCycleRefresh()
 
     Terminal& client_t = interface->getTerminal();
     if (packet_pending && ts.isPacketCancellable(packet_pending_index))
+    {
         ts.cancelPacket(packet_pending_index);
+        metric_increment(MetricFramesCoalesced);
+    }
     else if (deltas.size() > 0)
     {
         if (last_client_terminal.getWidth() == buffer_terminal.getWidth() &&
@@ -315,6 +399,7 @@ void Client::doCycleRefresh()
     {
         packet_pending_index = ts.sendPacket(deltas.c_str(), deltas.size());
         packet_pending = true;
+        metric_increment(MetricFramesSent);
         /* If full redraw, throw away the packet indices so that
            we can't discard this package */
         if (do_full_redraw)
@@ -334,6 +419,7 @@ void Client::cycle()
     assert(state.lock());
 
     lock_guard<recursive_mutex> cycle_lock(cycle_mutex);
+    MetricTimer cycle_timer(MetricClientCycleTime);
     if (!cycleCheck()) return;
 
     config_interface->cycle();
@@ -395,6 +481,17 @@ void Client::cycle()
     };
 
     ts.cycle();
+    /* More input waiting than fit in the receive buffer?
+       Come back for it soon. */
+    if (ts.isReceiveStalled())
+        state.lock()->notifyClient(self.lock());
+}
+
+void Client::getTransferStatistics(ui64* sent, ui64* queued)
+{
+    lock_guard<recursive_mutex> cycle_lock(cycle_mutex);
+    (*sent) = ts.getBytesSent();
+    (*queued) = ts.getQueuedBytes();
 }
 
 void Client::setGlobalChatLogger(SP<Logger> global_chat)
@@ -451,8 +548,7 @@ bool Client::identifySelectFunction(ui32 index)
         }
 
         /* First check if there's room for this user */
-        /* This is quite inefficient */
-        ui32 number_of_users = cdb->loadAllUserData().size();
+        ui32 number_of_users = cdb->getNumberOfUsers();
         if (number_of_users >= MAX_REGISTERED_USERS)
         {
             clientIdentified();
@@ -571,13 +667,14 @@ bool Client::identifySelectFunction(ui32 index)
         user->setAdmin(false);
         user->setPassword(password1);
 
-        ui32 number_of_users = cdb->loadAllUserData().size();
+        ui32 number_of_users = cdb->getNumberOfUsers();
         if (number_of_users >= MAX_REGISTERED_USERS)
         {
             clientIdentified();
             return true;
         }
 
+        user->internID();
         cdb->saveUserData(user);
         clientIdentified();
     }
@@ -634,7 +731,17 @@ void Client::gameInputFunction(const KeyPress &kp)
         SP<State> st = state.lock();
         if (!st) return;
 
-        if (!st->isAllowedPlayer(user, sp_slot)) return;
+        if (permission_generation != st->getSlotPermissionGeneration() ||
+            permission_slot != sp_slot.get() ||
+            permission_user != user.get())
+        {
+            permissions = st->getSlotPermissions(user, sp_slot);
+            permission_generation = st->getSlotPermissionGeneration();
+            permission_slot = sp_slot.get();
+            permission_user = user.get();
+        }
+
+        if (!(permissions & State::PermissionPlay)) return;
         sp_slot->feedInput(kp);
         sp_slot->setLastUser(user);
     }
@@ -797,6 +904,9 @@ void Client::clientIdentified()
     stringstream ss;
     ss << time_c << " " << TO_UTF8(nickname) << " has connected to the server.";
     global_chat->logMessageUTF8(ss.str());
+
+    SP<State> s = state.lock();
+    if (s) s->publishEvent("join", TO_UTF8(nickname));
 }
 
 void Client::setConfigurationDatabase(WP<ConfigurationDatabase> configuration_database)
@@ -35,6 +35,8 @@ class ClientTelnetSession : public trankesbel::TelnetSession
 
         bool readRawData(void* data, size_t* size);
         bool writeRawData(const void* data, size_t* size);
+        bool writeRawDataVector(const trankesbel::DataSpan* spans, size_t spans_count, size_t* size);
+        bool writeRawDataVectorZeroCopy(const trankesbel::DataSpan* spans, size_t spans_count, const std::vector<SP<const void> > &owners, size_t* size);
 
         void setClient(WP<Client> client);
 };
@@ -142,6 +144,13 @@ class Client
         void gameInputFunction(const trankesbel::KeyPress &kp);
         void gameResizeFunction(trankesbel::ui32 w, trankesbel::ui32 h);
 
+        /* Permissions of 'user' in the slot being watched, cached from
+           State::getSlotPermissions(). Checked on every key press. */
+        const User* permission_user;
+        const Slot* permission_slot;
+        trankesbel::ui64 permission_generation;
+        trankesbel::ui32 permissions;
+
         /* Checks if normal cycle can be done. */
         bool cycleCheck();
         /* Refreshes interface and screen. */
@@ -163,6 +172,15 @@ class Client
         /* Returns the socket the client is using */
         SP<trankesbel::Socket> getSocket() { return client_socket; };
 
+        /* Offers MCCP2 compression to the client. See TelnetSession::offerCompression(). */
+        void offerTelnetCompression(int memory_level, int window_bits)
+        { ts.offerCompression(memory_level, window_bits); };
+        /* Returns statistics on compression of the connection. */
+        trankesbel::TelnetCompressionStatistics getTelnetCompressionStatistics() const
+        { return ts.getCompressionStatistics(); };
+        /* Returns the bytes written to the client and the bytes waiting to be written. */
+        void getTransferStatistics(trankesbel::ui64* sent, trankesbel::ui64* queued);
+
         /* Returns true if client connection is active. */
         bool isActive() const;
 
@@ -1,335 +1,625 @@
 #include "configuration_db.hpp"
 #include <string>
+#include <sstream>
+#include <boost/bind.hpp>
 #include <cstdio>
 #include <iostream>
-#include <boost/bind.hpp>
 #include <openssl/sha.h>
 #include "hash.hpp"
 #include "sqlite3.h"
 #include <vector>
+#include <set>
 #include "configuration_primitives.hpp"
-#include <boost/function.hpp>
 #include "slot.hpp"
 #include "sockets.hpp"
+#include "metrics.hpp"
 
 using namespace dfterm;
 using namespace std;
 using namespace boost;
 using namespace trankesbel;
 
+/* Schema version stored in the database (PRAGMA user_version).
+   1: Indexes on Users(ID), Users(Name) and Slotprofiles(Name). */
+static const int SCHEMA_VERSION = 1;
+
+/* Binds a string to a statement parameter. Null characters
+   are thrown away, like escape_sql_string() does. */
+static int bind_string(sqlite3_stmt* stmt, int index, const string &str)
+{
+    if (str.find('\0') == string::npos)
+        return sqlite3_bind_text(stmt, index, str.data(), str.size(), SQLITE_TRANSIENT);
+
+    string stripped;
+    stripped.reserve(str.size());
+    size_t i1, str_size = str.size();
+    for (i1 = 0; i1 < str_size; ++i1)
+        if (str[i1] != 0) stripped.push_back(str[i1]);
+    return sqlite3_bind_text(stmt, index, stripped.data(), stripped.size(), SQLITE_TRANSIENT);
+}
+
+static int bind_number(sqlite3_stmt* stmt, int index, ui64 number)
+{
+    stringstream ss;
+    ss << number;
+    return bind_string(stmt, index, ss.str());
+}
+
+/* Returns a column of the current row as a string. NULL is an empty string. */
+static string column_string(sqlite3_stmt* stmt, int index)
+{
+    const char* text = (const char*) sqlite3_column_text(stmt, index);
+    if (!text) return string();
+    return string(text, sqlite3_column_bytes(stmt, index));
+}
+
+namespace {
+/* Resets a statement when it goes out of scope, so that a
+   cached statement doesn't keep holding the database. */
+class StatementReset
+{
+    private:
+        sqlite3_stmt* stmt;
+    public:
+        StatementReset(sqlite3_stmt* stmt) { this->stmt = stmt; };
+        ~StatementReset() { if (stmt) sqlite3_reset(stmt); };
+};
+}
+
 ConfigurationDatabase::ConfigurationDatabase()
 {
     db = (sqlite3*) 0;
+    transaction_depth = 0;
+    transaction_failed = false;
+    writes_pending = 0;
+    writer_running = false;
+    writer_stop = false;
+    unwritten_changes = 0;
+    data_version = 0;
+    cache.maximum_slots = 0xffffffff;
+    cache.address_ranges_ok = false;
+    cache.default_allowance = true;
 }
 
 ConfigurationDatabase::~ConfigurationDatabase()
 {
-    if (db)
-        sqlite3_close(db);
-    db = (sqlite3*) 0;
+    stopWriterThread();
+    close();
 }
 
-OpenStatus ConfigurationDatabase::open(const UnicodeString &filename)
+void ConfigurationDatabase::startWriterThread()
 {
-    if (db) sqlite3_close(db);
-    db = (sqlite3*) 0;
+    boost::lock_guard<boost::mutex> lock(writer_mutex);
+    if (writer_running) return;
 
-    string filename_utf8 = TO_UTF8(filename);
+    writer_stop = false;
+    writer_running = true;
+    writer_thread = boost::thread(static_writer, this);
+    writer_thread_id = writer_thread.get_id();
+}
 
-    /* Test if the database exists on the disk. */
-    bool database_exists = true;
-    int result = sqlite3_open_v2(filename_utf8.c_str(), &db, SQLITE_OPEN_READONLY, (const char*) 0);
-    if (result)
-        database_exists = false;
-    else
-        sqlite3_close(db);
-    db = (sqlite3*) 0;
+void ConfigurationDatabase::stopWriterThread()
+{
+    boost::unique_lock<boost::mutex> lock(writer_mutex);
+    if (!writer_running) return;
+    if (boost::this_thread::get_id() == writer_thread_id) return;
 
-    result = sqlite3_open(filename_utf8.c_str(), &db);
-    if (result)
-        return Failure;
+    writer_stop = true;
+    writer_cv.notify_all();
+    lock.unlock();
 
-    /* Create tables. These calls fail if they already exist (which is not bad). */
-    result = sqlite3_exec(db, "CREATE TABLE Users(Name TEXT, ID TEXT, PasswordSHA512 TEXT, PasswordSalt TEXT, Admin TEXT);", 0, 0, 0);
-    result = sqlite3_exec(db, "CREATE TABLE Slotprofiles(Name TEXT, ID TEXT, Width TEXT, Height TEXT, Path TEXT, WorkingPath TEXT, SlotType TEXT, AllowedWatchers TEXT, AllowedLaunchers TEXT, AllowedPlayers TEXT, AllowedClosers TEXT, ForbiddenWatchers TEXT, ForbiddenLaunchers TEXT, ForbiddenPlayers TEXT, ForbiddenClosers TEXT, MaxSlots TEXT);", 0, 0, 0);
-    result = sqlite3_exec(db, "CREATE TABLE MOTD(Content TEXT);", 0, 0, 0);
-    result = sqlite3_exec(db, "CREATE TABLE GlobalSettings(Key TEXT, Value TEXT);", 0, 0, 0);
-    result = sqlite3_exec(db, "CREATE TABLE AllowedAndForbiddenSocketAddressRanges(Allowed TEXT, Forbidden TEXT, DefaultAllowance TEXT);", 0, 0, 0);
+    writer_thread.join();
 
-    /* Create an admin user, if database was created. */
-    if (!database_exists)
-        return OkCreatedNewDatabase;
+    lock.lock();
+    writer_running = false;
+    writer_thread_id = boost::thread::id();
+}
 
-    return Ok;
+void ConfigurationDatabase::flush()
+{
+    boost::unique_lock<boost::mutex> lock(writer_mutex);
+    if (boost::this_thread::get_id() == writer_thread_id) return;
+
+    while (writes_pending > 0)
+        writer_cv.wait(lock);
 }
 
-int ConfigurationDatabase::maximumSlotsCallback(ui32* maximum, void* v_self, int argc, char** argv, char** colname)
+bool ConfigurationDatabase::queueWrite(const boost::function0<void> &job)
 {
-    assert(maximum && v_self);
+    boost::lock_guard<boost::mutex> lock(writer_mutex);
+    if (!writer_running || writer_stop || boost::this_thread::get_id() == writer_thread_id)
+        return false;
+
+    write_queue.push_back(job);
+    ++writes_pending;
+    writer_cv.notify_all();
+    return true;
+}
 
-    ui32 value = 0xffffffff;
-    bool correct_key = false;
+void ConfigurationDatabase::static_writer(ConfigurationDatabase* self)
+{
+    self->writer();
+}
 
-    int i;
-    for (i = 0; i < argc; ++i)
+void ConfigurationDatabase::writer()
+{
+    boost::unique_lock<boost::mutex> lock(writer_mutex);
+    while(true)
     {
-        if (!argv[i]) continue;
-        
-        if (!strcmp(colname[i], "Value"))
-        {
-            value = strtol(argv[i], 0, 10);
-            break;
-        }
-        if (!strcmp(colname[i], "Key") && !strcmp(argv[i], "MaximumSlots"))
-            correct_key = true;
+        while (write_queue.empty() && !writer_stop)
+            writer_cv.wait(lock);
+        /* Stop only when everything has been written. */
+        if (write_queue.empty()) return;
+
+        boost::function0<void> job = write_queue.front();
+        write_queue.pop_front();
+        lock.unlock();
+
+        job();
+
+        lock.lock();
+        --writes_pending;
+        if (writes_pending == 0) writer_cv.notify_all();
+    }
+}
+
+void ConfigurationDatabase::close()
+{
+    if (transaction_depth > 0)
+    {
+        LOG(Error, "Configuration database closed in the middle of a transaction. Changes in it are lost.");
+        transaction_depth = 0;
+        transaction_failed = false;
     }
 
-    if (correct_key)
-        (*maximum) = value;
+    map<string, sqlite3_stmt*>::iterator i1, statements_end = statements.end();
+    for (i1 = statements.begin(); i1 != statements_end; ++i1)
+        sqlite3_finalize(i1->second);
+    statements.clear();
 
-    return 0;
+    if (db)
+        sqlite3_close(db);
+    db = (sqlite3*) 0;
 }
 
-int ConfigurationDatabase::slotprofileNameListDataCallback(vector<UnicodeString>* name_list, void* v_self, int argc, char** argv, char** colname)
+sqlite3_stmt* ConfigurationDatabase::getStatement(const char* sql)
 {
-    assert(name_list && v_self);
+    assert(db && sql);
 
-    int i;
-    for (i = 0; i < argc; ++i)
+    string key(sql);
+    map<string, sqlite3_stmt*>::iterator i1 = statements.find(key);
+    if (i1 != statements.end())
     {
-        if (!argv[i]) continue;
-        
-        if (!strcmp(colname[i], "Name"))
-        {
-            string name_utf8 = argv[i];
-            (*name_list).push_back(UnicodeString::fromUTF8(name_utf8));
-        }
+        sqlite3_reset(i1->second);
+        sqlite3_clear_bindings(i1->second);
+        return i1->second;
     }
 
-    return 0;
+    sqlite3_stmt* stmt = (sqlite3_stmt*) 0;
+    int result = sqlite3_prepare_v2(db, sql, -1, &stmt, (const char**) 0);
+    if (result != SQLITE_OK || !stmt)
+    {
+        LOG(Error, "Error while preparing SQL statement \"" << sql << "\": " << sqlite3_errmsg(db));
+        if (stmt) sqlite3_finalize(stmt);
+        if (transaction_depth > 0) transaction_failed = true;
+        return (sqlite3_stmt*) 0;
+    }
+
+    statements[key] = stmt;
+    return stmt;
 }
 
-int ConfigurationDatabase::slotprofileDataCallback(SlotProfile* sp, void* v_self, int argc, char** argv, char** colname)
+bool ConfigurationDatabase::executeStatement(sqlite3_stmt* stmt)
 {
-    assert(sp && v_self);
+    if (!stmt) return false;
+    StatementReset sr(stmt);
+    MetricTimer statement_timer(MetricDatabaseLatency);
 
-    int i;
-    for (i = 0; i < argc; ++i)
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) { };
+    if (result != SQLITE_DONE)
     {
-        if (!argv[i]) continue;
-
-        if (!strcmp(colname[i], "Name"))
-            sp->setNameUTF8(argv[i]);
-        else if (!strcmp(colname[i], "ID"))
-            sp->setID(ID::getUnSerialized(string(argv[i])));
-        else if (!strcmp(colname[i], "Width"))
-            sp->setWidth(strtol(argv[i], NULL, 10));
-        else if (!strcmp(colname[i], "Height"))
-            sp->setHeight(strtol(argv[i], NULL, 10));
-        else if (!strcmp(colname[i], "Path"))
-            sp->setExecutable(argv[i]);
-        else if (!strcmp(colname[i], "WorkingPath"))
-            sp->setWorkingPath(argv[i]);
-        else if (!strcmp(colname[i], "SlotType"))
-        {
-            SlotType st = InvalidSlotType;
-            for (st = (SlotType) 0; st != InvalidSlotType; st = (SlotType) ((size_t) st + 1))
-                if (!strcmp(argv[i], SlotNames[(size_t) st].c_str()))
-                    break;
-            sp->setSlotType(st);
-        }
-        else if (!strcmp(colname[i], "AllowedWatchers"))
-            sp->setAllowedWatchers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "AllowedLaunchers"))
-            sp->setAllowedLaunchers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "AllowedPlayers"))
-            sp->setAllowedPlayers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "AllowedClosers"))
-            sp->setAllowedClosers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "ForbiddenWatchers"))
-            sp->setForbiddenWatchers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "ForbiddenLaunchers"))
-            sp->setForbiddenLaunchers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "ForbiddenPlayers"))
-            sp->setForbiddenPlayers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "ForbiddenClosers"))
-            sp->setForbiddenClosers(UserGroup::unSerialize(argv[i]));
-        else if (!strcmp(colname[i], "MaxSlots"))
-            sp->setMaxSlots(strtol(argv[i], NULL, 10));
+        LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db));
+        if (transaction_depth > 0) transaction_failed = true;
+        return false;
     }
+    return true;
+}
 
-    return 0;
-};
+bool ConfigurationDatabase::executeStatement(const char* sql)
+{
+    return executeStatement(getStatement(sql));
+}
 
-int ConfigurationDatabase::userDataCallback(SP<User>* user, void* v_self, int argc, char** argv, char** colname)
-{   
-    assert(user && (*user));
+void ConfigurationDatabase::beginTransaction()
+{
+    if (queueWrite(boost::bind(&ConfigurationDatabase::beginTransaction, this))) return;
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
 
-    string password_salt, password_hash;
-    int i;
-    for (i = 0; i < argc; ++i)
+    assert(db);
+
+    if (transaction_depth++ > 0) return;
+
+    transaction_failed = false;
+    if (!executeStatement("BEGIN;"))
+        transaction_failed = true;
+}
+
+bool ConfigurationDatabase::commitTransaction()
+{
+    if (queueWrite(boost::bind(&ConfigurationDatabase::commitTransaction, this))) return true;
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+
+    assert(db);
+    assert(transaction_depth > 0);
+
+    if (--transaction_depth > 0) return !transaction_failed;
+
+    if (transaction_failed)
     {
-        if (!argv[i]) continue;
-
-        if (!strcmp(colname[i], "Name"))
-            (*user)->setNameUTF8(string(argv[i]));
-        else if (!strcmp(colname[i], "PasswordSHA512"))
-            password_hash = argv[i];
-        else if (!strcmp(colname[i], "PasswordSalt"))
-            password_salt = argv[i];
-        else if (!strcmp(colname[i], "ID"))
-        {
-            ID id;
-            id.unSerialize(string(argv[i]));
-            (*user)->setID(id);
-        }
-        else if (!strcmp(colname[i], "Admin"))
-            if (!strcmp(argv[i], "Yes"))
-                (*user)->setAdmin(true);
+        LOG(Error, "Rolling back a configuration database transaction because a statement in it failed.");
+        executeStatement("ROLLBACK;");
+        transaction_failed = false;
+        return false;
     }
-    (*user)->setPasswordSalt(password_salt);
-    (*user)->setPasswordHash(password_hash);
 
-    return 0;
-};
+    if (!executeStatement("COMMIT;"))
+    {
+        executeStatement("ROLLBACK;");
+        return false;
+    }
+    return true;
+}
 
-int ConfigurationDatabase::userListDataCallback(vector<SP<User> >* user_list, void* v_self, int argc, char** argv, char** colname)
+void ConfigurationDatabase::migrateSchema()
 {
-    assert(user_list && v_self);
+    int version = 0;
+    sqlite3_stmt* stmt = getStatement("PRAGMA user_version;");
+    if (stmt)
+    {
+        StatementReset sr(stmt);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            version = sqlite3_column_int(stmt, 0);
+    }
+    if (version >= SCHEMA_VERSION) return;
 
-    string name, password_hash, password_salt;
-    ID id;
-    bool admin = false;
+    LOG(Note, "Updating configuration database schema from version " << version << " to " << SCHEMA_VERSION << ".");
 
-    int i;
-    for (i = 0; i < argc; ++i)
+    beginTransaction();
+    if (version < 1)
+    {
+        executeStatement("CREATE INDEX IF NOT EXISTS UsersID ON Users(ID);");
+        executeStatement("CREATE INDEX IF NOT EXISTS UsersName ON Users(Name);");
+        executeStatement("CREATE INDEX IF NOT EXISTS SlotprofilesName ON Slotprofiles(Name);");
+    }
+    stringstream ss;
+    ss << "PRAGMA user_version = " << SCHEMA_VERSION << ";";
+    char* errormsg = (char*) 0;
+    if (sqlite3_exec(db, ss.str().c_str(), 0, 0, &errormsg) != SQLITE_OK)
     {
-        if (!argv[i]) continue;
-
-        if (!strcmp(colname[i], "Name"))
-            name = argv[i];
-        else if (!strcmp(colname[i], "PasswordSHA512"))
-            password_hash = argv[i];
-        else if (!strcmp(colname[i], "PasswordSalt"))
-            password_salt = argv[i];
-        else if (!strcmp(colname[i], "ID"))
-            id.unSerialize(string(argv[i]));
-        else if (!strcmp(colname[i], "Admin"))
-            if (!strcmp(argv[i], "Yes"))
-                admin = true;
+        LOG(Error, "Error while executing SQL statement \"" << ss.str() << "\": " << errormsg);
+        transaction_failed = true;
     }
+    if (errormsg) sqlite3_free(errormsg);
+    commitTransaction();
+}
 
-    if (name.size() <= 0) return 0;
+OpenStatus ConfigurationDatabase::open(const UnicodeString &filename)
+{
+    flush();
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
 
-    SP<User> user(new User);
-    user->setPasswordSalt(password_salt);
-    user->setPasswordHash(password_hash);
-    user->setID(id);
-    user->setName(UnicodeString::fromUTF8(name));
-    user->setAdmin(admin);
-
-    (*user_list).push_back(user);
-    return 0;
-};
+    close();
 
-int ConfigurationDatabase::motdCallback(UnicodeString* us, void* v_self, int argc, char** argv, char** colname)
-{
-    assert(us && v_self);
+    string filename_utf8 = TO_UTF8(filename);
 
-    int i;
-    for (i = 0; i < argc; ++i)
+    /* Test if the database exists on the disk. */
+    bool database_exists = true;
+    int result = sqlite3_open_v2(filename_utf8.c_str(), &db, SQLITE_OPEN_READONLY, (const char*) 0);
+    if (result)
+        database_exists = false;
+    if (db)
+        sqlite3_close(db);
+    db = (sqlite3*) 0;
+
+    result = sqlite3_open(filename_utf8.c_str(), &db);
+    if (result)
     {
-        if (!argv[i]) continue;
+        if (db) sqlite3_close(db);
+        db = (sqlite3*) 0;
+        return Failure;
+    }
 
-        if (!strcmp(colname[i], "Content"))
-            (*us) = TO_UNICODESTRING(string(argv[i]));
+    /* With a write-ahead log, commits don't have to sync the disk every
+       time, and reading (also from dfterm2_configure) doesn't block writing. */
+    string journal_mode;
+    sqlite3_stmt* stmt = getStatement("PRAGMA journal_mode=WAL;");
+    if (stmt)
+    {
+        StatementReset sr(stmt);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            journal_mode = column_string(stmt, 0);
     }
-    
-    return 0;
+    if (journal_mode != "wal")
+    { LOG(Note, "Could not use write-ahead logging for the configuration database, journal mode is \"" << journal_mode << "\"."); }
+    else
+        executeStatement("PRAGMA synchronous=NORMAL;");
+
+    /* Create tables, if they don't exist yet. */
+    executeStatement("CREATE TABLE IF NOT EXISTS Users(Name TEXT, ID TEXT, PasswordSHA512 TEXT, PasswordSalt TEXT, Admin TEXT);");
+    executeStatement("CREATE TABLE IF NOT EXISTS Slotprofiles(Name TEXT, ID TEXT, Width TEXT, Height TEXT, Path TEXT, WorkingPath TEXT, SlotType TEXT, AllowedWatchers TEXT, AllowedLaunchers TEXT, AllowedPlayers TEXT, AllowedClosers TEXT, ForbiddenWatchers TEXT, ForbiddenLaunchers TEXT, ForbiddenPlayers TEXT, ForbiddenClosers TEXT, MaxSlots TEXT);");
+    executeStatement("CREATE TABLE IF NOT EXISTS MOTD(Content TEXT);");
+    executeStatement("CREATE TABLE IF NOT EXISTS GlobalSettings(Key TEXT, Value TEXT);");
+    executeStatement("CREATE TABLE IF NOT EXISTS AllowedAndForbiddenSocketAddressRanges(Allowed TEXT, Forbidden TEXT, DefaultAllowance TEXT);");
+
+    migrateSchema();
+
+    data_version = readDataVersion();
+    CachedData data;
+    readCache(&data);
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    cache = data;
+    clock.unlock();
+
+    /* Create an admin user, if database was created. */
+    if (!database_exists)
+        return OkCreatedNewDatabase;
+
+    return Ok;
 }
 
-int ConfigurationDatabase::allowedAndForbiddenSocketAddressRangesCallback(bool* default_allowance, SocketAddressRange* allowed, SocketAddressRange* forbidden, void* v_self, int argc, char** argv, char** colname)
+/* Reads a user from the current row of a
+   "SELECT Name, ID, PasswordSHA512, PasswordSalt, Admin" statement. */
+static SP<User> read_user(sqlite3_stmt* stmt)
 {
-    assert(allowed);
-    assert(forbidden);
-    assert(default_allowance);
+    SP<User> user(new User);
+    user->setNameUTF8(column_string(stmt, 0));
+    user->setID(ID::getUnSerialized(column_string(stmt, 1)));
+    user->setPasswordHash(column_string(stmt, 2));
+    user->setPasswordSalt(column_string(stmt, 3));
+    user->setAdmin(column_string(stmt, 4) == "Yes");
+    return user;
+}
 
-    int i;
-    for (i = 0; i < argc; ++i)
+/* Reads a slot profile from the current row of a "SELECT Name, ID, Width, Height,
+   Path, WorkingPath, SlotType, AllowedWatchers, AllowedLaunchers, AllowedPlayers,
+   AllowedClosers, ForbiddenWatchers, ForbiddenLaunchers, ForbiddenPlayers,
+   ForbiddenClosers, MaxSlots" statement. */
+static SP<SlotProfile> read_slotprofile(sqlite3_stmt* stmt)
+{
+    SP<SlotProfile> sp(new SlotProfile);
+    sp->setNameUTF8(column_string(stmt, 0));
+    sp->setID(ID::getUnSerialized(column_string(stmt, 1)));
+    sp->setWidth(strtol(column_string(stmt, 2).c_str(), NULL, 10));
+    sp->setHeight(strtol(column_string(stmt, 3).c_str(), NULL, 10));
+    sp->setExecutableUTF8(column_string(stmt, 4));
+    sp->setWorkingPathUTF8(column_string(stmt, 5));
+
+    string slot_type = column_string(stmt, 6);
+    SlotType st = InvalidSlotType;
+    for (st = (SlotType) 0; st != InvalidSlotType; st = (SlotType) ((size_t) st + 1))
+        if (slot_type == SlotNames[(size_t) st])
+            break;
+    sp->setSlotType(st);
+
+    sp->setAllowedWatchers(UserGroup::unSerialize(column_string(stmt, 7)));
+    sp->setAllowedLaunchers(UserGroup::unSerialize(column_string(stmt, 8)));
+    sp->setAllowedPlayers(UserGroup::unSerialize(column_string(stmt, 9)));
+    sp->setAllowedClosers(UserGroup::unSerialize(column_string(stmt, 10)));
+    sp->setForbiddenWatchers(UserGroup::unSerialize(column_string(stmt, 11)));
+    sp->setForbiddenLaunchers(UserGroup::unSerialize(column_string(stmt, 12)));
+    sp->setForbiddenPlayers(UserGroup::unSerialize(column_string(stmt, 13)));
+    sp->setForbiddenClosers(UserGroup::unSerialize(column_string(stmt, 14)));
+    sp->setMaxSlots(strtol(column_string(stmt, 15).c_str(), NULL, 10));
+    return sp;
+}
+
+void ConfigurationDatabase::readCache(CachedData* data)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+    assert(db && data);
+
+    int result;
+
+    /* Users */
+    data->users_by_name.clear();
+    data->users_by_id.clear();
+    sqlite3_stmt* stmt = getStatement("SELECT Name, ID, PasswordSHA512, PasswordSalt, Admin FROM Users;");
+    if (stmt)
     {
-        if (!argv[i]) continue;
+        StatementReset sr(stmt);
+        while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            if (sqlite3_column_bytes(stmt, 0) <= 0) continue;
 
-        if (!strcmp(colname[i], "Allowed"))
+            SP<User> user = read_user(stmt);
+            data->users_by_name[user->getNameUTF8()] = user;
+            data->users_by_id[user->getIDRef()] = user;
+        }
+        if (result != SQLITE_DONE)
+        { LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db)); };
+    }
+
+    /* Slot profiles. If a name is there twice, the first one counts. */
+    data->slotprofiles.clear();
+    set<string> slotprofile_names;
+    stmt = getStatement("SELECT Name, ID, Width, Height, Path, WorkingPath, SlotType, AllowedWatchers, AllowedLaunchers, AllowedPlayers, AllowedClosers, ForbiddenWatchers, ForbiddenLaunchers, ForbiddenPlayers, ForbiddenClosers, MaxSlots FROM Slotprofiles;");
+    if (stmt)
+    {
+        StatementReset sr(stmt);
+        while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
         {
-            bool result = allowed->unSerialize(hex_to_bytes(argv[i]));
-            if (!result)
+            if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) continue;
+            if (!slotprofile_names.insert(column_string(stmt, 0)).second) continue;
+
+            data->slotprofiles.push_back(read_slotprofile(stmt));
+        }
+        if (result != SQLITE_DONE)
+        { LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db)); };
+    }
+
+    /* MOTD */
+    data->motd = UnicodeString();
+    stmt = getStatement("SELECT Content FROM MOTD;");
+    if (stmt)
+    {
+        StatementReset sr(stmt);
+        while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+            if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+                data->motd = TO_UNICODESTRING(column_string(stmt, 0));
+        if (result != SQLITE_DONE)
+        { LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db)); };
+    }
+
+    /* Maximum number of slots */
+    data->maximum_slots = 0xffffffff;
+    stmt = getStatement("SELECT Value FROM GlobalSettings WHERE Key = 'MaximumSlots';");
+    if (stmt)
+    {
+        StatementReset sr(stmt);
+        while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+            if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+                data->maximum_slots = strtol(column_string(stmt, 0).c_str(), 0, 10);
+        if (result != SQLITE_DONE)
+        {
+            LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db));
+            data->maximum_slots = 0xffffffff;
+        }
+    }
+
+    /* Address restrictions */
+    data->address_ranges_ok = false;
+    data->default_allowance = true;
+    data->allowed_addresses = SocketAddressRange();
+    data->forbidden_addresses = SocketAddressRange();
+    stmt = getStatement("SELECT Allowed, Forbidden, DefaultAllowance FROM AllowedAndForbiddenSocketAddressRanges;");
+    if (!stmt) return;
+    StatementReset sr(stmt);
+
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+            if (!data->allowed_addresses.unSerialize(hex_to_bytes(column_string(stmt, 0))))
             {
                 LOG(Error, "The socket address range for allowed connections in database is malformed.");
-                return 1;
+                return;
             }
-        }
-        else if (!strcmp(colname[i], "Forbidden"))
-        {
-            bool result = forbidden->unSerialize(hex_to_bytes(argv[i]));
-            if (!result)
+        if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+            if (!data->forbidden_addresses.unSerialize(hex_to_bytes(column_string(stmt, 1))))
             {
                 LOG(Error, "The socket address range for allowed connections in database is malformed.");
-                return 1;
+                return;
             }
-        }
-        else if (!strcmp(colname[i], "DefaultAllowance"))
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
         {
-            if (!strcmp(argv[i], "Yes"))
-                (*default_allowance) = true;
-            else if (!strcmp(argv[i], "No"))
-                (*default_allowance) = false;
+            string default_allowance_str = column_string(stmt, 2);
+            if (default_allowance_str == "Yes")
+                data->default_allowance = true;
+            else if (default_allowance_str == "No")
+                data->default_allowance = false;
             else
             {
                 LOG(Error, "The default allowance field in database for address restrictions is malformed. Defaulting it to allow everyone.");
-                (*default_allowance) = true;
+                data->default_allowance = true;
             }
         }
     }
+    if (result != SQLITE_DONE)
+    {
+        LOG(Error, "Error while executing SQL statement \"" << sqlite3_sql(stmt) << "\": " << sqlite3_errmsg(db));
+        return;
+    }
+    data->address_ranges_ok = true;
+}
+
+void ConfigurationDatabase::writeBehind(const boost::function0<void> &job)
+{
+    boost::function0<void> run = boost::bind(&ConfigurationDatabase::runWrite, this, job);
+    if (queueWrite(run)) return;
+    run();
+}
+
+void ConfigurationDatabase::runWrite(boost::function0<void> job)
+{
+    job();
+
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    assert(unwritten_changes > 0);
+    --unwritten_changes;
+}
+
+int ConfigurationDatabase::readDataVersion()
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+    assert(db);
 
-    return 0;
+    int version = 0;
+    sqlite3_stmt* stmt = getStatement("PRAGMA data_version;");
+    if (!stmt) return 0;
+    StatementReset sr(stmt);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+    return version;
 }
 
-static int c_callback(void* a, int b, char** c, char** d)
+void ConfigurationDatabase::checkForChanges()
 {
-    function4<int, void*, int, char**, char**>* sql_callback_function = 
-    (function4<int, void*, int, char**, char**>*) a;
+    if (queueWrite(boost::bind(&ConfigurationDatabase::reloadIfChanged, this))) return;
+    reloadIfChanged();
+}
+
+void ConfigurationDatabase::reloadIfChanged()
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+    if (!db || transaction_depth > 0) return;
+
+    int version = readDataVersion();
+    if (version == data_version) return;
 
-    return (*sql_callback_function)((void*) 0x1, b, c, d);
+    CachedData data;
+    readCache(&data);
+
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    /* Our own changes are not all in the database yet, so what was
+       read is older than 'cache'. Try again next time. */
+    if (unwritten_changes > 0) return;
+
+    cache = data;
+    data_version = version;
+    LOG(Note, "The configuration database was changed by another program. Read it again.");
 }
 
 void ConfigurationDatabase::saveMOTD(UnicodeString motd)
 {
-    saveMOTDUTF8(TO_UTF8(motd));
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    cache.motd = motd;
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::writeMOTD, this, TO_UTF8(motd)));
 }
 
 void ConfigurationDatabase::saveMOTDUTF8(string motd_utf8)
 {
+    saveMOTD(TO_UNICODESTRING(motd_utf8));
+}
+
+void ConfigurationDatabase::writeMOTD(const string &motd_utf8)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+
     assert(db);
-    
-    string motd_escaped = escape_sql_string(motd_utf8);
-    
-    char* errormsg = (char*) 0;
-    
-    string statement;
-    statement = string("DELETE FROM MOTD;");
-    int result = sqlite3_exec(db, statement.c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK) /* Yes, next one is a warning and not an error */
-    { LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg); };
-    
-    if (errormsg) sqlite3_free(errormsg);
-    errormsg = (char*) 0;
-    
-    statement = string("INSERT INTO MOTD(Content) VALUES(\'") + motd_escaped + string("\');");
-    result = sqlite3_exec(db, statement.c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK)
-    { LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg); };
-    
-    if (errormsg) sqlite3_free(errormsg);
+
+    beginTransaction();
+    executeStatement("DELETE FROM MOTD;");
+
+    sqlite3_stmt* stmt = getStatement("INSERT INTO MOTD(Content) VALUES(?1);");
+    if (stmt)
+    {
+        bind_string(stmt, 1, motd_utf8);
+        executeStatement(stmt);
+    }
+    commitTransaction();
 }
 
 string ConfigurationDatabase::loadMOTDUTF8()
@@ -339,304 +629,360 @@ string ConfigurationDatabase::loadMOTDUTF8()
 
 UnicodeString ConfigurationDatabase::loadMOTD()
 {
-    assert(db);
-    
-    UnicodeString motd;
-    
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::motdCallback, this, &motd, _1, _2, _3, _4);
-    
-    string statement = string("SELECT Content FROM MOTD;");
-    char* errormsg = (char*) 0;
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, &errormsg);
-    if (result != SQLITE_OK)
-    { LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg); };
-    
-    if (errormsg) sqlite3_free(errormsg);
-    
-    return motd;
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    return cache.motd;
+}
+
+ui32 ConfigurationDatabase::getNumberOfUsers()
+{
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    return cache.users_by_name.size();
 }
 
 vector<SP<User> > ConfigurationDatabase::loadAllUserData()
 {
-    assert(db);
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
 
     vector<SP<User> > result_users;
+    result_users.reserve(cache.users_by_name.size());
 
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::userListDataCallback, this, &result_users, _1, _2, _3, _4);
-
-    string statement;
-    statement = string("SELECT Name, ID, PasswordSHA512, PasswordSalt, Admin FROM Users;");
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, 0);
-    if (result != SQLITE_OK) return vector<SP<User> >();
+    boost::unordered_map<string, SP<User> >::iterator i1, users_end = cache.users_by_name.end();
+    for (i1 = cache.users_by_name.begin(); i1 != users_end; ++i1)
+        result_users.push_back(SP<User>(new User(*i1->second)));
 
     return result_users;
 }
 
 void ConfigurationDatabase::deleteSlotProfileData(const UnicodeString &name)
 {
-    assert(db);
-
     string name_utf8 = TO_UTF8(name);
     if (escape_sql_string(name_utf8).size() < 1) return;
 
-    string statement = string("DELETE FROM Slotprofiles WHERE Name = \'") + escape_sql_string(name_utf8) + string("\';"); 
-    sqlite3_exec(db, statement.c_str(), 0, 0, 0);
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    vector<SP<SlotProfile> >::iterator i1, slotprofiles_end = cache.slotprofiles.end();
+    for (i1 = cache.slotprofiles.begin(); i1 != slotprofiles_end; ++i1)
+        if ((*i1)->getNameUTF8() == name_utf8)
+        {
+            cache.slotprofiles.erase(i1);
+            break;
+        }
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::removeSlotProfileData, this, name_utf8));
 }
 
-void ConfigurationDatabase::deleteUserData(const UnicodeString &name)
+void ConfigurationDatabase::removeSlotProfileData(const string &name_utf8)
 {
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
     assert(db);
 
+    sqlite3_stmt* stmt = getStatement("DELETE FROM Slotprofiles WHERE Name = ?1;");
+    if (!stmt) return;
+    bind_string(stmt, 1, name_utf8);
+    executeStatement(stmt);
+}
+
+void ConfigurationDatabase::deleteUserData(const UnicodeString &name)
+{
     string name_utf8 = TO_UTF8(name);
     if (escape_sql_string(name_utf8).size() < 1) return;
 
-    string statement = string("DELETE FROM Users WHERE Name = \'") + escape_sql_string(name_utf8) + string("\';"); 
-    sqlite3_exec(db, statement.c_str(), 0, 0, 0);
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    boost::unordered_map<string, SP<User> >::iterator i1 = cache.users_by_name.find(name_utf8);
+    if (i1 != cache.users_by_name.end())
+    {
+        boost::unordered_map<ID, SP<User> >::iterator i2 = cache.users_by_id.find(i1->second->getIDRef());
+        if (i2 != cache.users_by_id.end() && i2->second == i1->second)
+            cache.users_by_id.erase(i2);
+        cache.users_by_name.erase(i1);
+    }
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::removeUserData, this, name_utf8));
 }
 
-SP<User> ConfigurationDatabase::loadUserData(const ID& id)
+void ConfigurationDatabase::removeUserData(const string &name_utf8)
 {
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
     assert(db);
 
-    string id_str = escape_sql_string(id.serialize());
-    
-    SP<User> r_result(new User);
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::userDataCallback, this, &r_result, _1, _2, _3, _4);
+    sqlite3_stmt* stmt = getStatement("DELETE FROM Users WHERE Name = ?1;");
+    if (!stmt) return;
+    bind_string(stmt, 1, name_utf8);
+    executeStatement(stmt);
+}
+
+SP<User> ConfigurationDatabase::loadUserData(const ID& id)
+{
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
 
-    string statement;
-    statement = string("SELECT Name, ID, PasswordSHA512, PasswordSalt, Admin FROM Users WHERE ID = \'") + id_str + string("\';");
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, 0);
-    if (result != SQLITE_OK) return SP<User>();
-    if (r_result->getNameUTF8().size() == 0) return SP<User>();
+    boost::unordered_map<ID, SP<User> >::iterator i1 = cache.users_by_id.find(id);
+    if (i1 == cache.users_by_id.end()) return SP<User>();
 
-    return r_result;
+    return SP<User>(new User(*i1->second));
 }
 
 SP<User> ConfigurationDatabase::loadUserData(const UnicodeString &name)
 {
-    assert(db);
-
     string name_utf8 = TO_UTF8(name);
     if (escape_sql_string(name_utf8).size() < 1) return SP<User>();
-    
-    SP<User> r_result(new User);
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::userDataCallback, this, &r_result, _1, _2, _3, _4);
 
-    string statement;
-    statement = string("SELECT Name, ID, PasswordSHA512, PasswordSalt, Admin FROM Users WHERE Name = \'") + escape_sql_string(name_utf8) + string("\';");
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, 0);
-    if (result != SQLITE_OK) return SP<User>();
-    if (r_result->getNameUTF8().size() == 0) return SP<User>();
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
 
-    return r_result;
+    boost::unordered_map<string, SP<User> >::iterator i1 = cache.users_by_name.find(name_utf8);
+    if (i1 == cache.users_by_name.end()) return SP<User>();
+
+    return SP<User>(new User(*i1->second));
 }
 
 void ConfigurationDatabase::saveUserData(User* user)
 {
-    assert(db && user);
+    assert(user);
 
     string name_utf8 = TO_UTF8(user->getName());
     if (escape_sql_string(name_utf8).size() < 1) return;
 
-    string statement;
-    statement = string("DELETE FROM Users WHERE Name = \'") + escape_sql_string(name_utf8) + string("\';"); 
-    int result = sqlite3_exec(db, statement.c_str(), 0, 0, 0);
+    SP<User> user_copy(new User(*user));
+    user_copy->internID();
 
-    string admin_str("No");
-    if (user->isAdmin()) admin_str = "Yes";
-        
-    statement = string("INSERT INTO Users(Name, ID, PasswordSHA512, PasswordSalt, Admin) VALUES(\'") + escape_sql_string(name_utf8) + string("\', \'") + escape_sql_string(user->getID().serialize()) + string("\', \'") + escape_sql_string(user->getPasswordHash()) + string("\', \'") + escape_sql_string(user->getPasswordSalt()) + string("\', \'") + admin_str + string("\');");
-    result = sqlite3_exec(db, statement.c_str(), 0, 0, 0);
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    /* Renamed? Then the old name goes away. */
+    boost::unordered_map<ID, SP<User> >::iterator i2 = cache.users_by_id.find(user_copy->getIDRef());
+    if (i2 != cache.users_by_id.end() && i2->second->getNameUTF8() != name_utf8)
+    {
+        boost::unordered_map<string, SP<User> >::iterator i3 = cache.users_by_name.find(i2->second->getNameUTF8());
+        if (i3 != cache.users_by_name.end() && i3->second == i2->second)
+            cache.users_by_name.erase(i3);
+    }
+
+    SP<User> &by_name = cache.users_by_name[name_utf8];
+    if (by_name && !(by_name->getIDRef() == user_copy->getIDRef()))
+    {
+        boost::unordered_map<ID, SP<User> >::iterator i1 = cache.users_by_id.find(by_name->getIDRef());
+        if (i1 != cache.users_by_id.end() && i1->second == by_name)
+            cache.users_by_id.erase(i1);
+    }
+    by_name = user_copy;
+    cache.users_by_id[user_copy->getIDRef()] = user_copy;
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::writeUserData, this, user_copy));
+}
+
+void ConfigurationDatabase::writeUserData(SP<User> user)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+    assert(db && user);
+
+    string name_utf8 = TO_UTF8(user->getName());
+
+    beginTransaction();
+
+    /* The ID is there too, so that the old row goes away when a user is renamed. */
+    sqlite3_stmt* stmt = getStatement("DELETE FROM Users WHERE Name = ?1 OR ID = ?2;");
+    if (stmt)
+    {
+        bind_string(stmt, 1, name_utf8);
+        bind_string(stmt, 2, user->getID().serialize());
+        executeStatement(stmt);
+    }
+
+    stmt = getStatement("INSERT INTO Users(Name, ID, PasswordSHA512, PasswordSalt, Admin) VALUES(?1, ?2, ?3, ?4, ?5);");
+    if (stmt)
+    {
+        bind_string(stmt, 1, name_utf8);
+        bind_string(stmt, 2, user->getID().serialize());
+        bind_string(stmt, 3, user->getPasswordHash());
+        bind_string(stmt, 4, user->getPasswordSalt());
+        bind_string(stmt, 5, user->isAdmin() ? "Yes" : "No");
+        executeStatement(stmt);
+    }
+
+    commitTransaction();
 };
 
 void ConfigurationDatabase::saveSlotProfileData(SlotProfile* slotprofile)
 {
+    assert(slotprofile);
+
+    /* The write is done with a copy, as the original may change
+       before the writer thread gets to it. */
+    SP<SlotProfile> slotprofile_copy(new SlotProfile(*slotprofile));
+    string name_utf8 = slotprofile_copy->getNameUTF8();
+
+    /* Saving replaces the old row, so the profile goes last, like in the database. */
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    vector<SP<SlotProfile> >::iterator i1, slotprofiles_end = cache.slotprofiles.end();
+    for (i1 = cache.slotprofiles.begin(); i1 != slotprofiles_end; ++i1)
+        if ((*i1)->getNameUTF8() == name_utf8)
+        {
+            cache.slotprofiles.erase(i1);
+            break;
+        }
+    cache.slotprofiles.push_back(slotprofile_copy);
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::writeSlotProfileData, this, slotprofile_copy));
+}
+
+void ConfigurationDatabase::writeSlotProfileData(SP<SlotProfile> slotprofile)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+
     assert(db && slotprofile);
 
     string name = slotprofile->getNameUTF8();
 
-    string statement;
-    statement = string("DELETE FROM Slotprofiles WHERE NAME = \'") + escape_sql_string(name) + string("\';");
-    int result = sqlite3_exec(db, statement.c_str(), 0, 0, 0);
+    beginTransaction();
 
-    stringstream ss;
-    ss << "INSERT INTO Slotprofiles(Name, ID, Width, Height, Path, WorkingPath, SlotType, AllowedWatchers, AllowedLaunchers, AllowedPlayers, AllowedClosers, ForbiddenWatchers, ForbiddenLaunchers, ForbiddenPlayers, ForbiddenClosers, MaxSlots) VALUES(\'" << 
-    escape_sql_string(slotprofile->getNameUTF8()) << "\',\'" << 
-    escape_sql_string(slotprofile->getID().serialize()) << "\',\'" <<
-    slotprofile->getWidth() << "\',\'" <<
-    slotprofile->getHeight() << "\',\'" <<
-    escape_sql_string(slotprofile->getExecutableUTF8()) << "\',\'" <<
-    escape_sql_string(slotprofile->getWorkingPathUTF8()) << "\',\'" <<
-    escape_sql_string(SlotNames[(size_t) slotprofile->getSlotType()]) << "\',\'" <<
-    escape_sql_string(slotprofile->getAllowedWatchers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getAllowedLaunchers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getAllowedPlayers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getAllowedClosers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getForbiddenWatchers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getForbiddenLaunchers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getForbiddenPlayers().serialize()) << "\',\'" <<
-    escape_sql_string(slotprofile->getForbiddenClosers().serialize()) << "\',\'" <<
-    slotprofile->getMaxSlots() << "\');";
+    sqlite3_stmt* stmt = getStatement("DELETE FROM Slotprofiles WHERE Name = ?1;");
+    if (stmt)
+    {
+        bind_string(stmt, 1, name);
+        executeStatement(stmt);
+    }
 
-    char* errormsg = (char*) 0;
-    result = sqlite3_exec(db, ss.str().c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK)
-        LOG(Error, "Error while executing SQL statement \"" << ss.str() << "\": " << errormsg);
-    if (errormsg) sqlite3_free(errormsg);
+    stmt = getStatement("INSERT INTO Slotprofiles(Name, ID, Width, Height, Path, WorkingPath, SlotType, AllowedWatchers, AllowedLaunchers, AllowedPlayers, AllowedClosers, ForbiddenWatchers, ForbiddenLaunchers, ForbiddenPlayers, ForbiddenClosers, MaxSlots) VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);");
+    if (stmt)
+    {
+        bind_string(stmt, 1, name);
+        bind_string(stmt, 2, slotprofile->getID().serialize());
+        bind_number(stmt, 3, slotprofile->getWidth());
+        bind_number(stmt, 4, slotprofile->getHeight());
+        bind_string(stmt, 5, slotprofile->getExecutableUTF8());
+        bind_string(stmt, 6, slotprofile->getWorkingPathUTF8());
+        bind_string(stmt, 7, SlotNames[(size_t) slotprofile->getSlotType()]);
+        bind_string(stmt, 8, slotprofile->getAllowedWatchers().serialize());
+        bind_string(stmt, 9, slotprofile->getAllowedLaunchers().serialize());
+        bind_string(stmt, 10, slotprofile->getAllowedPlayers().serialize());
+        bind_string(stmt, 11, slotprofile->getAllowedClosers().serialize());
+        bind_string(stmt, 12, slotprofile->getForbiddenWatchers().serialize());
+        bind_string(stmt, 13, slotprofile->getForbiddenLaunchers().serialize());
+        bind_string(stmt, 14, slotprofile->getForbiddenPlayers().serialize());
+        bind_string(stmt, 15, slotprofile->getForbiddenClosers().serialize());
+        bind_number(stmt, 16, slotprofile->getMaxSlots());
+        executeStatement(stmt);
+    }
+
+    commitTransaction();
 };
 
 vector<UnicodeString> ConfigurationDatabase::loadSlotProfileNames()
 {
-    assert(db);
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
 
     vector<UnicodeString> name_list;
+    name_list.reserve(cache.slotprofiles.size());
 
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::slotprofileNameListDataCallback, this, &name_list, _1, _2, _3, _4);
-
-    char* errormsg = (char*) 0;
-
-    string statement;
-    statement = string("SELECT Name FROM Slotprofiles;");
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, &errormsg);
-    if (result != SQLITE_OK)
-    {
-        LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg);
-        if (errormsg) sqlite3_free(errormsg);
-        return name_list;
-    }
-    if (errormsg) sqlite3_free(errormsg);
+    vector<SP<SlotProfile> >::iterator i1, slotprofiles_end = cache.slotprofiles.end();
+    for (i1 = cache.slotprofiles.begin(); i1 != slotprofiles_end; ++i1)
+        name_list.push_back((*i1)->getName());
 
     return name_list;
 }
 
 SP<SlotProfile> ConfigurationDatabase::loadSlotProfileData(const UnicodeString &name)
 {
-    assert(db);
-
     string name_utf8 = TO_UTF8(name);
 
-    SlotProfile sp;
-
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::slotprofileDataCallback, this, &sp, _1, _2, _3, _4);
-
-    char* errormsg = (char*) 0;
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
 
-    string statement;
-    statement = string("SELECT Name, ID, Width, Height, Path, WorkingPath, SlotType, AllowedWatchers, AllowedLaunchers, AllowedPlayers, AllowedClosers, ForbiddenWatchers, ForbiddenLaunchers, ForbiddenPlayers, ForbiddenClosers, MaxSlots FROM Slotprofiles WHERE Name = \'") + escape_sql_string(name_utf8) + string("\';");
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, &errormsg);
-    if (result != SQLITE_OK)
-    {
-        LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg);
-        if (errormsg) sqlite3_free(errormsg);
-        return SP<SlotProfile>();
-    }
-    if (errormsg) sqlite3_free(errormsg);
+    vector<SP<SlotProfile> >::iterator i1, slotprofiles_end = cache.slotprofiles.end();
+    for (i1 = cache.slotprofiles.begin(); i1 != slotprofiles_end; ++i1)
+        if ((*i1)->getNameUTF8() == name_utf8)
+            return SP<SlotProfile>(new SlotProfile(**i1));
 
-    return SP<SlotProfile>(new SlotProfile(sp));
+    /* Not there, an empty profile (like the database gave). */
+    return SP<SlotProfile>(new SlotProfile);
 };
 
 void ConfigurationDatabase::saveMaximumNumberOfSlots(ui32 maximum)
 {
-    assert(db);
-
-    string statement = string("DELETE FROM GlobalSettings WHERE Key = \'MaximumSlots\';");
-    int result = sqlite3_exec(db, statement.c_str(), 0, 0, 0);
-
-    char* errormsg = (char*) 0;
-
-    stringstream ss;
-    ss << maximum;
-    statement = string("INSERT INTO GlobalSettings(Key, Value) VALUES(\'MaximumSlots\', \'") + escape_sql_string(ss.str()) + string("\');");
-    result = sqlite3_exec(db, statement.c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK)
-    { LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg); };
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    cache.maximum_slots = maximum;
+    ++unwritten_changes;
+    clock.unlock();
 
-    if (errormsg) sqlite3_free(errormsg);
+    writeBehind(boost::bind(&ConfigurationDatabase::writeMaximumNumberOfSlots, this, maximum));
 }
 
-ui32 ConfigurationDatabase::loadMaximumNumberOfSlots()
+void ConfigurationDatabase::writeMaximumNumberOfSlots(ui32 maximum)
 {
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+
     assert(db);
 
-    ui32 maximum = 0xffffffff;
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::maximumSlotsCallback, this, &maximum, _1, _2, _3, _4);
+    beginTransaction();
+    executeStatement("DELETE FROM GlobalSettings WHERE Key = 'MaximumSlots';");
 
-    string statement = string("SELECT Key, Value FROM GlobalSettings WHERE Key = \'MaximumSlots\';");
-    char* errormsg = (char*) 0;
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, &errormsg);
-    if (result != SQLITE_OK)
+    sqlite3_stmt* stmt = getStatement("INSERT INTO GlobalSettings(Key, Value) VALUES('MaximumSlots', ?1);");
+    if (stmt)
     {
-        LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg);
-        if (errormsg) sqlite3_free(errormsg);
-        return 0xffffffff;
+        bind_number(stmt, 1, maximum);
+        executeStatement(stmt);
     }
-    if (errormsg) sqlite3_free(errormsg);
+    commitTransaction();
+}
 
-    return maximum;
+ui32 ConfigurationDatabase::loadMaximumNumberOfSlots()
+{
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    return cache.maximum_slots;
 }
 
 void ConfigurationDatabase::saveAllowedAndForbiddenSocketAddressRanges(bool default_allowance, const SocketAddressRange &allowed, const SocketAddressRange &forbidden)
 {
-    assert(db);
+    boost::unique_lock<boost::mutex> clock(cache_mutex);
+    cache.address_ranges_ok = true;
+    cache.default_allowance = default_allowance;
+    cache.allowed_addresses = allowed;
+    cache.forbidden_addresses = forbidden;
+    ++unwritten_changes;
+    clock.unlock();
+
+    writeBehind(boost::bind(&ConfigurationDatabase::writeAllowedAndForbiddenSocketAddressRanges, this, default_allowance, allowed, forbidden));
+}
 
-    char* errormsg = (char*) 0;
+void ConfigurationDatabase::writeAllowedAndForbiddenSocketAddressRanges(bool default_allowance, const SocketAddressRange &allowed, const SocketAddressRange &forbidden)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(db_mutex);
+
+    assert(db);
 
     string allowed_str = allowed.serialize();
     string forbidden_str = forbidden.serialize();
 
-    string statement = string("DELETE FROM AllowedAndForbiddenSocketAddressRanges;");
-    int result = sqlite3_exec(db, statement.c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK)
-    { LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg); };
-    if (errormsg) sqlite3_free(errormsg);
-
-    string default_allowance_str("Yes");
-    if (!default_allowance)
-        default_allowance_str = "No";
-
-    stringstream ss;
-    ss << "INSERT INTO AllowedAndForbiddenSocketAddressRanges(Allowed, Forbidden, DefaultAllowance) VALUES(\'" << bytes_to_hex(allowed_str) << "\', \'" << bytes_to_hex(forbidden_str) << "\', \'" << default_allowance_str << "\');";
-    result = sqlite3_exec(db, ss.str().c_str(), 0, 0, &errormsg);
-    if (result != SQLITE_OK)
-    { LOG(Error, "Error while executing SQL statement \"" << ss.str() << "\": " << errormsg); };
+    beginTransaction();
+    executeStatement("DELETE FROM AllowedAndForbiddenSocketAddressRanges;");
 
-    if (errormsg) sqlite3_free(errormsg);
+    sqlite3_stmt* stmt = getStatement("INSERT INTO AllowedAndForbiddenSocketAddressRanges(Allowed, Forbidden, DefaultAllowance) VALUES(?1, ?2, ?3);");
+    if (stmt)
+    {
+        bind_string(stmt, 1, bytes_to_hex(allowed_str));
+        bind_string(stmt, 2, bytes_to_hex(forbidden_str));
+        bind_string(stmt, 3, default_allowance ? "Yes" : "No");
+        executeStatement(stmt);
+    }
+    commitTransaction();
 }
 
 void ConfigurationDatabase::loadAllowedAndForbiddenSocketAddressRanges(bool* default_allowance, SocketAddressRange* allowed, SocketAddressRange* forbidden)
 {
     assert(allowed);
     assert(forbidden);
-    assert(db);
     assert(default_allowance);
 
-    SocketAddressRange allowed_f, forbidden_f;
-    bool default_allowance_f = true;
-
-    function4<int, void*, int, char**, char**> sql_callback_function;
-    sql_callback_function = boost::bind(&ConfigurationDatabase::allowedAndForbiddenSocketAddressRangesCallback, this, &default_allowance_f, &allowed_f, &forbidden_f, _1, _2, _3, _4);
-
-    string statement = string("SELECT Allowed, Forbidden, DefaultAllowance FROM AllowedAndForbiddenSocketAddressRanges;");
-    char* errormsg = (char*) 0;
-    int result = sqlite3_exec(db, statement.c_str(), c_callback, (void*) &sql_callback_function, &errormsg);
-    if (result != SQLITE_OK)
-    {
-        LOG(Error, "Error while executing SQL statement \"" << statement << "\": " << errormsg);
-        if (errormsg) sqlite3_free(errormsg);
-        return;
-    }
-    if (errormsg) sqlite3_free(errormsg);
+    boost::lock_guard<boost::mutex> clock(cache_mutex);
+    /* Malformed ones in the database leave the arguments as they are. */
+    if (!cache.address_ranges_ok) return;
 
-    (*allowed) = allowed_f;
-    (*forbidden) = forbidden_f;
-    (*default_allowance) = default_allowance_f;
+    (*allowed) = cache.allowed_addresses;
+    (*forbidden) = cache.forbidden_addresses;
+    (*default_allowance) = cache.default_allowance;
 }
 
 
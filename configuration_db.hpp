@@ -3,6 +3,12 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <map>
+#include <string>
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
 #include "types.hpp"
 #include "sqlite3.h"
 #include "configuration_primitives.hpp"
@@ -27,13 +33,90 @@ class ConfigurationDatabase
         ConfigurationDatabase& operator=(const ConfigurationDatabase &) { return (*this); };
 
         sqlite3* db;
-        int slotprofileNameListDataCallback(std::vector<UnicodeString>* name_list, void* v_self, int argc, char** argv, char** colname);
-        int slotprofileDataCallback(SlotProfile* sp, void* v_self, int argc, char** argv, char** colname);
-        int motdCallback(UnicodeString* us, void* v_self, int argc, char** argv, char** colname);
-        int userDataCallback(SP<User>* user, void* v_self, int argc, char** argv, char** colname);
-        int userListDataCallback(std::vector<SP<User> >* user_list, void* v_self, int argc, char** argv, char** colname);
-        int maximumSlotsCallback(trankesbel::ui32* maximum, void* v_self, int argc, char** argv, char** colname);
-        int allowedAndForbiddenSocketAddressRangesCallback(bool* default_allowance, trankesbel::SocketAddressRange* allowed, trankesbel::SocketAddressRange* forbidden, void* v_self, int argc, char** argv, char** colname);
+
+        /* Prepared statements, by their SQL text. Prepared on first use
+           and kept until the database is closed. */
+        std::map<std::string, sqlite3_stmt*> statements;
+        /* Returns a prepared statement for 'sql', ready for binding parameters.
+           Returns null (and logs the error) if it can't be prepared. */
+        sqlite3_stmt* getStatement(const char* sql);
+        /* Runs a statement that doesn't return rows. Logs errors. */
+        bool executeStatement(sqlite3_stmt* stmt);
+        bool executeStatement(const char* sql);
+
+        /* Nesting depth of beginTransaction() calls, and whether
+           something failed in the current transaction. */
+        trankesbel::ui32 transaction_depth;
+        bool transaction_failed;
+
+        /* Brings the schema of an older database up to date. */
+        void migrateSchema();
+        void close();
+
+        /* Everything in the database, so that reading it doesn't need the disk.
+           Loaded when the database is opened and updated right away by the
+           save and delete calls; the database is written after. */
+        struct CachedData
+        {
+            boost::unordered_map<std::string, SP<User> > users_by_name;
+            boost::unordered_map<ID, SP<User> > users_by_id;
+            /* In the order they are in the database. */
+            std::vector<SP<SlotProfile> > slotprofiles;
+            UnicodeString motd;
+            trankesbel::ui32 maximum_slots;
+            /* False if the address ranges in the database are malformed. */
+            bool address_ranges_ok;
+            bool default_allowance;
+            trankesbel::SocketAddressRange allowed_addresses;
+            trankesbel::SocketAddressRange forbidden_addresses;
+        };
+        boost::mutex cache_mutex;
+        CachedData cache;
+        /* Changes that are in 'cache' but not yet in the database. Locked by 'cache_mutex'. */
+        trankesbel::ui32 unwritten_changes;
+        /* Reads everything from the database into 'data'. */
+        void readCache(CachedData* data);
+
+        /* PRAGMA data_version of the database when 'cache' was read. It changes
+           when another connection (like dfterm2_configure) writes. Locked by 'db_mutex'. */
+        int data_version;
+        int readDataVersion();
+        void reloadIfChanged();
+
+        /* The database parts of the save and delete calls. */
+        void writeUserData(SP<User> user);
+        void removeUserData(const std::string &name_utf8);
+        void writeSlotProfileData(SP<SlotProfile> slotprofile);
+        void removeSlotProfileData(const std::string &name_utf8);
+        void writeMOTD(const std::string &motd_utf8);
+        void writeMaximumNumberOfSlots(trankesbel::ui32 maximum);
+        void writeAllowedAndForbiddenSocketAddressRanges(bool default_allowance, const trankesbel::SocketAddressRange &allowed, const trankesbel::SocketAddressRange &forbidden);
+        /* Runs 'job' on the writer thread, or right away if it's not running.
+           The caller has counted the change in 'unwritten_changes'. */
+        void writeBehind(const boost::function0<void> &job);
+        void runWrite(boost::function0<void> job);
+
+        /* Locked by everything that uses 'db' and 'statements'. */
+        boost::recursive_mutex db_mutex;
+
+        /* Write-behind thread, see startWriterThread(). Writes are
+           run in the order they were queued. 'writes_pending' counts
+           queued writes and the one being run. */
+        boost::mutex writer_mutex;
+        boost::condition_variable writer_cv;
+        std::deque<boost::function0<void> > write_queue;
+        size_t writes_pending;
+        bool writer_running;
+        bool writer_stop;
+        boost::thread writer_thread;
+        boost::thread::id writer_thread_id;
+
+        static void static_writer(ConfigurationDatabase* self);
+        void writer();
+        /* If the writer thread is running and this is not it, queues
+           'job' for it and returns true. Otherwise returns false and
+           the caller should do the write itself. */
+        bool queueWrite(const boost::function0<void> &job);
 
     public:
         ConfigurationDatabase();
@@ -47,9 +130,34 @@ class ConfigurationDatabase
             return os;
         };
 
+        /* Starts a thread that does the writes to the database. After this,
+           calls that change the database only queue the change and return
+           right away. Reads are answered from memory and never wait for
+           the writes. */
+        void startWriterThread();
+        /* Writes everything that is queued and stops the thread. */
+        void stopWriterThread();
+        /* Waits until all queued writes have been done. */
+        void flush();
+
+        /* Reads everything again if the database was changed by some other
+           program since it was read. Done on the writer thread if it runs. */
+        void checkForChanges();
+
+        /* Groups the following calls into one transaction, so they are written
+           to disk together (and with one sync). Calls can be nested; the transaction
+           is committed by the outermost commitTransaction(). If a statement fails
+           in between, the whole transaction is rolled back. With the writer thread
+           running, commitTransaction() returns true without waiting for the result. */
+        void beginTransaction();
+        bool commitTransaction();
+
         void deleteUserData(const UnicodeString &name);
 
+        /* Users, like everything else, are kept in memory, so the load calls don't
+           read the database. They return copies; save changes with saveUserData(). */
         std::vector<SP<User> > loadAllUserData();
+        trankesbel::ui32 getNumberOfUsers();
         SP<User> loadUserData(const UnicodeString &name);
         SP<User> loadUserData(const ID& id);
         void saveUserData(User* user);
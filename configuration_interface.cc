@@ -3,6 +3,8 @@
 #include "configuration_interface.hpp"
 #include <algorithm>
 #include <cstdio>
+#include <sstream>
+#include <iomanip>
 #include "logger.hpp"
 
 using namespace dfterm;
@@ -311,6 +313,19 @@ void ConfigurationInterface::enterShowClientInformationMenu(SP<Client> c)
     window->addListElementUTF8(ip_address, "", false, false);
     window->addListElementUTF8(hostname, "", false, false);
 
+    TelnetCompressionStatistics tcs = c->getTelnetCompressionStatistics();
+    stringstream compression_ss;
+    if (!tcs.active)
+        compression_ss << "Compression: Off";
+    else
+    {
+        compression_ss << "Compression: " << tcs.uncompressed_bytes << " -> " << tcs.compressed_bytes << " bytes";
+        if (tcs.compressed_bytes > 0)
+            compression_ss << " (" << setprecision(3) << (double) tcs.uncompressed_bytes / (double) tcs.compressed_bytes << ":1)";
+        compression_ss << ", " << tcs.compression_nanoseconds / 1000000ULL << " ms CPU";
+    }
+    window->addListElementUTF8(compression_ss.str(), "", false, false);
+
     client_target = c->getID();
 }
 
@@ -394,6 +409,7 @@ void ConfigurationInterface::enterLinkToServerMenu(bool update_instead_of_adding
     window->addListElement("", "Port: ", "link_to_server_port", true, true);
     window->addListElement("", "Nanoseconds to wait before reconnecting: ", "link_to_server_nanoseconds", true, true);
     window->addListElement("", "Link name: ", "link_to_server_name", true, true);
+    window->addListElement("no", "Relay its slots to servers linking here: ", "link_to_server_relay", true, false);
     if (!update_instead_of_adding)
         window->addListElement("Add server-to-server link", "add_servertoserver_link", true, false);
     else
@@ -724,6 +740,8 @@ bool ConfigurationInterface::checkLinkToServerMenu(bool no_read)
         window->modifyListElementTextUTF8(i, str);
         i = window->getListDataIndex("link_to_server_name");
         window->modifyListElementTextUTF8(i, edit_pair.getNameUTF8());
+        i = window->getListDataIndex("link_to_server_relay");
+        window->modifyListElementTextUTF8(i, edit_pair.isRelay() ? "yes" : "no");
         return true;
     }
 
@@ -1175,7 +1193,6 @@ bool ConfigurationInterface::menuSelectFunction(ui32 index)
         st->setDefaultConnectionAllowance(edit_default_address_allowance);
         st->setAllowedAddresses(edit_allowed_addresses);
         st->setForbiddenAddresses(edit_forbidden_addresses);
-        st->checkAddressRestrictions();
         st->saveAddressRestrictions();
 
         LOG(Note, "Connection restrictions have been updated by " << user->getNameUTF8());
@@ -1196,6 +1213,11 @@ bool ConfigurationInterface::menuSelectFunction(ui32 index)
         
         enterLinkToServerMenu(true);
     }
+    else if (selection == "link_to_server_relay")
+    {
+        edit_pair.setRelay(!edit_pair.isRelay());
+        window->modifyListElementTextUTF8(window->getListDataIndex("link_to_server_relay"), edit_pair.isRelay() ? "yes" : "no");
+    }
     else if (selection == "add_servertoserver_link")
         addServerToServerLink(false);
     else if (selection == "update_servertoserver_link")
@@ -1481,9 +1503,12 @@ bool ConfigurationInterface::menuSelectFunction(ui32 index)
             }
             else
             {
+                /* The name may have changed, so delete the old row and save the new one in one go. */
+                configuration_database->beginTransaction();
                 configuration_database->deleteSlotProfileData(edit_slotprofile_sp_target->getName());
                 st->updateSlotProfile(edit_slotprofile_sp_target, edit_slotprofile);
                 configuration_database->saveSlotProfileData(edit_slotprofile_sp_target);
+                configuration_database->commitTransaction();
 
                 edit_slotprofile_sp_target = SP<SlotProfile>();
 
@@ -1584,7 +1609,7 @@ void ConfigurationInterface::auxiliaryEnterSpecificUsersWindow()
     {
         if (!users[i1]) continue;
         string element = string("\"") + users[i1]->getNameUTF8() + string("\"");
-        if (edit_usergroup.hasUser(users[i1]->getIDRef())) element.push_back('*');
+        if (edit_usergroup.hasUser(*users[i1])) element.push_back('*');
 
         string user_str = string("userselect_") + users[i1]->getID().serialize();
         auxiliary_window->addListElementUTF8(element.c_str(), user_str.c_str(), true, false);
@@ -1661,7 +1686,7 @@ void ConfigurationInterface::checkAuxiliaryWindowUsergroupSelections()
                 else
                 {
                     string username = user->getNameUTF8();
-                    if (edit_usergroup.hasUser(user_id))
+                    if (edit_usergroup.hasUser(*user))
                         auxiliary_window->modifyListElementTextUTF8(index, string("\"") + username + string("\"*"));
                     else
                         auxiliary_window->modifyListElementTextUTF8(index, string("\"") + username + string("\""));
@@ -25,11 +25,12 @@ class User
         bool active;
         bool admin;
         ID id;
+        IDHandle id_handle;
 
     public:
-        User() { active = true; admin = false; };
-        User(UnicodeString us) { name = us; active = true; admin = false; };
-        User(const std::string &us) { name = UnicodeString::fromUTF8(us); };
+        User() { active = true; admin = false; id_handle = 0; };
+        User(UnicodeString us) { name = us; active = true; admin = false; id_handle = 0; };
+        User(const std::string &us) { name = UnicodeString::fromUTF8(us); id_handle = 0; };
 
         data1D getPasswordHash() const { return password_hash_sha512; };
         void setPasswordHash(data1D hash) { password_hash_sha512 = hash; };
@@ -39,7 +40,18 @@ class User
         
         ID getID() const { return id; };
         const ID& getIDRef() const { return id; };
-        void setID(const ID& id) { this->id = id; };
+        /* setID() interns the ID, so only use it for users that are
+           in the database. */
+        void setID(const ID& id) { this->id = id; id_handle = id.getHandle(); };
+
+        /* Handle of the user ID (see ID::getHandle()), or 0 for guests,
+           whose IDs are made up per connection and never interned.
+           UserGroup::hasUser() takes this, so permission checks don't
+           touch the global ID table. */
+        IDHandle getIDHandle() const { return id_handle; };
+        /* Interns the current ID. Call this when a guest becomes a
+           registered user. */
+        void internID() { id_handle = id.getHandle(); };
 
         /* This one hashes the password and then calls setPasswordHash. */
         /* UnicodeString will be first converted to UTF-8 */
@@ -87,7 +99,11 @@ class UserGroup
         bool has_nobody;
         bool has_anybody;
         bool has_launcher;
-        std::set<ID> has_user;
+        /* Handles of the IDs of users in the group. (See ID::getHandle())
+           Only setUser() and toggleUser() add IDs to the table. Removals use
+           ID::findHandle(), since an ID without a handle can't be in the
+           group anyway. */
+        std::set<IDHandle> has_user;
 
     public:
         UserGroup()
@@ -105,12 +121,15 @@ class UserGroup
         bool hasNobody() const { return has_nobody; };
         bool hasAnybody() const { return has_anybody; };
         bool hasLauncher() const { return has_launcher; };
-        bool hasUser(const ID &user_id) const 
+        /* Takes User::getIDHandle(). Doesn't lock anything; a handle of
+           0 (a guest) is only in groups that have anybody. */
+        bool hasUser(IDHandle user_handle) const 
         { 
             if (has_nobody) return false;
             if (has_anybody) return true;
-            return has_user.find(user_id) != has_user.end(); 
+            return user_handle && has_user.find(user_handle) != has_user.end(); 
         };
+        bool hasUser(const User &user) const { return hasUser(user.getIDHandle()); };
 
         bool toggleAnybody()
         {
@@ -128,7 +147,7 @@ class UserGroup
         }
         bool toggleUser(const ID &user_id)
         {
-            std::set<ID>::iterator i1 = has_user.find(user_id);
+            std::set<IDHandle>::iterator i1 = has_user.find(ID::findHandle(user_id));
             if (i1 != has_user.end())
             {
                 has_user.erase(i1);
@@ -137,7 +156,7 @@ class UserGroup
             }
             else
             {
-                has_user.insert(user_id);
+                has_user.insert(user_id.getHandle());
                 if (has_nobody) has_nobody = false;
                 return true;
             }
@@ -175,11 +194,12 @@ class UserGroup
         }
         void setUser(const ID &user_id)
         {
-            has_user.insert(user_id);
+            has_user.insert(user_id.getHandle());
         }
         void unsetUser(const ID &user_id)
         {
-            has_user.erase(user_id);
+            IDHandle handle = ID::findHandle(user_id);
+            if (handle) has_user.erase(handle);
         }
 };
 
@@ -23,13 +23,32 @@ const trankesbel::ui32 MAX_REGISTERED_USERS = 500;
 /* Maximum number of (telnet) connections at a time */
 const trankesbel::ui32 MAX_CONNECTIONS = 500;
 
+/* Maximum number of listening sockets on one telnet port. */
+const trankesbel::ui32 MAX_TELNET_LISTENERS = 64;
+
+/* Maximum number of connections accepted from one listening
+   socket before going back to serve other sockets. */
+const trankesbel::ui32 ACCEPT_BATCH_SIZE = 64;
+
 /* Maximum number of server-to-server links at a time. */
 const trankesbel::ui32 MAX_SERVER_TO_SERVER_LINKS = 30;
 
+/* Mirrored slots that have come through this many server-to-server
+   links are not relayed further. Also stops relays that link in a circle. */
+const trankesbel::ui32 MAX_SERVER_TO_SERVER_HOPS = 8;
+
 /* Maximum number of HTTP connections at a time. */
-const trankesbel::ui32 MAX_HTTP_CONNECTIONS = 100;
+const trankesbel::ui32 MAX_HTTP_CONNECTIONS = 1000;
+
+/* Maximum number of spectators (WebSocket viewers of slots) at a time. */
+const trankesbel::ui32 MAX_SPECTATORS = 10000;
+
+/* Maximum number of event stream (/events) connections at a time. */
+const trankesbel::ui32 MAX_EVENT_SUBSCRIBERS = 10000;
 
-/* Maximum size for a file served through HTTP. */
+/* Files served through HTTP up to this size are kept in memory (and compressed).
+   Larger files are sent from the disk. Files with replacors are always kept in
+   memory, so they can't be larger than this. */
 const trankesbel::ui64 MAX_HTTP_FILE_SIZE = 1000000;
 
 /* Maximum size of configuration file. */
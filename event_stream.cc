@@ -0,0 +1,201 @@
+#include "event_stream.hpp"
+#include "nanoclock.hpp"
+#include "dfterm2_limits.hpp"
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <cassert>
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace std;
+
+/* How many recent events are kept for reconnecting browsers. */
+static const size_t EVENT_HISTORY_SIZE = 256;
+/* Subscribers with this many bytes waiting to be sent are disconnected. */
+static const size_t MAX_EVENT_SUBSCRIBER_QUEUE = 1048576;
+/* An empty comment is sent this often, so proxies don't close idle streams. */
+static const ui64 EVENT_KEEP_ALIVE_INTERVAL = 30000000000ULL;
+
+EventSubscriber::EventSubscriber(SP<Socket> s)
+{
+    assert(s);
+    this->s = s;
+}
+
+void EventSubscriber::queue(SP<const string> event)
+{
+    if (!event || !s->active()) return;
+
+    if (output.getQueuedBytes() + event->size() > MAX_EVENT_SUBSCRIBER_QUEUE)
+    {
+        LOG(Note, "Event stream connection from " << s->getAddress().getHumanReadablePlainUTF8() << " closed, as it is not reading the events.");
+        s->close();
+        return;
+    }
+
+    output.push(event);
+}
+
+void EventSubscriber::flush()
+{
+    output.flush(s.get());
+}
+
+void EventSubscriber::drain()
+{
+    char buf[1000];
+    while (s->recv(buf, 1000) > 0) { };
+}
+
+EventStreamServer::EventStreamServer()
+{
+    /* Ids continue from the time of start, so ids from before a restart
+       are not taken for ids of this run. */
+    next_id = (ui64) time(0) * 1000000ULL;
+    history_first_id = next_id;
+    keep_alive = SP<const string>(new string(":\n\n"));
+    last_keep_alive = nanoclock();
+}
+
+void EventStreamServer::setChat(SP<Logger> chat)
+{
+    chat_reader = chat ? chat->createReader() : SP<LoggerReader>();
+}
+
+string EventStreamServer::serializeEvent(const string &type, const string &data)
+{
+    string result;
+    result.reserve(type.size() + data.size() + 20);
+    result.append("event: ").append(type).append("\n");
+
+    /* A line break in data would end the field, so each line goes in a field of its own. */
+    size_t pos = 0;
+    while (true)
+    {
+        size_t end = data.find_first_of("\r\n", pos);
+        result.append("data: ").append(data, pos, (end == string::npos) ? string::npos : end - pos).append("\n");
+        if (end == string::npos) break;
+        pos = end + 1;
+        if (data[end] == '\r' && pos < data.size() && data[pos] == '\n') ++pos;
+    }
+    result.append("\n");
+    return result;
+}
+
+void EventStreamServer::broadcast(SP<const string> event)
+{
+    map<SP<Socket>, SP<EventSubscriber> >::iterator i1 = subscribers.begin();
+    while (i1 != subscribers.end())
+    {
+        i1->second->queue(event);
+        i1->second->flush();
+        if (!i1->first->active())
+        {
+            subscribers.erase(i1++);
+            continue;
+        }
+        ++i1;
+    }
+}
+
+void EventStreamServer::publish(const string &type, const string &data)
+{
+    if (type != "chat")
+        snapshot.reset();
+
+    stringstream ss;
+    ss << "id: " << next_id << "\n" << serializeEvent(type, data);
+    SP<const string> event(new string(ss.str()));
+    ++next_id;
+
+    history.push_back(event);
+    if (history.size() > EVENT_HISTORY_SIZE)
+    {
+        history.pop_front();
+        ++history_first_id;
+    }
+
+    broadcast(event);
+}
+
+bool EventStreamServer::addSubscriber(SP<Socket> s, const string &last_event_id)
+{
+    assert(s);
+
+    if (subscribers.size() >= MAX_EVENT_SUBSCRIBERS)
+    {
+        LOG(Note, "Event stream connection from " << s->getAddress().getHumanReadablePlainUTF8() << " closed, as maximum number (" << MAX_EVENT_SUBSCRIBERS << ") of event stream connections has been reached.");
+        s->close();
+        return false;
+    }
+
+    SP<EventSubscriber> subscriber(new EventSubscriber(s));
+    subscribers[s] = subscriber;
+
+    /* Missed events, if we still have all of them. */
+    bool replayed = false;
+    if (!last_event_id.empty())
+    {
+        char* end = 0;
+        ui64 last_id = strtoull(last_event_id.c_str(), &end, 10);
+        if (end && (*end) == 0 && last_id + 1 >= history_first_id && last_id < next_id)
+        {
+            size_t i1;
+            for (i1 = (size_t) (last_id + 1 - history_first_id); i1 < history.size(); ++i1)
+                subscriber->queue(history[i1]);
+            replayed = true;
+        }
+    }
+
+    if (!replayed)
+    {
+        if (!snapshot && snapshot_callback)
+            snapshot = SP<const string>(new string(snapshot_callback()));
+        subscriber->queue(snapshot);
+    }
+
+    subscriber->drain();
+    subscriber->flush();
+    if (!s->active())
+    {
+        subscribers.erase(s);
+        return false;
+    }
+    return true;
+}
+
+bool EventStreamServer::socketEvent(SP<Socket> s)
+{
+    map<SP<Socket>, SP<EventSubscriber> >::iterator i1 = subscribers.find(s);
+    if (i1 == subscribers.end()) return false;
+
+    SP<EventSubscriber> subscriber = i1->second;
+    subscriber->drain();
+    subscriber->flush();
+    if (!s->active())
+        subscribers.erase(s);
+    return true;
+}
+
+void EventStreamServer::cycle()
+{
+    if (chat_reader)
+    {
+        bool got_message = true;
+        while (true)
+        {
+            UnicodeString us = chat_reader->getLogMessage(&got_message);
+            if (!got_message) break;
+            publish("chat", TO_UTF8(us));
+        }
+    }
+
+    ui64 now = nanoclock();
+    if (now - last_keep_alive >= EVENT_KEEP_ALIVE_INTERVAL)
+    {
+        last_keep_alive = now;
+        broadcast(keep_alive);
+    }
+}
+
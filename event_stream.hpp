@@ -0,0 +1,123 @@
+/*
+
+Server-Sent Events (text/event-stream) feed of what happens on the server,
+for web pages that want to show who is online and which slots are running.
+See HTTPServer::serveStream().
+
+Events:
+  join      data: user name             A user has logged in.
+  leave     data: user name             A user has disconnected.
+  launch    data: slot name             A slot has been launched.
+  close     data: slot name             A slot has closed.
+  chat      data: line                  A line in the global chat (chat
+                                        messages and server notices).
+  users     data: one user per line     Users online. Sent first.
+  slots     data: one slot per line     Running slots. Sent first.
+
+Each event is serialized once, and the same buffer is queued to every
+subscriber. Recent events are kept, so a browser that reconnects with
+Last-Event-ID gets what it missed instead of the users and slots lists.
+
+*/
+
+#ifndef event_stream_hpp
+#define event_stream_hpp
+
+#include <string>
+#include <deque>
+#include <map>
+#include <boost/function.hpp>
+#include "types.hpp"
+#include "sockets.hpp"
+#include "send_queue.hpp"
+#include "logger.hpp"
+
+namespace dfterm
+{
+
+/* One connection receiving events. */
+class EventSubscriber
+{
+    private:
+        SP<trankesbel::Socket> s;
+
+        /* Events waiting to be sent. */
+        trankesbel::SendQueue output;
+
+        /* No copies */
+        EventSubscriber(const EventSubscriber &es) { };
+        EventSubscriber& operator=(const EventSubscriber &es) { return (*this); };
+
+    public:
+        EventSubscriber(SP<trankesbel::Socket> s);
+
+        SP<trankesbel::Socket> getSocket() const { return s; };
+
+        /* Queues an event. Closes the connection if it has fallen too
+           far behind; the browser will reconnect and catch up. */
+        void queue(SP<const std::string> event);
+        /* Sends as much as the socket takes. */
+        void flush();
+        /* Reads (and ignores) what the other end sends, to notice it closing. */
+        void drain();
+};
+
+class EventStreamServer
+{
+    private:
+        std::map<SP<trankesbel::Socket>, SP<EventSubscriber> > subscribers;
+
+        /* Recent events, oldest first, and the id of the first one. */
+        std::deque<SP<const std::string> > history;
+        trankesbel::ui64 history_first_id;
+        trankesbel::ui64 next_id;
+
+        /* Lines of the global chat. */
+        SP<LoggerReader> chat_reader;
+
+        /* Makes the users and slots events for new subscribers. Cached
+           until a join, leave, launch or close event. */
+        boost::function0<std::string> snapshot_callback;
+        SP<const std::string> snapshot;
+
+        SP<const std::string> keep_alive;
+        trankesbel::ui64 last_keep_alive;
+
+        /* No copies */
+        EventStreamServer(const EventStreamServer &ess) { };
+        EventStreamServer& operator=(const EventStreamServer &ess) { return (*this); };
+
+        /* Sends 'event' to everyone. */
+        void broadcast(SP<const std::string> event);
+
+    public:
+        EventStreamServer();
+
+        /* Sets the global chat, whose lines are sent as chat events. */
+        void setChat(SP<Logger> chat);
+        /* Sets the function that makes the users and slots events. */
+        void setSnapshotCallback(boost::function0<std::string> callback) { snapshot_callback = callback; };
+
+        /* Serializes one event, without an id. Data can have several lines. */
+        static std::string serializeEvent(const std::string &type, const std::string &data);
+
+        /* Sends an event to all subscribers. */
+        void publish(const std::string &type, const std::string &data);
+
+        /* Starts sending events to 's', which has been sent the response headers.
+           'last_event_id' is the Last-Event-ID request header, if any. */
+        bool addSubscriber(SP<trankesbel::Socket> s, const std::string &last_event_id);
+
+        /* Handles an event on socket 's'. Returns false if it's not a subscriber's socket. */
+        bool socketEvent(SP<trankesbel::Socket> s);
+
+        /* Sends new chat lines and keeps idle connections alive. Call this every now and then. */
+        void cycle();
+
+        size_t getNumberOfSubscribers() const { return subscribers.size(); };
+};
+
+}
+
+#endif
+
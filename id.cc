@@ -8,6 +8,10 @@
 #endif
 
 #include <cstring>
+#include <map>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include "rng.hpp"
 
 using namespace trankesbel;
@@ -112,11 +116,44 @@ void ID::unSerialize(const std::string &s)
     }
 }
 
-bool ID::operator==(const ID& id_value) const
+/* The interning table. Handle N is id_table_ids[N-1]. */
+static boost::mutex id_table_mutex;
+static map<ID, IDHandle> id_table_handles;
+static vector<ID> id_table_ids;
+
+IDHandle ID::getHandle() const
 {
-    ui32 i1;
-    for (i1 = 0; i1 < 64; ++i1)
-        if (this->id_value[i1] != id_value.id_value[i1])
-            return false;
-    return true;
+    boost::lock_guard<boost::mutex> lock(id_table_mutex);
+
+    map<ID, IDHandle>::iterator i1 = id_table_handles.find(*this);
+    if (i1 != id_table_handles.end())
+        return i1->second;
+
+    id_table_ids.push_back(*this);
+    IDHandle h = (IDHandle) id_table_ids.size();
+    id_table_handles[*this] = h;
+    return h;
+}
+
+IDHandle ID::findHandle(const ID &id)
+{
+    boost::lock_guard<boost::mutex> lock(id_table_mutex);
+
+    map<ID, IDHandle>::iterator i1 = id_table_handles.find(id);
+    if (i1 != id_table_handles.end())
+        return i1->second;
+    return 0;
+}
+
+ID ID::getByHandle(IDHandle handle)
+{
+    boost::lock_guard<boost::mutex> lock(id_table_mutex);
+
+    if (handle == 0 || handle > id_table_ids.size())
+    {
+        ID id;
+        memset(id.id_value, 0, 64);
+        return id;
+    }
+    return id_table_ids[handle-1];
 }
@@ -3,10 +3,18 @@
 
 #include "types.hpp"
 #include <string>
+#include <cstring>
+#if __cplusplus >= 201103L
+#include <functional>
+#endif
 
 namespace dfterm
 {
 
+/* A small number that stands for an ID for the lifetime of the process.
+   See ID::getHandle(). 0 is never a valid handle. */
+typedef trankesbel::ui32 IDHandle;
+
 /* Generates IDs that persist across
    process life time. They are internally 512 bit
    random byte sequences. Needs OpenSSL for secure random number
@@ -25,15 +33,13 @@ class ID
         { 
             if (this == &i) return (*this);
             
-            for (trankesbel::ui8 i1 = 0; i1 < 64; i1++)
-                id_value[i1] = i.id_value[i1];
+            memcpy(id_value, i.id_value, 64);
             
             return (*this);
         };
         ID(const ID& i)
         {
-            for (trankesbel::ui8 i1 = 0; i1 < 64; i1++)
-                id_value[i1] = i.id_value[i1];
+            memcpy(id_value, i.id_value, 64);
         }
         
         /* You can use these to convert the ID
@@ -50,22 +56,48 @@ class ID
         static ID getUnSerialized(const std::string &s);
         void unSerialize(const std::string &s);
         
-        bool operator==(const ID& id_value) const;
-        bool operator!=(const ID& id_value) const
-        { return !((*this) == id_value); };
+        bool operator==(const ID& id) const
+        { return memcmp(id_value, id.id_value, 64) == 0; };
+        bool operator!=(const ID& id) const
+        { return !((*this) == id); };
 
         bool operator<(const ID& id) const
+        { return memcmp(id_value, id.id_value, 64) < 0; };
+
+        /* IDs are random, so any part of them makes a good hash. */
+        size_t hash() const
         {
-            for (trankesbel::ui8 i1 = 0; i1 < 64; i1++)
-            {
-                if (id_value[i1] == id.id_value[i1]) continue;
-                if (id_value[i1] < id.id_value[i1]) return true; else return false;
-            }
-                
-            return false;
+            size_t h;
+            memcpy(&h, id_value, sizeof(h));
+            return h;
         }
+
+        /* Returns a 32-bit handle for this ID. Equal IDs get equal
+           handles, so handles can be used in place of IDs in runtime
+           structures. The first call for an ID adds it to a global table
+           (thread-safe). The table is never emptied, so don't use handles for
+           IDs that are made up all the time (like client IDs); look those
+           up with findHandle(). */
+        IDHandle getHandle() const;
+        /* Returns the handle of 'id' if it has one, or 0 if it hasn't.
+           Doesn't add anything to the table. */
+        static IDHandle findHandle(const ID &id);
+        /* Returns the ID for a handle returned by getHandle(). */
+        static ID getByHandle(IDHandle handle);
 };
 
+inline size_t hash_value(const ID &id) { return id.hash(); };
+
 }
 
+#if __cplusplus >= 201103L
+namespace std
+{
+template<> struct hash<dfterm::ID>
+{
+    size_t operator()(const dfterm::ID &id) const { return id.hash(); };
+};
+}
+#endif
+
 #endif
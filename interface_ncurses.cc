@@ -483,20 +483,27 @@ void InterfaceCurses::refresh()
     }
 
     /* Size changed or otherwise need update? */
-    if (old_terminal_w != terminal_w || old_terminal_h != terminal_h || window_update)
+    bool resized = (old_terminal_w != terminal_w || old_terminal_h != terminal_h);
+    if (resized || window_update)
     {
         window_update = false;
 
-        /* Clear the screen */
-        #ifndef NO_CURSES
-        if (!termemu_mode)
-            clear();
-        #endif
         if (termemu_mode)
         {
             terminal_w = old_terminal_w;
             terminal_h = old_terminal_h;
-            screen_terminal.fillRectangle(0, 0, screen_terminal.getWidth(), screen_terminal.getHeight(), TerminalTile((UChar32) ' ', 7, 0, false, false));
+        }
+
+        /* Clear the screen, if it changed size. Otherwise only
+           the windows that move are repainted. */
+        if (resized)
+        {
+            #ifndef NO_CURSES
+            if (!termemu_mode)
+                clear();
+            #endif
+            if (terminal_w > 0 && terminal_h > 0)
+                uncoverRectangle(Rectangle(0, 0, terminal_w-1, terminal_h-1));
         }
 
         /* Replace all windows. 
@@ -511,13 +518,12 @@ void InterfaceCurses::refresh()
         rectangles_minimum.clear();
         rectangles_window.clear();
         rectangles_refresh.clear();
-        clear_rectangles.clear();
 
         AbstractWindow focus;
         if (focused_window < rectangles_copy.size())
             focus = rectangles_window_copy[focused_window];
 
-        ui32 i1, len = rectangles_copy.size();
+        ui32 i1, i2, len = rectangles_copy.size();
         for (i1 = 0; i1 < len; ++i1)
         {
             ui32 x, y, w, h;
@@ -547,11 +553,31 @@ void InterfaceCurses::refresh()
             rectangles_window[focused_window].resizeEvent(Rectangle(rectangles[focused_window]));
         }
 
+        /* Windows that stayed in place keep their old refresh state.
+           Others are repainted, and where they were is cleared. */
+        ui32 len_copy = rectangles_copy.size();
+        for (i1 = 0; i1 < len_copy; ++i1)
+        {
+            for (i2 = 0; i2 < len; ++i2)
+                if (rectangles_window[i2] == rectangles_window_copy[i1])
+                    break;
+            if (i2 < len && rectangles[i2] == rectangles_copy[i1])
+            {
+                rectangles_refresh[i2] = rectangles_refresh_copy[i1];
+                continue;
+            }
+            uncoverRectangle(rectangles_copy[i1]);
+        }
+
         /* to ensure we don't get into update loop */
         window_update = false;
     }
 
-    ui32 i1, len = clear_rectangles.size();
+    /* Blank the uncovered regions. They are the first damaged regions. */
+    vector<Rectangle> damage;
+    damage.swap(clear_rectangles);
+
+    ui32 i1, i2, len = damage.size();
     for (i1 = 0; i1 < len; ++i1)
     {
         #ifndef NO_CURSES
@@ -561,7 +587,7 @@ void InterfaceCurses::refresh()
             attr_t attributes;
             attr_get(&attributes, (short*) 0, (void*) 0);
             
-            Rectangle &r = clear_rectangles[i1];
+            Rectangle &r = damage[i1];
             ui32 i2, i3;
             cchar_t character;
             setcchar(&character, L" ", attributes, White, NULL);
@@ -572,24 +598,25 @@ void InterfaceCurses::refresh()
         #endif
         if (termemu_mode)
         {
-            screen_terminal.fillRectangle(clear_rectangles[i1].left, clear_rectangles[i1].top,
-                                          clear_rectangles[i1].right - clear_rectangles[i1].left + 1,
-                                          clear_rectangles[i1].bottom - clear_rectangles[i1].top + 1,
+            screen_terminal.fillRectangle(damage[i1].left, damage[i1].top,
+                                          damage[i1].right - damage[i1].left + 1,
+                                          damage[i1].bottom - damage[i1].top + 1,
                                           TerminalTile(' ', 7, 0, false, false));
         }
     }
-    clear_rectangles.clear();
-
-    Rectangle refresh_this(0, 0, 0, 0);
-    bool refresh_this_ok = false;
 
+    /* Go through the windows from bottom to top. A window is repainted
+       if it wants to be or if it's over a damaged region, and then it's
+       damaged itself for the windows on top of it. */
     len = rectangles.size();
     if (fullscreen && focused_window < len && !rectangles_window[focused_window].getHidden())
     {
-        rectangles_window[focused_window].refreshEvent(focused_window);
-        rectangles_refresh[focused_window] = false;
-        refresh_this_ok = true;
-        refresh_this = refresh_this.extend(rectangles[focused_window]);
+        /* It covers the screen, so any damage is on it. */
+        if (rectangles_refresh[focused_window] || !damage.empty())
+        {
+            rectangles_window[focused_window].refreshEvent(focused_window);
+            rectangles_refresh[focused_window] = false;
+        }
     }
     
     if (!fullscreen || focused_window >= len)
@@ -598,14 +625,21 @@ void InterfaceCurses::refresh()
         if (rectangles_window[i1].getHidden())
             continue;
 
-        if ((rectangles_refresh[i1] && rectangles[i1].right >= rectangles[i1].left && rectangles[i1].bottom >= rectangles[i1].top) ||
-             (refresh_this_ok && rectangles[i1].overlaps(refresh_this)))
-        {
-            rectangles_window[i1].refreshEvent(i1);
-            rectangles_refresh[i1] = false;
-            refresh_this_ok = true;
-            refresh_this = refresh_this.extend(rectangles[i1]);
-        }
+        const Rectangle &r = rectangles[i1];
+        if (r.isEmpty())
+            continue;
+
+        bool damaged = rectangles_refresh[i1];
+        ui32 damage_len = damage.size();
+        for (i2 = 0; i2 < damage_len && !damaged; ++i2)
+            if (r.overlaps(damage[i2]))
+                damaged = true;
+        if (!damaged)
+            continue;
+
+        rectangles_window[i1].refreshEvent(i1);
+        rectangles_refresh[i1] = false;
+        damage.push_back(r);
     }
 
     #ifndef NO_CURSES
@@ -857,13 +891,34 @@ bool InterfaceCurses::requestWindowSize(AbstractWindow who, ui32* width, ui32* h
 {
     purgeDeadWindows();
 
+    lock_guard<recursive_mutex> lock(class_mutex);
+
+    ui32 i1, i2, i3, len = rectangles.size();
+
+    /* Asking for the same size again? Then the window stays where it is,
+       and nothing needs to be laid out again. */
+    if ((*width) > 0 && (*height) > 0)
+        for (i1 = 0; i1 < len; ++i1)
+        {
+            if (!(rectangles_window[i1] == who)) continue;
+
+            const Rectangle &r = rectangles[i1];
+            const Rectangle &r_min = rectangles_minimum[i1];
+            if (r.isEmpty() || r_min.right - r_min.left + 1 != (*width) || r_min.bottom - r_min.top + 1 != (*height))
+                break;
+
+            (*width) = r.right - r.left + 1;
+            (*height) = r.bottom - r.top + 1;
+            (*x) = r.left;
+            (*y) = r.top;
+            return true;
+        }
+
     window_update = true;
 
-    lock_guard<recursive_mutex> lock(class_mutex);
     bool set_focus = false;
     ui32 old_index = 0xFFFFFFFF;
     /* Remove the window from rectangles list, if it's already there. */
-    ui32 i1, i2, i3, i4, len = rectangles.size();
     for (i1 = 0; i1 < len; ++i1)
     {
         if (rectangles_window[i1] == who)
@@ -876,27 +931,17 @@ bool InterfaceCurses::requestWindowSize(AbstractWindow who, ui32* width, ui32* h
              else if (focused_window > i1)
                  --focused_window;
 
-             clear_rectangles.push_back(rectangles[i1]);
-             for (i2 = 0; i2 < len; ++i2)
-             {
-                 if (i2 == i1) continue;
-                 for (i3 = rectangles[i1].left; i3 <= rectangles[i1].right; ++i3)
-                     for (i4 = rectangles[i1].top; i4 <= rectangles[i1].bottom; ++i4)
-                         if (rectangles[i2].inside(i3, i4))
-                         {
-                             rectangles_refresh[i2] = true;
-                             i4 = rectangles[i1].bottom;
-                             i3 = rectangles[i1].right;
-                             break;
-                         }
-             }
+             /* Windows under it are repainted at refresh(). */
+             uncoverRectangle(rectangles[i1]);
              rectangles.erase(rectangles.begin() + i1);
              rectangles_minimum.erase(rectangles_minimum.begin() + i1);
              rectangles_window.erase(rectangles_window.begin() + i1);
              rectangles_refresh.erase(rectangles_refresh.begin() + i1);
              old_index = i1;
-             for (i2 = i1; i2 < len; ++i2)
+             /* The windows after it get a new number */
+             for (i2 = i1; i2 < rectangles.size(); ++i2)
                  rectangles_refresh[i2] = true;
+             break;
         }
     }
 
@@ -1581,32 +1626,26 @@ void InterfaceCurses::handleChangeWindowFocusByDirection(const KeyPress &kp)
         }
 }
 
+void InterfaceCurses::uncoverRectangle(const Rectangle &r)
+{
+    /* Windows that didn't fit have an empty rectangle */
+    if (r.isEmpty()) return;
+    clear_rectangles.push_back(r);
+}
+
 void InterfaceCurses::purgeDeadWindows()
 {
-    ui32 i1, i2, i3, i4, len = rectangles.size();
+    ui32 i1, i2, len = rectangles.size();
     for (i1 = 0; i1 < len; ++i1)
     {
         if (!rectangles_window[i1].isAlive())
         {
-            clear_rectangles.push_back(rectangles[i1]);
-            for (i2 = 0; i2 < len; ++i2)
-            {
-                if (i2 == i1) continue;
-                for (i3 = rectangles[i1].left; i3 <= rectangles[i1].right; ++i3)
-                    for (i4 = rectangles[i1].top; i4 <= rectangles[i1].bottom; ++i4)
-                        if (rectangles[i2].inside(i3, i4))
-                        {
-                            rectangles_refresh[i2] = true;
-                            i4 = rectangles[i1].bottom;
-                            i3 = rectangles[i1].right;
-                            break;
-                        }
-            }
+            uncoverRectangle(rectangles[i1]);
             rectangles.erase(rectangles.begin() + i1);
             rectangles_refresh.erase(rectangles_refresh.begin() + i1);
             rectangles_window.erase(rectangles_window.begin() + i1);
             rectangles_minimum.erase(rectangles_minimum.begin() + i1);
-            for (i2 = i1; i2 < len; ++i2)
+            for (i2 = i1; i2 < rectangles.size(); ++i2)
                 rectangles_refresh[i2] = true;
             if (focused_window > i1) --focused_window;
             else if (focused_window == i1) focused_window = 0xFFFFFFFF;
@@ -1654,7 +1693,7 @@ void InterfaceCurses::cycle()
             window_update = true;
             rectangles_refresh[focused_window] = true;
             rectangles_window[focused_window].setHidden(rectangles_window[focused_window].getHidden() ? false : true);
-            clear_rectangles.push_back(rectangles[focused_window]);
+            uncoverRectangle(rectangles[focused_window]);
             continue;
         }
 
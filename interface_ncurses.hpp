@@ -102,6 +102,11 @@ class Rectangle
             if (x >= left && y >= top && x <= right && y <= bottom) return true;
             return false;
         }
+        /* Returns true if there is no position inside this rectangle. */
+        bool isEmpty() const
+        {
+            return (right < left || bottom < top);
+        }
         /* Compares the rectangles by size. */
         bool operator<(const Rectangle &r) const
         {
@@ -251,8 +256,13 @@ class InterfaceCurses : public Interface
     /* Take the window from 'from', insert it at 'target', shift other windows. */
     void insertWindow(ui32 target, ui32 from);
 
-    /* And these are rectangles that need clearing at next refresh() call. */
+    /* And these are rectangles that need clearing at next refresh() call.
+       Windows are in z-order (the last one is on top), and refresh() repaints
+       only the windows that need refreshing or are over a cleared region,
+       and then the windows over those, so the cost depends on what changed. */
     std::vector<Rectangle> clear_rectangles;
+    /* Adds a region that is no longer covered by a window to clear_rectangles. */
+    void uncoverRectangle(const Rectangle &r);
 
     /* Currently focused window (gets input events) */
     ui32 focused_window;
@@ -287,7 +297,8 @@ class InterfaceCurses : public Interface
     /* If last processed key was 27 (hence, if escape/alt is down) */
     bool escape_down;
 
-    /* Set to true, all windows will have their position and size updated at next cycle. */
+    /* Set to true, all windows will have their position and size updated at next cycle.
+       Only windows that end up in a different place are repainted. */
     bool window_update;
 
     /* Set to true, currently focused window will be "locked", and all keys will be
@@ -2,12 +2,88 @@
 #define lockedresource_hpp
 
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <algorithm>
 #include "types.hpp"
+#include "nanoclock.hpp"
+#include "metrics.hpp"
 
 namespace dfterm {
 
 template<class T> class LockedObject;
 template<class T> class LockedResource;
+template<class T> class SharedLockedObject;
+template<class T> class SharedLockedResource;
+
+/* Statistics on how a resource has been locked.
+   Times are in nanoseconds. */
+struct LockStatistics
+{
+    /* Number of locks taken, and how many of them had to wait for another thread. */
+    trankesbel::ui64 locks;
+    trankesbel::ui64 contended_locks;
+    /* Time spent waiting for the lock. */
+    trankesbel::ui64 wait_time;
+    trankesbel::ui64 max_wait_time;
+    /* Time the lock was held. */
+    trankesbel::ui64 hold_time;
+    trankesbel::ui64 max_hold_time;
+
+    LockStatistics()
+    {
+        locks = contended_locks = 0;
+        wait_time = max_wait_time = 0;
+        hold_time = max_hold_time = 0;
+    }
+};
+
+/* Collects lock statistics for a resource. Does nothing
+   (except check a flag) unless enabled. */
+class LockStatisticsRecorder
+{
+    private:
+        boost::mutex statistics_mutex;
+        LockStatistics statistics;
+        volatile bool enabled;
+
+        /* No copies */
+        LockStatisticsRecorder& operator=(const LockStatisticsRecorder &lsr) { return (*this); };
+        LockStatisticsRecorder(const LockStatisticsRecorder &lsr) { };
+
+    public:
+        LockStatisticsRecorder() { enabled = false; };
+
+        bool isEnabled() const { return enabled; };
+        void setEnabled(bool enabled) { this->enabled = enabled; };
+
+        void recordWait(bool contended, trankesbel::ui64 wait_time)
+        {
+            boost::lock_guard<boost::mutex> lock(statistics_mutex);
+            ++statistics.locks;
+            if (contended) ++statistics.contended_locks;
+            statistics.wait_time += wait_time;
+            if (wait_time > statistics.max_wait_time) statistics.max_wait_time = wait_time;
+        }
+        void recordHold(trankesbel::ui64 hold_time)
+        {
+            boost::lock_guard<boost::mutex> lock(statistics_mutex);
+            statistics.hold_time += hold_time;
+            if (hold_time > statistics.max_hold_time) statistics.max_hold_time = hold_time;
+        }
+
+        LockStatistics getStatistics()
+        {
+            boost::lock_guard<boost::mutex> lock(statistics_mutex);
+            return statistics;
+        }
+        void resetStatistics()
+        {
+            boost::lock_guard<boost::mutex> lock(statistics_mutex);
+            statistics = LockStatistics();
+        }
+};
 
 /* A proxy class, that can be used to force locking (mutex lock) on
    objects before use. Can't be copied. */
@@ -16,6 +92,7 @@ class LockedResource
 {
     private:
         boost::recursive_mutex resource_mutex;
+        LockStatisticsRecorder recorder;
         T object;
 
         /* No copies */
@@ -37,10 +114,19 @@ class LockedResource
            or destroy the object. (locks are released on destructor) */
         LockedObject<T> lock()
         {
-            return LockedObject<T>(&object, &resource_mutex);
+            return LockedObject<T>(&object, &resource_mutex, &recorder);
         }
+
+        /* Turns recording of wait and hold times on or off. Off by default. */
+        void setStatisticsEnabled(bool enabled) { recorder.setEnabled(enabled); };
+        LockStatistics getStatistics() { return recorder.getStatistics(); };
+        void resetStatistics() { recorder.resetStatistics(); };
 };
 
+/* Holds the lock of a LockedResource. Does not allocate memory.
+   Copying locks the (recursive) mutex again for the copy, so every
+   copy holds its own lock and releases it on its own. Use swap() to
+   move a lock without locking again. */
 template<class T>
 class LockedObject
 {
@@ -48,44 +134,266 @@ class LockedObject
 
     private:
         T* object;
-        SP<boost::unique_lock<boost::recursive_mutex> > object_lock;
-        LockedObject(T* object, boost::recursive_mutex* rmutex)
+        boost::recursive_mutex* object_mutex;
+        /* Non-null if hold time is recorded for this lock. */
+        LockStatisticsRecorder* recorder;
+        trankesbel::ui64 lock_time;
+
+        LockedObject(T* object, boost::recursive_mutex* rmutex, LockStatisticsRecorder* recorder)
         {
-            object_lock = SP<boost::unique_lock<boost::recursive_mutex> >(new boost::unique_lock<boost::recursive_mutex>(boost::unique_lock<boost::recursive_mutex>(*rmutex)));
             this->object = object;
+            object_mutex = rmutex;
+            this->recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+
+            if (!recorder->isEnabled())
+            {
+                /* Only waits are timed, uncontended locks cost nothing extra. */
+                if (!rmutex->try_lock())
+                {
+                    MetricTimer wait_timer(MetricLockWaitTime);
+                    rmutex->lock();
+                }
+                return;
+            }
+
+            trankesbel::ui64 start = trankesbel::nanoclock();
+            bool contended = !rmutex->try_lock();
+            if (contended) rmutex->lock();
+            lock_time = trankesbel::nanoclock();
+            if (contended) metric_observe(MetricLockWaitTime, lock_time - start);
+
+            recorder->recordWait(contended, lock_time - start);
+            this->recorder = recorder;
         }
 
     public:
         LockedObject()
         {
             object = (T*) 0;
+            object_mutex = (boost::recursive_mutex*) 0;
+            recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+        }
+        ~LockedObject()
+        {
+            release();
         }
 
-        LockedObject(const LockedObject &lo) 
+        LockedObject(const LockedObject &lo)
         {
             object = lo.object;
-            object_lock = lo.object_lock;
+            object_mutex = lo.object_mutex;
+            recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+            if (object_mutex) object_mutex->lock();
         };
         LockedObject& operator=(const LockedObject &lo)
         {
             if (this == &lo) return (*this);
 
-            object = lo.object;
-            object_lock = lo.object_lock;
+            LockedObject copy(lo);
+            swap(copy);
 
             return (*this);
         }
+        #if __cplusplus >= 201103L
+        LockedObject(LockedObject &&lo)
+        {
+            object = (T*) 0;
+            object_mutex = (boost::recursive_mutex*) 0;
+            recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+            swap(lo);
+        }
+        LockedObject& operator=(LockedObject &&lo)
+        {
+            if (this == &lo) return (*this);
+            release();
+            swap(lo);
+            return (*this);
+        }
+        #endif
+
+        void swap(LockedObject &lo)
+        {
+            std::swap(object, lo.object);
+            std::swap(object_mutex, lo.object_mutex);
+            std::swap(recorder, lo.recorder);
+            std::swap(lock_time, lo.lock_time);
+        }
 
         T* get() { return object; };
         const T* get() const { return object; };
-        
+
         T& operator*() { return (*object); };
         T* operator->() { return object; };
         const T& operator*() const { return (*object); };
         const T* operator->() const { return object; };
-        void release() { object = (T*) 0; if (object_lock) object_lock->unlock(); };
+        void release()
+        {
+            if (object_mutex)
+            {
+                if (recorder) recorder->recordHold(trankesbel::nanoclock() - lock_time);
+                object_mutex->unlock();
+            }
+            object = (T*) 0;
+            object_mutex = (boost::recursive_mutex*) 0;
+            recorder = (LockStatisticsRecorder*) 0;
+        };
+};
+
+/* Like LockedResource, but many threads can read the
+   resource at the same time with lockShared(). The lock is
+   not recursive, so a thread must not lock the resource
+   again while it already holds it. */
+template<class T>
+class SharedLockedResource
+{
+    private:
+        boost::shared_mutex resource_mutex;
+        LockStatisticsRecorder recorder;
+        T object;
+
+        /* No copies */
+        SharedLockedResource& operator=(const SharedLockedResource &lr) { return (*this); };
+        SharedLockedResource(const SharedLockedResource &lr) { };
+
+    public:
+        ~SharedLockedResource()
+        {
+            boost::lock_guard<boost::shared_mutex> m(resource_mutex);
+        };
+        SharedLockedResource()
+        {
+        }
+
+        /* Locks the resource for writing. */
+        SharedLockedObject<T> lock()
+        {
+            return SharedLockedObject<T>(&object, &resource_mutex, &recorder, false);
+        }
+        /* Locks the resource for reading. Other readers can hold it at the same time. */
+        SharedLockedObject<const T> lockShared()
+        {
+            return SharedLockedObject<const T>(&object, &resource_mutex, &recorder, true);
+        }
+
+        void setStatisticsEnabled(bool enabled) { recorder.setEnabled(enabled); };
+        LockStatistics getStatistics() { return recorder.getStatistics(); };
+        void resetStatistics() { recorder.resetStatistics(); };
+};
+
+/* Holds a lock of a SharedLockedResource. Does not allocate memory.
+   As the lock is not recursive, copying moves the lock to the copy
+   and leaves the original empty (like std::auto_ptr). */
+template<class T>
+class SharedLockedObject
+{
+    template<class U> friend class SharedLockedResource;
+
+    private:
+        mutable T* object;
+        mutable boost::shared_mutex* object_mutex;
+        mutable bool shared;
+        mutable LockStatisticsRecorder* recorder;
+        mutable trankesbel::ui64 lock_time;
+
+        SharedLockedObject(T* object, boost::shared_mutex* smutex, LockStatisticsRecorder* recorder, bool shared)
+        {
+            this->object = object;
+            object_mutex = smutex;
+            this->shared = shared;
+            this->recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+
+            if (!recorder->isEnabled())
+            {
+                bool locked = shared ? smutex->try_lock_shared() : smutex->try_lock();
+                if (!locked)
+                {
+                    MetricTimer wait_timer(MetricLockWaitTime);
+                    if (shared) smutex->lock_shared();
+                    else smutex->lock();
+                }
+                return;
+            }
+
+            trankesbel::ui64 start = trankesbel::nanoclock();
+            bool contended;
+            if (shared)
+            {
+                contended = !smutex->try_lock_shared();
+                if (contended) smutex->lock_shared();
+            }
+            else
+            {
+                contended = !smutex->try_lock();
+                if (contended) smutex->lock();
+            }
+            lock_time = trankesbel::nanoclock();
+            if (contended) metric_observe(MetricLockWaitTime, lock_time - start);
+
+            recorder->recordWait(contended, lock_time - start);
+            this->recorder = recorder;
+        }
+
+        void take(const SharedLockedObject &lo)
+        {
+            object = lo.object;
+            object_mutex = lo.object_mutex;
+            shared = lo.shared;
+            recorder = lo.recorder;
+            lock_time = lo.lock_time;
+            lo.object = (T*) 0;
+            lo.object_mutex = (boost::shared_mutex*) 0;
+            lo.recorder = (LockStatisticsRecorder*) 0;
+        }
+
+    public:
+        SharedLockedObject()
+        {
+            object = (T*) 0;
+            object_mutex = (boost::shared_mutex*) 0;
+            shared = false;
+            recorder = (LockStatisticsRecorder*) 0;
+            lock_time = 0;
+        }
+        ~SharedLockedObject()
+        {
+            release();
+        }
+
+        SharedLockedObject(const SharedLockedObject &lo)
+        {
+            take(lo);
+        }
+        SharedLockedObject& operator=(const SharedLockedObject &lo)
+        {
+            if (this == &lo) return (*this);
+            release();
+            take(lo);
+            return (*this);
+        }
+
+        T* get() const { return object; };
+        T& operator*() const { return (*object); };
+        T* operator->() const { return object; };
+        void release()
+        {
+            if (object_mutex)
+            {
+                if (recorder) recorder->recordHold(trankesbel::nanoclock() - lock_time);
+                if (shared) object_mutex->unlock_shared();
+                else object_mutex->unlock();
+            }
+            object = (T*) 0;
+            object_mutex = (boost::shared_mutex*) 0;
+            recorder = (LockStatisticsRecorder*) 0;
+        }
 };
 
 };
 
 #endif
+
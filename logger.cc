@@ -1,137 +1,346 @@
 #include <wchar.h>
 #include <iostream>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <errno.h>
+#include <boost/thread.hpp>
 #include "logger.hpp"
 #include "unicode/unistr.h"
 #include "unicode/ustring.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace dfterm;
 using namespace std;
 using namespace boost;
 using namespace trankesbel;
 
-/* Every message goes here. */
 namespace dfterm {
-SP<Logger> admin_logger;
-SP<LoggerReader> admin_messages_reader;
-
 UnicodeString log_file; /* if not empty, logs to this file */
 };
 
-void dfterm::initialize_logger()
+namespace {
+struct LogEntry
 {
-    if (admin_logger) return;
+    LogEntry* next;
+    time_t timestamp;
+    Notability notability;
+    std::string message;
+};
+}
+
+/* Messages waiting for the writer, newest first. LOG pushes to this with
+   compare-and-swap, and the writer takes the whole list at once, so
+   there's no ABA problem. */
+static LogEntry* volatile log_head = (LogEntry*) 0;
 
-    admin_logger = SP<Logger>(new Logger);
-    admin_messages_reader = admin_logger->createReader();
+static bool log_compare_and_swap(LogEntry* expected, LogEntry* new_head)
+{
+    #ifdef _WIN32
+    return InterlockedCompareExchangePointer((PVOID volatile*) &log_head, new_head, expected) == expected;
+    #else
+    return __sync_bool_compare_and_swap(&log_head, expected, new_head);
+    #endif
 }
 
-/* Flush admin messages */
-void dfterm::flush_messages()
+static LogEntry* log_take_all()
+{
+    #ifdef _WIN32
+    return (LogEntry*) InterlockedExchangePointer((PVOID volatile*) &log_head, (PVOID) 0);
+    #else
+    __sync_synchronize();
+    return __sync_lock_test_and_set(&log_head, (LogEntry*) 0);
+    #endif
+}
+
+static boost::mutex log_writer_mutex;
+static boost::condition_variable log_writer_cv;
+/* Notified by the writer each time it has written out messages it took. */
+static boost::condition_variable log_written_cv;
+/* True while the writer is writing out messages it has taken from the list. */
+static bool log_writer_busy = false;
+static volatile bool log_writer_running = false;
+static bool log_writer_stop = false;
+static boost::thread* log_writer_thread = (boost::thread*) 0;
+/* Copy of 'log_file' for the writer thread. */
+static UnicodeString log_writer_file;
+
+void dfterm::log_message(Notability notability, const std::string &message_utf8)
 {
-    assert(admin_logger && admin_messages_reader);
+    LogEntry* entry = new LogEntry;
+    entry->timestamp = time(0);
+    entry->notability = notability;
+    entry->message = message_utf8;
 
-    bool msg;
+    LogEntry* old_head;
     do
     {
-        UnicodeString us = admin_messages_reader->getLogMessage(&msg);
-        if (!msg) break;
-
-        ::int32_t src_len = us.length();
-        UChar* us_str = us.getBuffer(src_len);
-        ::int32_t dest_len = 0;
-        UErrorCode uerror = U_ZERO_ERROR;
-        u_strToWCS(NULL, 0, &dest_len, us_str, src_len, &uerror);
-        if (U_FAILURE(uerror) && uerror != U_BUFFER_OVERFLOW_ERROR)
-        {
-            cout << "Failure in converting log message to wchar_t. (pre-flighting) " << u_errorName(uerror) << endl;
-            us.releaseBuffer();
-            continue;
-        }
-        uerror = U_ZERO_ERROR;
+        old_head = log_head;
+        entry->next = old_head;
+    } while (!log_compare_and_swap(old_head, entry));
 
-        wchar_t* dest_str = new wchar_t[dest_len+1];
-        memset(dest_str, 0, sizeof(wchar_t) * (dest_len+1));
-        u_strToWCS(dest_str, dest_len, &dest_len, us_str, src_len, &uerror);
-        us.releaseBuffer();
+    /* The writer only needs waking up when it may have run out of messages. */
+    if (!old_head && log_writer_running)
+    {
+        boost::lock_guard<boost::mutex> lock(log_writer_mutex);
+        log_writer_cv.notify_one();
+    }
+}
 
-        if (U_FAILURE(uerror))
-        {
-            cout << "Failure in converting log message to wchar_t." << u_errorName(uerror) << endl;
-            delete[] dest_str;
-            continue;
-        }
+/* The following are only used by the writer thread. */
+
+/* The file is kept open between writes. */
+#ifdef _WIN32
+static FILE* log_writer_fp = (FILE*) 0;
+#else
+static int log_writer_fd = -1;
+#endif
+static UnicodeString log_writer_open_file;
+
+/* Timestamp prefix, formatted again only when the second changes. */
+static time_t cached_timestamp_time = (time_t) -1;
+static char cached_timestamp[64];
 
-        /* Sanizite dest_str (to some point) 
-         * There are more characters that should be sanitized (see Unicode
-         * control characters or Firefox blacklist (google it)) but at the
-         * moment we aren't certain what encoding is actually used in the
-         * terminal. */
-        for (size_t i1 = 0; dest_str[i1]; ++i1)
-            if (dest_str[i1] < 32) /* control characters */
-                dest_str[i1] = '?';
-
-        std::string utf8_str = TO_UTF8(us);
-        for (size_t i1 = 0; i1 < utf8_str.size(); ++i1)
-            if (utf8_str[i1] < 32)
-                utf8_str[i1] = '?';
-
-        /* wcout not supported by mingw, so we use wprintf, but only do it
-           on Windows. */
-        #ifdef _WIN32
-        wprintf(L"%ls\n", dest_str);
-        #else
-        cout << utf8_str << "\n";
-        #endif
-        fflush(stdout);
-        delete[] dest_str;
-
-        if (log_file.length() > 0)
+static const char* log_timestamp(time_t t)
+{
+    if (t == cached_timestamp_time) return cached_timestamp;
+
+    #ifdef _WIN32
+    struct tm* timem = localtime(&t); /* on windows localtime() is thread-safe */
+    #else
+    struct tm timem_r;
+    struct tm* timem = localtime_r(&t, &timem_r);
+    #endif
+    if (!timem || strftime(cached_timestamp, 63, "%Y-%m-%d %H:%M:%S", timem) == 0)
+        strcpy(cached_timestamp, "?\?\?\?-\?\?-\?\? \?\?:\?\?:\?\?");
+
+    cached_timestamp_time = t;
+    return cached_timestamp;
+}
+
+static void close_log_file()
+{
+    #ifdef _WIN32
+    if (log_writer_fp) fclose(log_writer_fp);
+    log_writer_fp = (FILE*) 0;
+    #else
+    if (log_writer_fd != -1) close(log_writer_fd);
+    log_writer_fd = -1;
+    #endif
+    log_writer_open_file = UnicodeString();
+}
+
+static bool open_log_file(const UnicodeString &file_name)
+{
+    #ifdef _WIN32
+    if (log_writer_fp && log_writer_open_file == file_name) return true;
+    #else
+    if (log_writer_fd != -1 && log_writer_open_file == file_name) return true;
+    #endif
+    close_log_file();
+    if (file_name.length() == 0) return false;
+
+    #ifdef _WIN32
+    wchar_t* wc = (wchar_t*) 0;
+    size_t wc_size = 0;
+    TO_WCHAR_STRING(file_name, wc, &wc_size);
+    if (wc_size == 0)
+    {
+        wprintf(L"There is something wrong with the log file string. Could not save log messages to the log.\n");
+        return false;
+    }
+    wc = new wchar_t[wc_size+1];
+    memset(wc, 0, (wc_size+1) * sizeof(wchar_t));
+    TO_WCHAR_STRING(file_name, wc, &wc_size);
+
+    errno = 0;
+    log_writer_fp = _wfopen(wc, L"ab");
+    if (!log_writer_fp)
+    {
+        int err = errno;
+        wprintf(L"Could not open log file %ls, errno %d.\n", wc, err);
+        delete[] wc;
+        return false;
+    }
+    delete[] wc;
+    #else
+    log_writer_fd = open(TO_UTF8(file_name).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (log_writer_fd == -1)
+    {
+        int err = errno;
+        cout << "Could not open log file " << TO_UTF8(file_name) << ", errno " << err << "." << endl;
+        return false;
+    }
+    #endif
+
+    log_writer_open_file = file_name;
+    return true;
+}
+
+static void write_log_file(const std::string &data)
+{
+    #ifdef _WIN32
+    if (fwrite(data.data(), 1, data.size(), log_writer_fp) != data.size() || fflush(log_writer_fp))
+    {
+        int err = errno;
+        wprintf(L"Error when trying to write to log file, errno %d.\n", err);
+        close_log_file();
+    }
+    #else
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t result = write(log_writer_fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0)
         {
-            wchar_t* wc = (wchar_t*) 0;
-            size_t wc_size = 0;
-            TO_WCHAR_STRING(log_file, wc, &wc_size);
-            if (wc_size == 0)
-            {
-                wprintf(L"There is something wrong with the log file string. Could not save previous line to the log.\n");
-                continue;
-            }
-            wc = new wchar_t[wc_size+1];
-            memset(wc, 0, (wc_size+1) * sizeof(wchar_t));
-
-            TO_WCHAR_STRING(log_file, wc, &wc_size);
-            errno = 0;
-            #ifdef _WIN32
-            FILE* f = _wfopen(wc, L"at");
-            #else
-            FILE* f = fopen(TO_UTF8(log_file).c_str(), "at");
-            #endif
-            if (!f)
-            {
-                int err = errno;
-                wprintf(L"Could not open log file %ls, errno %d.\n", wc, err);
-                delete[] wc;
-                continue;
-            }
-            if (fprintf(f, "%s\n", TO_UTF8(us).c_str()) < 0)
-            {
-                int err = errno;
-                wprintf(L"Error when trying to write to log file %ls with fprintf(), errno %d.\n", wc, err);
-                delete[] wc;
-                fclose(f);
-                continue;
-            }
-            fclose(f);
-            delete[] wc;
+            int err = errno;
+            cout << "Error when trying to write to log file " << TO_UTF8(log_writer_open_file) << " with write(), errno " << err << "." << endl;
+            close_log_file();
+            return;
         }
-        
-    } while(msg);
+        written += result;
+    }
+    #endif
+}
+
+/* Writes out a list of messages, in the order they were logged. */
+static void write_log_messages(LogEntry* entries, const UnicodeString &file_name)
+{
+    /* The list is newest first. */
+    LogEntry* reversed = (LogEntry*) 0;
+    while (entries)
+    {
+        LogEntry* next = entries->next;
+        entries->next = reversed;
+        reversed = entries;
+        entries = next;
+    }
+
+    std::string batch;
+    while (reversed)
+    {
+        LogEntry* entry = reversed;
+        reversed = entry->next;
+
+        batch.append(log_timestamp(entry->timestamp));
+        if (entry->notability == dfterm::Note)
+            batch.append(" Note: ");
+        else if (entry->notability == dfterm::Error)
+            batch.append(" Error: ");
+        else
+            batch.append(" FATAL: ");
+
+        /* Sanitize control characters (to some point), so that messages
+           can't mess up the terminal or fake lines in the log file. */
+        size_t start = batch.size();
+        batch.append(entry->message);
+        for (size_t i1 = start; i1 < batch.size(); ++i1)
+            if ((unsigned char) batch[i1] < 32)
+                batch[i1] = '?';
+        batch.push_back('\n');
+
+        delete entry;
+    }
+    if (batch.empty()) return;
+
+    /* wcout not supported by mingw, so we use wprintf, but only do it
+       on Windows. */
+    #ifdef _WIN32
+    UnicodeString batch_us = UnicodeString::fromUTF8(batch);
+    wchar_t* wc = (wchar_t*) 0;
+    size_t wc_size = 0;
+    TO_WCHAR_STRING(batch_us, wc, &wc_size);
+    if (wc_size > 0)
+    {
+        wc = new wchar_t[wc_size+1];
+        memset(wc, 0, (wc_size+1) * sizeof(wchar_t));
+        TO_WCHAR_STRING(batch_us, wc, &wc_size);
+        wprintf(L"%ls", wc);
+        delete[] wc;
+    }
+    #else
+    fwrite(batch.data(), 1, batch.size(), stdout);
+    #endif
+    fflush(stdout);
+
+    if (open_log_file(file_name))
+        write_log_file(batch);
+}
+
+static void log_writer()
+{
+    boost::unique_lock<boost::mutex> lock(log_writer_mutex);
+    while(true)
+    {
+        while (!log_head && !log_writer_stop)
+            log_writer_cv.wait(lock);
+
+        bool stopping = log_writer_stop;
+        UnicodeString file_name = log_writer_file;
+        log_writer_busy = true;
+        lock.unlock();
+
+        write_log_messages(log_take_all(), file_name);
+
+        lock.lock();
+        log_writer_busy = false;
+        log_written_cv.notify_all();
+        if (stopping && !log_head) break;
+    }
+    log_writer_running = false;
+    log_written_cv.notify_all();
+    lock.unlock();
+    close_log_file();
+}
+
+static void stop_log_writer()
+{
+    boost::unique_lock<boost::mutex> lock(log_writer_mutex);
+    if (!log_writer_thread) return;
+
+    log_writer_stop = true;
+    log_writer_cv.notify_one();
+    lock.unlock();
+
+    log_writer_thread->join();
+}
+
+void dfterm::flush_messages()
+{
+    boost::lock_guard<boost::mutex> lock(log_writer_mutex);
+    if (log_writer_file != log_file)
+        log_writer_file = log_file;
+
+    if (!log_writer_thread)
+    {
+        log_writer_thread = new boost::thread(log_writer);
+        log_writer_running = true;
+        atexit(stop_log_writer);
+    }
+    log_writer_cv.notify_one();
+}
+
+void dfterm::flush_messages_and_wait()
+{
+    flush_messages();
+
+    boost::unique_lock<boost::mutex> lock(log_writer_mutex);
+    while ((log_head || log_writer_busy) && log_writer_running)
+        log_written_cv.wait(lock);
 }
 
 void Logger::logMessage(const UnicodeString &message)
 {
-    lock_guard<recursive_mutex> lock(logmutex);
+    boost::lock_guard<boost::recursive_mutex> lock(logmutex);
     vector<WP<LoggerReader> >::iterator i1, readers_end = readers.end();
     for (i1 = readers.begin(); i1 != readers_end; ++i1)
     {
@@ -187,7 +396,7 @@ SP<LoggerReader> Logger::createReader()
 
 void LoggerReader::logMessage(UnicodeString message)
 {
-    lock_guard<recursive_mutex> lock(logmutex);
+    boost::lock_guard<boost::recursive_mutex> lock(logmutex);
     messages.push(message);
 }
 
@@ -195,7 +404,7 @@ UnicodeString LoggerReader::getLogMessage(bool* got_message)
 {
     assert(got_message);
 
-    lock_guard<recursive_mutex> lock(logmutex);
+    boost::lock_guard<boost::recursive_mutex> lock(logmutex);
     (*got_message) = false;
     if (messages.empty()) return UnicodeString("");
     (*got_message) = true;
@@ -82,84 +82,27 @@ class LoggerReader
    Have all your messages in UTF-8. Timestamp will be added to every log message.
 */
 
-extern SP<Logger> admin_logger; 
-extern UnicodeString log_file;
-extern void flush_messages();
-extern void initialize_logger();
-
 enum Notability { Note, Error, Fatal };
 
+extern UnicodeString log_file;
+/* Hands a message to the log writer thread. Used by LOG. Thread-safe and
+   doesn't take locks, except to wake up the writer when it is idle. */
+extern void log_message(Notability notability, const std::string &message_utf8);
+/* Starts the log writer thread on the first call and wakes it up to write
+   out the messages logged so far (to the console and to 'log_file').
+   Doesn't wait for the writing; messages still queued at exit are written
+   out before the program exits. Call from the thread that sets 'log_file'. */
+extern void flush_messages();
+/* Same as flush_messages(), but waits until the writer thread has written
+   out everything logged so far. Use before printing something that should
+   come after the log, like the reason for exiting. */
+extern void flush_messages_and_wait();
 
-/* This is the most monstrous macro I have ever written. Please don't send me to hell. */
-#ifdef _WIN32
+/* Timestamps are added by the writer thread, so this only formats the message. */
 #define LOG(notability, stringstream_msg) { std::stringstream ___ss; \
-                                        dfterm::initialize_logger(); \
-                                        wchar_t msg[1000]; \
-                                        UChar msg_uchar[1000]; \
-                                        msg_uchar[999] = 0; \
-                                        msg[999] = 0; \
-                                        time_t timet = time(0); \
-                                        struct tm* timem = localtime(&timet); /* on windows localtime() is thread-safe */ \
-                                        if (wcsftime(msg, 999, L"%Y-%m-%d %H:%M:%S", timem) == 0) \
-                                        { \
-                                            admin_logger->logMessageUTF8("Error while trying to make a log message. wcsftime() returned 0."); \
-                                        } else { \
-                                        ::int32_t msg_len = 0; \
-                                        UErrorCode uerror = U_ZERO_ERROR; \
-                                        u_strFromWCS(msg_uchar, 999, &msg_len, msg, -1, &uerror); \
-                                        if (U_FAILURE(uerror)) \
-                                        { \
-                                            admin_logger->logMessageUTF8("Error while trying to make a log message."); \
-                                        } else { \
-                                        UnicodeString msg_us(msg_uchar, msg_len); \
-                                        std::string msg_utf8 = TO_UTF8(msg_us); \
-                                        ___ss << msg_utf8 << " "; \
-                                        if (notability == dfterm::Note) \
-                                            ___ss << "Note: "; \
-                                        else if (notability == dfterm::Error) \
-                                            ___ss << "Error: "; \
-                                        else if (notability == dfterm::Fatal) \
-                                            ___ss << "FATAL: "; \
                                         ___ss << stringstream_msg; \
-                                        dfterm::admin_logger->logMessageUTF8(___ss.str()); \
-                                        } } \
+                                        dfterm::log_message(notability, ___ss.str()); \
                                        }
-#else
-#define LOG(notability, stringstream_msg) { std::stringstream ___ss; \
-                                        dfterm::initialize_logger(); \
-                                        wchar_t msg[1000]; \
-                                        UChar msg_uchar[1000]; \
-                                        msg_uchar[999] = 0; \
-                                        msg[999] = 0; \
-                                        time_t timet = time(0); \
-                                        struct tm timem; \
-                                        localtime_r(&timet, &timem); /* assuming call always succeeds */ \
-                                        if (wcsftime(msg, 999, L"%Y-%m-%d %H:%M:%S", &timem) == 0) \
-                                        { \
-                                            dfterm::admin_logger->logMessageUTF8("Error while trying to make a log message. wcsftime() returned 0."); \
-                                        } else { \
-                                        ::int32_t msg_len = 0; \
-                                        UErrorCode uerror = U_ZERO_ERROR; \
-                                        u_strFromWCS(msg_uchar, 999, &msg_len, msg, -1, &uerror); \
-                                        if (U_FAILURE(uerror)) \
-                                        { \
-                                            dfterm::admin_logger->logMessageUTF8("Error while trying to make a log message."); \
-                                        } else { \
-                                        UnicodeString msg_us(msg_uchar, msg_len); \
-                                        std::string msg_utf8; \
-                                        msg_us.toUTF8String(msg_utf8); \
-                                        ___ss << msg_utf8 << " "; \
-                                        if (notability == dfterm::Note) \
-                                            ___ss << "Note: "; \
-                                        else if (notability == dfterm::Error) \
-                                            ___ss << "Error: "; \
-                                        else if (notability == dfterm::Fatal) \
-                                            ___ss << "FATAL: "; \
-                                        ___ss << stringstream_msg; \
-                                        dfterm::admin_logger->logMessageUTF8(___ss.str()); \
-                                        } } \
-                                       }
-#endif
 
 } /* namespace dfterm */
 
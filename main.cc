@@ -1,6 +1,7 @@
 #include "client.hpp"
 #include "sockets.hpp"
 #include <cstring>
+#include <cstdlib>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <iostream>
@@ -62,6 +63,10 @@ int main(int argc, char* argv[])
 
     string port("8000");
     string address("0.0.0.0");
+    ui32 listeners = 1;
+    int compression_memory_level = 4;
+    int compression_window_bits = 12;
+    bool lock_statistics = false;
 
     string httpport("8080");
     string httpaddress("0.0.0.0");
@@ -72,9 +77,13 @@ int main(int argc, char* argv[])
 
     bool use_http_service = false;
 
+    string metricsport("8082");
+    string metricsaddress("127.0.0.1");
+    bool use_metrics_service = false;
+
     string database_file("dfterm2_database.sqlite3");
 
-    SocketAddress listen_address, http_listen_address, flash_policy_listen_address;
+    SocketAddress listen_address, http_listen_address, flash_policy_listen_address, metrics_listen_address;
     bool succeeded_resolve = false;
     string error_message;
 
@@ -84,6 +93,8 @@ int main(int argc, char* argv[])
     boost::bind(resolve_success, &succeeded_resolve, &http_listen_address, &error_message, _1, _2, _3);
     function3<void, bool, SocketAddress, string> flash_resolve_binding = 
     boost::bind(resolve_success, &succeeded_resolve, &flash_policy_listen_address, &error_message, _1, _2, _3);
+    function3<void, bool, SocketAddress, string> metrics_resolve_binding = 
+    boost::bind(resolve_success, &succeeded_resolve, &metrics_listen_address, &error_message, _1, _2, _3);
 
     bool create_app_dir = false;
 
@@ -100,6 +111,14 @@ int main(int argc, char* argv[])
             conffile = argv[++i1];
         else if ((!strcmp(argv[i1], "--port") || !strcmp(argv[i1], "-p")) && i1 < argc-1)
             port = argv[++i1];
+        else if ((!strcmp(argv[i1], "--listeners") || !strcmp(argv[i1], "-l")) && i1 < argc-1)
+            listeners = (ui32) atoi(argv[++i1]);
+        else if (!strcmp(argv[i1], "--compressionmemlevel") && i1 < argc-1)
+            compression_memory_level = atoi(argv[++i1]);
+        else if (!strcmp(argv[i1], "--compressionwindowbits") && i1 < argc-1)
+            compression_window_bits = atoi(argv[++i1]);
+        else if (!strcmp(argv[i1], "--lockstatistics"))
+            lock_statistics = true;
         else if ((!strcmp(argv[i1], "--httpport") || !strcmp(argv[i1], "-hp")) && i1 < argc-1)
             httpport = argv[++i1];
         else if ((!strcmp(argv[i1], "--database") || !strcmp(argv[i1], "-db")) && i1 < argc-1)
@@ -119,6 +138,12 @@ int main(int argc, char* argv[])
             flashpolicyport = argv[++i1];
         else if (!strcmp(argv[i1], "--http"))
             use_http_service = true;
+        else if (!strcmp(argv[i1], "--metricsaddress") && i1 < argc-1)
+            metricsaddress = argv[++i1];
+        else if (!strcmp(argv[i1], "--metricsport") && i1 < argc-1)
+            metricsport = argv[++i1];
+        else if (!strcmp(argv[i1], "--metrics"))
+            use_metrics_service = true;
         else if (!strcmp(argv[i1], "--version") || !strcmp(argv[i1], "-v"))
         {
             cout << "This is dfterm2, (c) 2010-2012 Mikko Juola" << endl;
@@ -146,6 +171,18 @@ int main(int argc, char* argv[])
             cout << "--p (port number)     Set the port where dfterm2 will listen. Defaults to 8000." << endl << endl;
             cout << "--address (address)" << endl;
             cout << "-a (address)          Set the address on which dfterm2 will listen on. Defaults to 0.0.0.0." << endl << endl;
+            cout << "--listeners (count)" << endl;
+            cout << "-l (count)            Set how many sockets listen on the telnet port. Values above 1 use" << endl;
+            cout << "                      SO_REUSEPORT, where the kernel spreads new connections between the" << endl;
+            cout << "                      sockets. Helps with bursts of connections. Defaults to 1." << endl << endl;
+            cout << "--compressionmemlevel (level)" << endl;
+            cout << "                      Set zlib memory level (1-9) for telnet compression (MCCP2). 0 turns" << endl;
+            cout << "                      compression off. Defaults to 4." << endl;
+            cout << "--compressionwindowbits (bits)" << endl;
+            cout << "                      Set zlib window size (9-15) for telnet compression. Defaults to 12." << endl;
+            cout << "                      Each compressed connection uses about 2^(bits+2) + 2^(level+9) bytes." << endl << endl;
+            cout << "--lockstatistics      Log how long the main loop and other threads wait for and hold" << endl;
+            cout << "                      the locks of the client list and socket events, once a minute." << endl << endl;
             cout << "--httpport (port number)" << endl;
             cout << "-hp (port number)     Set the port where dfterm2 will listen for HTTP connections. Defaults to 8080." << endl << endl;
             cout << "--httpaddress (address)" << endl;
@@ -160,6 +197,12 @@ int main(int argc, char* argv[])
             cout << "--flashpolicyport (port)" << endl;
             cout << "-fpp (port)           Set the port from where flash policy file is served. Defaults to 8081" << endl;
             cout << "--http                Enable HTTP service." << endl;
+            cout << "--metrics             Enable serving statistics for Prometheus at /metrics. They are served" << endl;
+            cout << "                      on their own address, not with the HTTP service." << endl;
+            cout << "--metricsaddress (address)" << endl;
+            cout << "                      Set the address on which /metrics is served. Defaults to 127.0.0.1." << endl;
+            cout << "                      The statistics tell how many are connected; keep this address private." << endl;
+            cout << "--metricsport (port)  Set the port on which /metrics is served. Defaults to 8082." << endl;
             cout << "--version" << endl;
             cout << "-v                    Show version information and exit." << endl << endl;
             cout << "--logfile (log file)  Specify where dfterm2 saves its log. Defaults to dfterm2.log" << endl;
@@ -254,7 +297,7 @@ int main(int argc, char* argv[])
     SocketAddress::resolve(address, port, resolve_binding, true);
     if (!succeeded_resolve)
     {
-        flush_messages();
+        flush_messages_and_wait();
         cerr << "Resolving [" << address << "]:" << port << " failed. Check your listening address settings." << endl;
         return -1;
     }
@@ -264,41 +307,60 @@ int main(int argc, char* argv[])
         SocketAddress::resolve(httpaddress, httpport, http_resolve_binding, true);
         if (!succeeded_resolve)
         {
-            flush_messages();
+            flush_messages_and_wait();
             cerr << "Resolving [" << httpaddress << "]:" << httpport << " failed. Check your listening address settings for HTTP." << endl;
             return -1;
         }
         SocketAddress::resolve(flashpolicyaddress, flashpolicyport, flash_resolve_binding, true);
         if (!succeeded_resolve)
         {
-            flush_messages();
+            flush_messages_and_wait();
             cerr << "Resolving [" << flashpolicyaddress << "]:" << flashpolicyport << " failed. Check your listening address settings for flash policy." << endl;
             return -1;
         }
     }
 
+    if (use_metrics_service)
+    {
+        SocketAddress::resolve(metricsaddress, metricsport, metrics_resolve_binding, true);
+        if (!succeeded_resolve)
+        {
+            flush_messages_and_wait();
+            cerr << "Resolving [" << metricsaddress << "]:" << metricsport << " failed. Check your listening address settings for metrics." << endl;
+            return -1;
+        }
+    }
+
     SP<State> state = State::createState();
     if (!state->setDatabaseUTF8(database_file))
     {
+        flush_messages_and_wait();
         cerr << "Failed to set database." << endl;
-        flush_messages();
         return -1;
     }
     state->setAddressSettings(settings);
+    state->setTelnetCompression(compression_memory_level, compression_window_bits);
+    state->setLockStatisticsEnabled(lock_statistics);
     LOG(Note, "Using database " << database_file);
 
-    if (!state->addTelnetService(listen_address))
+    if (!state->addTelnetService(listen_address, listeners))
     {
-        flush_messages();
+        flush_messages_and_wait();
         cerr << "Could not add a telnet service. " << endl;
         return -1;
     }
     if (use_http_service && !state->addHTTPService(http_listen_address, flash_policy_listen_address, httpconnectaddress))
     {
-        flush_messages();
+        flush_messages_and_wait();
         cerr << "Could not add an HTTP service. " << endl;
         return -1;
     }
+    if (use_metrics_service && !state->addMetricsService(metrics_listen_address))
+    {
+        flush_messages_and_wait();
+        cerr << "Could not add a metrics service. " << endl;
+        return -1;
+    }
 
     state->loop();
     return 0;
@@ -10,6 +10,36 @@
 namespace trankesbel
 {
 
+/* Little-endian integers, as in the spectator and server-to-server
+   frames. The append functions add to the end of 'out'. The read
+   functions read from 'data' without checking its size; check that
+   there are 2 or 4 bytes first. */
+inline void appendLittleEndian16(std::string* out, ui32 v)
+{
+    out->push_back((char) v);
+    out->push_back((char) (v >> 8));
+}
+
+inline void appendLittleEndian32(std::string* out, ui32 v)
+{
+    out->push_back((char) v);
+    out->push_back((char) (v >> 8));
+    out->push_back((char) (v >> 16));
+    out->push_back((char) (v >> 24));
+}
+
+inline ui32 readLittleEndian16(const char* data)
+{
+    const ui8* d = (const ui8*) data;
+    return (ui32) d[0] | ((ui32) d[1] << 8);
+}
+
+inline ui32 readLittleEndian32(const char* data)
+{
+    const ui8* d = (const ui8*) data;
+    return (ui32) d[0] | ((ui32) d[1] << 8) | ((ui32) d[2] << 16) | ((ui32) d[3] << 24);
+}
+
 inline data1D marshalUnsignedInteger32(ui32 integer)
 {
     std::stringstream ss;
@@ -0,0 +1,229 @@
+#include "metrics.hpp"
+#include <boost/thread/tss.hpp>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace std;
+
+namespace {
+struct MetricsBlock
+{
+    MetricsBlock* next;
+    /* 1 while a thread owns the block. Only the owner writes to the numbers. */
+    volatile long in_use;
+
+    volatile ui64 counters[MetricCountersCount];
+    volatile ui64 buckets[MetricHistogramsCount][METRIC_HISTOGRAM_BUCKETS];
+    volatile ui64 sums[MetricHistogramsCount];
+};
+
+struct MetricInfo
+{
+    const char* name;
+    const char* help;
+    /* Values are nanoseconds, shown as seconds. */
+    bool nanoseconds;
+};
+
+/* Histogram buckets are 'first_bound', 'first_bound' << shift, 'first_bound' << 2*shift... */
+struct HistogramInfo
+{
+    const char* name;
+    const char* help;
+    bool nanoseconds;
+    ui64 first_bound;
+    ui32 shift;
+};
+}
+
+static const MetricInfo counter_info[MetricCountersCount] = {
+    { "dfterm2_loop_iterations_total", "Main loop iterations.", false },
+    { "dfterm2_socket_events_total", "Socket events handled by the main loop.", false },
+    { "dfterm2_frames_sent_total", "Screen updates queued to clients.", false },
+    { "dfterm2_frames_coalesced_total", "Screen updates replaced by a newer one before they were sent.", false },
+    { "dfterm2_feedstring_bytes_total", "Bytes fed to terminal emulators of slots.", false },
+    { "dfterm2_feedstring_seconds_total", "Time spent feeding terminal emulators of slots.", true } };
+
+static const HistogramInfo histogram_info[MetricHistogramsCount] = {
+    { "dfterm2_event_batch_size", "Socket events returned by one poll.", false, 1, 1 },
+    { "dfterm2_client_cycle_seconds", "Time taken by one client cycle.", true, 1000, 2 },
+    { "dfterm2_database_statement_seconds", "Time taken by configuration database statements.", true, 1000, 2 },
+    { "dfterm2_lock_wait_seconds", "Time spent waiting for a contended lock.", true, 1000, 2 },
+    { "dfterm2_server_to_server_hop_latency_seconds", "Time for mirrored frames to arrive from the server that sent them.", true, 1000000, 1 },
+    { "dfterm2_server_to_server_path_latency_seconds", "Time for mirrored frames to arrive from the server of the slot, through relays.", true, 1000000, 1 } };
+
+/* All blocks ever made, newest first. Blocks are never freed, so
+   the list only grows at the head. */
+static MetricsBlock* volatile metrics_blocks = (MetricsBlock*) 0;
+
+static bool metrics_compare_and_swap_block(MetricsBlock* expected, MetricsBlock* new_head)
+{
+    #ifdef _WIN32
+    return InterlockedCompareExchangePointer((PVOID volatile*) &metrics_blocks, new_head, expected) == expected;
+    #else
+    return __sync_bool_compare_and_swap(&metrics_blocks, expected, new_head);
+    #endif
+}
+
+static bool metrics_claim_block(MetricsBlock* block)
+{
+    #ifdef _WIN32
+    return InterlockedCompareExchange(&block->in_use, 1, 0) == 0;
+    #else
+    return __sync_bool_compare_and_swap(&block->in_use, 0, 1);
+    #endif
+}
+
+static void metrics_release_block(MetricsBlock* block)
+{
+    /* The numbers stay; the next thread to take the block adds to them. */
+    #ifdef _WIN32
+    InterlockedExchange(&block->in_use, 0);
+    #else
+    __sync_lock_release(&block->in_use);
+    #endif
+}
+
+static boost::thread_specific_ptr<MetricsBlock> thread_block(metrics_release_block);
+
+static MetricsBlock* get_thread_block()
+{
+    MetricsBlock* block = thread_block.get();
+    if (block) return block;
+
+    for (block = metrics_blocks; block; block = block->next)
+        if (metrics_claim_block(block))
+        {
+            thread_block.reset(block);
+            return block;
+        }
+
+    block = new MetricsBlock;
+    memset((void*) block, 0, sizeof(MetricsBlock));
+    block->in_use = 1;
+    do
+    {
+        block->next = metrics_blocks;
+    } while (!metrics_compare_and_swap_block(block->next, block));
+
+    thread_block.reset(block);
+    return block;
+}
+
+void dfterm::metric_add(MetricCounter counter, ui64 value)
+{
+    MetricsBlock* block = get_thread_block();
+    block->counters[counter] += value;
+}
+
+ui64 dfterm::metric_bucket_bound(MetricHistogram histogram, size_t bucket)
+{
+    return histogram_info[histogram].first_bound << (histogram_info[histogram].shift * bucket);
+}
+
+void dfterm::metric_observe(MetricHistogram histogram, ui64 value)
+{
+    MetricsBlock* block = get_thread_block();
+
+    size_t bucket = 0;
+    ui64 bound = histogram_info[histogram].first_bound;
+    ui32 shift = histogram_info[histogram].shift;
+    while (bucket < METRIC_HISTOGRAM_BUCKETS - 1 && value > bound)
+    {
+        ++bucket;
+        bound <<= shift;
+    }
+
+    block->buckets[histogram][bucket] += 1;
+    block->sums[histogram] += value;
+}
+
+void dfterm::metrics_snapshot(MetricsSnapshot* snapshot)
+{
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+
+    MetricsBlock* block;
+    for (block = metrics_blocks; block; block = block->next)
+    {
+        size_t i1, i2;
+        for (i1 = 0; i1 < MetricCountersCount; ++i1)
+            snapshot->counters[i1] += block->counters[i1];
+        for (i1 = 0; i1 < MetricHistogramsCount; ++i1)
+        {
+            for (i2 = 0; i2 < METRIC_HISTOGRAM_BUCKETS; ++i2)
+                snapshot->buckets[i1][i2] += block->buckets[i1][i2];
+            snapshot->sums[i1] += block->sums[i1];
+        }
+    }
+}
+
+static void write_value(ostream &out, ui64 value, bool nanoseconds)
+{
+    if (nanoseconds)
+        out << ((double) value / 1000000000.0);
+    else
+        out << value;
+}
+
+void dfterm::metrics_write_prometheus(ostream &out, const MetricsSnapshot &snapshot)
+{
+    /* Enough digits for nanoseconds of a few hours */
+    streamsize old_precision = out.precision(15);
+
+    size_t i1, i2;
+    for (i1 = 0; i1 < MetricCountersCount; ++i1)
+    {
+        const MetricInfo &mi = counter_info[i1];
+        out << "# HELP " << mi.name << " " << mi.help << "\n";
+        out << "# TYPE " << mi.name << " counter\n";
+        out << mi.name << " ";
+        write_value(out, snapshot.counters[i1], mi.nanoseconds);
+        out << "\n";
+    }
+
+    for (i1 = 0; i1 < MetricHistogramsCount; ++i1)
+    {
+        const HistogramInfo &hi = histogram_info[i1];
+        out << "# HELP " << hi.name << " " << hi.help << "\n";
+        out << "# TYPE " << hi.name << " histogram\n";
+
+        ui64 cumulative = 0;
+        for (i2 = 0; i2 < METRIC_HISTOGRAM_BUCKETS; ++i2)
+        {
+            cumulative += snapshot.buckets[i1][i2];
+            out << hi.name << "_bucket{le=\"";
+            if (i2 == METRIC_HISTOGRAM_BUCKETS - 1)
+                out << "+Inf";
+            else
+                write_value(out, metric_bucket_bound((MetricHistogram) i1, i2), hi.nanoseconds);
+            out << "\"} " << cumulative << "\n";
+        }
+        out << hi.name << "_sum ";
+        write_value(out, snapshot.sums[i1], hi.nanoseconds);
+        out << "\n";
+        out << hi.name << "_count " << cumulative << "\n";
+    }
+
+    out.precision(old_precision);
+}
+
+string dfterm::metric_label_escape(const string &value)
+{
+    string result;
+    result.reserve(value.size());
+    size_t i1, value_size = value.size();
+    for (i1 = 0; i1 < value_size; ++i1)
+    {
+        if (value[i1] == '\\') result.append("\\\\");
+        else if (value[i1] == '"') result.append("\\\"");
+        else if (value[i1] == '\n') result.append("\\n");
+        else result.push_back(value[i1]);
+    }
+    return result;
+}
+
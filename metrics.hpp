@@ -0,0 +1,95 @@
+/*
+
+Runtime counters and histograms, for the /metrics page.
+
+Every thread adds to its own block of counters, so recording is a
+couple of plain additions with no locks and no shared cache lines.
+Reading sums up the blocks of all threads; a reader may see a value a
+moment old, which is fine for monitoring. Blocks of threads that have
+exited are reused by new threads, so counts are never lost.
+
+*/
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <string>
+#include <ostream>
+#include "types.hpp"
+#include "nanoclock.hpp"
+
+namespace dfterm
+{
+
+enum MetricCounter { MetricLoopIterations = 0,    /* Main loop iterations */
+                     MetricSocketEvents,          /* Socket events handled by the main loop */
+                     MetricFramesSent,            /* Screen updates queued to clients */
+                     MetricFramesCoalesced,       /* Queued screen updates replaced by a newer one before sending */
+                     MetricFeedStringBytes,       /* Bytes fed to slot terminal emulators */
+                     MetricFeedStringNanoseconds, /* Time spent in it */
+                     MetricCountersCount };
+
+enum MetricHistogram { MetricEventBatchSize = 0,   /* Socket events returned by one poll */
+                       MetricClientCycleTime,      /* Client::cycle() (nanoseconds) */
+                       MetricDatabaseLatency,      /* Configuration database statements (nanoseconds) */
+                       MetricLockWaitTime,         /* Waits for contended locks of locked resources (nanoseconds) */
+                       MetricServerToServerHopLatency,  /* Mirrored frames, from the last server that sent them (nanoseconds) */
+                       MetricServerToServerPathLatency, /* Same, from the server of the slot */
+                       MetricHistogramsCount };
+
+/* Buckets per histogram. The last one has no upper bound. */
+const size_t METRIC_HISTOGRAM_BUCKETS = 12;
+
+/* Adds to a counter. */
+void metric_add(MetricCounter counter, trankesbel::ui64 value);
+inline void metric_increment(MetricCounter counter) { metric_add(counter, 1); };
+/* Records a value to a histogram. */
+void metric_observe(MetricHistogram histogram, trankesbel::ui64 value);
+
+/* Records the time from construction to destruction to a histogram. */
+class MetricTimer
+{
+    private:
+        MetricHistogram histogram;
+        trankesbel::ui64 start;
+
+        /* No copies */
+        MetricTimer(const MetricTimer &mt) { };
+        MetricTimer& operator=(const MetricTimer &mt) { return (*this); };
+
+    public:
+        MetricTimer(MetricHistogram histogram)
+        {
+            this->histogram = histogram;
+            start = trankesbel::nanoclock();
+        }
+        ~MetricTimer()
+        {
+            metric_observe(histogram, trankesbel::nanoclock() - start);
+        }
+};
+
+/* Counters and histograms summed over all threads. */
+struct MetricsSnapshot
+{
+    trankesbel::ui64 counters[MetricCountersCount];
+    /* Not cumulative; buckets[h][i] is the number of values in bucket i only. */
+    trankesbel::ui64 buckets[MetricHistogramsCount][METRIC_HISTOGRAM_BUCKETS];
+    trankesbel::ui64 sums[MetricHistogramsCount];
+};
+void metrics_snapshot(MetricsSnapshot* snapshot);
+
+/* Returns the upper bound of a histogram bucket, in the units it is recorded in.
+   Not meaningful for the last bucket. */
+trankesbel::ui64 metric_bucket_bound(MetricHistogram histogram, size_t bucket);
+
+/* Writes a snapshot in Prometheus text format. */
+void metrics_write_prometheus(std::ostream &out, const MetricsSnapshot &snapshot);
+
+/* Escapes a Prometheus label value. */
+std::string metric_label_escape(const std::string &value);
+
+};
+
+#endif
+
@@ -1,7 +1,25 @@
 #include "logger.hpp"
 #include "minimal_http_server.hpp"
+#include "hash.hpp"
+#include "websocket.hpp"
+#include <zlib.h>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 using namespace dfterm;
 using namespace std;
@@ -9,280 +27,909 @@ using namespace trankesbel;
 
 HTTPServer::HTTPServer()
 {
-    prune_counter = 0;
+    inotify_fd = -1;
+    last_file_check = 0;
+    not_found = HTTPResponse("HTTP/1.1 404 Not Found", 
+                             "Server: Dfterm2 minimal HTTP server\r\n"
+                             "Content-Type: text/html; charset=UTF-8\r\n"
+                             "Content-Length: 31\r\n",
+                             "<html><body>404</body></html>\r\n");
+}
+
+HTTPServer::~HTTPServer()
+{
+    #ifdef __linux__
+    if (inotify_fd != -1) ::close(inotify_fd);
+    #endif
+}
+
+HTTPResponse::HTTPResponse(const string &status, const string &headers, const string &body)
+{
+    string* b = new string;
+    SP<const string> sb(b);
+    b->reserve(status.size() + headers.size() + body.size() + 4);
+    b->append(status).append("\r\n").append(headers);
+    header_end = b->size();
+    b->append("\r\n");
+    body_start = b->size();
+    b->append(body);
+    buffer = sb;
+}
+
+/* Compresses 'in' into a gzip stream. */
+static bool gzip_compress(const string &in, string* out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out->resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef*) in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*) &(*out)[0];
+    zs.avail_out = out->size();
+
+    int result = deflate(&zs, Z_FINISH);
+    out->resize(out->size() - zs.avail_out);
+    deflateEnd(&zs);
+
+    return (result == Z_STREAM_END);
+}
+
+static string content_length_header(size_t length)
+{
+    stringstream ss;
+    ss << "Content-Length: " << length << "\r\n";
+    return ss.str();
+}
+
+Document::Document(const string &d, const string &ct)
+{
+    contenttype = ct;
+    /* 128 bits of SHA512 is plenty for telling versions apart. */
+    etag = string("\"") + hash_data(d).substr(0, 32) + string("\"");
+
+    /* Compressed version is only kept if it saves at least 10% */
+    string compressed;
+    bool use_gzip = gzip_compress(d, &compressed) && compressed.size() + compressed.size() / 9 < d.size();
+
+    string server_header("Server: Dfterm2 minimal HTTP server\r\n");
+    string type_header = string("Content-Type: ") + ct + string("\r\n");
+    string vary_header;
+    if (use_gzip) vary_header = "Vary: Accept-Encoding\r\n";
+
+    identity = HTTPResponse("HTTP/1.1 200 OK", server_header + type_header + content_length_header(d.size()) + "Accept-Ranges: bytes\r\nETag: " + etag + "\r\n" + vary_header, d);
+    identity_not_modified = HTTPResponse("HTTP/1.1 304 Not Modified", server_header + "ETag: " + etag + "\r\n" + vary_header, string());
+    if (!use_gzip) return;
+
+    gzip_etag = etag;
+    gzip_etag.insert(gzip_etag.size() - 1, "-gzip");
+    gzip = HTTPResponse("HTTP/1.1 200 OK", server_header + type_header + content_length_header(compressed.size()) + "Content-Encoding: gzip\r\nETag: " + gzip_etag + "\r\n" + vary_header, compressed);
+    gzip_not_modified = HTTPResponse("HTTP/1.1 304 Not Modified", server_header + "ETag: " + gzip_etag + "\r\n" + vary_header, string());
 }
 
-void HTTPServer::pruneUnusedSockets()
+Document::Document(SP<ServedFile> f, const string &et, const string &ct)
 {
-    set<SP<Socket> >::iterator i1, listening_sockets_end;
-    bool repeat = true;
-    while (repeat)
+    assert(f);
+    file = f;
+    contenttype = ct;
+    etag = et;
+
+    string server_header("Server: Dfterm2 minimal HTTP server\r\n");
+    identity = HTTPResponse("HTTP/1.1 200 OK", server_header + "Content-Type: " + ct + "\r\n" + content_length_header(f->size) + "Accept-Ranges: bytes\r\nETag: " + etag + "\r\n", string());
+    identity_not_modified = HTTPResponse("HTTP/1.1 304 Not Modified", server_header + "ETag: " + etag + "\r\n", string());
+}
+
+ui64 Document::getSize() const
+{
+    if (file) return file->size;
+    if (!identity.buffer) return 0;
+    return identity.buffer->size() - identity.body_start;
+}
+
+ServedFile::~ServedFile()
+{
+    #ifdef _WIN32
+    if (fd != -1) _close(fd);
+    #else
+    if (fd != -1) ::close(fd);
+    #endif
+}
+
+HTTPPendingResponse::HTTPPendingResponse(const HTTPResponse &response, bool head_only)
+{
+    head = response.buffer;
+    begin = 0;
+    split = response.header_end;
+    end = head_only ? response.body_start : response.buffer->size();
+    connection_header = "";
+    connection_header_size = 0;
+    body_begin = body_end = 0;
+    file_begin = file_end = 0;
+    sent = 0;
+}
+
+void HTTPRequestParser::reset()
+{
+    state = RequestLine;
+    line.clear();
+    head_size = 0;
+    last_header.clear();
+    method.clear();
+    target.clear();
+    version.clear();
+    headers.clear();
+}
+
+string HTTPRequestParser::getHeader(const string &name) const
+{
+    map<string, string>::const_iterator i1 = headers.find(name);
+    if (i1 == headers.end()) return string();
+    return i1->second;
+}
+
+void HTTPRequestParser::parseRequestLine()
+{
+    /* Empty lines before the request line are allowed. */
+    if (line.empty()) return;
+
+    size_t space1 = line.find(' ');
+    if (space1 == string::npos || space1 == 0) { state = Malformed; return; };
+    size_t space2 = line.find(' ', space1+1);
+    if (space2 == string::npos || space2 == space1+1) { state = Malformed; return; };
+    if (line.find(' ', space2+1) != string::npos) { state = Malformed; return; };
+
+    method = line.substr(0, space1);
+    target = line.substr(space1+1, space2-space1-1);
+    version = line.substr(space2+1);
+
+    if (version != "HTTP/1.1" && version != "HTTP/1.0") { state = Malformed; return; };
+    size_t i1, len = method.size();
+    for (i1 = 0; i1 < len; ++i1)
+        if (method[i1] < 'A' || method[i1] > 'Z') { state = Malformed; return; };
+
+    state = Headers;
+}
+
+void HTTPRequestParser::parseHeaderLine()
+{
+    if (line.empty())
+    {
+        state = Complete;
+        return;
+    }
+
+    /* Continuation of the previous header */
+    if (line[0] == ' ' || line[0] == '\t')
+    {
+        if (last_header.empty()) { state = Malformed; return; };
+        size_t start = line.find_first_not_of(" \t");
+        if (start != string::npos)
+            headers[last_header].append(" ").append(line, start, string::npos);
+        return;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == string::npos || colon == 0) { state = Malformed; return; };
+
+    string name = line.substr(0, colon);
+    size_t i1, len = name.size();
+    for (i1 = 0; i1 < len; ++i1)
+    {
+        if (name[i1] == ' ' || name[i1] == '\t') { state = Malformed; return; };
+        if (name[i1] >= 'A' && name[i1] <= 'Z') name[i1] = name[i1] - 'A' + 'a';
+    }
+
+    size_t start = line.find_first_not_of(" \t", colon+1);
+    size_t end = line.find_last_not_of(" \t");
+    string value;
+    if (start != string::npos && end >= start)
+        value = line.substr(start, end-start+1);
+
+    /* Repeated headers are combined, as in RFC 2616 section 4.2. */
+    map<string, string>::iterator i2 = headers.find(name);
+    if (i2 != headers.end())
+        i2->second.append(",").append(value);
+    else
+        headers[name] = value;
+    last_header = name;
+}
+
+size_t HTTPRequestParser::feed(const char* data, size_t len)
+{
+    size_t used = 0;
+    while (used < len && (state == RequestLine || state == Headers))
     {
-        repeat = false;
-        listening_sockets_end = listening_sockets.end();
-        for (i1 = listening_sockets.begin(); i1 != listening_sockets_end; ++i1)
+        const char* newline = (const char*) memchr(data + used, '\n', len - used);
+        size_t chunk = newline ? (size_t) (newline - (data + used)) + 1 : len - used;
+
+        head_size += chunk;
+        if (head_size > max_bytes_on_request)
         {
-            if (!(*i1) || !(*i1)->active())
-            {
-                listening_sockets.erase(i1);
-                LOG(Note, "Pruned an inactive listening socket for HTTP from memory.");
-                repeat = true;
-                break;
-            }
+            state = TooLarge;
+            return used + chunk;
+        }
+
+        if (!newline)
+        {
+            line.append(data + used, chunk);
+            used += chunk;
+            break;
         }
-    };
 
-    repeat = true;
-    set<SP<HTTPClient> >::iterator i2, http_clients_end;
-    while(repeat)
+        line.append(data + used, chunk - 1);
+        used += chunk;
+        if (!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+
+        if (state == RequestLine)
+            parseRequestLine();
+        else
+            parseHeaderLine();
+        line.clear();
+    }
+
+    return used;
+}
+
+/* Splits a comma separated header value to its elements, without
+   surrounding whitespace. Parameters (";q=0.5") are kept. */
+static vector<string> split_header_list(const string &value)
+{
+    vector<string> result;
+    size_t start = 0;
+    while (start <= value.size())
     {
-        repeat = false;
-        http_clients_end = http_clients.end();
-        for (i2 = http_clients.begin(); i2 != http_clients_end; ++i2)
+        size_t comma = value.find(',', start);
+        if (comma == string::npos) comma = value.size();
+
+        size_t first = value.find_first_not_of(" \t", start);
+        if (first != string::npos && first < comma)
         {
-            if (!(*i2) || !(*i2)->getSocket() || !(*i2)->getSocket()->active())
-            {
-                LOG(Note, "Pruned an inactive HTTP connection from memory.");
-                http_clients.erase(i2);
-                repeat = true;
-                break;
-            }
+            size_t last = value.find_last_not_of(" \t", comma - 1);
+            result.push_back(value.substr(first, last - first + 1));
         }
-    };
+        start = comma + 1;
+    }
+    return result;
 }
 
-void HTTPClient::cycle()
+static string to_lower_case(string s)
 {
-    if (!s || !s->active()) return;
+    size_t i1, len = s.size();
+    for (i1 = 0; i1 < len; ++i1)
+        if (s[i1] >= 'A' && s[i1] <= 'Z') s[i1] = s[i1] - 'A' + 'a';
+    return s;
+}
+
+/* For headers with case insensitive tokens, like Connection. 'token' must be in lower case. */
+static bool header_has_token(const string &value, const string &token)
+{
+    vector<string> elements = split_header_list(to_lower_case(value));
+    vector<string>::iterator i1, elements_end = elements.end();
+    for (i1 = elements.begin(); i1 != elements_end; ++i1)
+        if ((*i1) == token) return true;
+    return false;
+}
 
-    if (nanoclock() - creation_time >= max_nanoseconds_on_request)
+static bool accepts_gzip(const string &accept_encoding)
+{
+    vector<string> elements = split_header_list(to_lower_case(accept_encoding));
+    vector<string>::iterator i1, elements_end = elements.end();
+    for (i1 = elements.begin(); i1 != elements_end; ++i1)
     {
-        LOG(Note, "Disconnecting HTTP connection from " << s->getAddress().getHumanReadablePlainUTF8() << " due to reaching maximum connection time.");
-        s->close();
+        string coding = i1->substr(0, i1->find(';'));
+        size_t end = coding.find_last_not_of(" \t");
+        coding.erase(end == string::npos ? 0 : end + 1);
+        if (coding != "gzip" && coding != "x-gzip") continue;
+
+        /* "gzip;q=0" means no gzip */
+        size_t q = i1->find("q=");
+        if (q == string::npos) return true;
+        return (atof(i1->c_str() + q + 2) > 0.0);
+    }
+    return false;
+}
+
+static bool etag_matches(const string &if_none_match, const string &etag)
+{
+    if (if_none_match.empty()) return false;
+
+    vector<string> elements = split_header_list(if_none_match);
+    vector<string>::iterator i1, elements_end = elements.end();
+    for (i1 = elements.begin(); i1 != elements_end; ++i1)
+    {
+        /* If-None-Match uses the weak comparison */
+        if ((*i1) == "*") return true;
+        if ((*i1) == etag) return true;
+        if (i1->size() > 2 && (*i1)[0] == 'W' && (*i1)[1] == '/' && i1->substr(2) == etag) return true;
+    }
+    return false;
+}
+
+void HTTPClient::queueResponse(HTTPPendingResponse pr, bool keep_alive, bool http10)
+{
+    if (!keep_alive)
+    {
+        pr.connection_header = "Connection: close\r\n";
+        closing = true;
+    }
+    else if (http10)
+        pr.connection_header = "Connection: keep-alive\r\n";
+    pr.connection_header_size = strlen(pr.connection_header);
+
+    pending_responses.push_back(pr);
+}
+
+/* Parses a Range header value for a document of 'size' bytes. Returns 1 and
+   sets the (inclusive) byte range if there's one range that can be served,
+   -1 if the range can't be satisfied and 0 if the header should be ignored
+   (it is malformed or asks for several ranges). */
+static int parse_range(const string &range, ui64 size, ui64* first, ui64* last)
+{
+    if (range.size() < 6 || to_lower_case(range.substr(0, 6)) != "bytes=") return 0;
+    string spec = range.substr(6);
+    if (spec.find(',') != string::npos) return 0;
+
+    size_t dash = spec.find('-');
+    if (dash == string::npos) return 0;
+    string start = spec.substr(0, dash);
+    string stop = spec.substr(dash+1);
+    if (start.find_first_not_of("0123456789") != string::npos) return 0;
+    if (stop.find_first_not_of("0123456789") != string::npos) return 0;
+    if (start.empty() && stop.empty()) return 0;
+    /* Numbers this long don't fit. */
+    if (start.size() > 18 || stop.size() > 18) return 0;
+
+    if (start.empty())
+    {
+        /* Suffix range, the last 'stop' bytes */
+        ui64 suffix = (ui64) strtoull(stop.c_str(), (char**) 0, 10);
+        if (suffix == 0 || size == 0) return -1;
+        if (suffix > size) suffix = size;
+        (*first) = size - suffix;
+        (*last) = size - 1;
+        return 1;
+    }
+
+    (*first) = (ui64) strtoull(start.c_str(), (char**) 0, 10);
+    (*last) = stop.empty() ? size - 1 : (ui64) strtoull(stop.c_str(), (char**) 0, 10);
+    if ((*last) < (*first)) return 0;
+    if ((*first) >= size) return -1;
+    if ((*last) >= size) (*last) = size - 1;
+    return 1;
+}
+
+bool HTTPClient::respondRange(const Document &d, bool keep_alive, bool http10)
+{
+    if (parser.method != "GET") return false;
+    string range = parser.getHeader("range");
+    if (range.empty()) return false;
+    /* If-Range with an old entity tag (or a date, which we don't send) means the whole document */
+    string if_range = parser.getHeader("if-range");
+    if (!if_range.empty() && if_range != d.etag) return false;
+
+    ui64 size = d.getSize();
+    ui64 first = 0, last = 0;
+    int result = parse_range(range, size, &first, &last);
+    if (result == 0) return false;
+
+    stringstream headers;
+    headers << "Server: Dfterm2 minimal HTTP server\r\n";
+    if (result < 0)
+    {
+        LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << parser.method << " requested page \"" << parser.target << "\" (416)");
+        headers << "Content-Range: bytes */" << size << "\r\n";
+        headers << "Content-Length: 0\r\n";
+        queueResponse(HTTPPendingResponse(HTTPResponse("HTTP/1.1 416 Range Not Satisfiable", headers.str(), string()), false), keep_alive, http10);
+        return true;
+    }
+
+    LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << parser.method << " requested page \"" << parser.target << "\" (206)");
+    headers << "Content-Type: " << d.contenttype << "\r\n";
+    headers << "Content-Length: " << (last - first + 1) << "\r\n";
+    headers << "Content-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+    headers << "ETag: " << d.etag << "\r\n";
+
+    HTTPPendingResponse pr(HTTPResponse("HTTP/1.1 206 Partial Content", headers.str(), string()), false);
+    if (d.file)
+    {
+        pr.file = d.file;
+        pr.file_begin = first;
+        pr.file_end = last + 1;
+    }
+    else
+    {
+        pr.body = d.identity.buffer;
+        pr.body_begin = d.identity.body_start + (size_t) first;
+        pr.body_end = d.identity.body_start + (size_t) last + 1;
+    }
+    queueResponse(pr, keep_alive, http10);
+    return true;
+}
+
+bool HTTPClient::respondUpgrade(bool http10)
+{
+    if (!websocket_handlers) return false;
+
+    string path = parser.target.substr(0, parser.target.find('?'));
+    map<string, WebSocketCallback>::iterator i1 = websocket_handlers->find(path);
+    if (i1 == websocket_handlers->end()) return false;
+
+    string key = parser.getHeader("sec-websocket-key");
+    if (http10 || key.empty() ||
+        !header_has_token(parser.getHeader("connection"), "upgrade") ||
+        parser.getHeader("sec-websocket-version") != "13")
+    {
+        LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " sent a bad WebSocket request for \"" << parser.target << "\" (400)");
+        HTTPResponse bad_request("HTTP/1.1 400 Bad Request", 
+                                 "Server: Dfterm2 minimal HTTP server\r\n"
+                                 "Sec-WebSocket-Version: 13\r\n"
+                                 "Content-Length: 0\r\n", string());
+        queueResponse(HTTPPendingResponse(bad_request, false), false, http10);
+        return true;
+    }
+
+    LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " upgraded to WebSocket for \"" << parser.target << "\" (101)");
+    HTTPResponse switching("HTTP/1.1 101 Switching Protocols",
+                           string("Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Accept: ") + WebSocketSession::acceptKey(key) + "\r\n", string());
+    queueResponse(HTTPPendingResponse(switching, false), true, false);
+
+    /* Nothing after this is HTTP. */
+    closing = true;
+    upgraded = true;
+    upgrade_callback = i1->second;
+    upgrade_target = parser.target;
+    return true;
+}
+
+bool HTTPClient::respondProtocolUpgrade(bool http10)
+{
+    if (!upgrade_handlers || http10) return false;
+
+    string path = parser.target.substr(0, parser.target.find('?'));
+    map<string, UpgradeDocument>::iterator i1 = upgrade_handlers->find(path);
+    if (i1 == upgrade_handlers->end()) return false;
+    if (!header_has_token(parser.getHeader("upgrade"), to_lower_case(i1->second.protocol)) ||
+        !header_has_token(parser.getHeader("connection"), "upgrade"))
+        return false;
+
+    LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " upgraded to " << i1->second.protocol << " for \"" << parser.target << "\" (101)");
+    HTTPResponse switching("HTTP/1.1 101 Switching Protocols",
+                           string("Upgrade: ") + i1->second.protocol + "\r\n"
+                           "Connection: Upgrade\r\n", string());
+    queueResponse(HTTPPendingResponse(switching, false), true, false);
+
+    /* Nothing after this is HTTP. */
+    closing = true;
+    upgraded = true;
+    upgrade_callback = i1->second.callback;
+    upgrade_target = parser.target;
+    return true;
+}
+
+bool HTTPClient::respondStream(bool http10)
+{
+    if (!stream_handlers) return false;
+
+    string path = parser.target.substr(0, parser.target.find('?'));
+    map<string, StreamDocument>::iterator i1 = stream_handlers->find(path);
+    if (i1 == stream_handlers->end()) return false;
+
+    LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " started streaming \"" << parser.target << "\" (200)");
+    /* No length; the response ends when the connection closes. */
+    HTTPResponse stream("HTTP/1.1 200 OK",
+                        string("Server: Dfterm2 minimal HTTP server\r\n"
+                               "Content-Type: ") + i1->second.contenttype + "\r\n"
+                        "Cache-Control: no-cache\r\n", string());
+    queueResponse(HTTPPendingResponse(stream, false), false, http10);
+
+    upgraded = true;
+    upgrade_stream = true;
+    upgrade_callback = i1->second.callback;
+    upgrade_target = parser.target;
+    upgrade_last_event_id = parser.getHeader("last-event-id");
+    return true;
+}
+
+bool HTTPClient::takeUpgrade(WebSocketCallback* callback, string* target, string* leftover)
+{
+    if (!upgraded || !pending_responses.empty()) return false;
+    if (!s || !s->active()) return false;
+
+    (*callback) = upgrade_callback;
+    (*target) = upgrade_target;
+    (*leftover) = upgrade_stream ? upgrade_last_event_id : input.substr(input_used);
+    input.clear();
+    input_used = 0;
+    upgraded = false;
+    return true;
+}
+
+void HTTPClient::respond()
+{
+    last_activity_time = nanoclock();
+
+    bool http10 = (parser.version == "HTTP/1.0");
+    string connection = parser.getHeader("connection");
+    bool keep_alive = http10 ? header_has_token(connection, "keep-alive") : !header_has_token(connection, "close");
+    /* Request bodies are not read, so there's no telling where the next request would start. */
+    string content_length = parser.getHeader("content-length");
+    if (!parser.getHeader("transfer-encoding").empty() || (!content_length.empty() && content_length != "0"))
+        keep_alive = false;
+
+    bool get = (parser.method == "GET");
+    bool head = (parser.method == "HEAD");
+    const string &document = parser.target;
+
+    string upgrade = parser.getHeader("upgrade");
+    if (get && header_has_token(upgrade, "websocket") && respondUpgrade(http10))
+        return;
+    if (get && !upgrade.empty() && respondProtocolUpgrade(http10))
+        return;
+    if (get && respondStream(http10))
+        return;
+
+    if (!get && !head)
+    {
+        closing = true;
         return;
     }
 
-    if (!plain_document.empty())
+    map<string, Document>::iterator i1 = served_content->find(document);
+    if (i1 == served_content->end() && dynamic_content)
     {
-        if (waiting_for_request)
+        map<string, DynamicDocument>::iterator i2 = dynamic_content->find(document);
+        if (i2 != dynamic_content->end())
         {
-            map<string, Document>::iterator i1 = served_content->find(plain_document);
-            if (i1 == served_content->end())
-            {
-                s->close();
-                return;
-            }
-
-            waiting_for_request = false;
-            response_string = i1->second.document;
+            string body = i2->second.callback();
+            stringstream headers;
+            headers << "Server: Dfterm2 minimal HTTP server\r\n";
+            headers << "Content-Type: " << i2->second.contenttype << "\r\n";
+            headers << "Content-Length: " << body.size() << "\r\n";
+            headers << "Cache-Control: no-cache\r\n";
+            queueResponse(HTTPPendingResponse(HTTPResponse("HTTP/1.1 200 OK", headers.str(), body), head), keep_alive, http10);
+            return;
         }
     }
+    if (i1 == served_content->end())
+    {
+        LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << parser.method << " requested page \"" << document << "\" (404)");
+        queueResponse(HTTPPendingResponse(*not_found, head), keep_alive, http10);
+        return;
+    }
+
+    const Document &d = i1->second;
+    bool use_gzip = d.gzip.buffer && accepts_gzip(parser.getHeader("accept-encoding"));
 
-    if (waiting_for_request)
+    if (etag_matches(parser.getHeader("if-none-match"), use_gzip ? d.gzip_etag : d.etag))
     {
-        size_t result = 1;
-        while(result)
-        {
-            char buf[1000];
-            result = s->recv(buf, 1000);
-            if (result == 0) break;
+        LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << parser.method << " requested page \"" << document << "\" (304)");
+        queueResponse(HTTPPendingResponse(use_gzip ? d.gzip_not_modified : d.identity_not_modified, head), keep_alive, http10);
+        return;
+    }
 
-            request_string.append(buf, result);
-            if (request_string.size() > max_bytes_on_request)
-            {
-                LOG(Note, "Disconnecting HTTP connection from " << s->getAddress().getHumanReadablePlainUTF8() << " due to reaching maximum byte limit (" << max_bytes_on_request << ") on HTTP request.");
-                s->close();
-                return;
-            }
-        }
+    if (respondRange(d, keep_alive, http10))
+        return;
 
+    LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << parser.method << " requested page \"" << document << "\" (200)");
+    HTTPPendingResponse pr(use_gzip ? d.gzip : d.identity, head);
+    if (d.file && !head)
+    {
+        pr.file = d.file;
+        pr.file_end = d.file->size;
+    }
+    queueResponse(pr, keep_alive, http10);
+}
 
-        /* Check if request string is complete */
-        size_t index = request_string.find("\r\n\r\n", 0, 4);
-        if (index == string::npos)
-            return;
+/* Adds a span for [data, data+size) to 'spans', leaving out the first 'skip' bytes. */
+static void add_span(DataSpan* spans, size_t* spans_count, const char* data, size_t size, ui64* skip)
+{
+    if ((*skip) >= size)
+    {
+        (*skip) -= size;
+        return;
+    }
+    spans[*spans_count].data = data + (size_t) (*skip);
+    spans[*spans_count].size = size - (size_t) (*skip);
+    (*skip) = 0;
+    ++(*spans_count);
+}
 
-        Regex get_method("^GET ([^ \r\n]+) HTTP/1\\.1\r\n");
-        bool get = get_method.execute(request_string);
-        bool head = false;
-        string document;
-        if (get)
-            document = get_method.getMatch(1);
-        else
+bool HTTPClient::sendPending()
+{
+    while (!pending_responses.empty())
+    {
+        /* All queued responses go out in one call, up to the first one
+           that has a part to be sent from a file. */
+        DataSpan spans[max_pending_responses * 4];
+        size_t spans_count = 0;
+
+        deque<HTTPPendingResponse>::iterator i1, pending_responses_end = pending_responses.end();
+        for (i1 = pending_responses.begin(); i1 != pending_responses_end; ++i1)
         {
-            Regex head_method("^HEAD ([^ \r\n+) HTTP/1\\.1\r\n");
-            head = head_method.execute(request_string);
-            if (head)
-                document = head_method.getMatch(1);
+            const char* data = i1->head->data();
+            ui64 skip = i1->sent;
+            add_span(spans, &spans_count, data + i1->begin, i1->split - i1->begin, &skip);
+            add_span(spans, &spans_count, i1->connection_header, i1->connection_header_size, &skip);
+            add_span(spans, &spans_count, data + i1->split, i1->end - i1->split, &skip);
+            if (i1->body)
+                add_span(spans, &spans_count, i1->body->data() + i1->body_begin, i1->body_end - i1->body_begin, &skip);
+            if (i1->file_end > i1->file_begin) break;
         }
-        string get_or_head("GET");
-        if (!get && head) get_or_head = "HEAD";
 
-        if (get || head)
+        size_t result;
+        if (spans_count > 0)
+            result = s->sendv(spans, spans_count);
+        else
         {
-            map<string, Document>::iterator i1 = served_content->find(document);
-            if (i1 != served_content->end())
+            /* Only the file part of the first response is left. */
+            HTTPPendingResponse &pr = pending_responses.front();
+            ui64 offset = pr.file_begin + (pr.sent - pr.memorySize());
+            ui64 count = pr.file_end - offset;
+            if (count > max_file_send_size) count = max_file_send_size;
+
+            bool end_of_file = false;
+            result = s->sendFile(pr.file->fd, offset, (size_t) count, &end_of_file);
+            if (end_of_file)
             {
-                LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << get_or_head << " requested page \"" << document << "\" (200)");
-
-                stringstream response;
-                response << "HTTP/1.1 200 OK\r\n";
-                response << "Server: Dfterm2 minimal HTTP server\r\n";
-                response << "Connection: close\r\n";
-                response << "Content-Type: " << i1->second.contenttype << "\r\n\r\n";
-                if (get)
-                    response << i1->second.document;
-
-                response_string = response.str();
-                waiting_for_request = false;
+                /* The file got shorter after we said how long it is. */
+                LOG(Note, "File being sent to HTTP connection from " << s->getAddress().getHumanReadablePlainUTF8() << " ended early; closing connection.");
+                s->close();
+                return false;
             }
-            else
+        }
+        if (!s->active()) return false;
+        if (result == 0) return true;
+        last_activity_time = nanoclock();
+
+        ui64 sent = result;
+        while (sent > 0 && !pending_responses.empty())
+        {
+            HTTPPendingResponse &pr = pending_responses.front();
+            ui64 left = pr.size() - pr.sent;
+            if (sent < left)
             {
-                LOG(Note, "A connection from " << s->getAddress().getHumanReadablePlainUTF8() << " " << get_or_head << " requested page \"" << document << "\" (404)");
-
-                stringstream response;
-                response << "HTTP/1.1 404 Not Found\r\n";
-                response << "Server: Dfterm2 minimal HTTP server\r\n";
-                response << "Connection: close\r\n";
-                response << "Content-Type: text/html; charset=UTF-8\r\n\r\n";
-                if (get)
-                    response << "<html><body>404</body></html>\r\n";
-
-                response_string = response.str();
-                waiting_for_request = false;
+                pr.sent += sent;
+                break;
             }
+            sent -= left;
+            pending_responses.pop_front();
         }
-        else
+    }
+    return true;
+}
+
+bool HTTPClient::readRequests()
+{
+    while (!closing)
+    {
+        if (pending_responses.size() >= max_pending_responses)
+            return true;
+
+        if (input_used == input.size())
         {
-            s->close();
-            return;
+            input.clear();
+            input_used = 0;
+
+            char buf[4096];
+            size_t result = s->recv(buf, 4096);
+            if (result == 0) return false;
+            input.append(buf, result);
         }
+
+        input_used += parser.feed(input.data() + input_used, input.size() - input_used);
+        switch(parser.getState())
+        {
+            case HTTPRequestParser::TooLarge:
+                LOG(Note, "Disconnecting HTTP connection from " << s->getAddress().getHumanReadablePlainUTF8() << " due to reaching maximum byte limit (" << max_bytes_on_request << ") on HTTP request.");
+                s->close();
+                return false;
+            case HTTPRequestParser::Malformed:
+                s->close();
+                return false;
+            case HTTPRequestParser::Complete:
+                respond();
+                parser.reset();
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+void HTTPClient::cycle()
+{
+    if (!s || !s->active()) return;
+
+    if (nanoclock() - last_activity_time >= max_nanoseconds_on_request)
+    {
+        LOG(Note, "Disconnecting HTTP connection from " << s->getAddress().getHumanReadablePlainUTF8() << " due to reaching maximum idle time.");
+        s->close();
+        return;
     }
 
-    if (!waiting_for_request)
+    if (!plain_document.empty() && !closing)
     {
-        /* Read and ignore all data */
-        char dummybuf[1000];
-        size_t result = 1;
-        while(result)
-        { result = s->recv(dummybuf, 1000); };
+        closing = true;
 
-        if (response_string.size() == 0)
+        map<string, Document>::iterator i1 = served_content->find(plain_document);
+        if (i1 == served_content->end())
         {
             s->close();
             return;
         }
 
-        const char* buf;
-        size_t len;
-
-        result = 1;
-        while (result)
+        /* Just the body */
+        const Document &d = i1->second;
+        HTTPPendingResponse pr(d.identity, false);
+        pr.begin = pr.split = d.identity.body_start;
+        if (d.file)
         {
-            buf = response_string.data();
-            len = response_string.size();
-
-            result = s->send(buf, len);
-            if (result > 0)
-                response_string.erase(0, result);
-        
-            if (result == len)
-            {
-                s->close();
-                return;
-            }
+            pr.file = d.file;
+            pr.file_end = d.file->size;
         }
+        pending_responses.push_back(pr);
     }
-}
 
-SP<Socket> HTTPServer::cycle()
-{
-    ++prune_counter;
-    if (prune_counter > 200)
+    while(true)
     {
-        pruneUnusedSockets();
-        prune_counter = 0;
+        bool more = readRequests();
+        if (!s->active()) return;
+        if (!sendPending()) return;
+
+        /* Sockets are edge triggered; if there's room for more responses
+           now, the rest of the requests must be read now too. */
+        if (!more || pending_responses.size() >= max_pending_responses)
+            break;
     }
 
-    bool repeat = true;
+    if (closing && !upgraded && pending_responses.empty())
+    {
+        /* Read and ignore all data */
+        char dummybuf[1000];
+        size_t result = 1;
+        while(result)
+        { result = s->recv(dummybuf, 1000); };
+
+        s->close();
+    }
+}
 
-    while(repeat)
+void HTTPServer::acceptConnections(SP<Socket> listening_socket, const string* plain_document, vector<SP<Socket> >* new_sockets)
+{
+    vector<SP<Socket> > accepted;
+    while (listening_socket->acceptBatch(accepted, ACCEPT_BATCH_SIZE) > 0)
     {
-        repeat = false;
-        /* Check listening sockets */
-        SP<Socket> http_client(new Socket);
-        set<SP<Socket> >::iterator i1, listening_sockets_end = listening_sockets.end();
-        for (i1 = listening_sockets.begin(); i1 != listening_sockets_end; ++i1)
+        vector<SP<Socket> >::iterator i1, accepted_end = accepted.end();
+        for (i1 = accepted.begin(); i1 != accepted_end; ++i1)
         {
-            if (!(*i1) || !(*i1)->active())
-                continue;
-
-            bool got_connection = (*i1)->accept(http_client.get());
-            if (!got_connection) continue;
+            SP<Socket> http_client = (*i1);
+            const char* kind = plain_document ? "plain" : "HTTP";
 
             if (http_clients.size() >= MAX_HTTP_CONNECTIONS)
             {
-                repeat = true;
-                pruneUnusedSockets();
-                if (http_clients.size() >= MAX_HTTP_CONNECTIONS)
-                {
-                    LOG(Note, "Got HTTP connection from " << http_client->getAddress().getHumanReadablePlainUTF8() << " but closed it immediately, as maximum number (" << MAX_HTTP_CONNECTIONS << ") of HTTP connections has been reached.");
-                    http_client->close();
-                    break;
-                }
+                LOG(Note, "Got " << kind << " connection from " << http_client->getAddress().getHumanReadablePlainUTF8() << " but closed it immediately, as maximum number (" << MAX_HTTP_CONNECTIONS << ") of HTTP connections has been reached.");
+                http_client->close();
+                continue;
             }
 
             SP<HTTPClient> hc(new HTTPClient);
-            hc->setServedContent(&served_content);
+            hc->setServedContent(&served_content, &not_found);
+            hc->setWebSocketHandlers(&websocket_handlers);
+            hc->setDynamicContent(&dynamic_content);
+            hc->setStreamHandlers(&stream_handlers);
+            hc->setUpgradeHandlers(&upgrade_handlers);
+            if (plain_document)
+                hc->setPlain(*plain_document);
             hc->setSocket(http_client);
-            http_clients.insert(hc);
-
-            LOG(Note, "Got HTTP connection from " << http_client->getAddress().getHumanReadablePlainUTF8());
-            return http_client;
-        };
-
-        SP<Socket> plain_http_client(new Socket);
-        set<pair<SP<Socket>, string> >::iterator i2, plain_listening_sockets_end = plain_listening_sockets.end();
-        for (i2 = plain_listening_sockets.begin(); i2 != plain_listening_sockets_end; ++i2)
-        {
-            if (!(i2->first) || !(i2->first)->active())
-                continue;
+            http_clients[http_client] = hc;
+            http_clients_by_age.insert(pair<ui64, WP<HTTPClient> >(hc->getLastActivityTime() + max_nanoseconds_on_request, hc));
 
-            bool got_connection = (i2->first)->accept(http_client.get());
-            if (!got_connection) continue;
+            LOG(Note, "Got " << kind << " connection from " << http_client->getAddress().getHumanReadablePlainUTF8());
 
-            if (http_clients.size() >= MAX_HTTP_CONNECTIONS)
+            /* Plain connections don't wait for a request, start sending right away. */
+            if (plain_document)
             {
-                repeat = true;
-                pruneUnusedSockets();
-                if (http_clients.size() >= MAX_HTTP_CONNECTIONS)
+                hc->cycle();
+                if (!http_client->active())
                 {
-                    LOG(Note, "Got plain connection from " << http_client->getAddress().getHumanReadablePlainUTF8() << " but closed it immediately, as maximum number (" << MAX_HTTP_CONNECTIONS << ") of HTTP connections has been reached.");
-                    http_client->close();
-                    break;
+                    http_clients.erase(http_client);
+                    continue;
                 }
             }
+            new_sockets->push_back(http_client);
+        }
+        accepted.clear();
+    }
+}
 
-            SP<HTTPClient> hc(new HTTPClient);
-            hc->setServedContent(&served_content);
-            hc->setPlain(i2->second);
-            hc->setSocket(http_client);
-            http_clients.insert(hc);
+bool HTTPServer::socketEvent(SP<Socket> s, vector<SP<Socket> >* new_sockets)
+{
+    assert(new_sockets);
+    if (!s) return false;
+
+    map<SP<Socket>, SP<HTTPClient> >::iterator i1 = http_clients.find(s);
+    if (i1 != http_clients.end())
+    {
+        SP<HTTPClient> hc = i1->second;
+        hc->cycle();
 
-            LOG(Note, "Got plain connection from " << http_client->getAddress().getHumanReadablePlainUTF8());
-            return http_client;
-        };
+        WebSocketCallback callback;
+        string target, leftover;
+        if (hc->takeUpgrade(&callback, &target, &leftover))
+        {
+            http_clients.erase(s);
+            callback(s, target, leftover);
+            return true;
+        }
+
+        if (!s->active())
+            http_clients.erase(s);
+        return true;
     }
 
-    /* Check clients */
-    set<SP<HTTPClient> >::iterator i2, http_clients_end = http_clients.end();
-    for (i2 = http_clients.begin(); i2 != http_clients_end; ++i2)
+    if (listening_sockets.find(s) != listening_sockets.end())
     {
-        SP<HTTPClient> hc = (*i2);
-        hc->cycle();
+        if (!s->active())
+        {
+            listening_sockets.erase(s);
+            LOG(Note, "Pruned an inactive listening socket for HTTP from memory.");
+            return true;
+        }
+        acceptConnections(s, (const string*) 0, new_sockets);
+        return true;
     }
 
-    return SP<Socket>();
+    map<SP<Socket>, string>::iterator i2 = plain_listening_sockets.find(s);
+    if (i2 != plain_listening_sockets.end())
+    {
+        if (!s->active())
+        {
+            plain_listening_sockets.erase(i2);
+            LOG(Note, "Pruned an inactive listening socket for HTTP from memory.");
+            return true;
+        }
+        string plain_document = i2->second;
+        acceptConnections(s, &plain_document, new_sockets);
+        return true;
+    }
+
+    return false;
+}
+
+void HTTPServer::expireConnections()
+{
+    ui64 now = nanoclock();
+    while (!http_clients_by_age.empty())
+    {
+        multimap<ui64, WP<HTTPClient> >::iterator i1 = http_clients_by_age.begin();
+        if (i1->first > now)
+            break;
+
+        SP<HTTPClient> hc = i1->second.lock();
+        http_clients_by_age.erase(i1);
+        if (!hc) continue;
+
+        SP<Socket> s = hc->getSocket();
+        if (!s) continue;
+
+        /* Active since? Check again later. */
+        ui64 expires = hc->getLastActivityTime() + max_nanoseconds_on_request;
+        if (expires > now && s->active())
+        {
+            http_clients_by_age.insert(pair<ui64, WP<HTTPClient> >(expires, hc));
+            continue;
+        }
+
+        /* cycle() closes connections that have been idle too long. */
+        hc->cycle();
+        http_clients.erase(s);
+    }
 }
 
 void HTTPServer::addListeningSocket(SP<Socket> listening_socket)
@@ -294,7 +941,7 @@ void HTTPServer::addListeningSocket(SP<Socket> listening_socket)
 void HTTPServer::addPlainListeningSocket(SP<Socket> listening_socket, const string &serviceaddress)
 {
     assert(listening_socket && listening_socket->active());
-    plain_listening_sockets.insert(pair<SP<Socket>, string>(listening_socket, serviceaddress));
+    plain_listening_sockets[listening_socket] = serviceaddress;
 }
 
 void HTTPServer::serveContentUTF8(string buffer, string contenttype, string serviceaddress)
@@ -303,15 +950,68 @@ void HTTPServer::serveContentUTF8(string buffer, string contenttype, string serv
     served_content[serviceaddress] = Document(buffer, contenttype);
 }
 
+void HTTPServer::serveDynamicUTF8(boost::function0<string> callback, string contenttype, string serviceaddress)
+{
+    assert(!serviceaddress.empty());
+    DynamicDocument &dd = dynamic_content[serviceaddress];
+    dd.contenttype = contenttype;
+    dd.callback = callback;
+}
+
+void HTTPServer::serveStream(StreamCallback callback, string contenttype, string serviceaddress)
+{
+    assert(!serviceaddress.empty());
+    StreamDocument &sd = stream_handlers[serviceaddress];
+    sd.contenttype = contenttype;
+    sd.callback = callback;
+}
+
+void HTTPServer::serveWebSocket(string serviceaddress, WebSocketCallback callback)
+{
+    assert(!serviceaddress.empty());
+    websocket_handlers[serviceaddress] = callback;
+}
+
+void HTTPServer::serveUpgrade(string serviceaddress, string protocol, WebSocketCallback callback)
+{
+    assert(!serviceaddress.empty() && !protocol.empty());
+    UpgradeDocument &ud = upgrade_handlers[serviceaddress];
+    ud.protocol = protocol;
+    ud.callback = callback;
+}
+
 void HTTPServer::serveFileUTF8(string filename, string contenttype, string serviceaddress, const map<string, string> &replacors)
 {
+    assert(!serviceaddress.empty());
+
+    FileRegistration &fr = served_files[serviceaddress];
+    fr.filename = filename;
+    fr.contenttype = contenttype;
+    fr.replacors = replacors;
+
+    if (!loadFile(serviceaddress))
+    {
+        served_files.erase(serviceaddress);
+        return;
+    }
+    watchFile(filename);
+}
+
+bool HTTPServer::loadFile(const string &serviceaddress)
+{
+    map<string, FileRegistration>::iterator i1 = served_files.find(serviceaddress);
+    if (i1 == served_files.end()) return false;
+    const string &filename = i1->second.filename;
+    const map<string, string> &replacors = i1->second.replacors;
+
+    #ifdef _WIN32
     wchar_t* wc = (wchar_t*) 0;
     size_t wc_size = 0;
     TO_WCHAR_STRING(filename, wc, &wc_size);
     if (wc_size == 0)
     {
         LOG(Error, "Tried to serve a file from disk in HTTP server but filename \"" << filename << "\" is malformed.");
-        return;
+        return false;
     }
 
     wc = new wchar_t[wc_size+1];
@@ -319,76 +1019,181 @@ void HTTPServer::serveFileUTF8(string filename, string contenttype, string servi
 
     TO_WCHAR_STRING(filename, wc, &wc_size);
 
-    #ifdef _WIN32
-    FILE* f = _wfopen(wc, L"rb");
+    int fd = _wopen(wc, _O_RDONLY | _O_BINARY);
+    delete[] wc;
     #else
-    FILE* f = fopen(TO_UTF8(filename).c_str(), "rb");
+    int flags = O_RDONLY;
+    #ifdef O_CLOEXEC
+    flags |= O_CLOEXEC;
+    #endif
+    int fd = open(TO_UTF8(filename).c_str(), flags);
     #endif
-    delete[] wc;
 
-    if (!f)
+    if (fd == -1)
     {
         LOG(Error, "Attempted to serve file \"" << filename << "\" but opening it for reading failed.");
-        return;
+        return false;
     }
 
-    // Calculate the size of the file
-    
-    
+    SP<ServedFile> sf(new ServedFile);
+    sf->fd = fd;
+
+    // Get the size of the file, and modification time for the entity tag
     #ifdef _WIN32
-    __int64 fsize = 0;
-    _fseeki64(f, 0, SEEK_END);
-    fsize = _ftelli64(f);
-    if (fsize == -1)
+    struct _stat64 st;
+    if (_fstat64(fd, &st) == -1)
     #else
-    off_t fsize = 0;
-    fseeko(f, 0, SEEK_END);
-    fsize = ftello(f);
-    if (fsize < (off_t) 0)
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     #endif
     {
         LOG(Error, "Attempted to serve file \"" << filename << "\" but calculating file size failed.");
-        fclose(f);
-        return;
+        return false;
     }
-    #ifdef _WIN32
-    _fseeki64(f, 0, SEEK_SET);
-    #else
-    fseeko(f, 0, SEEK_SET);
-    #endif
+    sf->size = (ui64) st.st_size;
 
-    if ((ui64) fsize > MAX_HTTP_FILE_SIZE)
+    if (replacors.empty() && sf->size > MAX_HTTP_FILE_SIZE)
     {
-        LOG(Error, "Attempted to serve file \"" << filename << "\" but it is larger (" << fsize << " bytes) than the compile time limit (" << MAX_HTTP_FILE_SIZE << " bytes) on file sizes.");
-        fclose(f);
-        return;
+        stringstream etag;
+        etag << "\"" << hex << sf->size << "-" << (ui64) st.st_mtime;
+        #ifdef __linux__
+        etag << "." << (ui64) st.st_mtim.tv_nsec;
+        #endif
+        etag << "\"";
+
+        served_content[serviceaddress] = Document(sf, etag.str(), i1->second.contenttype);
+        return true;
+    }
+
+    if (sf->size > MAX_HTTP_FILE_SIZE)
+    {
+        LOG(Error, "Attempted to serve file \"" << filename << "\" with replacors but it is larger (" << sf->size << " bytes) than the compile time limit (" << MAX_HTTP_FILE_SIZE << " bytes) on such files.");
+        return false;
     }
 
-    char* buf = new char[fsize];
-    size_t result = fread(buf, 1, fsize, f);
-    if (result != (ui64) fsize)
+    string document_copy;
+    document_copy.resize((size_t) sf->size);
+    size_t read_bytes = 0;
+    while (read_bytes < document_copy.size())
+    {
+        #ifdef _WIN32
+        int result = _read(fd, &document_copy[read_bytes], (unsigned int) (document_copy.size() - read_bytes));
+        #else
+        ssize_t result = read(fd, &document_copy[read_bytes], document_copy.size() - read_bytes);
+        #endif
+        if (result <= 0) break;
+        read_bytes += result;
+    }
+    if (read_bytes != document_copy.size())
     {
         LOG(Error, "Attempted to serve file \"" << filename << "\" but there was a read error.");
-        delete[] buf;
-        return;
+        return false;
     }
-    fclose(f);
 
-    string document_copy = string(buf, fsize);
-    map<string, string>::const_iterator i1, replacors_end = replacors.end();
-    for (i1 = replacors.begin(); i1 != replacors_end; ++i1)
+    map<string, string>::const_iterator i2, replacors_end = replacors.end();
+    for (i2 = replacors.begin(); i2 != replacors_end; ++i2)
     {
         while(true)
         {
-            size_t index = document_copy.find(i1->first);
+            size_t index = document_copy.find(i2->first);
             if (index == string::npos) break;
 
-            document_copy.erase(index, i1->first.size());
-            document_copy.insert(index, i1->second);
+            document_copy.erase(index, i2->first.size());
+            document_copy.insert(index, i2->second);
+        }
+    }
+
+    served_content[serviceaddress] = Document(document_copy, i1->second.contenttype);
+    return true;
+}
+
+/* Splits a file name to directory and the name in it. */
+static void split_filename(const string &filename, string* directory, string* name)
+{
+    size_t slash = filename.rfind('/');
+    if (slash == string::npos)
+    {
+        (*directory) = ".";
+        (*name) = filename;
+        return;
+    }
+    (*directory) = (slash == 0) ? string("/") : filename.substr(0, slash);
+    (*name) = filename.substr(slash+1);
+}
+
+void HTTPServer::watchFile(const string &filename)
+{
+    #ifdef __linux__
+    if (inotify_fd == -1)
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1)
+        {
+            LOG(Note, "inotify is not available; HTTP server will not notice changes to served files.");
+            return;
+        }
+    }
+
+    /* Directories are watched, so files replaced by renaming are noticed too. */
+    string directory, name;
+    split_filename(filename, &directory, &name);
+    int wd = inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+    if (wd == -1)
+    {
+        LOG(Note, "Could not watch directory \"" << directory << "\" for changes to served file \"" << filename << "\".");
+        return;
+    }
+    watched_directories[wd] = directory;
+    #endif
+}
+
+void HTTPServer::checkFileChanges()
+{
+    #ifdef __linux__
+    if (inotify_fd == -1) return;
+
+    ui64 now = nanoclock();
+    if (now - last_file_check < 1000000000ULL) return;
+    last_file_check = now;
+
+    /* Collect the changed files first, a file is often changed several times in a row. */
+    set<pair<string, string> > changed;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while(true)
+    {
+        ssize_t result = read(inotify_fd, buf, sizeof(buf));
+        if (result <= 0) break;
+
+        ssize_t i1 = 0;
+        while (i1 < result)
+        {
+            const struct inotify_event* ev = (const struct inotify_event*) (buf + i1);
+            i1 += sizeof(struct inotify_event) + ev->len;
+
+            map<int, string>::iterator i2 = watched_directories.find(ev->wd);
+            if (i2 == watched_directories.end() || ev->len == 0) continue;
+            changed.insert(pair<string, string>(i2->second, string(ev->name)));
         }
     }
+    if (changed.empty()) return;
 
-    served_content[serviceaddress] = Document(document_copy, contenttype);
+    map<string, FileRegistration>::iterator i3, served_files_end = served_files.end();
+    for (i3 = served_files.begin(); i3 != served_files_end; ++i3)
+    {
+        string directory, name;
+        split_filename(i3->second.filename, &directory, &name);
+        if (changed.find(pair<string, string>(directory, name)) == changed.end()) continue;
 
-    delete[] buf;
+        if (loadFile(i3->first))
+        {
+            LOG(Note, "Served file \"" << i3->second.filename << "\" changed on disk and was loaded again.");
+        }
+        else
+        {
+            LOG(Note, "Served file \"" << i3->second.filename << "\" changed on disk but could not be loaded again; it is no longer served.");
+            served_content.erase(i3->first);
+        }
+    }
+    #endif
 }
+
@@ -3,6 +3,8 @@
 
 #include <set>
 #include <map>
+#include <deque>
+#include <vector>
 #include "dfterm2_limits.hpp"
 #include "types.hpp"
 #include "sockets.hpp"
@@ -18,13 +20,44 @@ class HTTPServer
 {
     private:
         std::set<SP<trankesbel::Socket> > listening_sockets;
-        std::set<std::pair<SP<trankesbel::Socket>, std::string> > plain_listening_sockets;
+        /* key = listening socket, value = document address to serve on connect */
+        std::map<SP<trankesbel::Socket>, std::string> plain_listening_sockets;
 
-        std::set<SP<HTTPClient> > http_clients;
+        /* HTTP connections by their socket. */
+        std::map<SP<trankesbel::Socket>, SP<HTTPClient> > http_clients;
+        /* The same connections by the time they should be checked for
+           being idle too long. Connections that have been active since
+           are put back with a later time, closed ones are skipped. */
+        std::multimap<trankesbel::ui64, WP<HTTPClient> > http_clients_by_age;
         std::map<std::string, Document> served_content; /* key = document address, value = document */
-        int prune_counter;
+        std::map<std::string, WebSocketCallback> websocket_handlers; /* key = document address */
+        std::map<std::string, DynamicDocument> dynamic_content; /* key = document address */
+        std::map<std::string, StreamDocument> stream_handlers; /* key = document address */
+        std::map<std::string, UpgradeDocument> upgrade_handlers; /* key = document address */
+        /* Response for documents that are not served. */
+        HTTPResponse not_found;
 
-        void pruneUnusedSockets();
+        /* Files given to serveFileUTF8(), by document address, so they
+           can be loaded again when they change. */
+        struct FileRegistration
+        {
+            std::string filename;
+            std::string contenttype;
+            std::map<std::string, std::string> replacors;
+        };
+        std::map<std::string, FileRegistration> served_files;
+        /* Loads (or reloads) a file in served_files into served_content. */
+        bool loadFile(const std::string &serviceaddress);
+
+        /* inotify descriptor (-1 if not in use) and the directories
+           of served files watched with it, by watch descriptor. */
+        int inotify_fd;
+        std::map<int, std::string> watched_directories;
+        trankesbel::ui64 last_file_check;
+        void watchFile(const std::string &filename);
+
+        /* Accepts pending connections from a listening socket. */
+        void acceptConnections(SP<trankesbel::Socket> listening_socket, const std::string* plain_document, std::vector<SP<trankesbel::Socket> >* new_sockets);
 
         /* No copies */
         HTTPServer(const HTTPServer &hs) { };
@@ -32,16 +65,27 @@ class HTTPServer
 
     public:
         HTTPServer();
+        ~HTTPServer();
+
+        /* Handles an event on socket 's'. Only the connection (or listening
+           socket) 's' belongs to is looked at. Returns false if 's' is not
+           one of the sockets of this server.
+
+           New client connections are appended to 'new_sockets'. Add them to
+           a SocketEvents class and call this function for events on them.
+           Listening sockets added with HTTPServer::addListeningSocket should
+           be added to it by the caller. */
+        bool socketEvent(SP<trankesbel::Socket> s, std::vector<SP<trankesbel::Socket> >* new_sockets);
 
-        /* Checks for new connections, sends data over network etc. etc. 
-           It can return a socket that should be added to a SocketEvents class,
-           and then this function should be called whenever any of the sockets
-           is ready. These sockets are client connections to the HTTP server.
+        /* Closes connections that have been open longer than allowed.
+           Call this every now and then. Only looks at the connections that
+           are due, so it's cheap to call often. */
+        void expireConnections();
 
-           You should call this until the return value is a null reference. 
-           Listening sockets added with HTTPServer::addListeningSocket are never
-           returned through this function. */
-        SP<trankesbel::Socket> cycle();
+        /* Loads served files again if they have changed on the disk (noticed
+           with inotify, so on Linux only). Call this every now and then; it
+           only checks once a second. */
+        void checkFileChanges();
 
         /* Gives a listening socket on which HTTPServer will listen for HTTP connections. */
         void addListeningSocket(SP<trankesbel::Socket> listening_socket);
@@ -52,12 +96,34 @@ class HTTPServer
         /* Tells the server to serve given buffer as content for given request address.
            For serviceaddress http://1.2.3.4/ this would be "/" and for http://1.2.3.4/monkey this would be "/monkey" 
            The contenttype is given after Content-type: (goes here), so you can use values like "text/html; charset=UTF-8" or
-           something else. Don't use \r\n in it. */
+           something else. Don't use \r\n in it. 
+           The complete responses (and a gzip compressed one) are built here, so serving
+           the content later just sends them. */
         void serveContentUTF8(std::string buffer, std::string contenttype, std::string serviceaddress);
-        /* Same as above but loads the content from file. Note that the file is loaded into memory
-           before returning so it is not a good idea to use this on large files. 
-           If you fill in replacors, any string that matches the key in the map is replaced by the value. */
+        /* Same as above but serves a file. Files up to MAX_HTTP_FILE_SIZE are loaded into memory,
+           larger ones are sent from the disk as they are requested.
+           If you fill in replacors, any string that matches the key in the map is replaced by the value.
+           This is done once here, so such files are always loaded into memory. */
         void serveFileUTF8(std::string filename, std::string contenttype, std::string serviceaddress, const std::map<std::string, std::string> &replacors);
+
+        /* Serves a document that 'callback' makes for each request, for pages that
+           change all the time. It's not cached or compressed, so keep these small. */
+        void serveDynamicUTF8(boost::function0<std::string> callback, std::string contenttype, std::string serviceaddress);
+
+        /* Serves a response that doesn't end, like Server-Sent Events. The headers are
+           sent here and then the socket is given to 'callback', like with serveWebSocket(). */
+        void serveStream(StreamCallback callback, std::string contenttype, std::string serviceaddress);
+
+        /* Accepts WebSocket upgrade requests for serviceaddress (query strings are
+           allowed after it). 'callback' is called with the socket once the upgrade is done;
+           the socket is then no longer handled by HTTPServer, and socketEvent() returns
+           false for it. */
+        void serveWebSocket(std::string serviceaddress, WebSocketCallback callback);
+
+        /* Same as above, but for upgrades to 'protocol' (the token in the Upgrade
+           header). The connection is handed over right after the 101 response;
+           the protocol is up to the callback. */
+        void serveUpgrade(std::string serviceaddress, std::string protocol, WebSocketCallback callback);
 };
 
 };
@@ -4,6 +4,10 @@
 #define minimal_http_server_private_hpp
 
 #include <sstream>
+#include <map>
+#include <deque>
+#include <string>
+#include <boost/function.hpp>
 #include "nanoclock.hpp"
 #include "sockets.hpp"
 
@@ -13,58 +17,283 @@ namespace dfterm
 /* This is the maximum number of bytes that we will accept
    before two newlines in HTTP request. */
 const size_t max_bytes_on_request = 5000;
-/* This is the longest lifespan of a connection, in nanoseconds.
-   (120000000000 = 120 seconds = 2 minutes) */
+/* This is the longest time a connection can stay idle or take to send
+   a request, in nanoseconds. (120000000000 = 120 seconds = 2 minutes) */
 const trankesbel::ui64 max_nanoseconds_on_request = 120000000000LL;
+/* Stop reading pipelined requests when this many responses are waiting to be sent. */
+const size_t max_pending_responses = 16;
+/* Most bytes sent from a file in one call. */
+const trankesbel::ui64 max_file_send_size = 1048576;
+
+/* Called when a connection has been upgraded to WebSocket. The parameters are
+   the socket, the request target (with the query string) and data received
+   after the upgrade request. */
+typedef boost::function3<void, SP<trankesbel::Socket>, std::string, std::string> WebSocketCallback;
+
+/* Called when the headers of a streamed response have been sent. The
+   parameters are the socket, the request target and the Last-Event-ID
+   request header. The caller sends the body and closes the connection. */
+typedef boost::function3<void, SP<trankesbel::Socket>, std::string, std::string> StreamCallback;
+
+struct StreamDocument
+{
+    std::string contenttype;
+    StreamCallback callback;
+};
+
+/* Accepts upgrades of connections to some other protocol than WebSocket.
+   The callback is called like a WebSocketCallback. */
+struct UpgradeDocument
+{
+    /* The token in the Upgrade header */
+    std::string protocol;
+    WebSocketCallback callback;
+};
+
+/* A document that is made again for every request. */
+struct DynamicDocument
+{
+    std::string contenttype;
+    /* Returns the body. */
+    boost::function0<std::string> callback;
+};
+
+/* A complete HTTP response (status line, headers and body) in one
+   buffer. The buffer is shared by all connections sending it. */
+class HTTPResponse
+{
+    public:
+        SP<const std::string> buffer;
+        /* Offset of the empty line that ends the headers. Connection
+           headers are inserted here when sending. */
+        size_t header_end;
+        /* Offset of the body. */
+        size_t body_start;
+
+        HTTPResponse() { header_end = body_start = 0; };
+
+        /* Builds the response out of a status line ("HTTP/1.1 200 OK"),
+           header lines (each ending in \r\n) and a body. */
+        HTTPResponse(const std::string &status, const std::string &headers, const std::string &body);
+};
+
+/* A file that is sent from the disk rather than from memory. */
+class ServedFile
+{
+    private:
+        /* No copies */
+        ServedFile(const ServedFile &sf) { };
+        ServedFile& operator=(const ServedFile &sf) { return (*this); };
+
+    public:
+        /* Open file descriptor and the size of the file when it was opened. */
+        int fd;
+        trankesbel::ui64 size;
+
+        ServedFile() { fd = -1; size = 0; };
+        ~ServedFile();
+};
 
 class Document
 {
     public:
-        std::string document;    /* The whole document is in this string */
-        std::string contenttype; /* And the contenttype for it */
+        std::string contenttype; /* The contenttype of the document */
+        /* Strong entity tag of the document, with the quotes. */
+        std::string etag;
+
+        /* 200 response with the document as it is, and 304 response for it. */
+        HTTPResponse identity;
+        HTTPResponse identity_not_modified;
+        /* Same with gzip content encoding. 'gzip.buffer' is null
+           if compressing didn't make the document smaller. */
+        std::string gzip_etag;
+        HTTPResponse gzip;
+        HTTPResponse gzip_not_modified;
+
+        /* If set, the body is sent from this file, and the responses
+           above only have the headers. There's no gzip variant. */
+        SP<ServedFile> file;
 
         Document() { };
 
-        Document(const std::string &d, const std::string &ct)
-        {
-            document = d;
-            contenttype = ct;
-        }
+        /* Precomputes the responses for document 'd'. */
+        Document(const std::string &d, const std::string &ct);
+        /* Precomputes the headers for a document sent from file 'f'. */
+        Document(SP<ServedFile> f, const std::string &et, const std::string &ct);
+
+        /* Returns the size of the (uncompressed) body. */
+        trankesbel::ui64 getSize() const;
+};
+
+/* Parses the head of an HTTP request (request line and headers)
+   as the data arrives, without going over the data again. */
+class HTTPRequestParser
+{
+    public:
+        enum State { RequestLine, Headers, Complete, Malformed, TooLarge };
+
+    private:
+        State state;
+        /* The line being read, without the line end. */
+        std::string line;
+        size_t head_size;
+        std::string last_header;
+
+        void parseRequestLine();
+        void parseHeaderLine();
+
+    public:
+        HTTPRequestParser() { reset(); };
+
+        /* Request line parts, e.g. "GET", "/", "HTTP/1.1" */
+        std::string method;
+        std::string target;
+        std::string version;
+        /* Header names are in lower case. */
+        std::map<std::string, std::string> headers;
+
+        /* Gets ready for the next request. */
+        void reset();
+
+        /* Feeds received data to the parser. Returns how many bytes were used;
+           parsing stops at the end of the request head, so any data after it
+           belongs to the next request. */
+        size_t feed(const char* data, size_t len);
+
+        State getState() const { return state; };
+        /* Returns the value of a header (name in lower case) or an empty string. */
+        std::string getHeader(const std::string &name) const;
+};
+
+/* A response queued for sending on a connection. */
+struct HTTPPendingResponse
+{
+    /* Sent in this order: [begin, split) of 'head', 'connection_header',
+       [split, end) of 'head', [body_begin, body_end) of 'body' and
+       [file_begin, file_end) of 'file'. 'body' and 'file' may be null. */
+    SP<const std::string> head;
+    size_t begin;
+    size_t split;
+    size_t end;
+    const char* connection_header;
+    size_t connection_header_size;
+    SP<const std::string> body;
+    size_t body_begin;
+    size_t body_end;
+    SP<ServedFile> file;
+    trankesbel::ui64 file_begin;
+    trankesbel::ui64 file_end;
+    /* How many of these bytes have been sent. */
+    trankesbel::ui64 sent;
+
+    /* Sends all of 'response', or only its headers. */
+    HTTPPendingResponse(const HTTPResponse &response, bool head_only);
+
+    trankesbel::ui64 memorySize() const { return (split - begin) + connection_header_size + (end - split) + (body_end - body_begin); };
+    trankesbel::ui64 size() const { return memorySize() + (file_end - file_begin); };
 };
 
 class HTTPClient
 {
     private:
         SP<trankesbel::Socket> s;
-        std::string request_string;
-        std::string response_string;
+        HTTPRequestParser parser;
+        /* Received data that hasn't gone through the parser yet. */
+        std::string input;
+        size_t input_used;
+        std::deque<HTTPPendingResponse> pending_responses;
         std::string plain_document;
-        trankesbel::ui64 creation_time;
+        trankesbel::ui64 last_activity_time;
         std::map<std::string, Document>* served_content;
+        const HTTPResponse* not_found;
+        std::map<std::string, WebSocketCallback>* websocket_handlers;
+        std::map<std::string, DynamicDocument>* dynamic_content;
+        std::map<std::string, StreamDocument>* stream_handlers;
+        std::map<std::string, UpgradeDocument>* upgrade_handlers;
+        /* Don't read more requests. */
+        bool closing;
+
+        /* Set when the connection is upgraded to WebSocket or handed to a
+           stream handler, once the response headers are sent. */
+        bool upgraded;
+        WebSocketCallback upgrade_callback;
+        std::string upgrade_target;
+        /* For streams, the Last-Event-ID header. */
+        bool upgrade_stream;
+        std::string upgrade_last_event_id;
 
-        bool waiting_for_request;
+        /* Queues the response to a WebSocket upgrade request. Returns false
+           if the request is not one. */
+        bool respondUpgrade(bool http10);
+        /* Same, for upgrades to other protocols. */
+        bool respondProtocolUpgrade(bool http10);
+        /* Queues the headers of a streamed response. Returns false if the
+           request is not for a stream. */
+        bool respondStream(bool http10);
 
         /* No copies */
         HTTPClient(const HTTPClient &hc) { };
         HTTPClient& operator=(const HTTPClient &hc) { return (*this); };
 
+        /* Reads and parses requests. Returns true if it stopped because
+           too many responses are waiting to be sent. */
+        bool readRequests();
+        /* Queues the response for the request in 'parser'. */
+        void respond();
+        /* Queues a 206 or 416 response if the request has a Range header that
+           applies to 'd'. Returns false if the whole document should be sent. */
+        bool respondRange(const Document &d, bool keep_alive, bool http10);
+        void queueResponse(HTTPPendingResponse pr, bool keep_alive, bool http10);
+        /* Sends queued responses. Returns false if the connection was closed. */
+        bool sendPending();
+
     public:
         HTTPClient()
         {
-            creation_time = trankesbel::nanoclock();
-            waiting_for_request = true;
+            last_activity_time = trankesbel::nanoclock();
+            input_used = 0;
+            served_content = (std::map<std::string, Document>*) 0;
+            not_found = (const HTTPResponse*) 0;
+            websocket_handlers = (std::map<std::string, WebSocketCallback>*) 0;
+            dynamic_content = (std::map<std::string, DynamicDocument>*) 0;
+            stream_handlers = (std::map<std::string, StreamDocument>*) 0;
+            upgrade_handlers = (std::map<std::string, UpgradeDocument>*) 0;
+            upgrade_stream = false;
+            closing = false;
+            upgraded = false;
         }
 
         void setPlain(const std::string &p)
         { plain_document = p; };
 
-        void setServedContent(std::map<std::string, Document>* sc)
-        { served_content = sc; };
+        void setServedContent(std::map<std::string, Document>* sc, const HTTPResponse* nf)
+        { served_content = sc; not_found = nf; };
+        void setWebSocketHandlers(std::map<std::string, WebSocketCallback>* wh)
+        { websocket_handlers = wh; };
+        void setDynamicContent(std::map<std::string, DynamicDocument>* dc)
+        { dynamic_content = dc; };
+        void setStreamHandlers(std::map<std::string, StreamDocument>* sh)
+        { stream_handlers = sh; };
+        void setUpgradeHandlers(std::map<std::string, UpgradeDocument>* uh)
+        { upgrade_handlers = uh; };
 
         void setSocket(SP<trankesbel::Socket> sock) { s = sock; };
         SP<trankesbel::Socket> getSocket() { return s; };
 
+        /* Time of connection or the last complete request. The connection
+           is closed if nothing happens for max_nanoseconds_on_request. */
+        trankesbel::ui64 getLastActivityTime() const { return last_activity_time; };
+
+        /* Reads requests and sends the responses, as far as
+           the socket allows without blocking. Requests can be pipelined. */
         void cycle();
+
+        /* Returns true, and what's needed to hand the connection over, if the
+           connection has been upgraded to WebSocket (or is a stream) and the HTTP
+           part is done. 'leftover' is the data received after the request, or for
+           streams, the Last-Event-ID header. The connection is no longer handled
+           by HTTPClient after this. */
+        bool takeUpgrade(WebSocketCallback* callback, std::string* target, std::string* leftover);
 };
 
 }
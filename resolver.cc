@@ -0,0 +1,425 @@
+#include "resolver.hpp"
+#include "nanoclock.hpp"
+#include <boost/bind.hpp>
+
+using namespace trankesbel;
+using namespace boost;
+using namespace std;
+
+/* Defaults for the resolver returned by getInstance(). */
+static const ui32 DEFAULT_RESOLVER_THREADS = 4;
+/* 5 minutes for successful lookups, 30 seconds for failed ones. */
+static const ui64 DEFAULT_RESOLVER_CACHE_TTL = 300000000000ULL;
+static const ui64 DEFAULT_RESOLVER_NEGATIVE_CACHE_TTL = 30000000000ULL;
+/* Maximum number of cached results. */
+static const size_t MAX_RESOLVER_CACHE_SIZE = 10000;
+/* Maximum number of different lookups in progress or waiting for a thread
+   (forward and reverse lookups each), and callbacks waiting for one lookup. Beyond these (e.g. a flood of
+   connections) lookups fail right away instead of queuing. */
+static const size_t MAX_RESOLVER_IN_FLIGHT = 1000;
+static const size_t MAX_RESOLVER_WAITERS = 100;
+
+static Resolver* global_resolver = (Resolver*) 0;
+static boost::once_flag global_resolver_once = BOOST_ONCE_INIT;
+
+static void create_global_resolver()
+{
+    /* Never deleted; resolver threads may still be running at exit. */
+    global_resolver = new Resolver(DEFAULT_RESOLVER_THREADS, DEFAULT_RESOLVER_CACHE_TTL, DEFAULT_RESOLVER_NEGATIVE_CACHE_TTL);
+}
+
+Resolver* Resolver::getInstance()
+{
+    boost::call_once(create_global_resolver, global_resolver_once);
+    return global_resolver;
+}
+
+Resolver::Resolver(ui32 max_threads, ui64 cache_ttl, ui64 negative_cache_ttl)
+{
+    if (max_threads < 1) max_threads = 1;
+    this->max_threads = max_threads;
+    this->cache_ttl = cache_ttl;
+    this->negative_cache_ttl = negative_cache_ttl;
+    threads = 0;
+    idle_threads = 0;
+    reverse_threads = 0;
+    /* Leave one thread for forward lookups, if there's more than one. */
+    max_reverse_threads = (max_threads > 1) ? max_threads - 1 : 1;
+    reverse_in_flight = 0;
+}
+
+Resolver::~Resolver()
+{
+}
+
+static string forward_key(const string &address, const string &service)
+{
+    string key("F");
+    key.append(address);
+    key.push_back('\n');
+    key.append(service);
+    return key;
+}
+
+static string reverse_key(const SocketAddress &address)
+{
+    return string("R") + address.getHumanReadablePlainUTF8WithoutPort();
+}
+
+static void reverse_adapter(bool success, SocketAddress, string host_or_error, Resolver::ReverseResolveCallback callback)
+{
+    callback(success, host_or_error);
+}
+
+void Resolver::static_worker(Resolver* self)
+{
+    self->worker();
+}
+
+bool Resolver::hasWork() const
+{
+    return !forward_queue.empty() || (!reverse_queue.empty() && reverse_threads < max_reverse_threads);
+}
+
+void Resolver::worker()
+{
+    boost::unique_lock<boost::mutex> lock(resolver_mutex);
+    while(true)
+    {
+        while (!hasWork())
+        {
+            ++idle_threads;
+            work_available.wait(lock);
+            --idle_threads;
+        }
+
+        /* Forward lookups first; something is usually waiting to connect. */
+        bool reverse_queued = forward_queue.empty();
+        deque<string> &queue = reverse_queued ? reverse_queue : forward_queue;
+        string key = queue.front();
+        queue.pop_front();
+
+        map<string, Request>::iterator i1 = in_flight.find(key);
+        if (i1 == in_flight.end()) continue;
+
+        bool reverse = i1->second.reverse;
+        string address = i1->second.address;
+        string service = i1->second.service;
+        SocketAddress reverse_address = i1->second.reverse_address;
+        if (reverse) ++reverse_threads;
+        lock.unlock();
+
+        Result result;
+        result.success = false;
+        if (reverse)
+            result.text = reverseResolveNow(reverse_address, &result.success);
+        else
+            result.address = SocketAddress::resolveNow(address, service, &result.success, &result.text);
+
+        finish(key, result);
+        lock.lock();
+        if (reverse)
+        {
+            --reverse_threads;
+            /* An idle thread may be waiting for a reverse lookup slot. */
+            if (!reverse_queue.empty()) work_available.notify_one();
+        }
+    }
+}
+
+void Resolver::eraseCached(map<string, Result>::iterator i)
+{
+    cache_by_expiry.erase(i->second.expiry_entry);
+    cache.erase(i);
+}
+
+void Resolver::pruneCache(ui64 now)
+{
+    /* Expired entries, and if that's not enough, the ones expiring soonest. */
+    while (!cache_by_expiry.empty() &&
+           (cache_by_expiry.begin()->first <= now || cache.size() >= MAX_RESOLVER_CACHE_SIZE))
+    {
+        cache.erase(cache_by_expiry.begin()->second);
+        cache_by_expiry.erase(cache_by_expiry.begin());
+    }
+}
+
+void Resolver::finish(const string &key, const Result &result)
+{
+    vector<Waiter> waiters;
+    function0<void> wakeup;
+    bool queued = false;
+
+    boost::unique_lock<boost::mutex> lock(resolver_mutex);
+
+    ui64 now = nanoclock();
+    map<string, Result>::iterator i3 = cache.find(key);
+    if (i3 != cache.end())
+        eraseCached(i3);
+    if (cache.size() >= MAX_RESOLVER_CACHE_SIZE)
+        pruneCache(now);
+    Result &cached = cache[key];
+    cached = result;
+    cached.expires = now + (result.success ? cache_ttl : negative_cache_ttl);
+    cached.expiry_entry = cache_by_expiry.insert(pair<ui64, string>(cached.expires, key));
+
+    map<string, Request>::iterator i1 = in_flight.find(key);
+    if (i1 != in_flight.end())
+    {
+        waiters.swap(i1->second.waiters);
+        if (i1->second.reverse) --reverse_in_flight;
+        in_flight.erase(i1);
+    }
+
+    vector<Waiter>::iterator i2, waiters_end = waiters.end();
+    for (i2 = waiters.begin(); i2 != waiters_end; ++i2)
+    {
+        if (!i2->through_loop) continue;
+        completed.push_back(boost::bind(i2->callback, result.success, result.address, result.text));
+        queued = true;
+    }
+    wakeup = wakeup_function;
+    lock.unlock();
+
+    /* Callbacks are called without the lock held, so that they can start new lookups. */
+    for (i2 = waiters.begin(); i2 != waiters_end; ++i2)
+        if (!i2->through_loop)
+            i2->callback(result.success, result.address, result.text);
+
+    if (queued && wakeup) wakeup();
+}
+
+void Resolver::deliver(boost::unique_lock<boost::mutex> &lock, const Waiter &waiter, const Result &result)
+{
+    if (waiter.through_loop)
+    {
+        completed.push_back(boost::bind(waiter.callback, result.success, result.address, result.text));
+        function0<void> wakeup = wakeup_function;
+        lock.unlock();
+        if (wakeup) wakeup();
+        return;
+    }
+    lock.unlock();
+    waiter.callback(result.success, result.address, result.text);
+}
+
+void Resolver::submit(const string &key, const Request &request, const Waiter &waiter)
+{
+    boost::unique_lock<boost::mutex> lock(resolver_mutex);
+
+    map<string, Result>::iterator i1 = cache.find(key);
+    if (i1 != cache.end())
+    {
+        if (i1->second.expires > nanoclock())
+        {
+            Result result = i1->second;
+            deliver(lock, waiter, result);
+            return;
+        }
+        eraseCached(i1);
+    }
+
+    Result too_busy;
+    too_busy.success = false;
+    too_busy.text = "Too many name lookups in progress.";
+    too_busy.expires = 0;
+
+    /* Same lookup already going on? Then just wait for that one. */
+    map<string, Request>::iterator i2 = in_flight.find(key);
+    if (i2 != in_flight.end())
+    {
+        if (i2->second.waiters.size() >= MAX_RESOLVER_WAITERS)
+        {
+            deliver(lock, waiter, too_busy);
+            return;
+        }
+        i2->second.waiters.push_back(waiter);
+        return;
+    }
+
+    /* Forward and reverse lookups have separate limits, so a flood of
+       reverse lookups doesn't make forward lookups fail. */
+    size_t same_kind_in_flight = request.reverse ? reverse_in_flight : in_flight.size() - reverse_in_flight;
+    if (same_kind_in_flight >= MAX_RESOLVER_IN_FLIGHT)
+    {
+        deliver(lock, waiter, too_busy);
+        return;
+    }
+
+    Request &r = in_flight[key];
+    r = request;
+    r.waiters.clear();
+    r.waiters.push_back(waiter);
+    if (request.reverse)
+    {
+        ++reverse_in_flight;
+        reverse_queue.push_back(key);
+    }
+    else
+        forward_queue.push_back(key);
+
+    if (forward_queue.size() + reverse_queue.size() > idle_threads && threads < max_threads)
+    {
+        ++threads;
+        boost::thread t(static_worker, this);
+        t.detach();
+    }
+    else
+        work_available.notify_one();
+}
+
+void Resolver::resolve(const string &address, const string &service, ResolveCallback callback)
+{
+    if (!callback) return;
+
+    Waiter w;
+    w.callback = callback;
+    w.through_loop = true;
+
+    /* Plain IP addresses don't need a thread. */
+    bool success = false;
+    SocketAddress sa = SocketAddress::resolvePlainUTF8(address, service, &success, (string*) 0);
+    if (success)
+    {
+        boost::unique_lock<boost::mutex> lock(resolver_mutex);
+        completed.push_back(boost::bind(callback, true, sa, string()));
+        function0<void> wakeup = wakeup_function;
+        lock.unlock();
+        if (wakeup) wakeup();
+        return;
+    }
+
+    Request r;
+    r.reverse = false;
+    r.address = address;
+    r.service = service;
+    submit(forward_key(address, service), r, w);
+}
+
+void Resolver::resolveDirect(const string &address, const string &service, ResolveCallback callback)
+{
+    if (!callback) return;
+
+    bool success = false;
+    SocketAddress sa = SocketAddress::resolvePlainUTF8(address, service, &success, (string*) 0);
+    if (success)
+    {
+        callback(true, sa, string());
+        return;
+    }
+
+    Waiter w;
+    w.callback = callback;
+    w.through_loop = false;
+
+    Request r;
+    r.reverse = false;
+    r.address = address;
+    r.service = service;
+    submit(forward_key(address, service), r, w);
+}
+
+void Resolver::reverseResolve(const SocketAddress &address, ReverseResolveCallback callback)
+{
+    if (!callback) return;
+
+    Waiter w;
+    w.callback = boost::bind(reverse_adapter, _1, _2, _3, callback);
+    w.through_loop = true;
+
+    Request r;
+    r.reverse = true;
+    r.reverse_address = address;
+    submit(reverse_key(address), r, w);
+}
+
+void Resolver::reverseResolveDirect(const SocketAddress &address, ReverseResolveCallback callback)
+{
+    if (!callback) return;
+
+    Waiter w;
+    w.callback = boost::bind(reverse_adapter, _1, _2, _3, callback);
+    w.through_loop = false;
+
+    Request r;
+    r.reverse = true;
+    r.reverse_address = address;
+    submit(reverse_key(address), r, w);
+}
+
+namespace {
+struct BlockingResult
+{
+    boost::mutex m;
+    boost::condition_variable cv;
+    bool done;
+    bool success;
+    SocketAddress address;
+    string text;
+
+    BlockingResult() { done = false; success = false; };
+};
+}
+
+static void blocking_callback(bool success, SocketAddress sa, string text, BlockingResult* br)
+{
+    boost::lock_guard<boost::mutex> lock(br->m);
+    br->success = success;
+    br->address = sa;
+    br->text = text;
+    br->done = true;
+    br->cv.notify_all();
+}
+
+static void blocking_reverse_callback(bool success, string text, BlockingResult* br)
+{
+    blocking_callback(success, SocketAddress(), text, br);
+}
+
+SocketAddress Resolver::resolveBlocking(const string &address, const string &service, bool* success, string* errormsg)
+{
+    BlockingResult br;
+    resolveDirect(address, service, boost::bind(blocking_callback, _1, _2, _3, &br));
+
+    boost::unique_lock<boost::mutex> lock(br.m);
+    while (!br.done)
+        br.cv.wait(lock);
+
+    if (success) (*success) = br.success;
+    if (errormsg) (*errormsg) = br.text;
+    return br.address;
+}
+
+string Resolver::reverseResolveBlocking(const SocketAddress &address, bool* success)
+{
+    BlockingResult br;
+    reverseResolveDirect(address, boost::bind(blocking_reverse_callback, _1, _2, &br));
+
+    boost::unique_lock<boost::mutex> lock(br.m);
+    while (!br.done)
+        br.cv.wait(lock);
+
+    if (success) (*success) = br.success;
+    return br.text;
+}
+
+void Resolver::setWakeUpFunction(function0<void> wakeup_function)
+{
+    boost::lock_guard<boost::mutex> lock(resolver_mutex);
+    this->wakeup_function = wakeup_function;
+}
+
+void Resolver::dispatchCompleted()
+{
+    boost::unique_lock<boost::mutex> lock(resolver_mutex);
+    if (completed.empty()) return;
+
+    deque<function0<void> > callbacks;
+    callbacks.swap(completed);
+    lock.unlock();
+
+    deque<function0<void> >::iterator i1, callbacks_end = callbacks.end();
+    for (i1 = callbacks.begin(); i1 != callbacks_end; ++i1)
+        (*i1)();
+}
+
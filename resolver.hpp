@@ -0,0 +1,151 @@
+/* Asynchronous, caching name resolver.
+
+   Resolves host names to addresses and addresses back to host
+   names in a small pool of threads, instead of a new thread for
+   each lookup. Results (also failures, for a shorter time) are cached,
+   and a lookup for a name that is already being looked up is attached
+   to the one in progress instead of starting another.
+
+   There are two ways to get the results. Callbacks given to resolve() and
+   reverseResolve() are queued, and called when the event loop calls
+   dispatchCompleted(). Set a wake-up function with setWakeUpFunction() so the
+   loop knows when there's something to dispatch. Callbacks given to
+   the *Direct() functions are called right away from a resolver thread
+   (or from the calling thread, if the result was in cache).
+
+   Forward lookups have their own queue, which is served first, and one
+   thread never does reverse lookups, so a flood of connections from
+   addresses whose name servers don't answer doesn't hold up connecting
+   to other servers. The number of lookups waiting is limited (forward and
+   reverse separately); over the limit, lookups fail without being tried. */
+
+#ifndef resolver_hpp
+#define resolver_hpp
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include "types.hpp"
+#include "sockets.hpp"
+
+namespace trankesbel {
+
+class Resolver
+{
+    public:
+        /* Arguments: success, resolved address, error message on failure */
+        typedef boost::function3<void, bool, SocketAddress, std::string> ResolveCallback;
+        /* Arguments: success, host name or error message on failure */
+        typedef boost::function2<void, bool, std::string> ReverseResolveCallback;
+
+    private:
+        struct Result
+        {
+            bool success;
+            SocketAddress address;
+            /* Host name for reverse lookups, error message if not successful. */
+            std::string text;
+            ui64 expires;
+            /* This result in 'cache_by_expiry'. */
+            std::multimap<ui64, std::string>::iterator expiry_entry;
+        };
+        struct Waiter
+        {
+            ResolveCallback callback;
+            bool through_loop;
+        };
+        struct Request
+        {
+            bool reverse;
+            std::string address;
+            std::string service;
+            SocketAddress reverse_address;
+            std::vector<Waiter> waiters;
+        };
+
+        boost::mutex resolver_mutex;
+        boost::condition_variable work_available;
+
+        /* Lookups in progress or waiting for a thread, by cache key. */
+        std::map<std::string, Request> in_flight;
+        /* How many of them are reverse lookups. */
+        size_t reverse_in_flight;
+        /* Keys of lookups waiting for a thread. */
+        std::deque<std::string> forward_queue;
+        std::deque<std::string> reverse_queue;
+        std::map<std::string, Result> cache;
+        /* Keys of 'cache' by the time they expire. */
+        std::multimap<ui64, std::string> cache_by_expiry;
+
+        /* Callbacks waiting for dispatchCompleted(). */
+        std::deque<boost::function0<void> > completed;
+        boost::function0<void> wakeup_function;
+
+        ui32 max_threads;
+        ui32 threads;
+        ui32 idle_threads;
+        /* Threads doing reverse lookups, and how many may. */
+        ui32 reverse_threads;
+        ui32 max_reverse_threads;
+        ui64 cache_ttl;
+        ui64 negative_cache_ttl;
+
+        static void static_worker(Resolver* self);
+        void worker();
+
+        /* Calls or queues the callback of 'waiter' with 'result'. Unlocks 'lock'. */
+        void deliver(boost::unique_lock<boost::mutex> &lock, const Waiter &waiter, const Result &result);
+        /* Looks up cache or starts a lookup for 'request'. If there are
+           too many lookups waiting already, fails right away. */
+        void submit(const std::string &key, const Request &request, const Waiter &waiter);
+        void finish(const std::string &key, const Result &result);
+        void eraseCached(std::map<std::string, Result>::iterator i);
+        void pruneCache(ui64 now);
+        /* True if a worker can take a lookup from the queues. */
+        bool hasWork() const;
+
+        /* No copies */
+        Resolver(const Resolver &r) { };
+        Resolver& operator=(const Resolver &r) { return (*this); };
+
+    public:
+        /* 'max_threads' is the maximum number of lookups in progress at a time.
+           Successful results are cached for 'cache_ttl' nanoseconds and
+           failures for 'negative_cache_ttl' nanoseconds. */
+        Resolver(ui32 max_threads, ui64 cache_ttl, ui64 negative_cache_ttl);
+        /* Threads are not stopped, so don't destroy a resolver that is in use. */
+        ~Resolver();
+
+        /* Returns the resolver used by sockets. It is created on first call
+           and lives until the program exits. */
+        static Resolver* getInstance();
+
+        /* Resolves a host name (or IP address) and service (port).
+           The callback is called from dispatchCompleted(). */
+        void resolve(const std::string &address, const std::string &service, ResolveCallback callback);
+        /* Resolves an address to a host name.
+           The callback is called from dispatchCompleted(). */
+        void reverseResolve(const SocketAddress &address, ReverseResolveCallback callback);
+
+        /* Same as above, but callbacks are called from resolver threads. */
+        void resolveDirect(const std::string &address, const std::string &service, ResolveCallback callback);
+        void reverseResolveDirect(const SocketAddress &address, ReverseResolveCallback callback);
+
+        /* Same as above, but block until the result is ready. */
+        SocketAddress resolveBlocking(const std::string &address, const std::string &service, bool* success, std::string* errormsg);
+        std::string reverseResolveBlocking(const SocketAddress &address, bool* success);
+
+        /* Sets a function that is called (from a resolver thread) when
+           there are callbacks waiting for dispatchCompleted(). Must be thread-safe. */
+        void setWakeUpFunction(boost::function0<void> wakeup_function);
+        /* Calls the callbacks of completed resolve() and reverseResolve() calls. */
+        void dispatchCompleted();
+};
+
+}
+
+#endif
+
@@ -0,0 +1,118 @@
+/* A fixed-capacity byte ring buffer.
+
+   Data is written at the tail and read from the head, and
+   neither moves the data that is already in the buffer. The
+   readable data is at most two contiguous spans of memory
+   (before and after the wrap point), which can be looked at
+   with getReadSpans() without copying. */
+
+#ifndef ring_buffer_hpp
+#define ring_buffer_hpp
+
+#include <cstring>
+#include <vector>
+#include "types.hpp"
+
+namespace trankesbel {
+
+class RingBuffer
+{
+    private:
+        std::vector<char> ring;
+        size_t head;
+        size_t used;
+
+    public:
+        RingBuffer(size_t capacity)
+        {
+            if (capacity < 1) capacity = 1;
+            ring.resize(capacity);
+            head = 0;
+            used = 0;
+        };
+
+        size_t capacity() const { return ring.size(); };
+        size_t size() const { return used; };
+        size_t freeSpace() const { return ring.size() - used; };
+        bool empty() const { return used == 0; };
+        bool full() const { return used == ring.size(); };
+        void clear() { head = 0; used = 0; };
+
+        /* Appends up to 'datasize' bytes. Returns the number of bytes
+           actually appended, which is less if the buffer gets full. */
+        size_t write(const void* data, size_t datasize)
+        {
+            if (datasize > freeSpace()) datasize = freeSpace();
+            if (datasize == 0) return 0;
+
+            size_t tail = (head + used) % ring.size();
+            size_t first = ring.size() - tail;
+            if (first > datasize) first = datasize;
+            memcpy(&ring[tail], data, first);
+            if (datasize > first)
+                memcpy(&ring[0], (const char*) data + first, datasize - first);
+            used += datasize;
+            return datasize;
+        }
+        /* Appends one byte. Returns false if the buffer is full. */
+        bool push(char c)
+        {
+            if (full()) return false;
+            ring[(head + used) % ring.size()] = c;
+            ++used;
+            return true;
+        }
+
+        /* Fills 'spans' with the readable data in order and returns
+           the number of spans filled (0, 1 or 2). The spans are valid
+           until the buffer is next written to. */
+        size_t getReadSpans(DataSpan spans[2]) const
+        {
+            if (used == 0) return 0;
+            size_t first = ring.size() - head;
+            if (first >= used)
+            {
+                spans[0].data = &ring[head];
+                spans[0].size = used;
+                return 1;
+            }
+            spans[0].data = &ring[head];
+            spans[0].size = first;
+            spans[1].data = &ring[0];
+            spans[1].size = used - first;
+            return 2;
+        }
+
+        /* Throws away up to 'datasize' bytes from the head. */
+        size_t consume(size_t datasize)
+        {
+            if (datasize > used) datasize = used;
+            head = (head + datasize) % ring.size();
+            used -= datasize;
+            if (used == 0) head = 0;
+            return datasize;
+        }
+
+        /* Copies up to 'datasize' bytes from the head to 'data' and
+           removes them from the buffer. Returns the number of bytes read. */
+        size_t read(void* data, size_t datasize)
+        {
+            DataSpan spans[2];
+            size_t spans_count = getReadSpans(spans);
+            size_t total = 0;
+            size_t i1;
+            for (i1 = 0; i1 < spans_count && total < datasize; ++i1)
+            {
+                size_t chunk = spans[i1].size;
+                if (chunk > datasize - total) chunk = datasize - total;
+                memcpy((char*) data + total, spans[i1].data, chunk);
+                total += chunk;
+            }
+            return consume(total);
+        }
+};
+
+}
+
+#endif
+
@@ -0,0 +1,49 @@
+#include "send_queue.hpp"
+#include <cassert>
+
+using namespace trankesbel;
+using namespace std;
+
+/* Most buffers given to one sendv() call. */
+#define MAX_SEND_QUEUE_SPANS 16
+
+bool SendQueue::flush(Socket* s)
+{
+    assert(s);
+
+    while (!buffers.empty() && s->active())
+    {
+        DataSpan spans[MAX_SEND_QUEUE_SPANS];
+        size_t spans_count = 0;
+
+        deque<SP<const string> >::iterator i1, buffers_end = buffers.end();
+        for (i1 = buffers.begin(); i1 != buffers_end && spans_count < MAX_SEND_QUEUE_SPANS; ++i1)
+        {
+            size_t skip = (spans_count == 0) ? first_sent : 0;
+            spans[spans_count].data = (*i1)->data() + skip;
+            spans[spans_count].size = (*i1)->size() - skip;
+            ++spans_count;
+        }
+
+        size_t result = s->sendv(spans, spans_count);
+        if (result == 0) break;
+
+        while (result > 0 && !buffers.empty())
+        {
+            size_t left = buffers.front()->size() - first_sent;
+            if (result < left)
+            {
+                first_sent += result;
+                queued_bytes -= result;
+                break;
+            }
+            result -= left;
+            queued_bytes -= left;
+            buffers.pop_front();
+            first_sent = 0;
+        }
+    }
+
+    return buffers.empty();
+}
+
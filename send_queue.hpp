@@ -0,0 +1,50 @@
+/* A queue of shared, immutable buffers waiting to be sent on a socket.
+
+   The same buffer (a WebSocket frame, an event, a link message) can be
+   queued on any number of connections without copying it. flush() gives
+   as many buffers as it can to one Socket::sendv() call and remembers how
+   much of the first buffer has been sent. */
+
+#ifndef send_queue_hpp
+#define send_queue_hpp
+
+#include <string>
+#include <deque>
+#include "types.hpp"
+#include "sockets.hpp"
+
+namespace trankesbel {
+
+class SendQueue
+{
+    private:
+        std::deque<SP<const std::string> > buffers;
+        /* How much of the first buffer is sent. */
+        size_t first_sent;
+        /* Bytes not sent yet. */
+        size_t queued_bytes;
+
+    public:
+        SendQueue() { first_sent = 0; queued_bytes = 0; };
+
+        /* Queues a buffer. Null and empty buffers are ignored. */
+        void push(SP<const std::string> buffer)
+        {
+            if (!buffer || buffer->empty()) return;
+            buffers.push_back(buffer);
+            queued_bytes += buffer->size();
+        };
+
+        bool empty() const { return buffers.empty(); };
+        /* Number of buffers not completely sent. */
+        size_t size() const { return buffers.size(); };
+        size_t getQueuedBytes() const { return queued_bytes; };
+
+        /* Sends as much as 's' takes. Returns true if the queue is empty afterwards. */
+        bool flush(Socket* s);
+};
+
+}
+
+#endif
+
@@ -2,11 +2,21 @@
 #define server_to_server_hpp
 
 #include <string>
+#include <map>
+#include <set>
+#include <vector>
 #include "sockets.hpp"
+#include "configuration_primitives.hpp"
+#include "server_to_server_protocol.hpp"
 
 namespace dfterm
 {
 
+class Slot;
+class SlotMirror;
+class SpectatorFeed;
+class SpectatorServer;
+
 /* Defines a link to another dfterm2 server. 
    This class stores just the information needed.
    ServerToServerLinkSession then maintains the
@@ -18,6 +28,7 @@ class ServerToServerConfigurationPair
         std::string remoteport;
         std::string name;
         trankesbel::ui64 server_timeout;
+        bool relay;
 
     public:
         ServerToServerConfigurationPair();
@@ -26,7 +37,7 @@ class ServerToServerConfigurationPair
         bool unSerialize(const std::string &stscp);
 
         /* Sets the remote server host. The address will be resolved
-           with SocketAddress::resolveUTF8() in a ServerToServerSession. */
+           with Resolver in a ServerToServerSession. */
         void setTargetUTF8(const std::string &remotehost, const std::string &port);
         /* Returns the hostname of the remote server. 
            This is an empty string if not set before. */
@@ -40,16 +51,23 @@ class ServerToServerConfigurationPair
         std::string getNameUTF8() const;
         void getNameUTF8(std::string* name) const;
 
-        /* This is the number of nanoseconds to wait until trying again to connect
-           to another server. It defaults to 120000000000. (120 seconds) */
+        /* This is the longest time, in nanoseconds, to wait until trying again to
+           connect to another server. Tries after failures are first made sooner and
+           the wait grows up to this. It defaults to 120000000000. (120 seconds) */
         void setServerTimeout(trankesbel::ui64 nanoseconds);
         /* And gets the timeout */
         trankesbel::ui64 getServerTimeout() const;
 
+        /* Marks the other server as a relay upstream: slots mirrored from it
+           are exported again to servers that link to this one. Defaults to false. */
+        void setRelay(bool relay);
+        bool isRelay() const;
+
         bool operator<(const ServerToServerConfigurationPair &c_pair) const
         {
             if (name != c_pair.name) return name < c_pair.name;
             if (server_timeout != c_pair.server_timeout) return server_timeout < c_pair.server_timeout;
+            if (relay != c_pair.relay) return relay < c_pair.relay;
             if (remotehostname != c_pair.remotehostname) return remotehostname < c_pair.remotehostname;
             return remoteport < c_pair.remoteport;
         }
@@ -60,7 +78,16 @@ class ServerToServerConfigurationPair
    ServerToServerConfigurationPair. 
    
    You cannot update ServerToServerConfigurationPair in a session
-   once it has been created. */
+   once it has been created. 
+
+   The session links to the HTTP port of the other server and mirrors
+   its exported slots as SlotMirror slots (see server_to_server_protocol.hpp).
+   The mirrors are subscribed to while someone watches them.
+
+   There is no thread; the event loop drives the session. The address is
+   resolved with Resolver, and the connection is made without blocking. Failed
+   tries and closed links are tried again after a wait that grows with each
+   failure, with some randomness so that links don't all retry at once. */
 class ServerToServerSession
 {
     private:
@@ -68,21 +95,59 @@ class ServerToServerSession
         SP<trankesbel::Socket> server_socket;
         trankesbel::SocketAddress server_address;
 
-        /* This class internally uses threads, so we need a mutex. */
+        /* The event loop uses sessions, but they can be queried from other threads. */
         boost::recursive_mutex session_mutex;
 
-        /* The function that will be called when socket goes ready. */
+        /* The function that will be called when there's a new socket. */
         boost::function1<void, SP<trankesbel::Socket> > callback_function;
 
-        /* This thread handles (re)connecting and resolving. */
-        SP<boost::thread> session_thread;
-        /* And this is the function for it */
-        static void static_server_to_server_session(ServerToServerSession* self);
-        void server_to_server_session();
+        enum LinkPhase { Waiting, Resolving, Connecting, Connected };
+        LinkPhase phase;
+        /* When to try next while Waiting, and when to give up the try while
+           Connecting or Connected but not upgraded. */
+        trankesbel::ui64 phase_deadline;
+        /* Failed tries since the link was last up. */
+        trankesbel::ui32 failures;
+
+        /* Resolver calls this with the address. */
+        static void static_resolved(WP<ServerToServerSession> self, bool success, trankesbel::SocketAddress sa, std::string errormsg);
+        void resolved(bool success, const trankesbel::SocketAddress &sa, const std::string &errormsg);
+        void startResolving();
+        /* Closes the link, if any, and waits before trying again.
+           Returns the number of nanoseconds to wait. */
+        trankesbel::ui64 scheduleRetry();
 
-        bool broken; /* Used when thread creation fails or some other unrecoverable error occurs. */
+        bool broken; /* Set when the session can never connect. */
         bool connection_ready; /* Set to true, when sending and receiving data through the session is ok. */
 
+        /* Set after the HTTP upgrade request is sent, and the response
+           received so far. 'connection' carries the link messages. */
+        bool upgrade_sent;
+        bool upgraded;
+        std::string upgrade_response;
+        SP<ServerToServerConnection> connection;
+
+        /* Mirrors of the exported slots, by the slot number of the other server. */
+        std::map<trankesbel::ui32, SP<SlotMirror> > mirrors;
+        /* Subscribed slots, and since when they have not been watched (0 if they are). */
+        std::map<trankesbel::ui32, trankesbel::ui64> subscriptions;
+        /* Permissions of the mirrors: anyone can watch, nobody can play or close. */
+        SP<SlotProfile> mirror_profile;
+        /* Called with new mirrors. */
+        boost::function1<void, SP<Slot> > mirror_callback;
+
+        /* Handles one message from the other server. */
+        void handleMessage(const std::string &message);
+        void handleSlots(const std::string &message);
+        /* Subscribed slots that have been asked for a keyframe since the last one. */
+        std::set<trankesbel::ui32> keyframe_requests;
+
+        /* Reads the response to the upgrade request, and appends messages that came
+           after it to 'messages'. Returns false if it's not complete yet. */
+        bool readUpgradeResponse(std::vector<std::string>* messages);
+        /* Marks all mirrors dead, when the link closes. */
+        void closeMirrors();
+
         WP<ServerToServerSession> self;
 
         ServerToServerSession() { };
@@ -96,10 +161,10 @@ class ServerToServerSession
 
         /* Creates a new session. 
            You can set a callback here that will be called
-           when the server session becomes ready. The
+           when the session starts connecting. The
            argument will be the socket object associated with the 
            session. (So you can drop it to SocketEvents when called).
-           Note that the callback is called from another thread.
+           The callback is called from checkTimers() or Resolver::dispatchCompleted().
          */
         static SP<ServerToServerSession> create(const ServerToServerConfigurationPair &pair,
                                                 boost::function1<void, SP<trankesbel::Socket> > callback_function);
@@ -110,19 +175,129 @@ class ServerToServerSession
         ~ServerToServerSession();
 
         /* Returns true if some unrecoverable error has occursed in the session. 
-           Currently happens only if has not been possible to create a thread for
-           resolving address. */
+           Currently happens only if there is no hostname to connect to. */
         bool isBroken();
 
         /* Returns true if connection has been established. */
         bool isConnectionReady();
 
         /* Returns the socket class used by session. You can put it in SocketEvents
-           to know when to call ServerToServerSession::read() or ServerToServerSession::write().
-           Returns a null reference if session is not ready. */
+           to know when to call ServerToServerSession::cycle().
+           Returns a null reference if session is not connecting or connected. */
         SP<trankesbel::Socket> getSocket();
 
+        /* Sets the function that is called with new mirrored slots. They should
+           be added to the slots of the state. */
+        void setMirrorCallback(boost::function1<void, SP<Slot> > mirror_callback);
+
+        /* Subscribes to the mirrors in 'watched' and unsubscribes from the ones that
+           haven't been watched for a while. Call this every now and then. */
+        void updateSubscriptions(const std::set<const Slot*> &watched);
+
+        /* Handles the link. Call this when there's an event on the socket. */
         void cycle();
+
+        /* Starts the next try to connect, or gives up a try that takes too long,
+           if it is time. Returns the number of nanoseconds until this should
+           be called again. Call this from the event loop. */
+        trankesbel::ui64 checkTimers();
+};
+
+/* One linked server, receiving slots of this server. */
+class ServerToServerExportLink
+{
+    private:
+        SP<ServerToServerConnection> connection;
+
+        struct Subscription
+        {
+            /* Last generation sent. */
+            trankesbel::ui32 sent_generation;
+            /* Set when a frame was skipped; a keyframe is sent when the link catches up. */
+            bool behind;
+        };
+        std::map<trankesbel::ui32, Subscription> subscriptions;
+
+        /* No copies */
+        ServerToServerExportLink(const ServerToServerExportLink &stsel) { };
+        ServerToServerExportLink& operator=(const ServerToServerExportLink &stsel) { return (*this); };
+
+        friend class ServerToServerExporter;
+
+    public:
+        ServerToServerExportLink(SP<trankesbel::Socket> s) { connection = SP<ServerToServerConnection>(new ServerToServerConnection(s)); };
+
+        SP<trankesbel::Socket> getSocket() const { return connection->getSocket(); };
+};
+
+/* Exports the slots of this server to linked servers. Each screen change is
+   encoded once, using the feeds of SpectatorServer, and the same message is
+   sent on every link. Mirrors can be exported too (relayed); their frames are
+   sent on as they were received. Not thread-safe; State calls this with its cycle
+   mutex locked. */
+class ServerToServerExporter
+{
+    private:
+        SpectatorServer* spectator_server;
+        std::map<SP<trankesbel::Socket>, SP<ServerToServerExportLink> > links;
+
+        struct ExportedSlot
+        {
+            WP<Slot> slot;
+            /* The feed, while some link is subscribed. */
+            SP<SpectatorFeed> feed;
+            size_t subscribers;
+            /* Messages of the current generation of the feed, made when first needed. */
+            trankesbel::ui32 message_generation;
+            SP<const std::string> delta_message;
+            SP<const std::string> keyframe_message;
+        };
+        /* Exported slots by slot number, and slot numbers by slot. */
+        std::map<trankesbel::ui32, ExportedSlot> exported;
+        std::map<const Slot*, trankesbel::ui32> slot_numbers;
+        trankesbel::ui32 next_slot_number;
+        SP<const std::string> slots_message;
+
+        /* No copies */
+        ServerToServerExporter(const ServerToServerExporter &stse) { };
+        ServerToServerExporter& operator=(const ServerToServerExporter &stse) { return (*this); };
+
+        /* Makes a LinkFrame message of 'frame', a payload of the feed. */
+        SP<const std::string> makeFrameMessage(trankesbel::ui32 slot_number, ExportedSlot &es, SP<const std::string> frame);
+        SP<const std::string> getKeyframeMessage(trankesbel::ui32 slot_number, ExportedSlot &es);
+        SP<const std::string> getDeltaMessage(trankesbel::ui32 slot_number, ExportedSlot &es);
+
+        void handleMessage(SP<ServerToServerExportLink> link, const std::string &message);
+        void unsubscribe(SP<ServerToServerExportLink> link, trankesbel::ui32 slot_number);
+        /* Sends keyframes to subscriptions that are behind, if the link has caught up. */
+        void catchUp(SP<ServerToServerExportLink> link);
+        /* Reads messages and sends what's queued. Forgets the link if it closed. */
+        void cycleLink(SP<ServerToServerExportLink> link, const std::string &leftover);
+
+    public:
+        ServerToServerExporter();
+
+        /* Sets the server whose feeds are used. Must be called before anything else. */
+        void setSpectatorServer(SpectatorServer* spectator_server) { this->spectator_server = spectator_server; };
+
+        /* Sets the slots that are exported. Called when slots or their permissions change. */
+        void setSlots(const std::vector<SP<Slot> > &slots);
+
+        /* Starts exporting to the upgraded connection 's'. 'leftover' is data that
+           was received after the HTTP upgrade request. */
+        bool addLink(SP<trankesbel::Socket> s, const std::string &leftover);
+
+        /* Handles an event on socket 's'. Returns false if it's not a link's socket. */
+        bool socketEvent(SP<trankesbel::Socket> s);
+
+        /* Called when 'feed' has a new frame. */
+        void frameReady(SP<SpectatorFeed> feed);
+
+        /* Returns the slots some link is subscribed to. Mirrors among them
+           must stay subscribed to, for relaying. */
+        std::vector<SP<Slot> > getSubscribedSlots() const;
+
+        size_t getNumberOfLinks() const { return links.size(); };
 };
 
 
@@ -9,6 +9,7 @@ ServerToServerConfigurationPair::ServerToServerConfigurationPair()
 {
     remoteport = "0";
     server_timeout = 120000000000ULL;
+    relay = false;
 }
 
 void ServerToServerConfigurationPair::setTargetUTF8(const std::string &remotehost, const std::string &port)
@@ -37,6 +38,16 @@ ui64 ServerToServerConfigurationPair::getServerTimeout() const
     return server_timeout;
 }
 
+void ServerToServerConfigurationPair::setRelay(bool relay)
+{
+    this->relay = relay;
+}
+
+bool ServerToServerConfigurationPair::isRelay() const
+{
+    return relay;
+}
+
 void ServerToServerConfigurationPair::setNameUTF8(const std::string &name)
 {
     this->name = name;
@@ -55,7 +66,7 @@ void ServerToServerConfigurationPair::getNameUTF8(std::string* name) const
 
 std::string ServerToServerConfigurationPair::serialize() const
 {
-    return marshalString(name) + marshalString(remoteport) + marshalString(remotehostname) + marshalUnsignedInteger64(server_timeout);
+    return marshalString(name) + marshalString(remoteport) + marshalString(remotehostname) + marshalUnsignedInteger64(server_timeout) + marshalUnsignedInteger32(relay ? 1 : 0);
 }
 
 bool ServerToServerConfigurationPair::unSerialize(const std::string &stscp)
@@ -75,6 +86,16 @@ bool ServerToServerConfigurationPair::unSerialize(const std::string &stscp)
 
     server_timeout = unMarshalUnsignedInteger64(stscp, cursor, &consumed);
     if (consumed == 0) return false;
+    cursor += consumed;
+
+    /* Links saved before relays existed end here. */
+    relay = false;
+    if (cursor < stscp.size())
+    {
+        ui32 relay_flag = unMarshalUnsignedInteger32(stscp, cursor, &consumed);
+        if (consumed == 0) return false;
+        relay = (relay_flag != 0);
+    }
 
     return true;
 }
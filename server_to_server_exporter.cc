@@ -0,0 +1,350 @@
+#include "server_to_server.hpp"
+#include "spectator.hpp"
+#include "slot.hpp"
+#include "slot_mirror.hpp"
+#include "logger.hpp"
+#include "marshal.hpp"
+#include "dfterm2_limits.hpp"
+#include "nanoclock.hpp"
+#include <cassert>
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace std;
+
+/* Links with this many bytes waiting to be sent get no more deltas;
+   they get keyframes when they have caught up. */
+static const size_t MAX_SERVER_TO_SERVER_LINK_QUEUE = 262144;
+
+ServerToServerExporter::ServerToServerExporter()
+{
+    spectator_server = (SpectatorServer*) 0;
+    next_slot_number = 1;
+    slots_message = ServerToServerConnection::makeMessage(LinkSlots, string());
+}
+
+void ServerToServerExporter::setSlots(const vector<SP<Slot> > &slots)
+{
+    assert(spectator_server);
+
+    set<ui32> listed;
+    string body;
+    vector<SP<Slot> >::const_iterator i1, slots_end = slots.end();
+    for (i1 = slots.begin(); i1 != slots_end; ++i1)
+    {
+        if (!(*i1)) continue;
+
+        /* A new slot can be at the address of a gone one, so check it's the same slot. */
+        ui32 number = 0;
+        map<const Slot*, ui32>::iterator i2 = slot_numbers.find(i1->get());
+        if (i2 != slot_numbers.end() && exported[i2->second].slot.lock() == (*i1))
+            number = i2->second;
+        else
+        {
+            number = next_slot_number++;
+            slot_numbers[i1->get()] = number;
+            ExportedSlot &es = exported[number];
+            es.slot = (*i1);
+            es.subscribers = 0;
+            es.message_generation = 0;
+        }
+        listed.insert(number);
+
+        ui32 hops = 0;
+        if ((*i1)->isMirror())
+            hops = boost::static_pointer_cast<SlotMirror>(*i1)->getHops();
+
+        string name = (*i1)->getNameUTF8();
+        if (name.size() > 0xFFFF) name.resize(0xFFFF);
+        appendLittleEndian32(&body, number);
+        body.push_back((char) hops);
+        appendLittleEndian16(&body, (ui32) name.size());
+        body.append(name);
+    }
+
+    /* Forget slots that are not exported anymore. Links forget
+       them when they get the new list. */
+    map<ui32, ExportedSlot>::iterator i3 = exported.begin();
+    while (i3 != exported.end())
+    {
+        if (listed.find(i3->first) != listed.end()) { ++i3; continue; };
+
+        map<SP<Socket>, SP<ServerToServerExportLink> >::iterator i4, links_end = links.end();
+        for (i4 = links.begin(); i4 != links_end; ++i4)
+            i4->second->subscriptions.erase(i3->first);
+        if (i3->second.feed)
+            spectator_server->unlinkFeed(i3->second.feed);
+
+        map<const Slot*, ui32>::iterator i5 = slot_numbers.begin();
+        while (i5 != slot_numbers.end())
+        {
+            if (i5->second == i3->first)
+                slot_numbers.erase(i5++);
+            else
+                ++i5;
+        }
+        exported.erase(i3++);
+    }
+
+    if (slots_message->compare(5, string::npos, body) == 0) return;
+    slots_message = ServerToServerConnection::makeMessage(LinkSlots, body);
+
+    vector<SP<ServerToServerExportLink> > to_send;
+    map<SP<Socket>, SP<ServerToServerExportLink> >::iterator i6, links_end = links.end();
+    for (i6 = links.begin(); i6 != links_end; ++i6)
+        to_send.push_back(i6->second);
+
+    vector<SP<ServerToServerExportLink> >::iterator i7, to_send_end = to_send.end();
+    for (i7 = to_send.begin(); i7 != to_send_end; ++i7)
+    {
+        (*i7)->connection->queue(slots_message);
+        cycleLink(*i7, string());
+    }
+}
+
+SP<const string> ServerToServerExporter::makeFrameMessage(ui32 slot_number, ExportedSlot &es, SP<const string> frame)
+{
+    /* Frames of relayed mirrors are passed on as they were received.
+       Frames made here (all frames of slots of this server) are encoded. */
+    vector<ui64> stamps;
+    SP<const string> encoded_frame;
+    SP<Slot> slot = es.slot.lock();
+    if (slot && slot->isMirror())
+    {
+        SP<const string> received_frame;
+        boost::static_pointer_cast<SlotMirror>(slot)->getLastFrame(&received_frame, &encoded_frame, &stamps);
+        if (received_frame != frame)
+            encoded_frame.reset();
+    }
+    if (!encoded_frame)
+        encoded_frame = ServerToServerConnection::encodeFrame(*frame);
+
+    /* The other server could send any number of stamps; keep the first
+       one (from the server of the slot) and the latest ones. */
+    if (stamps.size() > MAX_SERVER_TO_SERVER_HOPS)
+        stamps.erase(stamps.begin() + 1, stamps.end() - MAX_SERVER_TO_SERVER_HOPS);
+    stamps.push_back(nanoclock());
+
+    return ServerToServerConnection::makeFrameMessage(slot_number, stamps, *encoded_frame);
+}
+
+SP<const string> ServerToServerExporter::getKeyframeMessage(ui32 slot_number, ExportedSlot &es)
+{
+    assert(es.feed);
+    if (es.message_generation != es.feed->getGeneration())
+    {
+        es.message_generation = es.feed->getGeneration();
+        es.delta_message.reset();
+        es.keyframe_message.reset();
+    }
+    if (!es.keyframe_message)
+        es.keyframe_message = makeFrameMessage(slot_number, es, es.feed->getKeyframePayload());
+    return es.keyframe_message;
+}
+
+SP<const string> ServerToServerExporter::getDeltaMessage(ui32 slot_number, ExportedSlot &es)
+{
+    assert(es.feed);
+    if (es.message_generation != es.feed->getGeneration())
+    {
+        es.message_generation = es.feed->getGeneration();
+        es.delta_message.reset();
+        es.keyframe_message.reset();
+    }
+    if (!es.delta_message)
+        es.delta_message = makeFrameMessage(slot_number, es, es.feed->getDeltaPayload());
+    return es.delta_message;
+}
+
+bool ServerToServerExporter::addLink(SP<Socket> s, const string &leftover)
+{
+    assert(s);
+
+    if (links.size() >= MAX_SERVER_TO_SERVER_LINKS)
+    {
+        LOG(Note, "Server-to-server link from " << s->getAddress().getHumanReadablePlainUTF8() << " closed, as maximum number (" << MAX_SERVER_TO_SERVER_LINKS << ") of server-to-server links has been reached.");
+        s->close();
+        return false;
+    }
+
+    SP<ServerToServerExportLink> link(new ServerToServerExportLink(s));
+    links[s] = link;
+    LOG(Note, "Server-to-server link from " << s->getAddress().getHumanReadablePlainUTF8() << " is receiving slots.");
+
+    link->connection->queue(slots_message);
+    cycleLink(link, leftover);
+    return s->active();
+}
+
+bool ServerToServerExporter::socketEvent(SP<Socket> s)
+{
+    map<SP<Socket>, SP<ServerToServerExportLink> >::iterator i1 = links.find(s);
+    if (i1 == links.end()) return false;
+
+    cycleLink(i1->second, string());
+    return true;
+}
+
+void ServerToServerExporter::cycleLink(SP<ServerToServerExportLink> link, const string &leftover)
+{
+    vector<string> messages;
+    if (!leftover.empty())
+        link->connection->feedInput(leftover, &messages);
+    link->connection->readMessages(&messages);
+
+    vector<string>::iterator i1, messages_end = messages.end();
+    for (i1 = messages.begin(); i1 != messages_end; ++i1)
+        handleMessage(link, *i1);
+
+    link->connection->flush();
+    catchUp(link);
+
+    if (link->connection->isActive()) return;
+
+    vector<ui32> subscribed;
+    map<ui32, ServerToServerExportLink::Subscription>::iterator i2, subscriptions_end = link->subscriptions.end();
+    for (i2 = link->subscriptions.begin(); i2 != subscriptions_end; ++i2)
+        subscribed.push_back(i2->first);
+    vector<ui32>::iterator i3, subscribed_end = subscribed.end();
+    for (i3 = subscribed.begin(); i3 != subscribed_end; ++i3)
+        unsubscribe(link, *i3);
+
+    LOG(Note, "Server-to-server link from " << link->getSocket()->getAddress().getHumanReadablePlainUTF8() << " has closed.");
+    links.erase(link->getSocket());
+}
+
+void ServerToServerExporter::handleMessage(SP<ServerToServerExportLink> link, const string &message)
+{
+    ui32 slot_number;
+    if (!ServerToServerConnection::readSlotMessage(message, &slot_number))
+        return;
+
+    if (message[0] == LinkSubscribe)
+    {
+        map<ui32, ExportedSlot>::iterator i1 = exported.find(slot_number);
+        if (i1 == exported.end()) return;
+        if (link->subscriptions.find(slot_number) != link->subscriptions.end()) return;
+
+        ExportedSlot &es = i1->second;
+        if (es.subscribers == 0)
+        {
+            SP<Slot> slot = es.slot.lock();
+            if (!slot) return;
+            es.feed = spectator_server->linkFeed(slot);
+        }
+        ++es.subscribers;
+
+        ServerToServerExportLink::Subscription &sub = link->subscriptions[slot_number];
+        sub.sent_generation = 0;
+        sub.behind = true;
+    }
+    else if (message[0] == LinkUnsubscribe)
+        unsubscribe(link, slot_number);
+    else if (message[0] == LinkKeyframeRequest)
+    {
+        map<ui32, ServerToServerExportLink::Subscription>::iterator i2 = link->subscriptions.find(slot_number);
+        if (i2 == link->subscriptions.end()) return;
+        i2->second.sent_generation = 0;
+        i2->second.behind = true;
+    }
+}
+
+void ServerToServerExporter::unsubscribe(SP<ServerToServerExportLink> link, ui32 slot_number)
+{
+    if (link->subscriptions.erase(slot_number) == 0) return;
+
+    map<ui32, ExportedSlot>::iterator i1 = exported.find(slot_number);
+    if (i1 == exported.end()) return;
+
+    ExportedSlot &es = i1->second;
+    assert(es.subscribers > 0);
+    if (--es.subscribers > 0) return;
+
+    spectator_server->unlinkFeed(es.feed);
+    es.feed.reset();
+    es.delta_message.reset();
+    es.keyframe_message.reset();
+    es.message_generation = 0;
+}
+
+void ServerToServerExporter::catchUp(SP<ServerToServerExportLink> link)
+{
+    if (!link->connection->isActive()) return;
+
+    map<ui32, ServerToServerExportLink::Subscription>::iterator i1, subscriptions_end = link->subscriptions.end();
+    for (i1 = link->subscriptions.begin(); i1 != subscriptions_end; ++i1)
+    {
+        if (link->connection->getQueuedBytes() >= MAX_SERVER_TO_SERVER_LINK_QUEUE) break;
+
+        ServerToServerExportLink::Subscription &sub = i1->second;
+        if (!sub.behind) continue;
+
+        map<ui32, ExportedSlot>::iterator i2 = exported.find(i1->first);
+        if (i2 == exported.end()) continue;
+        ExportedSlot &es = i2->second;
+        if (!es.feed || es.feed->getGeneration() == 0) continue;
+
+        if (sub.sent_generation != es.feed->getGeneration())
+        {
+            link->connection->queue(getKeyframeMessage(i1->first, es));
+            sub.sent_generation = es.feed->getGeneration();
+        }
+        sub.behind = false;
+    }
+    link->connection->flush();
+}
+
+vector<SP<Slot> > ServerToServerExporter::getSubscribedSlots() const
+{
+    vector<SP<Slot> > result;
+    map<ui32, ExportedSlot>::const_iterator i1, exported_end = exported.end();
+    for (i1 = exported.begin(); i1 != exported_end; ++i1)
+    {
+        if (i1->second.subscribers == 0) continue;
+        SP<Slot> slot = i1->second.slot.lock();
+        if (slot) result.push_back(slot);
+    }
+    return result;
+}
+
+void ServerToServerExporter::frameReady(SP<SpectatorFeed> feed)
+{
+    assert(feed);
+
+    map<const Slot*, ui32>::iterator i1 = slot_numbers.find(feed->getSlot().lock().get());
+    if (i1 == slot_numbers.end()) return;
+    ui32 slot_number = i1->second;
+    ExportedSlot &es = exported[slot_number];
+    if (es.feed != feed) return;
+
+    ui32 generation = feed->getGeneration();
+
+    vector<SP<ServerToServerExportLink> > closed;
+    map<SP<Socket>, SP<ServerToServerExportLink> >::iterator i2, links_end = links.end();
+    for (i2 = links.begin(); i2 != links_end; ++i2)
+    {
+        SP<ServerToServerExportLink> link = i2->second;
+        map<ui32, ServerToServerExportLink::Subscription>::iterator i3 = link->subscriptions.find(slot_number);
+        if (i3 == link->subscriptions.end()) continue;
+
+        ServerToServerExportLink::Subscription &sub = i3->second;
+        if (!sub.behind && sub.sent_generation != 0 && sub.sent_generation == generation - 1 &&
+            link->connection->getQueuedBytes() < MAX_SERVER_TO_SERVER_LINK_QUEUE)
+        {
+            link->connection->queue(getDeltaMessage(slot_number, es));
+            sub.sent_generation = generation;
+        }
+        else
+            sub.behind = true;
+
+        link->connection->flush();
+        catchUp(link);
+        if (!link->connection->isActive())
+            closed.push_back(link);
+    }
+
+    vector<SP<ServerToServerExportLink> >::iterator i4, closed_end = closed.end();
+    for (i4 = closed.begin(); i4 != closed_end; ++i4)
+        cycleLink(*i4, string());
+}
+
@@ -0,0 +1,181 @@
+#include "server_to_server_protocol.hpp"
+#include "logger.hpp"
+#include "marshal.hpp"
+#include <zlib.h>
+#include <cassert>
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace std;
+
+/* Largest message that is accepted. A keyframe of the largest captured
+   screen (1000x1000 cells that are all different) fits in this. */
+static const ui32 MAX_SERVER_TO_SERVER_MESSAGE = 8000000;
+/* Frames smaller than this are not worth compressing. */
+static const size_t SERVER_TO_SERVER_COMPRESS_THRESHOLD = 256;
+
+ServerToServerConnection::ServerToServerConnection(SP<Socket> s)
+{
+    assert(s);
+    this->s = s;
+}
+
+SP<const string> ServerToServerConnection::makeMessage(ui8 type, const string &body)
+{
+    string message;
+    message.reserve(body.size() + 5);
+    appendLittleEndian32(&message, (ui32) body.size() + 1);
+    message.push_back((char) type);
+    message.append(body);
+    return SP<const string>(new string(message));
+}
+
+SP<const string> ServerToServerConnection::makeSlotMessage(ui8 type, ui32 slot_number)
+{
+    string body;
+    appendLittleEndian32(&body, slot_number);
+    return makeMessage(type, body);
+}
+
+SP<const string> ServerToServerConnection::encodeFrame(const string &frame)
+{
+    if (frame.size() >= SERVER_TO_SERVER_COMPRESS_THRESHOLD)
+    {
+        uLongf compressed_size = compressBound(frame.size());
+        string compressed(compressed_size, '\0');
+        if (compress2((Bytef*) &compressed[0], &compressed_size, (const Bytef*) frame.data(), frame.size(), Z_DEFAULT_COMPRESSION) == Z_OK &&
+            compressed_size + 4 < frame.size())
+        {
+            string encoded;
+            encoded.reserve(compressed_size + 5);
+            encoded.push_back((char) 1);
+            appendLittleEndian32(&encoded, (ui32) frame.size());
+            encoded.append(compressed, 0, compressed_size);
+            return SP<const string>(new string(encoded));
+        }
+    }
+
+    string encoded;
+    encoded.reserve(frame.size() + 1);
+    encoded.push_back((char) 0);
+    encoded.append(frame);
+    return SP<const string>(new string(encoded));
+}
+
+bool ServerToServerConnection::decodeFrame(const string &encoded_frame, string* frame)
+{
+    assert(frame);
+    if (encoded_frame.size() < 1) return false;
+
+    if (encoded_frame[0] == 0)
+    {
+        frame->assign(encoded_frame, 1, string::npos);
+        return true;
+    }
+    if (encoded_frame[0] != 1 || encoded_frame.size() < 5) return false;
+
+    uLongf size = readLittleEndian32(encoded_frame.data() + 1);
+    if (size > MAX_SERVER_TO_SERVER_MESSAGE) return false;
+    frame->assign(size, '\0');
+    if (size == 0) return true;
+    if (uncompress((Bytef*) &(*frame)[0], &size, (const Bytef*) encoded_frame.data() + 5, encoded_frame.size() - 5) != Z_OK)
+        return false;
+    frame->resize(size);
+    return true;
+}
+
+SP<const string> ServerToServerConnection::makeFrameMessage(ui32 slot_number, const vector<ui64> &stamps, const string &encoded_frame)
+{
+    assert(stamps.size() <= 0xFF);
+
+    string body;
+    body.reserve(encoded_frame.size() + stamps.size() * 8 + 5);
+    appendLittleEndian32(&body, slot_number);
+    body.push_back((char) stamps.size());
+    vector<ui64>::const_iterator i1, stamps_end = stamps.end();
+    for (i1 = stamps.begin(); i1 != stamps_end; ++i1)
+    {
+        appendLittleEndian32(&body, (ui32) (*i1));
+        appendLittleEndian32(&body, (ui32) ((*i1) >> 32));
+    }
+    body.append(encoded_frame);
+    return makeMessage(LinkFrame, body);
+}
+
+bool ServerToServerConnection::readSlotMessage(const string &message, ui32* slot_number)
+{
+    assert(slot_number);
+    if (message.size() < 5) return false;
+    (*slot_number) = readLittleEndian32(message.data() + 1);
+    return true;
+}
+
+bool ServerToServerConnection::readFrameMessage(const string &message, ui32* slot_number, vector<ui64>* stamps, string* encoded_frame)
+{
+    assert(slot_number && stamps && encoded_frame);
+    if (message.size() < 6) return false;
+    (*slot_number) = readLittleEndian32(message.data() + 1);
+
+    size_t stamps_count = (unsigned char) message[5];
+    if (message.size() - 6 < stamps_count * 8 + 1) return false;
+    stamps->clear();
+    size_t i1;
+    for (i1 = 0; i1 < stamps_count; ++i1)
+        stamps->push_back((ui64) readLittleEndian32(message.data() + 6 + i1 * 8) | ((ui64) readLittleEndian32(message.data() + 10 + i1 * 8) << 32));
+
+    encoded_frame->assign(message, 6 + stamps_count * 8, string::npos);
+    return true;
+}
+
+void ServerToServerConnection::queue(SP<const string> message)
+{
+    output.push(message);
+}
+
+void ServerToServerConnection::flush()
+{
+    output.flush(s.get());
+}
+
+void ServerToServerConnection::parseInput(vector<string>* messages)
+{
+    size_t used = 0;
+    while (input.size() - used >= 4)
+    {
+        ui32 length = readLittleEndian32(input.data() + used);
+        if (length == 0 || length > MAX_SERVER_TO_SERVER_MESSAGE)
+        {
+            LOG(Error, "Server-to-server link with " << s->getAddress().getHumanReadablePlainUTF8() << " sent a message of " << length << " bytes. Closing the link.");
+            s->close();
+            input.clear();
+            return;
+        }
+        if (input.size() - used - 4 < length) break;
+
+        messages->push_back(input.substr(used + 4, length));
+        used += 4 + length;
+    }
+    input.erase(0, used);
+}
+
+void ServerToServerConnection::readMessages(vector<string>* messages)
+{
+    assert(messages);
+
+    char buf[16384];
+    size_t result;
+    while (s->active() && (result = s->recv(buf, 16384)) > 0)
+    {
+        input.append(buf, result);
+        parseInput(messages);
+    }
+}
+
+void ServerToServerConnection::feedInput(const string &data, vector<string>* messages)
+{
+    assert(messages);
+
+    input.append(data);
+    parseInput(messages);
+}
+
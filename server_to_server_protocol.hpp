@@ -0,0 +1,130 @@
+/*
+
+Protocol of server-to-server links, used to mirror slots of one dfterm2
+server on another. The linking server connects to the HTTP port of the
+other server and upgrades the connection:
+
+    GET /link HTTP/1.1
+    Host: (host)
+    Connection: Upgrade
+    Upgrade: dfterm2-link
+
+After the 101 response both ends send messages. A message is the length
+of the rest of the message (u32), a type (u8) and a body. Numbers are
+little endian.
+
+The linked server exports the slots anyone may watch without logging in
+(the same ones spectators can watch). It tells their names, and the
+linking server subscribes to the slots someone is watching there. Screens
+are sent as the keyframes and deltas of the spectator protocol (see
+spectator.hpp); they are encoded once per change and the same message is
+sent on every link.
+
+A server can relay the slots it mirrors from a link that is marked as a
+relay upstream, so that slots spread through a tree of servers. A relay
+passes the frames on as it got them, byte for byte, and only adds a time
+stamp. It makes a keyframe itself when a link or a viewer needs one.
+
+Exporting server to linking server:
+  1 (u8), slots
+     The exported slots. A slot is a slot number (u32), the number of
+     links the slot has come through before this one (u8, 0 for slots of
+     the server itself), the length of its name (u16) and the name (UTF-8).
+     Sent first and whenever the slots change; slots that are not in the
+     list are gone.
+  2 (u8), slot number (u32), number of stamps (u8), stamps, compression (u8), frame
+     A keyframe or a delta of a subscribed slot. Stamps (u64) are the times
+     (nanoclock(), nanoseconds since 1970) at which each server on the way
+     sent the frame, starting from the server of the slot. If compression
+     is 1, the frame is compressed with zlib and preceded by its size (u32).
+     Otherwise compression is 0.
+
+Linking server to exporting server:
+  1 (u8), slot number (u32)     Subscribes to a slot. A keyframe comes first.
+  2 (u8), slot number (u32)     Unsubscribes.
+  3 (u8), slot number (u32)     Asks for a keyframe, for example after a
+                                delta that didn't follow the previous frame.
+
+*/
+
+#ifndef server_to_server_protocol_hpp
+#define server_to_server_protocol_hpp
+
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "sockets.hpp"
+#include "send_queue.hpp"
+
+namespace dfterm
+{
+
+/* The Upgrade token and the request target of links. */
+const char* const SERVER_TO_SERVER_PROTOCOL = "dfterm2-link";
+const char* const SERVER_TO_SERVER_TARGET = "/link";
+
+enum ServerToServerExportMessage { LinkSlots = 1, LinkFrame = 2 };
+enum ServerToServerMirrorMessage { LinkSubscribe = 1, LinkUnsubscribe = 2, LinkKeyframeRequest = 3 };
+
+/* One end of a link, after the HTTP upgrade. Frames messages and queues
+   them until the socket takes them. Not thread-safe. */
+class ServerToServerConnection
+{
+    private:
+        SP<trankesbel::Socket> s;
+
+        /* Messages waiting to be sent. */
+        trankesbel::SendQueue output;
+
+        /* Received data that is not a complete message yet. */
+        std::string input;
+
+        /* No copies */
+        ServerToServerConnection(const ServerToServerConnection &stsc) { };
+        ServerToServerConnection& operator=(const ServerToServerConnection &stsc) { return (*this); };
+
+        /* Takes complete messages out of 'input'. */
+        void parseInput(std::vector<std::string>* messages);
+
+    public:
+        ServerToServerConnection(SP<trankesbel::Socket> s);
+
+        SP<trankesbel::Socket> getSocket() const { return s; };
+        bool isActive() const { return s->active(); };
+
+        /* Makes a message. */
+        static SP<const std::string> makeMessage(trankesbel::ui8 type, const std::string &body);
+        /* Makes a message that is just a type and a slot number. */
+        static SP<const std::string> makeSlotMessage(trankesbel::ui8 type, trankesbel::ui32 slot_number);
+        /* Encodes a frame as it is in LinkFrame messages: the compression and the frame.
+           Large frames are compressed if that makes them smaller. */
+        static SP<const std::string> encodeFrame(const std::string &frame);
+        /* And decodes it. Returns false if it's broken. */
+        static bool decodeFrame(const std::string &encoded_frame, std::string* frame);
+        /* Makes a LinkFrame message of an encoded frame. */
+        static SP<const std::string> makeFrameMessage(trankesbel::ui32 slot_number, const std::vector<trankesbel::ui64> &stamps, const std::string &encoded_frame);
+
+        /* Reads the slot number of a message body made with makeSlotMessage().
+           Returns false if the body is too short. */
+        static bool readSlotMessage(const std::string &message, trankesbel::ui32* slot_number);
+        /* Reads a LinkFrame message. The frame is left encoded. Returns false if it's broken. */
+        static bool readFrameMessage(const std::string &message, trankesbel::ui32* slot_number, std::vector<trankesbel::ui64>* stamps, std::string* encoded_frame);
+
+        /* Queues a message (or, before the upgrade, any data). */
+        void queue(SP<const std::string> message);
+        /* Sends as much as the socket takes. */
+        void flush();
+        size_t getQueuedBytes() const { return output.getQueuedBytes(); };
+
+        /* Reads what has arrived and appends complete messages to 'messages'.
+           A message is the type followed by the body. A message that is too
+           large closes the connection. */
+        void readMessages(std::vector<std::string>* messages);
+        /* Same, for data that was received before the connection was handed over. */
+        void feedInput(const std::string &data, std::vector<std::string>* messages);
+};
+
+}
+
+#endif
+
@@ -1,11 +1,30 @@
 #include "server_to_server.hpp"
+#include "slot_mirror.hpp"
 #include "logger.hpp"
+#include "marshal.hpp"
+#include "nanoclock.hpp"
+#include "metrics.hpp"
+#include "resolver.hpp"
+#include "rng.hpp"
+#include <boost/bind.hpp>
 
 using namespace dfterm;
 using namespace trankesbel;
 using namespace std;
 using namespace boost;
 
+/* Mirrors that nobody has watched for this long are unsubscribed from. (30 seconds) */
+static const ui64 MIRROR_UNSUBSCRIBE_DELAY = 30000000000ULL;
+/* Longest response to the upgrade request that is read. */
+static const size_t MAX_UPGRADE_RESPONSE = 8192;
+/* Wait before the first try again after a failure. (1 second) It doubles
+   with each failure, up to the server timeout of the link. */
+static const ui64 SERVER_TO_SERVER_FIRST_RETRY = 1000000000ULL;
+/* Tries that haven't connected and upgraded in this time are given up. (30 seconds) */
+static const ui64 SERVER_TO_SERVER_CONNECT_TIMEOUT = 30000000000ULL;
+/* Returned by checkTimers() when there's nothing to wait for. (1 hour) */
+static const ui64 NO_SERVER_TO_SERVER_TIMER = 3600000000000ULL;
+
 
 SP<ServerToServerSession> ServerToServerSession::create(const ServerToServerConfigurationPair &pair,
                                                         function1<void, SP<Socket> > callback_function)
@@ -19,22 +38,15 @@ SP<ServerToServerSession> ServerToServerSession::create(const ServerToServerConf
 
 ServerToServerSession::~ServerToServerSession()
 {
-    unique_lock<recursive_mutex> lock(session_mutex);
+    lock_guard<recursive_mutex> lock(session_mutex);
+
+    closeMirrors();
 
     if (server_socket)
     {
         server_socket->close();
         server_socket = SP<Socket>();
     }
-
-    if (session_thread)
-    {
-        session_thread->interrupt();
-        session_thread->detach();
-        session_thread = SP<thread>();
-    }
-
-    lock.unlock();
 }
 
 void ServerToServerSession::construct(const ServerToServerConfigurationPair &pair)
@@ -42,88 +54,114 @@ void ServerToServerSession::construct(const ServerToServerConfigurationPair &pai
     lock_guard<recursive_mutex> lock(session_mutex);
 
     this->pair = pair;
-    broken = false;
+    broken = pair.getTargetHostnameUTF8().empty();
     connection_ready = false;
+    upgrade_sent = false;
+    upgraded = false;
 
-    /* Launch thread */
-    try
-    {
-        session_thread = SP<thread>(new thread(static_server_to_server_session, this));
-    }
-    catch (boost::thread_resource_error tre)
-    {
-        broken = true;
-        return;
-    }
+    /* The first try is made on the first checkTimers(). */
+    phase = Waiting;
+    phase_deadline = 0;
+    failures = 0;
+
+    mirror_profile = SP<SlotProfile>(new SlotProfile);
+    mirror_profile->setNameUTF8(pair.getNameUTF8());
+    mirror_profile->setAllowedLaunchers(UserGroup());
+    mirror_profile->setAllowedPlayers(UserGroup());
+    mirror_profile->setAllowedClosers(UserGroup());
 }
 
-void ServerToServerSession::static_server_to_server_session(ServerToServerSession* self)
+ui64 ServerToServerSession::checkTimers()
 {
-    try
+    lock_guard<recursive_mutex> lock(session_mutex);
+    if (broken) return NO_SERVER_TO_SERVER_TIMER;
+
+    ui64 now = nanoclock();
+    bool timed = (phase == Waiting || phase == Connecting || (phase == Connected && !upgraded));
+    if (!timed) return NO_SERVER_TO_SERVER_TIMER;
+    if (now < phase_deadline) return phase_deadline - now;
+
+    if (phase == Waiting)
     {
-        self->server_to_server_session();
+        startResolving();
+        return checkTimers();
     }
-    catch(thread_interrupted ti)
-    {
-    };
+
+    ui64 wait = scheduleRetry();
+    LOG(Error, "Server-to-server link \"" << pair.getNameUTF8() << "\" to hostname \"" << pair.getTargetHostnameUTF8() << "\" to port \"" << pair.getTargetPortUTF8() << "\" timed out. Trying again in " << wait << " nanoseconds.");
+    return wait;
 }
 
-void ServerToServerSession::server_to_server_session()
+void ServerToServerSession::startResolving()
 {
-    SP<ServerToServerSession> stss = self.lock();
-    assert(stss);
+    phase = Resolving;
+    Resolver::getInstance()->resolve(pair.getTargetHostnameUTF8(), pair.getTargetPortUTF8(), boost::bind(&ServerToServerSession::static_resolved, self, _1, _2, _3));
+}
 
-    this_thread::interruption_point();
+void ServerToServerSession::static_resolved(WP<ServerToServerSession> self, bool success, SocketAddress sa, string errormsg)
+{
+    SP<ServerToServerSession> stss = self.lock();
+    if (stss) stss->resolved(success, sa, errormsg);
+}
 
+void ServerToServerSession::resolved(bool success, const SocketAddress &sa, const string &errormsg)
+{
     unique_lock<recursive_mutex> lock(session_mutex);
+    if (phase != Resolving) return;
+
     string hostname = pair.getTargetHostnameUTF8();
     string port = pair.getTargetPortUTF8();
-    ui64 server_timeout = pair.getServerTimeout();
-    lock.unlock();
-
-    SocketAddress sa;
-    while(true)
+    if (!success)
     {
-        this_thread::interruption_point();
-        bool success;
-        string errormsg;
-
-        sa = SocketAddress::resolveUTF8(hostname, port, &success, &errormsg);
-        if (!success)
-        {
-            LOG(Error, "Resolving hostname \"" << hostname << "\" with port \"" << port << "\" failed with error \"" << errormsg << "\". Trying again in " << server_timeout << " nanoseconds.");
-
-            this_thread::sleep(posix_time::time_duration(posix_time::microseconds(server_timeout / 1000ULL)));
-            continue;
-        }
-
-        break;
+        ui64 wait = scheduleRetry();
+        LOG(Error, "Resolving hostname \"" << hostname << "\" with port \"" << port << "\" failed with error \"" << errormsg << "\". Trying again in " << wait << " nanoseconds.");
+        return;
     }
 
-    SP<Socket> connection;
-    while(!connection || !connection->active())
+    SP<Socket> connecting_socket(new Socket);
+    if (!connecting_socket->connectNonBlocking(sa))
     {
-        this_thread::interruption_point();
-
-        connection = SP<Socket>(new Socket);
-        if (!connection->connect(sa))
-        {
-            LOG(Error, "Connecting to hostname \"" << hostname << "\" to port \"" << port << "\" failed with error \"" << connection->getError() << "\". Trying again in " << server_timeout << " nanoseconds.");
-            this_thread::sleep(posix_time::time_duration(posix_time::microseconds(server_timeout / 1000ULL)));
-            continue;
-        }
+        ui64 wait = scheduleRetry();
+        LOG(Error, "Connecting to hostname \"" << hostname << "\" to port \"" << port << "\" failed with error \"" << connecting_socket->getError() << "\". Trying again in " << wait << " nanoseconds.");
+        return;
     }
 
-    LOG(Note, "Successfully connected server-to-server session to hostname \"" << hostname << "\" to port \"" << port << "\".");
-    lock.lock();
-    assert(connection);
-    connection_ready = true;
-    server_socket = connection;
+    phase = Connecting;
+    phase_deadline = nanoclock() + SERVER_TO_SERVER_CONNECT_TIMEOUT;
+    server_socket = connecting_socket;
     server_address = sa;
     function1<void, SP<Socket> > cf = callback_function;
     lock.unlock();
 
-    if (cf) cf(connection);
+    if (cf) cf(connecting_socket);
+}
+
+ui64 ServerToServerSession::scheduleRetry()
+{
+    if (server_socket)
+        server_socket->close();
+    server_socket = SP<Socket>();
+    connection = SP<ServerToServerConnection>();
+    connection_ready = false;
+    upgrade_sent = false;
+    upgraded = false;
+    upgrade_response.clear();
+    closeMirrors();
+
+    /* Twice as long after each failure, up to the server timeout. The wait
+       is a random time between half of that and all of it. */
+    ui64 wait = pair.getServerTimeout();
+    if (failures < 32 && (SERVER_TO_SERVER_FIRST_RETRY << failures) < wait)
+        wait = SERVER_TO_SERVER_FIRST_RETRY << failures;
+    ++failures;
+
+    ui32 r;
+    makeRandomBytes((unsigned char*) &r, sizeof(r));
+    wait = wait / 2 + (ui64) ((double) (wait / 2) * ((double) r / 4294967296.0));
+
+    phase = Waiting;
+    phase_deadline = nanoclock() + wait;
+    return wait;
 }
 
 bool ServerToServerSession::isBroken()
@@ -142,13 +180,241 @@ SP<Socket> ServerToServerSession::getSocket()
 {
     lock_guard<recursive_mutex> lock(session_mutex);
     if (broken) return SP<Socket>();
-    if (!connection_ready) return SP<Socket>();
 
     return server_socket;
 }
 
+void ServerToServerSession::setMirrorCallback(function1<void, SP<Slot> > mirror_callback)
+{
+    lock_guard<recursive_mutex> lock(session_mutex);
+    this->mirror_callback = mirror_callback;
+}
+
+void ServerToServerSession::closeMirrors()
+{
+    map<ui32, SP<SlotMirror> >::iterator i1, mirrors_end = mirrors.end();
+    for (i1 = mirrors.begin(); i1 != mirrors_end; ++i1)
+        i1->second->setAlive(false);
+    mirrors.clear();
+    subscriptions.clear();
+    keyframe_requests.clear();
+}
+
+bool ServerToServerSession::readUpgradeResponse(vector<string>* messages)
+{
+    char buf[1000];
+    size_t result;
+    while ((result = server_socket->recv(buf, 1000)) > 0)
+    {
+        upgrade_response.append(buf, result);
+        if (upgrade_response.find("\r\n\r\n") != string::npos) break;
+    }
+
+    size_t headers_end = upgrade_response.find("\r\n\r\n");
+    if (headers_end == string::npos)
+    {
+        if (upgrade_response.size() > MAX_UPGRADE_RESPONSE)
+        {
+            LOG(Error, "Server-to-server link \"" << pair.getNameUTF8() << "\" got a too long response to its upgrade request. Closing the link.");
+            server_socket->close();
+        }
+        return false;
+    }
+
+    /* "HTTP/1.1 101 Switching Protocols" */
+    string status_line = upgrade_response.substr(0, upgrade_response.find("\r\n"));
+    if (status_line.size() < 12 || status_line.compare(0, 5, "HTTP/") || status_line.compare(8, 4, " 101"))
+    {
+        LOG(Error, "Server-to-server link \"" << pair.getNameUTF8() << "\" was refused by the other server: \"" << status_line << "\". Closing the link.");
+        server_socket->close();
+        return false;
+    }
+
+    upgraded = true;
+    failures = 0;
+    LOG(Note, "Server-to-server link \"" << pair.getNameUTF8() << "\" is up.");
+    connection->feedInput(upgrade_response.substr(headers_end + 4), messages);
+    upgrade_response.clear();
+    return true;
+}
+
+void ServerToServerSession::handleSlots(const string &message)
+{
+    const char* d = message.data();
+    map<ui32, string> listed;
+    map<ui32, ui32> listed_hops;
+    size_t pos = 1;
+    while (message.size() - pos >= 7)
+    {
+        ui32 number = readLittleEndian32(d + pos);
+        ui32 hops = (unsigned char) d[pos+4];
+        size_t name_size = readLittleEndian16(d + pos + 5);
+        pos += 7;
+        if (message.size() - pos < name_size) break;
+        listed[number] = message.substr(pos, name_size);
+        /* One more link, this one. */
+        listed_hops[number] = hops + 1;
+        pos += name_size;
+    }
+
+    /* Slots that are gone */
+    map<ui32, SP<SlotMirror> >::iterator i1 = mirrors.begin();
+    while (i1 != mirrors.end())
+    {
+        if (listed.find(i1->first) != listed.end()) { ++i1; continue; };
+
+        i1->second->setAlive(false);
+        subscriptions.erase(i1->first);
+        keyframe_requests.erase(i1->first);
+        mirrors.erase(i1++);
+    }
+
+    /* And new ones */
+    map<ui32, string>::iterator i2, listed_end = listed.end();
+    for (i2 = listed.begin(); i2 != listed_end; ++i2)
+    {
+        map<ui32, SP<SlotMirror> >::iterator i3 = mirrors.find(i2->first);
+        if (i3 != mirrors.end())
+        {
+            i3->second->setHops(listed_hops[i2->first]);
+            continue;
+        }
+
+        SP<SlotMirror> mirror = SlotMirror::create();
+        mirror->setNameUTF8(pair.getNameUTF8() + ": " + i2->second);
+        mirror->setSlotProfile(mirror_profile);
+        mirror->setHops(listed_hops[i2->first]);
+        mirror->setRelayed(pair.isRelay());
+        mirrors[i2->first] = mirror;
+        if (mirror_callback) mirror_callback(mirror);
+    }
+}
+
+void ServerToServerSession::handleMessage(const string &message)
+{
+    if (message[0] == LinkSlots)
+    {
+        handleSlots(message);
+        return;
+    }
+    if (message[0] != LinkFrame) return;
+
+    ui32 slot_number;
+    vector<ui64> stamps;
+    string encoded_frame, frame;
+    if (!ServerToServerConnection::readFrameMessage(message, &slot_number, &stamps, &encoded_frame) ||
+        !ServerToServerConnection::decodeFrame(encoded_frame, &frame) || frame.empty())
+    {
+        LOG(Error, "Server-to-server link \"" << pair.getNameUTF8() << "\" got a broken frame. Closing the link.");
+        server_socket->close();
+        return;
+    }
+
+    map<ui32, SP<SlotMirror> >::iterator i1 = mirrors.find(slot_number);
+    if (i1 == mirrors.end() || subscriptions.find(slot_number) == subscriptions.end()) return;
+
+    bool keyframe = (frame[0] == 1);
+    if (!i1->second->applyFrame(SP<const string>(new string(frame)), SP<const string>(new string(encoded_frame)), stamps))
+    {
+        if (keyframe_requests.insert(slot_number).second)
+            connection->queue(ServerToServerConnection::makeSlotMessage(LinkKeyframeRequest, slot_number));
+        return;
+    }
+    if (keyframe)
+        keyframe_requests.erase(slot_number);
+
+    /* The clocks of the servers may differ a bit. */
+    if (!stamps.empty())
+    {
+        ui64 now = nanoclock();
+        metric_observe(MetricServerToServerHopLatency, (now > stamps.back()) ? now - stamps.back() : 0);
+        metric_observe(MetricServerToServerPathLatency, (now > stamps.front()) ? now - stamps.front() : 0);
+    }
+
+    i1->second->signalData();
+}
+
+void ServerToServerSession::updateSubscriptions(const set<const Slot*> &watched)
+{
+    lock_guard<recursive_mutex> lock(session_mutex);
+    if (!upgraded || !connection) return;
+
+    ui64 now = nanoclock();
+    map<ui32, SP<SlotMirror> >::iterator i1, mirrors_end = mirrors.end();
+    for (i1 = mirrors.begin(); i1 != mirrors_end; ++i1)
+    {
+        map<ui32, ui64>::iterator i2 = subscriptions.find(i1->first);
+        if (watched.find(i1->second.get()) != watched.end())
+        {
+            if (i2 != subscriptions.end())
+                i2->second = 0;
+            else
+            {
+                subscriptions[i1->first] = 0;
+                connection->queue(ServerToServerConnection::makeSlotMessage(LinkSubscribe, i1->first));
+            }
+            continue;
+        }
+        if (i2 == subscriptions.end()) continue;
+
+        if (i2->second == 0)
+            i2->second = now;
+        else if (now - i2->second > MIRROR_UNSUBSCRIBE_DELAY)
+        {
+            connection->queue(ServerToServerConnection::makeSlotMessage(LinkUnsubscribe, i1->first));
+            subscriptions.erase(i2);
+            keyframe_requests.erase(i1->first);
+        }
+    }
+    connection->flush();
+}
+
 void ServerToServerSession::cycle()
 {
     lock_guard<recursive_mutex> lock(session_mutex);
+    if (!server_socket) return;
+
+    if (phase == Connecting)
+    {
+        if (!server_socket->finishConnect())
+        {
+            if (server_socket->active()) return;
+
+            string errormsg = server_socket->getError();
+            ui64 wait = scheduleRetry();
+            LOG(Error, "Connecting to hostname \"" << pair.getTargetHostnameUTF8() << "\" to port \"" << pair.getTargetPortUTF8() << "\" failed with error \"" << errormsg << "\". Trying again in " << wait << " nanoseconds.");
+            return;
+        }
+
+        LOG(Note, "Successfully connected server-to-server session to hostname \"" << pair.getTargetHostnameUTF8() << "\" to port \"" << pair.getTargetPortUTF8() << "\".");
+        phase = Connected;
+        connection_ready = true;
+        connection = SP<ServerToServerConnection>(new ServerToServerConnection(server_socket));
+    }
+
+    if (!upgrade_sent)
+    {
+        string request = string("GET ") + SERVER_TO_SERVER_TARGET + " HTTP/1.1\r\n"
+                         "Host: " + pair.getTargetHostnameUTF8() + ":" + pair.getTargetPortUTF8() + "\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Upgrade: " + SERVER_TO_SERVER_PROTOCOL + "\r\n\r\n";
+        connection->queue(SP<const string>(new string(request)));
+        upgrade_sent = true;
+    }
+
+    vector<string> messages;
+    if (upgraded || readUpgradeResponse(&messages))
+        connection->readMessages(&messages);
+
+    vector<string>::iterator i1, messages_end = messages.end();
+    for (i1 = messages.begin(); i1 != messages_end && server_socket->active(); ++i1)
+        handleMessage(*i1);
+    connection->flush();
+
+    if (!server_socket->active())
+    {
+        ui64 wait = scheduleRetry();
+        LOG(Note, "Server-to-server link \"" << pair.getNameUTF8() << "\" has closed. Trying again in " << wait << " nanoseconds.");
+    }
 }
 
@@ -54,12 +54,18 @@ class Slot
 
         void setSelf(WP<Slot> s) { self = s; };
 
+        /* Bytes read from the program, written only by the thread of the slot. */
+        volatile trankesbel::ui64 bytes_read;
+
     protected:
-        Slot() { };
+        Slot() { bytes_read = 0; };
 
         WP<State> state;
         WP<Slot> self;
 
+        /* Called by the slot thread when it has read data from the program. */
+        void addBytesRead(trankesbel::ui64 bytes) { bytes_read = bytes_read + bytes; };
+
     public:
         virtual ~Slot() { };
         
@@ -95,6 +101,10 @@ class Slot
         UnicodeString getName() const { return name; };
         std::string getNameUTF8() const { return TO_UTF8(name); };
 
+        /* Returns how many bytes have been read from the program
+           (through a pty, for terminal slots). */
+        trankesbel::ui64 getBytesRead() const { return bytes_read; };
+
         /* Sets a generic parameter for slot. (See SlotTypes enum for explanations) 
          * TODO: Maybe roll some RTTI-like system to get real methods like setWorkingDirectory()
          * and setDFExecutablePath() instead of a lousy interface like this to set those. */
@@ -114,6 +124,9 @@ class Slot
 
         /* Sends input to the slot. */
         virtual void feedInput(const trankesbel::KeyPress &kp) = 0;
+
+        /* Returns true if the slot shows a slot of another server (see SlotMirror). */
+        virtual bool isMirror() const { return false; };
 };
 
 /* Lists slot types. */
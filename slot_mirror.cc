@@ -0,0 +1,268 @@
+#include "slot_mirror.hpp"
+#include "state.hpp"
+#include "interface_ncurses.hpp"
+#include "marshal.hpp"
+#include <cassert>
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace boost;
+using namespace std;
+
+/* Largest screen that is accepted; the same as what spectators capture. */
+static const ui32 MAX_MIRROR_SCREEN_SIZE = 1000;
+
+static CursesElement unpack_cell(ui32 cell)
+{
+    return CursesElement(cell & 0x1FFFFF, (Color) ((cell >> 21) & 0x7), (Color) ((cell >> 24) & 0x7), (cell & (1 << 27)) != 0);
+}
+
+/* Reads frames of the spectator protocol. Every read checks there's enough left. */
+namespace {
+class FrameReader
+{
+    private:
+        const unsigned char* data;
+        size_t size, pos;
+
+    public:
+        FrameReader(const string &frame)
+        {
+            data = (const unsigned char*) frame.data();
+            size = frame.size();
+            pos = 0;
+        }
+
+        bool atEnd() const { return pos >= size; };
+
+        bool u8(ui32* v)
+        {
+            if (size - pos < 1) return false;
+            (*v) = data[pos++];
+            return true;
+        }
+        bool u16(ui32* v)
+        {
+            if (size - pos < 2) return false;
+            (*v) = readLittleEndian16((const char*) data + pos);
+            pos += 2;
+            return true;
+        }
+        bool u32(ui32* v)
+        {
+            if (size - pos < 4) return false;
+            (*v) = readLittleEndian32((const char*) data + pos);
+            pos += 4;
+            return true;
+        }
+        bool varint(ui32* v)
+        {
+            (*v) = 0;
+            ui32 shift;
+            for (shift = 0; shift < 35; shift += 7)
+            {
+                if (pos >= size) return false;
+                ui32 b = data[pos++];
+                (*v) |= (b & 0x7F) << shift;
+                if (!(b & 0x80)) return true;
+            }
+            return false;
+        }
+
+        /* Reads runs that cover exactly 'count' cells to 'cells'. */
+        bool runs(ui32* cells, size_t count)
+        {
+            size_t done = 0;
+            while (done < count)
+            {
+                ui32 run, cell;
+                if (!varint(&run) || !u32(&cell)) return false;
+                if (run == 0 || run > count - done) return false;
+                size_t i1;
+                for (i1 = 0; i1 < run; ++i1)
+                    cells[done + i1] = cell;
+                done += run;
+            }
+            return true;
+        }
+};
+}
+
+SlotMirror::SlotMirror() : Slot()
+{
+    alive = true;
+    generation = 0;
+    width = 80;
+    height = 25;
+    cells.assign(width * height, ' ' | (7 << 21));
+    hops = 1;
+    relayed = false;
+}
+
+SP<SlotMirror> SlotMirror::create()
+{
+    SP<SlotMirror> result(new SlotMirror);
+    result->self = result;
+    return result;
+}
+
+bool SlotMirror::applyFrame(SP<const string> frame, SP<const string> encoded_frame, const vector<ui64> &stamps)
+{
+    assert(frame && encoded_frame);
+
+    FrameReader fr(*frame);
+    ui32 type, new_generation, w, h;
+    if (!fr.u8(&type) || !fr.u32(&new_generation) || !fr.u16(&w) || !fr.u16(&h))
+        return false;
+    if (w > MAX_MIRROR_SCREEN_SIZE || h > MAX_MIRROR_SCREEN_SIZE || new_generation == 0)
+        return false;
+
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+
+    if (type == 1)
+    {
+        vector<ui32> new_cells(w * h);
+        if (!fr.runs(new_cells.empty() ? (ui32*) 0 : &new_cells[0], new_cells.size()) || !fr.atEnd())
+            return false;
+
+        cells.swap(new_cells);
+        width = w;
+        height = h;
+        generation = new_generation;
+        last_frame = frame;
+        last_encoded_frame = encoded_frame;
+        last_stamps = stamps;
+        return true;
+    }
+    if (type != 2) return false;
+
+    ui32 expected = generation + 1;
+    if (expected == 0) expected = 1;
+    if (generation == 0 || new_generation != expected || w != width || h != height)
+        return false;
+
+    vector<ui32> new_cells = cells;
+    size_t pos = 0;
+    while (!fr.atEnd())
+    {
+        ui32 skip, count;
+        if (!fr.varint(&skip) || !fr.varint(&count)) return false;
+        if (skip > new_cells.size() - pos || count > new_cells.size() - pos - skip) return false;
+        pos += skip;
+        if (!fr.runs(&new_cells[0] + pos, count)) return false;
+        pos += count;
+    }
+
+    cells.swap(new_cells);
+    generation = new_generation;
+    last_frame = frame;
+    last_encoded_frame = encoded_frame;
+    last_stamps = stamps;
+    return true;
+}
+
+void SlotMirror::signalData()
+{
+    SP<State> s = state.lock();
+    SP<Slot> self_sp = self.lock();
+    if (s && self_sp)
+        s->signalSlotData(self_sp);
+}
+
+void SlotMirror::setAlive(bool alive)
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    this->alive = alive;
+}
+
+bool SlotMirror::isAlive()
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    return alive;
+}
+
+void SlotMirror::getFrame(ui32* generation, ui32* width, ui32* height, vector<ui32>* cells, SP<const string>* last_frame)
+{
+    assert(generation && width && height && cells && last_frame);
+
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    (*generation) = this->generation;
+    (*width) = this->width;
+    (*height) = this->height;
+    (*cells) = this->cells;
+    (*last_frame) = this->last_frame;
+}
+
+void SlotMirror::getLastFrame(SP<const string>* last_frame, SP<const string>* last_encoded_frame, vector<ui64>* stamps)
+{
+    assert(last_frame && last_encoded_frame && stamps);
+
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    (*last_frame) = this->last_frame;
+    (*last_encoded_frame) = this->last_encoded_frame;
+    (*stamps) = last_stamps;
+}
+
+void SlotMirror::setHops(ui32 hops)
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    this->hops = hops;
+}
+
+ui32 SlotMirror::getHops()
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    return hops;
+}
+
+void SlotMirror::setRelayed(bool relayed)
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    this->relayed = relayed;
+}
+
+bool SlotMirror::isRelayed()
+{
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    return relayed;
+}
+
+void SlotMirror::getSize(ui32* width, ui32* height)
+{
+    assert(width && height);
+
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    (*width) = this->width;
+    (*height) = this->height;
+}
+
+void SlotMirror::unloadToWindow(SP<Interface2DWindow> target_window)
+{
+    assert(target_window);
+
+    lock_guard<recursive_mutex> lock(mirror_mutex);
+    target_window->setMinimumSize(width, height);
+
+    ui32 actual_window_w, actual_window_h;
+    target_window->getSize(&actual_window_w, &actual_window_h);
+
+    ui32 offset_x = 0, offset_y = 0;
+    if (actual_window_w > width)
+        offset_x = (actual_window_w - width) / 2;
+    if (actual_window_h > height)
+        offset_y = (actual_window_h - height) / 2;
+
+    vector<CursesElement> elements(actual_window_w * actual_window_h);
+    ui32 i1, i2;
+    for (i2 = 0; i2 < actual_window_h; ++i2)
+        for (i1 = 0; i1 < actual_window_w; ++i1)
+        {
+            if (i1 < offset_x || i2 < offset_y || i1 - offset_x >= width || i2 - offset_y >= height)
+                continue;
+            elements[i1 + i2 * actual_window_w] = unpack_cell(cells[(i1 - offset_x) + (i2 - offset_y) * width]);
+        }
+
+    if (elements.empty()) return;
+    target_window->setScreenDisplayNewElements(&elements[0], sizeof(CursesElement), actual_window_w, actual_window_w, actual_window_h, 0, 0);
+}
+
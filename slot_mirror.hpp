@@ -0,0 +1,82 @@
+#ifndef slot_mirror_hpp
+#define slot_mirror_hpp
+
+#include "slot.hpp"
+#include "types.hpp"
+#include <boost/thread/recursive_mutex.hpp>
+#include <string>
+#include <vector>
+
+namespace dfterm
+{
+
+/* A slot that shows a slot of another server, received through a
+   server-to-server link (see ServerToServerSession). It can only be
+   watched; input is ignored. */
+class SlotMirror : public Slot
+{
+    private:
+        bool alive;
+        boost::recursive_mutex mirror_mutex;
+
+        /* Current frame, as cells of the spectator protocol. Generation 0
+           means no frame has been received yet. */
+        trankesbel::ui32 generation;
+        trankesbel::ui32 width, height;
+        std::vector<trankesbel::ui32> cells;
+
+        /* The frame that made the current generation, as it was received,
+           and its stamps. Relays pass these on as they are. */
+        SP<const std::string> last_frame;
+        SP<const std::string> last_encoded_frame;
+        std::vector<trankesbel::ui64> last_stamps;
+
+        /* Links the slot came through, and whether it may be relayed. */
+        trankesbel::ui32 hops;
+        bool relayed;
+
+        SlotMirror();
+
+    public:
+        static SP<SlotMirror> create();
+
+        /* Applies a keyframe or a delta of the spectator protocol.
+           Returns false if it can't be applied; a delta must follow
+           the previous frame. 'encoded_frame' is the frame as it was in
+           the LinkFrame message, and 'stamps' its stamps. */
+        bool applyFrame(SP<const std::string> frame, SP<const std::string> encoded_frame, const std::vector<trankesbel::ui64> &stamps);
+        /* Tells the state there's something new to show. */
+        void signalData();
+
+        /* Called by the link when the slot is gone on the other server
+           or the link is closed. */
+        void setAlive(bool alive);
+
+        /* Gets the current frame. 'last_frame' is the frame that made it,
+           or null if no frame has been received. */
+        void getFrame(trankesbel::ui32* generation, trankesbel::ui32* width, trankesbel::ui32* height,
+                      std::vector<trankesbel::ui32>* cells, SP<const std::string>* last_frame);
+        /* Gets the frame that made the current generation, encoded as it was
+           received, and its stamps. */
+        void getLastFrame(SP<const std::string>* last_frame, SP<const std::string>* last_encoded_frame, std::vector<trankesbel::ui64>* stamps);
+
+        /* Set and get the number of links the slot came through. */
+        void setHops(trankesbel::ui32 hops);
+        trankesbel::ui32 getHops();
+        /* Set and get whether the slot may be exported to other servers. */
+        void setRelayed(bool relayed);
+        bool isRelayed();
+
+        void setParameter(std::string key, UnicodeString value) { };
+
+        void getSize(trankesbel::ui32* width, trankesbel::ui32* height);
+        bool isAlive();
+        void unloadToWindow(SP<trankesbel::Interface2DWindow> target_window);
+        void feedInput(const trankesbel::KeyPress &kp) { };
+        bool isMirror() const { return true; };
+};
+
+}; /* namespace */
+
+#endif
+
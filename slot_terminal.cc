@@ -3,6 +3,7 @@
 #include "types.hpp"
 #include <unistd.h>
 #include "nanoclock.hpp"
+#include "metrics.hpp"
 #include "interface.hpp"
 #include "interface_ncurses.hpp"
 #include <iostream>
@@ -206,6 +207,7 @@ void TerminalGlue::thread_function()
             }
             if (terminated)
                 break;
+            addBytesRead(read_buffer.size());
 
             UErrorCode errorcode = U_ZERO_ERROR;
             UnicodeString converted(read_buffer.data(), read_buffer.size(),
@@ -221,7 +223,10 @@ void TerminalGlue::thread_function()
             converted.toUTF8String(read_buffer);
 
             unique_lock<recursive_mutex> lock2(game_terminal_mutex);
+            ui64 feed_start = nanoclock();
             game_terminal.feedString(read_buffer.data(), read_buffer.size());
+            metric_add(MetricFeedStringNanoseconds, nanoclock() - feed_start);
+            metric_add(MetricFeedStringBytes, read_buffer.size());
             lock2.unlock();
             SP<State> s = state.lock();
             if (s)
@@ -4,11 +4,35 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 #include "marshal.hpp"
 
 using namespace trankesbel;
 using namespace std;
 
+static const i32 MATCHER_NO_MATCH = -1;
+static const i32 MATCHER_MATCH = -2;
+
+/* Maximum number of strings in the hostname regex cache. */
+static const size_t MAX_HOSTNAME_REGEX_CACHE_SIZE = 10000;
+
+/* Splits addresses to the numbers ranges are defined with. */
+static void split_IPv4_address(const struct sockaddr_in &sai, ui32 parts[4])
+{
+    ui32 addr = ntohl(sai.sin_addr.s_addr);
+    parts[0] = (addr & 0xff000000) >> 24;
+    parts[1] = (addr & 0x00ff0000) >> 16;
+    parts[2] = (addr & 0x0000ff00) >> 8;
+    parts[3] = (addr & 0x000000ff);
+}
+
+static void split_IPv6_address(const struct sockaddr_in6 &sai6, ui32 parts[8])
+{
+    const unsigned char* buf = (const unsigned char*) &sai6.sin6_addr;
+    for (int i1 = 0; i1 < 8; ++i1)
+        parts[i1] = ((ui32) buf[i1*2] << 8) + buf[i1*2+1];
+}
+
 bool SocketAddressRange::operator==(const SocketAddressRange &sar) const
 {
     if (sar.individual_socket_addresses.size() != individual_socket_addresses.size()) return false;
@@ -223,6 +247,7 @@ bool SocketAddressRange::unSerialize(const std::string &s)
         addHostnameRegexUTF8(sa);
     }
 
+    compile();
     return true;
 }
 
@@ -232,6 +257,167 @@ void SocketAddressRange::clear()
     IPv4_ranges.clear();
     IPv6_ranges.clear();
     hostname_regexes.clear();
+    hostname_regex_cache.clear();
+    IPv4_matcher.clear();
+    IPv6_matcher.clear();
+}
+
+/* Hash of a sorted list of rule indices (FNV-1a). */
+static ui64 hash_rules(const vector<size_t> &rules)
+{
+    ui64 h = 14695981039346656037ULL;
+    vector<size_t>::const_iterator i1, rules_end = rules.end();
+    for (i1 = rules.begin(); i1 != rules_end; ++i1)
+    {
+        ui64 v = (ui64) (*i1);
+        for (int i2 = 0; i2 < 8; ++i2)
+        {
+            h ^= (v >> (i2 * 8)) & 0xff;
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+i32 SocketAddressRange::compileMatcherNode(vector<MatcherNode> &matcher,
+                                           const vector<NumberRange> &ranges,
+                                           size_t parts,
+                                           size_t level,
+                                           const vector<size_t> &rules,
+                                           MatcherMemo &memo)
+{
+    if (rules.empty()) return MATCHER_NO_MATCH;
+    if (level == parts) return MATCHER_MATCH;
+
+    pair<size_t, ui64> key(level, hash_rules(rules));
+    MatcherMemo::iterator m = memo.find(key);
+    if (m != memo.end() && m->second.first == rules) return m->second.second;
+
+    /* Interval boundaries are where some rule starts or stops applying.
+       Sweep over them in order, keeping the set of rules that apply. */
+    vector<pair<ui64, size_t> > starts, ends;
+    starts.reserve(rules.size());
+    ends.reserve(rules.size());
+    vector<size_t>::const_iterator i1, rules_end = rules.end();
+    for (i1 = rules.begin(); i1 != rules_end; ++i1)
+    {
+        const NumberRange &nr = ranges[(*i1) * parts + level];
+        starts.push_back(pair<ui64, size_t>(nr.getStart(), *i1));
+        ends.push_back(pair<ui64, size_t>((ui64) nr.getEnd() + 1, *i1));
+    }
+    sort(starts.begin(), starts.end());
+    sort(ends.begin(), ends.end());
+
+    MatcherNode node;
+    set<size_t> active;
+    size_t i2 = 0, i3 = 0, starts_size = starts.size(), ends_size = ends.size();
+    ui64 n = 0;
+    while (n <= 0xffffffffULL)
+    {
+        while (i2 < starts_size && starts[i2].first == n)
+            active.insert(starts[i2++].second);
+        while (i3 < ends_size && ends[i3].first == n)
+            active.erase(ends[i3++].second);
+
+        vector<size_t> interval_rules(active.begin(), active.end());
+        i32 next = compileMatcherNode(matcher, ranges, parts, level+1, interval_rules, memo);
+
+        /* Neighbouring intervals that lead to the same place are one interval. */
+        if (node.next.empty() || node.next.back() != next)
+        {
+            node.starts.push_back((ui32) n);
+            node.next.push_back(next);
+        }
+
+        /* Next boundary */
+        ui64 next_n = 0x100000000ULL;
+        if (i2 < starts_size && starts[i2].first < next_n) next_n = starts[i2].first;
+        if (i3 < ends_size && ends[i3].first < next_n) next_n = ends[i3].first;
+        n = next_n;
+    }
+
+    i32 result;
+    if (node.next.size() == 1 && node.next[0] < 0)
+        result = node.next[0];
+    else
+    {
+        result = (i32) matcher.size();
+        matcher.push_back(node);
+    }
+
+    /* On a hash collision, the node that was there first stays memoized. */
+    if (m == memo.end())
+        memo[key] = pair<vector<size_t>, i32>(rules, result);
+    return result;
+}
+
+void SocketAddressRange::compile()
+{
+    IPv4_matcher.clear();
+    IPv6_matcher.clear();
+
+    /* Individual addresses are ranges of one address. */
+    vector<NumberRange> IPv4_all = IPv4_ranges;
+    vector<NumberRange> IPv6_all = IPv6_ranges;
+    set<SocketAddress>::const_iterator i1, individual_socket_addresses_end = individual_socket_addresses.end();
+    for (i1 = individual_socket_addresses.begin(); i1 != individual_socket_addresses_end; ++i1)
+    {
+        ui32 parts[8];
+        if (i1->getIPProtocol() == IPv4)
+        {
+            struct sockaddr_in sai;
+            i1->getRawIPv4Sockaddr(&sai);
+            split_IPv4_address(sai, parts);
+            for (int i2 = 0; i2 < 4; ++i2)
+                IPv4_all.push_back(NumberRange(parts[i2]));
+        }
+        else
+        {
+            struct sockaddr_in6 sai6;
+            i1->getRawIPv6Sockaddr(&sai6);
+            split_IPv6_address(sai6, parts);
+            for (int i2 = 0; i2 < 8; ++i2)
+                IPv6_all.push_back(NumberRange(parts[i2]));
+        }
+    }
+
+    /* Rules with an empty number range can never match. */
+    vector<size_t> rules;
+    size_t i3, i4;
+    for (i3 = 0; i3 < IPv4_all.size() / 4; ++i3)
+    {
+        for (i4 = 0; i4 < 4; ++i4)
+            if (IPv4_all[i3*4 + i4].isNoRange()) break;
+        if (i4 == 4) rules.push_back(i3);
+    }
+
+    MatcherMemo memo;
+    i32 root = compileMatcherNode(IPv4_matcher, IPv4_all, 4, 0, rules, memo);
+    if (root == MATCHER_MATCH)
+    {
+        MatcherNode all;
+        all.starts.push_back(0);
+        all.next.push_back(MATCHER_MATCH);
+        IPv4_matcher.push_back(all);
+    }
+
+    rules.clear();
+    memo.clear();
+    for (i3 = 0; i3 < IPv6_all.size() / 8; ++i3)
+    {
+        for (i4 = 0; i4 < 8; ++i4)
+            if (IPv6_all[i3*8 + i4].isNoRange()) break;
+        if (i4 == 8) rules.push_back(i3);
+    }
+
+    root = compileMatcherNode(IPv6_matcher, IPv6_all, 8, 0, rules, memo);
+    if (root == MATCHER_MATCH)
+    {
+        MatcherNode all;
+        all.starts.push_back(0);
+        all.next.push_back(MATCHER_MATCH);
+        IPv6_matcher.push_back(all);
+    }
 }
 
 void SocketAddressRange::addSocketAddress(const SocketAddress &sa)
@@ -240,6 +426,7 @@ void SocketAddressRange::addSocketAddress(const SocketAddress &sa)
     sa_copy.setPort(0);
     sa_copy.setHostnameUTF8("");
     individual_socket_addresses.insert(sa_copy);
+    compile();
 }
 
 
@@ -249,6 +436,7 @@ void SocketAddressRange::deleteSocketAddress(const SocketAddress &sa)
     sa_copy.setPort(0);
     sa_copy.setHostnameUTF8("");
     individual_socket_addresses.erase(sa_copy);
+    compile();
 }
 
 void SocketAddressRange::addIPv4Range(const NumberRange &a,
@@ -264,6 +452,7 @@ void SocketAddressRange::addIPv4Range(const NumberRange &a,
     IPv4_ranges.push_back(b);
     IPv4_ranges.push_back(c);
     IPv4_ranges.push_back(d);
+    compile();
 }
 
 void SocketAddressRange::addIPv6Range(const NumberRange &a,
@@ -284,6 +473,7 @@ void SocketAddressRange::addIPv6Range(const NumberRange &a,
     IPv6_ranges.push_back(f);
     IPv6_ranges.push_back(g);
     IPv6_ranges.push_back(h);
+    compile();
 }
 
 void SocketAddressRange::addHostnameRegexUTF8(const std::string &regex_string)
@@ -292,6 +482,7 @@ void SocketAddressRange::addHostnameRegexUTF8(const std::string &regex_string)
     if (p.second.isInvalid()) return;
 
     hostname_regexes.push_back(p);
+    hostname_regex_cache.clear();
 }
 
 void SocketAddressRange::deleteHostnameRegexUTF8(const std::string &regex_string)
@@ -303,81 +494,76 @@ void SocketAddressRange::deleteHostnameRegexUTF8(const std::string &regex_string
             continue;
 
         hostname_regexes.erase(i1);
+        hostname_regex_cache.clear();
         return;
     }
 }
 
-bool SocketAddressRange::testAddress(const SocketAddress &sa) const
+bool SocketAddressRange::runMatcher(const vector<MatcherNode> &matcher, const ui32* parts, size_t parts_count)
 {
-    SocketAddress sa_copy = sa;
-    sa_copy.setPort(0);
-    sa_copy.setHostnameUTF8("");
+    if (matcher.empty()) return false;
 
-    set<SocketAddress>::const_iterator i1 = individual_socket_addresses.find(sa_copy);
-    if (i1 != individual_socket_addresses.end())
-        return true;
+    i32 node_index = (i32) matcher.size() - 1;
+    size_t i1;
+    for (i1 = 0; i1 < parts_count; ++i1)
+    {
+        const MatcherNode &node = matcher[node_index];
+        size_t interval = (upper_bound(node.starts.begin(), node.starts.end(), parts[i1]) - node.starts.begin()) - 1;
+        node_index = node.next[interval];
+        if (node_index == MATCHER_MATCH) return true;
+        if (node_index == MATCHER_NO_MATCH) return false;
+    }
 
-    switch (sa.getIPProtocol())
+    return false;
+}
+
+bool SocketAddressRange::testHostnameRegexes(const string &name) const
+{
+    map<string, bool>::const_iterator i1 = hostname_regex_cache.find(name);
+    if (i1 != hostname_regex_cache.end())
+        return i1->second;
+
+    bool result = false;
+    vector<pair<string, Regex> >::const_iterator i2, hostname_regexes_end = hostname_regexes.end();
+    for (i2 = hostname_regexes.begin(); i2 != hostname_regexes_end; ++i2)
     {
-        case IPv4:
+        Regex r = i2->second;
+        if (r.execute(name))
         {
-            struct sockaddr_in sai;
-            sa.getRawIPv4Sockaddr(&sai);
+            result = true;
+            break;
+        }
+    }
 
-            ui32 addr = ntohl(sai.sin_addr.s_addr);
-            ui32 a = (addr & 0xff000000) >> 24;
-            ui32 b = (addr & 0x00ff0000) >> 16;
-            ui32 c = (addr & 0x0000ff00) >> 8;
-            ui32 d = (addr & 0x000000ff);
+    if (hostname_regex_cache.size() >= MAX_HOSTNAME_REGEX_CACHE_SIZE)
+        hostname_regex_cache.clear();
+    hostname_regex_cache[name] = result;
 
-            ui32 i1, len = IPv4_ranges.size();
-            assert( (len % 4) == 0);
+    return result;
+}
 
-            for (i1 = 0; i1 < len; i1 += 4)
-            {
-                if (!IPv4_ranges[i1].isInRange(a)) continue;
-                if (!IPv4_ranges[i1+1].isInRange(b)) continue;
-                if (!IPv4_ranges[i1+2].isInRange(c)) continue;
-                if (!IPv4_ranges[i1+3].isInRange(d)) continue;
+bool SocketAddressRange::testAddress(const SocketAddress &sa) const
+{
+    ui32 parts[8];
 
+    switch (sa.getIPProtocol())
+    {
+        case IPv4:
+        {
+            struct sockaddr_in sai;
+            sa.getRawIPv4Sockaddr(&sai);
+            split_IPv4_address(sai, parts);
+            if (runMatcher(IPv4_matcher, parts, 4))
                 return true;
-            }
         }
         break;
         case IPv6:
         {
             struct sockaddr_in6 sai6;
             sa.getRawIPv6Sockaddr(&sai6);
-
-            ui16 a, b, c, d, e, f, g, h;
-            
-            const char* buf = (const char*) &sai6.sin6_addr;
-
-            a = ((ui16) buf[0] << 8) + buf[1];
-            b = ((ui16) buf[2] << 8) + buf[3];
-            c = ((ui16) buf[4] << 8) + buf[5];
-            d = ((ui16) buf[6] << 8) + buf[7];
-            e = ((ui16) buf[8] << 8) + buf[9];
-            f = ((ui16) buf[10] << 8) + buf[11];
-            g = ((ui16) buf[12] << 8) + buf[13];
-            h = ((ui16) buf[14] << 8) + buf[15];
-
-            ui32 i1, len = IPv6_ranges.size();
-            assert( (len % 8) == 0);
-
-            for (i1 = 0; i1 < len; i1 += 8)
-            {
-                if (!IPv6_ranges[i1].isInRange(a)) continue;
-                if (!IPv6_ranges[i1+1].isInRange(b)) continue;
-                if (!IPv6_ranges[i1+2].isInRange(c)) continue;
-                if (!IPv6_ranges[i1+3].isInRange(d)) continue;
-                if (!IPv6_ranges[i1+4].isInRange(e)) continue;
-                if (!IPv6_ranges[i1+5].isInRange(f)) continue;
-                if (!IPv6_ranges[i1+6].isInRange(g)) continue;
-                if (!IPv6_ranges[i1+7].isInRange(h)) continue;
-
+            split_IPv6_address(sai6, parts);
+            if (runMatcher(IPv6_matcher, parts, 8))
                 return true;
-            }
         }
         break;
         default:
@@ -386,19 +572,11 @@ bool SocketAddressRange::testAddress(const SocketAddress &sa) const
     }
 
     /* Finally, test hostnames. */
-    string hostname = sa.getHostnameUTF8();
-    string address_name = sa.getHumanReadablePlainUTF8WithoutPort();
-    vector<pair<string, Regex> >::const_iterator i2, hostname_regexes_end = hostname_regexes.end();
-    for (i2 = hostname_regexes.begin(); i2 != hostname_regexes_end; ++i2)
-    {
-        Regex r = i2->second;
-        if (r.execute(hostname))
-            return true;
-        if (r.execute(address_name))
-            return true;
-    }
+    if (hostname_regexes.empty()) return false;
 
-    return false;
+    if (testHostnameRegexes(sa.getHostnameUTF8()))
+        return true;
+    return testHostnameRegexes(sa.getHumanReadablePlainUTF8WithoutPort());
 };
 
 void SocketAddressRange::getSocketAddressesToVector(vector<SocketAddress> &vec) const
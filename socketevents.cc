@@ -1,5 +1,6 @@
 #include "sockets.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 #include <iostream>
 #ifdef _WIN32
     #ifndef __WIN32
@@ -13,21 +14,53 @@ using namespace dfterm;
 using namespace trankesbel;
 using namespace std;
 
+/* Events are polled in batches of this many, and polling is repeated while
+   batches come full, up to this many batches for one wait. A busy level-triggered
+   descriptor can't then keep the loop from returning. */
+static const int EVENT_BATCH_SIZE = 10;
+static const int MAX_EVENT_BATCHES = 100;
+
 /* epoll() based handling */
 #ifndef _WIN32
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 SocketEvents::SocketEvents()
 {
     epoll_desc = -1;
     prune_counter = 0;
+
+    if (pipe(wakeup_pipe))
+    {
+        wakeup_pipe[0] = wakeup_pipe[1] = -1;
+        LOG(Error, "pipe() failed. Resolved host names may be noticed late.");
+    }
+    else
+    {
+        fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(wakeup_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wakeup_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
 }
 
 SocketEvents::~SocketEvents()
 {
     if (epoll_desc != -1) close(epoll_desc);
     epoll_desc = -1;
+    if (wakeup_pipe[0] != -1) close(wakeup_pipe[0]);
+    if (wakeup_pipe[1] != -1) close(wakeup_pipe[1]);
+}
+
+void SocketEvents::wakeUp()
+{
+    if (wakeup_pipe[1] == -1) return;
+    /* If the pipe is full, there's already a wake-up pending. */
+    char c = 0;
+    ssize_t result = write(wakeup_pipe[1], &c, 1);
+    (void) result;
 }
 
 void SocketEvents::addSocket(WP<Socket> socket)
@@ -36,7 +69,18 @@ void SocketEvents::addSocket(WP<Socket> socket)
     char* err2;
 
     if (epoll_desc == -1)
+    {
         epoll_desc = epoll_create(20);
+        if (epoll_desc != -1 && wakeup_pipe[0] != -1)
+        {
+            /* Level-triggered, the pipe is emptied in _getEvent() as soon as it's seen. */
+            struct epoll_event ee;
+            memset(&ee, 0, sizeof(struct epoll_event));
+            ee.data.fd = wakeup_pipe[0];
+            ee.events = EPOLLIN;
+            epoll_ctl(epoll_desc, EPOLL_CTL_ADD, wakeup_pipe[0], &ee);
+        }
+    }
     if (epoll_desc == -1)
     {
         errstr[499] = 0;
@@ -110,25 +154,36 @@ WP<Socket> SocketEvents::_getEvent(uint64_t timeout_nanoseconds, bool ignore_for
     if (epoll_desc == -1) return SP<Socket>();
     if (target_sockets.empty()) return SP<Socket>();
 
-    struct epoll_event ee[10];
+    struct epoll_event ee[EVENT_BATCH_SIZE];
     vector<epoll_event> ee_events;
 
-    int result_i = 0;
+    int result_i = 0, batches = 0;
     do
     {
-        result_i = epoll_wait(epoll_desc, ee, 10, timeout_nanoseconds / 1000000);
+        result_i = epoll_wait(epoll_desc, ee, EVENT_BATCH_SIZE, timeout_nanoseconds / 1000000);
         if (result_i == -1 && errno != EINTR)
             return SP<Socket>();
         else if (result_i == -1 && errno == EINTR)
             continue;
 
         for (int i1 = 0; i1 < result_i; ++i1)
+        {
+            /* The pipe is level-triggered, so it's emptied right away.
+               Otherwise it would come up again in the next poll. */
+            if (ee[i1].data.fd == wakeup_pipe[0])
+            {
+                char buf[64];
+                while (read(wakeup_pipe[0], buf, 64) > 0) { };
+                continue;
+            }
             ee_events.push_back(ee[i1]);
+        }
 
         timeout_nanoseconds = 0;
-    } while(result_i > 0);
+    } while(result_i == EVENT_BATCH_SIZE && ++batches < MAX_EVENT_BATCHES);
 
     if (ee_events.size() == 0) return SP<Socket>();
+    dfterm::metric_observe(dfterm::MetricEventBatchSize, ee_events.size());
 
     vector<epoll_event>::iterator i2, ee_events_end = ee_events.end();
     map<int, WP<Socket> >::iterator target_sockets_end = target_sockets.end();
@@ -136,8 +191,17 @@ WP<Socket> SocketEvents::_getEvent(uint64_t timeout_nanoseconds, bool ignore_for
     for (i2 = ee_events.begin(); i2 != ee_events_end; ++i2)
     {
         map<int, WP<Socket> >::iterator i1 = target_sockets.find(i2->data.fd);
-        if (i1 != target_sockets_end)
-            forced_events.insert(i1->second);
+        if (i1 == target_sockets_end) continue;
+
+        /* Zero copy completions arrive in the error queue. Reap them here
+           so an idle socket doesn't keep its sent buffers pinned until
+           the next send. */
+        if (i2->events & EPOLLERR)
+        {
+            SP<Socket> s = i1->second.lock();
+            if (s) s->reapZeroCopyCompletions();
+        }
+        forced_events.insert(i1->second);
     }
 
     result = SP<Socket>();
@@ -161,17 +225,43 @@ SP<Socket> SocketEvents::getEvent(uint64_t timeout_nanoseconds)
 #include <sys/event.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 SocketEvents::SocketEvents()
 {
     prune_counter = 0;
     kqueue_desc = -1;
+
+    if (pipe(wakeup_pipe))
+    {
+        wakeup_pipe[0] = wakeup_pipe[1] = -1;
+        LOG(Error, "pipe() failed. Resolved host names may be noticed late.");
+    }
+    else
+    {
+        fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(wakeup_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wakeup_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
 }
 
 SocketEvents::~SocketEvents()
 {
     if (kqueue_desc != -1)
         close(kqueue_desc);
+    if (wakeup_pipe[0] != -1) close(wakeup_pipe[0]);
+    if (wakeup_pipe[1] != -1) close(wakeup_pipe[1]);
+}
+
+void SocketEvents::wakeUp()
+{
+    if (wakeup_pipe[1] == -1) return;
+    /* If the pipe is full, there's already a wake-up pending. */
+    char c = 0;
+    ssize_t result = write(wakeup_pipe[1], &c, 1);
+    (void) result;
 }
 
 void SocketEvents::addSocket(WP<Socket> socket)
@@ -193,6 +283,13 @@ void SocketEvents::addSocket(WP<Socket> socket)
                         << errorstr);
             abort();
         }
+
+        if (wakeup_pipe[0] != -1)
+        {
+            struct kevent ke;
+            EV_SET(&ke, wakeup_pipe[0], EVFILT_READ, EV_ADD|EV_ENABLE, 0, 0, NULL);
+            kevent(kqueue_desc, &ke, 1, 0, 0, NULL);
+        }
     }
     assert(kqueue_desc != -1);
 
@@ -260,17 +357,17 @@ WP<Socket> SocketEvents::_getEvent(uint64_t timeout_nanoseconds, bool ignore_for
     if (kqueue_desc == -1) return SP<Socket>();
     if (target_sockets.empty()) return SP<Socket>();
 
-    struct kevent ke[10];
+    struct kevent ke[EVENT_BATCH_SIZE];
     vector<struct kevent> ke_events;
     struct timespec ts;
 
     ts.tv_sec = timeout_nanoseconds / 1000000000;
     ts.tv_nsec = timeout_nanoseconds % 1000000000;
 
-    int result_i = 0;
+    int result_i = 0, batches = 0;
     do
     {
-        result_i = kevent(kqueue_desc, 0, 0, ke, 10, &ts);
+        result_i = kevent(kqueue_desc, 0, 0, ke, EVENT_BATCH_SIZE, &ts);
         if (result_i == -1 && errno != EINTR)
         {
             char errstr[500];
@@ -283,12 +380,22 @@ WP<Socket> SocketEvents::_getEvent(uint64_t timeout_nanoseconds, bool ignore_for
             continue;
 
         for (int i1 = 0; i1 < result_i; ++i1)
+        {
+            /* Emptied right away, see the epoll version. */
+            if ((int) ke[i1].ident == wakeup_pipe[0])
+            {
+                char buf[64];
+                while (read(wakeup_pipe[0], buf, 64) > 0) { };
+                continue;
+            }
             ke_events.push_back(ke[i1]);
+        }
 
         ts.tv_sec = ts.tv_nsec = 0;
-    } while(result_i > 0);
+    } while(result_i == EVENT_BATCH_SIZE && ++batches < MAX_EVENT_BATCHES);
 
     if (ke_events.size() == 0) return SP<Socket>();
+    dfterm::metric_observe(dfterm::MetricEventBatchSize, ke_events.size());
 
     vector<struct kevent>::iterator i2, ke_events_end = ke_events.end();
     map<int, WP<Socket> >::iterator target_sockets_end = target_sockets.end();
@@ -322,10 +429,19 @@ SP<Socket> SocketEvents::getEvent(uint64_t timeout_nanoseconds)
 SocketEvents::SocketEvents()
 {
     prune_counter = 0;
-    event_objects = (WSAEVENT*) 0;
-    event_sockets = (WP<Socket>*) 0;
-    event_size = 0;
-    event_size_allocated = 0;
+    event_objects = new WSAEVENT[1];
+    event_sockets = new WP<Socket>[1];
+    event_size = 1;
+    event_size_allocated = 1;
+
+    /* Manual reset, reset when getEvent() notices it. */
+    event_objects[0] = WSACreateEvent();
+}
+
+void SocketEvents::wakeUp()
+{
+    if (event_objects[0] != WSA_INVALID_EVENT)
+        WSASetEvent(event_objects[0]);
 }
 
 SocketEvents::~SocketEvents()
@@ -416,8 +532,9 @@ void SocketEvents::pruneTargetSockets()
         }
     } while(do_repeat);
 
+    /* Index 0 is the wake-up event. */
     size_t i2;
-    for (i2 = 0; i2 < event_size; ++i2)
+    for (i2 = 1; i2 < event_size; ++i2)
     {
         if (event_objects[i2] == WSA_INVALID_EVENT)
             continue;
@@ -446,7 +563,7 @@ SP<Socket> SocketEvents::getEvent(uint64_t timeout_nanoseconds)
         prune_counter = 0;
     }
 
-    if (event_size == 0) return SP<Socket>();
+    if (event_size <= 1) return SP<Socket>();
 
     SP<Socket> result_s;
     while (!result_s && !forced_events.empty())
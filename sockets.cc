@@ -1,6 +1,7 @@
 #define _WIN32_WINNT 0x0501
 
 #include "sockets.hpp"
+#include "resolver.hpp"
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
@@ -8,6 +9,7 @@
 #include <fcntl.h>
 #include "types.hpp"
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/bind.hpp>
 #include "unicode/unistr.h"
 
 #ifdef _WIN32
@@ -20,8 +22,30 @@
 #include <ws2tcpip.h>
 #else
 #include <unistd.h>
+#include <sys/uio.h>
+#include <limits.h>
 #endif
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY
+#endif
+
+/* Maximum number of zero copy sends waiting for
+   completion before we start copying again. */
+#define MAX_PENDING_ZEROCOPY_SENDS 256
+
+/* Maximum number of buffers in one sendv() call. */
+#define MAX_SENDV_SPANS 64
+
 using namespace trankesbel;
 using namespace std;
 using namespace boost;
@@ -30,11 +54,6 @@ using namespace boost;
 static bool winsock_initialized = false;
 static recursive_mutex winsock_initialized_mutex;
 
-static void second_wait(int seconds)
-{
-    Sleep(seconds * 1000);
-}
-
 static void test_initialize_winsock()
 {
     lock_guard<recursive_mutex> lock(winsock_initialized_mutex);
@@ -63,10 +82,6 @@ static void test_winsock_shutdown()
     }
 }
 #else
-static void second_wait(int seconds)
-{
-    sleep(seconds);
-}
 static void test_winsock_shutdown() { };
 static void test_initialize_winsock() { };
 #endif
@@ -287,6 +302,7 @@ struct address_info_s
 #ifdef _WIN32
 static int getSocketError() { return WSAGetLastError(); };
 static int getEWOULDBLOCK() { return WSAEWOULDBLOCK; };
+static int getEINPROGRESS() { return WSAEWOULDBLOCK; };
 static void resetSocketError() { WSASetLastError(0); };
 
 static string getErrorStringSocketsError(int error_code)
@@ -302,6 +318,7 @@ static string getErrorStringSocketsError(int error_code)
 #else
 static int getSocketError() { return errno; };
 static int getEWOULDBLOCK() { return EWOULDBLOCK; };
+static int getEINPROGRESS() { return EINPROGRESS; };
 static void resetSocketError() { errno = 0; };
 
 static string getErrorStringSocketsError(int error_code)
@@ -381,20 +398,11 @@ void SocketAddress::getHumanReadable_thread(void* address_info)
     service_buf[500] = 0;
     int result;
 
-    int max_wait = 20;
-    do
-    {
-        if (ais->fam == IPv4)
-            result = getnameinfo((struct sockaddr*) &ais->sa4, sizeof(ais->sa4), node_buf, 500, service_buf, 500, NI_NUMERICHOST|NI_NUMERICSERV);
-        else
-            result = getnameinfo((struct sockaddr*) &ais->sa6, sizeof(ais->sa6), node_buf, 500, service_buf, 500, NI_NUMERICHOST|NI_NUMERICSERV);
-
-        if (result == EAI_AGAIN)
-            second_wait(1);
-        else
-            break;
-    }
-    while( (max_wait--) > 0);
+    /* Numeric conversion doesn't ask any name server, so there is nothing to retry. */
+    if (ais->fam == IPv4)
+        result = getnameinfo((struct sockaddr*) &ais->sa4, sizeof(ais->sa4), node_buf, 500, service_buf, 500, NI_NUMERICHOST|NI_NUMERICSERV);
+    else
+        result = getnameinfo((struct sockaddr*) &ais->sa6, sizeof(ais->sa6), node_buf, 500, service_buf, 500, NI_NUMERICHOST|NI_NUMERICSERV);
 
     if (!result)
     {
@@ -457,22 +465,20 @@ void SocketAddress::getHumanReadable(function3<void, bool, string, string> human
     ais->signal_function = humanreadable_signal;
     ais->fam = ip_protocol;
 
-    thread thread_lookup(getHumanReadable_thread, (void*) ais);
-    if (block)
-        thread_lookup.join();
-    else
-        thread_lookup.detach();
+    /* Numeric conversion only, no need for a thread. */
+    getHumanReadable_thread((void*) ais);
 }
 
-void SocketAddress::resolve_thread(string address_string, string service_string, function3<void, bool, SocketAddress, string> readysignal)
+SocketAddress SocketAddress::resolveNow(string address_string, string service_string, bool* success, string* errormsg)
 {
     struct addrinfo *ai = (struct addrinfo*) 0;
     int result = getaddrinfo(address_string.c_str(), service_string.c_str(), NULL, &ai);
     if (result)
     {
         if (ai) freeaddrinfo(ai);
-        readysignal(false, SocketAddress(), getErrorStringEAI(result));
-        return;
+        if (success) (*success) = false;
+        if (errormsg) (*errormsg) = getErrorStringEAI(result);
+        return SocketAddress();
     }
 
     struct addrinfo *i1;
@@ -490,9 +496,9 @@ void SocketAddress::resolve_thread(string address_string, string service_string,
                 sa.ip_protocol = IPv4;
                 memcpy(&sa.sa4, i1->ai_addr, sizeof(sa.sa4));
                 sa.sa4.sin_family = PF_INET;
-                readysignal(true, sa, "");
+                if (success) (*success) = true;
                 freeaddrinfo(ai);
-                return;
+                return sa;
             }
             if (i1->ai_family == PF_INET6)
             {
@@ -500,22 +506,17 @@ void SocketAddress::resolve_thread(string address_string, string service_string,
                 sa.ip_protocol = IPv6;
                 memcpy(&sa.sa6, i1->ai_addr, sizeof(sa.sa6));
                 sa.sa6.sin6_family = PF_INET6;
-                readysignal(true, sa, "");
+                if (success) (*success) = true;
                 freeaddrinfo(ai);
-                return;
+                return sa;
             }
         }
     };
 
     freeaddrinfo(ai);
-    readysignal(false, SocketAddress(), "Could not find supported address for asked name.");
-}
-
-static void resolve_callback(bool success, SocketAddress sa, string errormsg, bool* success2, SocketAddress* sa2, string* errormsg2)
-{
-    (*success2) = success;
-    (*errormsg2) = errormsg;
-    (*sa2) = sa;
+    if (success) (*success) = false;
+    if (errormsg) (*errormsg) = "Could not find supported address for asked name.";
+    return SocketAddress();
 }
 
 SocketAddress SocketAddress::resolvePlainUTF8(std::string address_string, std::string service_string, bool* success, std::string* errormsg)
@@ -578,30 +579,25 @@ SocketAddress SocketAddress::resolvePlainUTF8(std::string address_string, std::s
     return SocketAddress();
 }
 
-SocketAddress SocketAddress::resolveUTF8(string address_string, string service_string, bool* success2, string* errormsg2)
+SocketAddress SocketAddress::resolveUTF8(string address_string, string service_string, bool* success, string* errormsg)
 {
-    string result_str;
-    bool success = false;
-    SocketAddress sa;
-
-    function3<void, bool, SocketAddress, string> callback;
-    callback = boost::bind(resolve_callback, _1, _2, _3, &success, &sa, &result_str);
-
-    resolve(address_string, service_string, callback, true);
-
-    if (errormsg2) (*errormsg2) = result_str;
-    if (success2) (*success2) = success;
-
-    return sa;
+    return Resolver::getInstance()->resolveBlocking(address_string, service_string, success, errormsg);
 }
 
 void SocketAddress::resolve(string address_string, string service_string, function3<void, bool, SocketAddress, string> readysignal, bool block)
 {
-    thread socketaddress_creation(resolve_thread, address_string, service_string, readysignal);
+    if (!readysignal) return;
+
     if (block)
-        socketaddress_creation.join();
-    else
-        socketaddress_creation.detach();
+    {
+        bool success = false;
+        string errormsg;
+        SocketAddress sa = Resolver::getInstance()->resolveBlocking(address_string, service_string, &success, &errormsg);
+        readysignal(success, sa, errormsg);
+        return;
+    }
+
+    Resolver::getInstance()->resolveDirect(address_string, service_string, readysignal);
 }
 
 ui16 SocketAddress::getPort() const
@@ -652,6 +648,9 @@ Socket::Socket()
 {
     socket_desc = INVALID_SOCKET;
     listening_socket = false;
+    connecting = false;
+    zero_copy_enabled = false;
+    zero_copy_sequence = 0;
 }
 
 Socket::~Socket()
@@ -665,7 +664,10 @@ Socket::Socket(SOCKET new_socket_desc, const SocketAddress &sa)
 {
     socket_desc = new_socket_desc;
     listening_socket = false;
+    connecting = false;
     socket_addr = SP<SocketAddress>(new SocketAddress(sa));
+    zero_copy_enabled = false;
+    zero_copy_sequence = 0;
 }
 
 SOCKET Socket::getRawSocket()
@@ -674,7 +676,7 @@ SOCKET Socket::getRawSocket()
     return socket_desc;
 }
 
-bool Socket::createSocket(const SocketAddress &sa, bool also_bind)
+bool Socket::createSocket(const SocketAddress &sa, bool also_bind, bool share_port)
 {
     lock_guard<recursive_mutex> lock(socket_mutex);
     socket_desc = INVALID_SOCKET;
@@ -699,6 +701,23 @@ bool Socket::createSocket(const SocketAddress &sa, bool also_bind)
             socket_desc = INVALID_SOCKET;
             return false;
         }
+        if (share_port)
+        {
+#ifdef SO_REUSEPORT
+            if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, (const char*) &flag, sizeof(flag)))
+            {
+                socket_error = string("setsockopt() failure. ") + getErrorStringSocketsError(getSocketError());
+                closesocket(socket_desc);
+                socket_desc = INVALID_SOCKET;
+                return false;
+            }
+#else
+            socket_error = "Port sharing (SO_REUSEPORT) is not supported on this platform.";
+            closesocket(socket_desc);
+            socket_desc = INVALID_SOCKET;
+            return false;
+#endif
+        }
         if (sa.ip_protocol == IPv4) 
             result = ::bind(socket_desc, (struct sockaddr*) &sa.sa4, sizeof(sa.sa4));
         else
@@ -843,7 +862,80 @@ bool Socket::connect(const SocketAddress &sa)
     return true;
 }
 
-bool Socket::listen(const SocketAddress &sa)
+bool Socket::connectNonBlocking(const SocketAddress &sa)
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (socket_desc != INVALID_SOCKET)
+    {
+        socket_error = "Socket is active; can't start connecting.";
+        return false;
+    }
+    if (async_connect_thread)
+    {
+        socket_error = "Asynchronous connecting in progress; can't start connecting.";
+        return false;
+    }
+
+    listening_socket = false;
+
+    if (!createSocket(sa, false))
+        return false;
+
+#ifndef _WIN32
+    int flags = fcntl(socket_desc, F_GETFL, 0);
+    fcntl(socket_desc, F_SETFL, flags | O_NONBLOCK);
+#else
+    unsigned long non_blocking_mode = 1;
+    ioctlsocket(socket_desc, FIONBIO, &non_blocking_mode);
+#endif
+
+    int result = -1;
+    if (sa.ip_protocol == IPv4)
+        result = ::connect(socket_desc, (struct sockaddr*) &sa.sa4, sizeof(sa.sa4));
+    else
+        result = ::connect(socket_desc, (struct sockaddr*) &sa.sa6, sizeof(sa.sa6));
+
+    if (result == -1 && getSocketError() != getEINPROGRESS())
+    {
+        socket_error = string("connect() failure. ") + getErrorStringSocketsError(getSocketError());
+        closesocket(socket_desc);
+        socket_desc = INVALID_SOCKET;
+        return false;
+    }
+
+    connecting = (result == -1);
+    socket_addr = SP<SocketAddress>(new SocketAddress(sa));
+    return true;
+}
+
+bool Socket::finishConnect()
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (socket_desc == INVALID_SOCKET) return false;
+    if (!connecting) return true;
+
+    int error_code = 0;
+    socklen_t error_code_size = sizeof(error_code);
+    if (getsockopt(socket_desc, SOL_SOCKET, SO_ERROR, (char*) &error_code, &error_code_size))
+        error_code = getSocketError();
+    if (error_code)
+    {
+        socket_error = string("connect() failure. ") + getErrorStringSocketsError(error_code);
+        close();
+        return false;
+    }
+
+    /* No error may also mean it's not done yet. It is done when there's a peer. */
+    sockaddr_max_t peer;
+    socklen_t peer_size = sizeof(peer);
+    if (getpeername(socket_desc, (struct sockaddr*) &peer, &peer_size))
+        return false;
+
+    connecting = false;
+    return true;
+}
+
+bool Socket::listen(const SocketAddress &sa, bool share_port)
 {
     lock_guard<recursive_mutex> lock(socket_mutex);
     if (socket_desc != INVALID_SOCKET)
@@ -859,10 +951,12 @@ bool Socket::listen(const SocketAddress &sa)
 
     listening_socket = false;
 
-    if (!createSocket(sa, true))
+    if (!createSocket(sa, true, share_port))
         return false;
 
-    int result = ::listen(socket_desc, 10);
+    /* Let the kernel queue as many connections as it allows; a burst
+       of reconnecting clients would overflow a short backlog. */
+    int result = ::listen(socket_desc, SOMAXCONN);
     if (result)
     {
         socket_error = string("listen() failure. ") + getErrorStringSocketsError(getSocketError());
@@ -895,11 +989,19 @@ void Socket::close()
 
     lock_guard<recursive_mutex> lock(socket_mutex);
 
+    /* Release what the kernel has already finished with. The rest is
+       dropped below; the kernel holds its own references to those pages. */
+    reapZeroCopyCompletions();
+
     if (socket_desc != INVALID_SOCKET)
         closesocket(socket_desc);
     socket_desc = INVALID_SOCKET;
     listening_socket = false;
+    connecting = false;
     socket_addr = SP<SocketAddress>();
+    zero_copy_enabled = false;
+    zero_copy_sequence = 0;
+    zero_copy_pinned.clear();
 }
 
 bool Socket::accept(Socket* accept_socket)
@@ -958,44 +1060,95 @@ bool Socket::accept(Socket* accept_socket)
     return true;
 }
 
-SocketAddress Socket::getAddress()
+size_t Socket::acceptBatch(vector<SP<Socket> > &accepted, size_t max_accepts)
 {
     lock_guard<recursive_mutex> lock(socket_mutex);
-    if (!socket_addr) return SocketAddress();
-    return *socket_addr.get();
-}
-
-static void set_async_socketaddress_hostname(string address_string, SP<SocketAddress> address)
-{
-    if (!address) return;
+    if (socket_desc == INVALID_SOCKET) return 0;
+    if (!listening_socket) return 0;
 
-    /* For now, use regexes to throw away the port part
-       of the address string. */
-    Regex IPv4_regex("^([0-9.]+):(.+)$");
-    if (IPv4_regex.execute(address_string))
-        address_string = IPv4_regex.getMatch(1);
-    else
+    size_t accepts = 0;
+    while (accepts < max_accepts)
     {
-        Regex IPv6_regex("^\\[([0-9a-fA-F:]+)\\]:(.+)$");
-        if (IPv6_regex.execute(address_string))
-            address_string = IPv6_regex.getMatch(1);
+        /* Get the peer address from accept() itself, saves
+           a getpeername() call per connection. */
+        sockaddr_max_t sa_struct;
+        memset(&sa_struct, 0, sizeof(sockaddr_max_t));
+        socklen_t sa_struct_len = sizeof(sa_struct);
+
+        SOCKET new_socket_desc;
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+        new_socket_desc = ::accept4(socket_desc, (struct sockaddr*) &sa_struct, &sa_struct_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        new_socket_desc = ::accept(socket_desc, (struct sockaddr*) &sa_struct, &sa_struct_len);
+#endif
+        if (new_socket_desc == INVALID_SOCKET)
+        {
+            int err = getSocketError();
+            if (err == getEWOULDBLOCK()) break;
+#ifndef _WIN32
+            /* The connection went away before we got to it. 
+               Not a problem with the listening socket. */
+            if (err == ECONNABORTED || err == EPROTO || err == EINTR) continue;
+            /* Out of descriptors or memory. Leave the rest in
+               the queue and try again later. */
+            if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) break;
+#else
+            if (err == WSAECONNRESET || err == WSAEINTR) continue;
+            if (err == WSAEMFILE || err == WSAENOBUFS) break;
+#endif
+            close();
+            break;
+        }
+
+        SocketAddress sa;
+        struct sockaddr* sa2 = (struct sockaddr*) &sa_struct;
+        if (sa2->sa_family == PF_INET)
+            sa = SocketAddress((struct sockaddr_in*) &sa_struct);
+        else if (sa2->sa_family == PF_INET6)
+            sa = SocketAddress((struct sockaddr_in6*) &sa_struct);
         else
-            return;
+        {
+            ::closesocket(new_socket_desc);
+            continue;
+        }
+
+#if !(defined(__linux__) && defined(SOCK_NONBLOCK))
+#ifndef _WIN32
+        int flags = fcntl(new_socket_desc, F_GETFL, 0);
+        fcntl(new_socket_desc, F_SETFL, flags | O_NONBLOCK);
+        fcntl(new_socket_desc, F_SETFD, FD_CLOEXEC);
+#else
+        unsigned long non_blocking_mode = 1;
+        ioctlsocket(new_socket_desc, FIONBIO, &non_blocking_mode);
+#endif
+#endif
+
+        accepted.push_back(SP<Socket>(new Socket(new_socket_desc, sa)));
+        ++accepts;
     }
 
-    bool success = false;
-    string hostname = reverseResolveUTF8(address_string, &success);
-    if (!success) return;
+    return accepts;
+}
 
+SocketAddress Socket::getAddress()
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (!socket_addr) return SocketAddress();
+    return *socket_addr.get();
+}
+
+static void set_socketaddress_hostname(bool success, string hostname, SP<SocketAddress> address, function0<void> resolved)
+{
+    if (!success || !address) return;
     address->setHostnameUTF8(hostname);
+    if (resolved) resolved();
 }
 
-void Socket::startAsynchronousReverseResolve()
+void Socket::startAsynchronousReverseResolve(function0<void> resolved)
 {
     lock_guard<recursive_mutex> lock(socket_mutex);
-    string addr = socket_addr->getHumanReadablePlainUTF8();
-    thread t(set_async_socketaddress_hostname, addr, socket_addr);
-    t.detach();
+    if (!socket_addr) return;
+    Resolver::getInstance()->reverseResolve(*socket_addr.get(), boost::bind(set_socketaddress_hostname, _1, _2, socket_addr, resolved));
 }
 
 bool Socket::active()
@@ -1028,6 +1181,213 @@ size_t Socket::send(const void* data, size_t datalen)
     return result;
 }
 
+size_t Socket::sendv(const DataSpan* spans, size_t spans_count)
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (socket_desc == INVALID_SOCKET) return 0;
+    if (listening_socket) return 0;
+    if (spans_count == 0) return 0;
+    if (spans_count > MAX_SENDV_SPANS) spans_count = MAX_SENDV_SPANS;
+
+#ifndef _WIN32
+    struct iovec iov[MAX_SENDV_SPANS];
+    size_t i1;
+    for (i1 = 0; i1 < spans_count; ++i1)
+    {
+        iov[i1].iov_base = (void*) spans[i1].data;
+        iov[i1].iov_len = spans[i1].size;
+    }
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = spans_count;
+
+    resetSocketError();
+    ssize_t result = ::sendmsg(socket_desc, &mh, 0);
+    if (result == -1)
+    {
+        if (getSocketError() == getEWOULDBLOCK()) return 0;
+        close();
+        return 0;
+    }
+    return (size_t) result;
+#else
+    WSABUF wsabuf[MAX_SENDV_SPANS];
+    size_t i1;
+    for (i1 = 0; i1 < spans_count; ++i1)
+    {
+        wsabuf[i1].buf = (char*) spans[i1].data;
+        wsabuf[i1].len = (ULONG) spans[i1].size;
+    }
+
+    DWORD sent = 0;
+    int result = WSASend(socket_desc, wsabuf, (DWORD) spans_count, &sent, 0, NULL, NULL);
+    if (result == SOCKET_ERROR)
+    {
+        if (getSocketError() == getEWOULDBLOCK()) return 0;
+        close();
+        return 0;
+    }
+    return (size_t) sent;
+#endif
+}
+
+size_t Socket::sendFile(int fd, ui64 offset, size_t count, bool* end_of_file)
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (end_of_file) (*end_of_file) = false;
+    if (socket_desc == INVALID_SOCKET) return 0;
+    if (listening_socket) return 0;
+    if (count == 0) return 0;
+
+#ifdef __linux__
+    off_t off = (off_t) offset;
+    resetSocketError();
+    ssize_t result = ::sendfile(socket_desc, fd, &off, count);
+    if (result == -1)
+    {
+        if (getSocketError() == getEWOULDBLOCK()) return 0;
+        close();
+        return 0;
+    }
+    if (result == 0 && end_of_file) (*end_of_file) = true;
+    return (size_t) result;
+#else
+    /* What doesn't get sent is just read again on the next call. */
+    char buf[65536];
+    if (count > 65536) count = 65536;
+    #ifdef _WIN32
+    int result = -1;
+    if (_lseeki64(fd, (__int64) offset, SEEK_SET) != -1)
+        result = _read(fd, buf, (unsigned int) count);
+    #else
+    ssize_t result = ::pread(fd, buf, count, (off_t) offset);
+    #endif
+    if (result <= 0)
+    {
+        if (end_of_file) (*end_of_file) = true;
+        return 0;
+    }
+    return send(buf, (size_t) result);
+#endif
+}
+
+bool Socket::enableZeroCopy()
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (socket_desc == INVALID_SOCKET) return false;
+    if (listening_socket) return false;
+    if (zero_copy_enabled) return true;
+
+#ifdef HAVE_ZEROCOPY
+    const int flag = 1;
+    if (setsockopt(socket_desc, SOL_SOCKET, SO_ZEROCOPY, (const char*) &flag, sizeof(flag)))
+        return false;
+    zero_copy_enabled = true;
+    zero_copy_sequence = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Socket::isZeroCopyEnabled()
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    return zero_copy_enabled;
+}
+
+void Socket::reapZeroCopyCompletions()
+{
+#ifdef HAVE_ZEROCOPY
+    lock_guard<recursive_mutex> lock(socket_mutex);
+    if (socket_desc == INVALID_SOCKET) return;
+    if (zero_copy_pinned.empty()) return;
+
+    while (!zero_copy_pinned.empty())
+    {
+        char control[128];
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        ssize_t result = ::recvmsg(socket_desc, &mh, MSG_ERRQUEUE);
+        if (result == -1) return;
+
+        struct cmsghdr* cm;
+        for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err* see = (struct sock_extended_err*) CMSG_DATA(cm);
+            if (see->ee_errno != 0 || see->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* Completions are reported as a range [ee_info, ee_data] of 
+               sequence numbers. For TCP, they complete in order. */
+            ui32 last_done = see->ee_data;
+            while (!zero_copy_pinned.empty() &&
+                   (i32) (last_done - zero_copy_pinned.front().first) >= 0)
+                zero_copy_pinned.pop_front();
+        }
+    }
+#endif
+}
+
+size_t Socket::sendvZeroCopy(const DataSpan* spans, size_t spans_count, const vector<SP<const void> > &owners)
+{
+    lock_guard<recursive_mutex> lock(socket_mutex);
+#ifdef HAVE_ZEROCOPY
+    if (socket_desc == INVALID_SOCKET) return 0;
+    if (listening_socket) return 0;
+    if (spans_count == 0) return 0;
+
+    reapZeroCopyCompletions();
+    if (!zero_copy_enabled || zero_copy_pinned.size() >= MAX_PENDING_ZEROCOPY_SENDS)
+        return sendv(spans, spans_count);
+
+    if (spans_count > MAX_SENDV_SPANS) spans_count = MAX_SENDV_SPANS;
+
+    struct iovec iov[MAX_SENDV_SPANS];
+    size_t i1;
+    for (i1 = 0; i1 < spans_count; ++i1)
+    {
+        iov[i1].iov_base = (void*) spans[i1].data;
+        iov[i1].iov_len = spans[i1].size;
+    }
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = spans_count;
+
+    resetSocketError();
+    ssize_t result = ::sendmsg(socket_desc, &mh, MSG_ZEROCOPY);
+    if (result == -1)
+    {
+        if (getSocketError() == getEWOULDBLOCK()) return 0;
+        if (getSocketError() == ENOBUFS)
+        {
+            /* Out of locked memory for zero copy. Copy this time. */
+            return sendv(spans, spans_count);
+        }
+        close();
+        return 0;
+    }
+
+    /* Each successful call gets a sequence number, whether the
+       kernel ended up copying or not. */
+    zero_copy_pinned.push_back(pair<ui32, vector<SP<const void> > >(zero_copy_sequence++, owners));
+    return (size_t) result;
+#else
+    return sendv(spans, spans_count);
+#endif
+}
+
 size_t Socket::recv(void* data, size_t datalen)
 {
     lock_guard<recursive_mutex> lock(socket_mutex);
@@ -1080,10 +1440,8 @@ void trankesbel::shutdownSockets()
 }
 
 
-static void reverse_resolve_function(const SocketAddress &sa, function2<void, bool, string> signal_func)
+string trankesbel::reverseResolveNow(const SocketAddress &sa, bool* success)
 {
-    if (!signal_func) return;
-
     struct sockaddr_in sa4;
     struct sockaddr_in6 sa6;
     bool use_ipv4 = false;
@@ -1096,48 +1454,49 @@ static void reverse_resolve_function(const SocketAddress &sa, function2<void, bo
     else
         sa.getRawIPv6Sockaddr(&sa6);
 
-
-    int max_wait = 20;
-
     char node_name[2001], service_name[2001];
     node_name[2000] = 0;
     service_name[2000] = 0;
 
+    /* EAI_AGAIN (name server not answering) is not retried; it's a failure
+       like any other, and the resolver caches it for a while. Retrying
+       would hold a resolver thread for many seconds per address. */
     int result = 0;
-    do
-    {
-        if (use_ipv4)
-            result = getnameinfo((struct sockaddr*) &sa4, sizeof(sa4), node_name, 2000, service_name, 2000, NI_NAMEREQD);
-        else
-            result = getnameinfo((struct sockaddr*) &sa6, sizeof(sa6), node_name, 2000, service_name, 2000, NI_NAMEREQD);
-
-        if (result == EAI_AGAIN)
-            second_wait(1);
-        else
-            break;
-    } while ( (max_wait--) > 0);
+    if (use_ipv4)
+        result = getnameinfo((struct sockaddr*) &sa4, sizeof(sa4), node_name, 2000, service_name, 2000, NI_NAMEREQD);
+    else
+        result = getnameinfo((struct sockaddr*) &sa6, sizeof(sa6), node_name, 2000, service_name, 2000, NI_NAMEREQD);
 
+    if (success) (*success) = (result == 0);
     if (!result)
-        signal_func(true, string(node_name));
-    else
-        signal_func(false, getErrorStringEAI(result));
+        return string(node_name);
+    return getErrorStringEAI(result);
 }
 
 void trankesbel::reverseResolveUTF8(const SocketAddress &sa, function2<void, bool, string> func, bool block)
 {
-    thread reverse_resolve_thread(reverse_resolve_function, sa, func);
+    if (!func) return;
+
     if (block)
-        reverse_resolve_thread.join();
-    else
-        reverse_resolve_thread.detach();
+    {
+        bool success = false;
+        string host_or_error = Resolver::getInstance()->reverseResolveBlocking(sa, &success);
+        func(success, host_or_error);
+        return;
+    }
+
+    Resolver::getInstance()->reverseResolveDirect(sa, func);
 }
 
 static void reverse_resolve_proxy(bool success, SocketAddress sa, string errormsg, function2<void, bool, string> func)
 {
     if (!success)
+    {
         func(false, errormsg);
+        return;
+    }
 
-    reverse_resolve_function(sa, func);
+    Resolver::getInstance()->reverseResolveDirect(sa, func);
 }
 
 void trankesbel::reverseResolveUTF8(string address, function2<void, bool, string> func, bool block)
@@ -13,7 +13,9 @@
 #include <boost/thread.hpp>
 #include <string>
 #include <set>
+#include <map>
 #include <vector>
+#include <deque>
 #include "types.hpp"
 #ifndef _WIN32
 #include <sys/socket.h>
@@ -68,7 +70,6 @@ class SocketAddress
         boost::recursive_mutex hostname_mutex;
 
         static void getHumanReadable_thread(void* address_info);
-        static void resolve_thread(std::string address_string, std::string service_string, boost::function3<void, bool, SocketAddress, std::string> readysignal);
 
         SocketAddress(const struct sockaddr_in* sai);
         SocketAddress(const struct sockaddr_in6* sai6);
@@ -93,16 +94,14 @@ class SocketAddress
         /* Copies raw IPv6 sockaddr_in6 structure to sai6 */
         void getRawIPv6Sockaddr(struct sockaddr_in6* sai) const;
 
-        /* Returns human readable form of the address. The call is asynchronous (unless you set block to true),
-           and result is then 'signalled' to the given callback function.
-           It creates a thread for this purpose so thread-safety issues are relevant. 
+        /* Returns human readable form of the address to the given callback function.
+           The address is not resolved to a name, so this never waits for the network
+           and the signal is always sent before the call returns, whatever 'block' is.
            The first bool argument tells if converting the address was succeful.
            If it's true, the string contains the address in human readable form.
            If it's false, the string contains error message. The second
            string is undefined on error, otherwise it's the service name of
-           address (port number). 
-
-           If block is true, the call won't return until it has sent the signal. */
+           address (port number). */
         void getHumanReadable(boost::function3<void, bool, std::string, std::string> humanreadable_signal, bool block);
         /* Returns human readable form of the address. Never blocks and never resolves the address to anything. 
            The address will be in plain IPv4 or IPv6 form. */
@@ -111,8 +110,9 @@ class SocketAddress
         
 
         /* Resolves an internet address to a new class. The call is asynchronous (unless you set block to true).
-           Just like getHumanReadable(), same thread issues apply.
-           The signal function is called when resolving is ready, with the boolean argument as true
+           Lookups are done in the resolver thread pool (see resolver.hpp) and the signal
+           function is called from one of its threads, or from the calling thread if the
+           result was cached. It is called when resolving is ready, with the boolean argument as true
            if resolving was successful and false if it was not. 
 
            The third argument to ready signal function is the error message, if resolving fails.
@@ -129,6 +129,9 @@ class SocketAddress
         /* Resolves the address immediately (i.e. never blocks). If the address is not in IP-address
            form, the call will most likely fail. */
         static SocketAddress resolvePlainUTF8(std::string address_string, std::string service_string, bool* success, std::string* errormsg);
+        /* Resolves the address in the calling thread, without the resolver cache. 
+           Blocks while looking up hostnames. You probably want resolveUTF8() instead. */
+        static SocketAddress resolveNow(std::string address_string, std::string service_string, bool* success, std::string* errormsg);
 
         /* Gets/sets the port this socket address points to. */
         ui16 getPort() const;
@@ -168,6 +171,8 @@ void reverseResolveUTF8(const SocketAddress &sa, boost::function2<void, bool, st
    If the resolving fails, returns an error message and 'success', if not NULL, is set to false (otherwise true). */
 std::string reverseResolveUTF8(std::string address, bool* success);
 std::string reverseResolveUTF8(const SocketAddress &sa, bool* success);
+/* Reverse resolves in the calling thread, without the resolver cache. Always blocks. */
+std::string reverseResolveNow(const SocketAddress &sa, bool* success);
 
 class NumberRange
 {
@@ -242,6 +247,42 @@ class SocketAddressRange
         std::vector<NumberRange> IPv6_ranges;  // .size() % 8 == 0
         std::vector<std::pair<std::string, Regex> > hostname_regexes;
 
+        /* The addresses and ranges above are compiled into a tree
+           with one level per number in the address (4 for IPv4, 8 for IPv6).
+           Each node splits the numbers into intervals, and each interval
+           points to the node for the next number, or tells if the address
+           matches. Nodes that would be the same are shared. Testing an address
+           is then a binary search per level, no matter how many rules there are. */
+        struct MatcherNode
+        {
+            /* Interval i covers numbers from starts[i] to starts[i+1]-1. starts[0] is 0. */
+            std::vector<ui32> starts;
+            /* Index of next node, or MATCHER_MATCH/MATCHER_NO_MATCH. */
+            std::vector<i32> next;
+        };
+        /* Root is the last node, as it is compiled last. Empty if nothing can match. */
+        std::vector<MatcherNode> IPv4_matcher;
+        std::vector<MatcherNode> IPv6_matcher;
+
+        /* Results of running hostname regexes, by tested string. 
+           Cleared whenever regexes change. */
+        mutable std::map<std::string, bool> hostname_regex_cache;
+
+        /* Nodes already compiled, by level and a hash of the rules that
+           apply. The rules are kept to tell hash collisions apart. */
+        typedef std::map<std::pair<size_t, ui64>, std::pair<std::vector<size_t>, i32> > MatcherMemo;
+
+        /* Rebuilds IPv4_matcher and IPv6_matcher. Called after every change. */
+        void compile();
+        static i32 compileMatcherNode(std::vector<MatcherNode> &matcher,
+                                      const std::vector<NumberRange> &ranges,
+                                      size_t parts,
+                                      size_t level,
+                                      const std::vector<size_t> &rules,
+                                      MatcherMemo &memo);
+        static bool runMatcher(const std::vector<MatcherNode> &matcher, const ui32* parts, size_t parts_count);
+        bool testHostnameRegexes(const std::string &name) const;
+
 
     public:
         /* Clears all rules from the range. After this call,
@@ -305,7 +346,9 @@ class SocketAddressRange
 
         /* Tests an address against this range. Returns true
            if there's a match and false if there is not. 
-           The port number in socket address is ignored. */
+           The port number in socket address is ignored. 
+           Results of hostname regexes are cached inside the range, so 
+           don't call this from many threads at once for the same range. */
         bool testAddress(const SocketAddress &sa) const;
         
         /* Adds all individual addresses to the given vector. 
@@ -351,6 +394,8 @@ class Socket
         std::string socket_error;
         SP<SocketAddress> socket_addr;
         bool listening_socket;
+        /* Set while a connection started with connectNonBlocking() is not ready. */
+        bool connecting;
 
         /* Mutex for all operations. Needed when
            connecting asynchronously. */
@@ -358,10 +403,19 @@ class Socket
         /* Thread for asynchronous connection */
         SP<boost::thread> async_connect_thread;
 
+        /* Zero copy sending (MSG_ZEROCOPY). The kernel reads the 
+           memory after sendmsg() has returned, so buffers are kept alive
+           here, keyed by sequence number of the send, until the kernel
+           reports them done. */
+        bool zero_copy_enabled;
+        ui32 zero_copy_sequence;
+        std::deque<std::pair<ui32, std::vector<SP<const void> > > > zero_copy_pinned;
+
         /* Thread object when connecting asynchronously. */
 
-        /* Creates and binds the socket descriptor, if it can. */
-        bool createSocket(const SocketAddress &sa, bool also_bind);
+        /* Creates and binds the socket descriptor, if it can. 
+           If 'share_port' is true, the socket is bound with SO_REUSEPORT. */
+        bool createSocket(const SocketAddress &sa, bool also_bind, bool share_port = false);
 
         /* thread function for asynchronous connections */
         void connectAsynchronous_thread(SocketAddress sa, boost::function1<void, bool> callback_function);
@@ -380,8 +434,11 @@ class Socket
         /* Starts an asynchronous request to reverse resolve the
            address of this socket. At some point in future,
            the hostname /may/ be set to the address you get
-           from Socket::getAddress().getHostname(). */
-        void startAsynchronousReverseResolve();
+           from Socket::getAddress().getHostname(). The hostname
+           is set from Resolver::dispatchCompleted(), so that it
+           changes in the event loop thread. If the lookup succeeds,
+           'resolved' is called after the hostname has been set. */
+        void startAsynchronousReverseResolve(boost::function0<void> resolved = boost::function0<void>());
 
         /* Returns true if socket is active. */
         bool active();
@@ -389,7 +446,12 @@ class Socket
         /* Bind the socket to given address and start listening. 
            Returns true if listening was successful, false, if it was not.
            Sets error string (Socket::getError()) if there's an error. */
-        bool listen(const SocketAddress &sa);
+        bool listen(const SocketAddress &sa) { return listen(sa, false); };
+        /* Same as above, but if 'share_port' is true, the socket is bound with
+           SO_REUSEPORT so that several sockets can listen on the same address. 
+           The kernel then spreads incoming connections between them. Fails
+           on platforms that don't have SO_REUSEPORT. */
+        bool listen(const SocketAddress &sa, bool share_port);
 
         /* Try to connect to given address. The call blocks. 
            Returns either true or false, depending on success. 
@@ -407,6 +469,16 @@ class Socket
            This call itself always returns true, unless there's already asynchronous connection
            in process, in which case it returns false. */
         bool connectAsynchronous(const SocketAddress &sa, boost::function1<void, bool> callback_function);
+        /* Starts connecting to given address without blocking and without a thread.
+           Returns false if that fails right away; error message is then in
+           Socket::getError(). Otherwise the socket is active, and you should
+           put it in SocketEvents and call Socket::finishConnect() when it
+           gets an event. */
+        bool connectNonBlocking(const SocketAddress &sa);
+        /* Checks a connection started with connectNonBlocking(). Returns true
+           when it is ready. Returns false if it is still connecting, or if it failed,
+           in which case the socket closes and the error message is in Socket::getError(). */
+        bool finishConnect();
 
         /* Closes the socket down. */
         void close();
@@ -421,6 +493,13 @@ class Socket
            It has to be a closed socket or this method will always return false. 
            Socket may close if there's an error, you should check with Socket::active(). */
         bool accept(Socket* accept_socket);
+        /* Accepts up to 'max_accepts' pending connections in one go and appends
+           them to 'accepted'. Returns the number of connections accepted, which is 0
+           if there were none pending. Where accept4() is available, the new sockets
+           are created non-blocking and close-on-exec without extra system calls.
+           Connections that were aborted before we got to them are skipped. 
+           Socket may close if there's an error, you should check with Socket::active(). */
+        size_t acceptBatch(std::vector<SP<Socket> > &accepted, size_t max_accepts);
 
         /* Send data through socket. Returns the number of bytes written, which may be less
            than requested amount and even 0.
@@ -429,6 +508,31 @@ class Socket
            Does not set error string in any case. */
         size_t send(const void* data, size_t datalen);
         size_t send(std::string data) { return send((const void*) data.c_str(), data.size()); };
+        /* Same as send(), but sends several buffers at once (sendmsg()/WSASend()),
+           in the order they are in 'spans'. Returns the total number of bytes written. */
+        size_t sendv(const DataSpan* spans, size_t spans_count);
+
+        /* Sends up to 'count' bytes of file descriptor 'fd' starting at 'offset' 
+           (sendfile() on Linux, elsewhere the file is read into a buffer and sent).
+           Returns the number of bytes written, like send(). If the file ends before
+           anything could be sent, sets 'end_of_file' to true. The file offset of
+           'fd' may change. */
+        size_t sendFile(int fd, ui64 offset, size_t count, bool* end_of_file);
+
+        /* Turns on zero copy sending for this socket. Returns false if
+           the platform or kernel doesn't support it. */
+        bool enableZeroCopy();
+        bool isZeroCopyEnabled();
+        /* Same as sendv(), but the kernel reads the data directly from the buffers
+           instead of copying it. 'owners' must hold the memory of the spans; 
+           the socket keeps references to them until the kernel is done with them. 
+           Falls back to sendv() if zero copy is not enabled or too many sends 
+           are still pending. */
+        size_t sendvZeroCopy(const DataSpan* spans, size_t spans_count, const std::vector<SP<const void> > &owners);
+        /* Releases buffers of zero copy sends that the kernel has completed.
+           Called by sendvZeroCopy(), close() and SocketEvents when the socket
+           reports error queue readiness, you don't normally need to call this. */
+        void reapZeroCopyCompletions();
 
         /* Receive data from socket. Returns the number of bytes read. Does not block.
            If there's an error or connection otherwise closes, socket closes down and you
@@ -453,16 +557,20 @@ class SocketEvents
         #ifndef __WIN32
         #ifdef __linux__
         int epoll_desc;
+        /* wakeUp() writes to [1], and epoll waits on [0]. */
+        int wakeup_pipe[2];
 
         WP<Socket> _getEvent(uint64_t timeout_nanoseconds, bool ignore_forced_events);
         #elif __FreeBSD__
         int kqueue_desc;
+        int wakeup_pipe[2];
 
         WP<Socket> _getEvent(uint64_t timeout_nanoseconds, bool ignore_forced_events);
         #endif
 
         #else
-        /* Normal c-style array for easy interfacing with winsock */
+        /* Normal c-style array for easy interfacing with winsock.
+           The first event is the one set by wakeUp() and has no socket. */
         WSAEVENT* event_objects;
         WP<Socket>* event_sockets;
         size_t event_size;
@@ -493,6 +601,11 @@ class SocketEvents
          * is not thread-safe. */
         void forceEvent(SP<Socket> socket);
 
+        /* Makes a getEvent() call that is blocking (or the next one) return
+           a null reference right away. Unlike the other calls, this one
+           is thread-safe and does not need the object to be locked. */
+        void wakeUp();
+
         /* Returns a socket where an event occured. Blocks if no events are occuring
          * May indicate socket is now ready for writing or reading or maybe neither. 
          * If there are no sockets in the class, returns null reference. 
@@ -0,0 +1,474 @@
+#include "spectator.hpp"
+#include "slot.hpp"
+#include "slot_mirror.hpp"
+#include "logger.hpp"
+#include "marshal.hpp"
+#include "interface_ncurses.hpp"
+#include "dfterm2_limits.hpp"
+#include <cassert>
+
+using namespace dfterm;
+using namespace trankesbel;
+using namespace std;
+
+/* Viewers that haven't acknowledged this many frames don't get more deltas. */
+static const ui32 MAX_UNACKED_SPECTATOR_FRAMES = 30;
+/* Viewers that have this many frames waiting to be sent don't get more deltas. */
+static const size_t MAX_QUEUED_SPECTATOR_FRAMES = 4;
+/* Changed cells that have fewer unchanged cells than this between
+   them go to the same span. */
+static const size_t SPECTATOR_SPAN_MERGE_GAP = 8;
+/* Largest screen that is captured. */
+static const ui32 MAX_SPECTATOR_SCREEN_SIZE = 1000;
+
+static ui32 pack_cell(const CursesElement &ce)
+{
+    return (ce.Symbol & 0x1FFFFF) |
+           (((ui32) ce.Foreground & 0x7) << 21) |
+           (((ui32) ce.Background & 0x7) << 24) |
+           (ce.Bold ? (1 << 27) : 0);
+}
+
+static void put_varint(string* out, ui32 v)
+{
+    while (v >= 0x80)
+    {
+        out->push_back((char) ((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    out->push_back((char) v);
+}
+
+/* Appends cells as runs of the same cell. */
+static void put_runs(string* out, const ui32* cells, size_t count)
+{
+    size_t i1 = 0;
+    while (i1 < count)
+    {
+        size_t i2 = i1 + 1;
+        while (i2 < count && cells[i2] == cells[i1]) ++i2;
+        put_varint(out, (ui32) (i2 - i1));
+        appendLittleEndian32(out, cells[i1]);
+        i1 = i2;
+    }
+}
+
+void SpectatorCaptureWindow::setMinimumSize(ui32 width, ui32 height)
+{
+    if (width > MAX_SPECTATOR_SCREEN_SIZE) width = MAX_SPECTATOR_SCREEN_SIZE;
+    if (height > MAX_SPECTATOR_SCREEN_SIZE) height = MAX_SPECTATOR_SCREEN_SIZE;
+    if (width == this->width && height == this->height) return;
+
+    this->width = width;
+    this->height = height;
+    cells.assign(width * height, pack_cell(CursesElement()));
+}
+
+KeyPress SpectatorCaptureWindow::getKeyPress()
+{
+    return KeyPress();
+}
+
+void SpectatorCaptureWindow::setScreenDisplay(const ui32* elements, ui32 element_pitch, ui32 width, ui32 height, ui32 x, ui32 y)
+{
+    /* Element identifiers have no colors; show them as plain symbols. */
+    ui32 i1, i2;
+    for (i2 = 0; i2 < height && i2 + y < this->height; ++i2)
+        for (i1 = 0; i1 < width && i1 + x < this->width; ++i1)
+            cells[(i1 + x) + (i2 + y) * this->width] = pack_cell(CursesElement(elements[i1 + i2 * element_pitch], White, Black, false));
+}
+
+void SpectatorCaptureWindow::setScreenDisplayNewElements(const void* elements, size_t element_size, ui32 element_pitch, ui32 width, ui32 height, ui32 x, ui32 y)
+{
+    assert(element_size == sizeof(CursesElement));
+
+    const CursesElement* ce = (const CursesElement*) elements;
+    ui32 i1, i2;
+    for (i2 = 0; i2 < height && i2 + y < this->height; ++i2)
+        for (i1 = 0; i1 < width && i1 + x < this->width; ++i1)
+            cells[(i1 + x) + (i2 + y) * this->width] = pack_cell(ce[i1 + i2 * element_pitch]);
+}
+
+void SpectatorCaptureWindow::setScreenDisplayFill(ui32 element_index, ui32 width, ui32 height, ui32 x, ui32 y)
+{
+    ui32 cell = pack_cell(CursesElement(element_index, White, Black, false));
+    ui32 i1, i2;
+    for (i2 = 0; i2 < height && i2 + y < this->height; ++i2)
+        for (i1 = 0; i1 < width && i1 + x < this->width; ++i1)
+            cells[(i1 + x) + (i2 + y) * this->width] = cell;
+}
+
+void SpectatorCaptureWindow::setScreenDisplayFillNewElement(const void* element, size_t element_size, ui32 width, ui32 height, ui32 x, ui32 y)
+{
+    assert(element_size == sizeof(CursesElement));
+
+    ui32 cell = pack_cell(*((const CursesElement*) element));
+    ui32 i1, i2;
+    for (i2 = 0; i2 < height && i2 + y < this->height; ++i2)
+        for (i1 = 0; i1 < width && i1 + x < this->width; ++i1)
+            cells[(i1 + x) + (i2 + y) * this->width] = cell;
+}
+
+SpectatorFeed::SpectatorFeed(SP<Slot> slot)
+{
+    assert(slot);
+    this->slot = slot;
+    capture = SP<SpectatorCaptureWindow>(new SpectatorCaptureWindow);
+    generation = 0;
+    width = height = 0;
+    links = 0;
+
+    string payload;
+    payload.push_back((char) 3);
+    payload.append(slot->getNameUTF8());
+    name_frame = WebSocketSession::makeFrame(payload);
+}
+
+bool SpectatorFeed::captureFrame()
+{
+    SP<Slot> s = slot.lock();
+    if (!s) return false;
+    if (s->isMirror())
+        return captureMirrorFrame(boost::static_pointer_cast<SlotMirror>(s));
+
+    s->unloadToWindow(capture);
+
+    ui32 w = capture->getWidth();
+    ui32 h = capture->getHeight();
+    const vector<ui32> &new_cells = capture->getCells();
+    if (generation != 0 && w == width && h == height && new_cells == cells)
+        return false;
+
+    bool resized = (generation == 0 || w != width || h != height);
+    ++generation;
+    if (generation == 0) generation = 1;
+
+    string payload;
+    payload.push_back((char) (resized ? 1 : 2));
+    appendLittleEndian32(&payload, generation);
+    appendLittleEndian16(&payload, w);
+    appendLittleEndian16(&payload, h);
+
+    if (resized)
+        put_runs(&payload, new_cells.empty() ? (const ui32*) 0 : &new_cells[0], new_cells.size());
+    else
+    {
+        size_t i1 = 0, last_end = 0, count = new_cells.size();
+        while (i1 < count)
+        {
+            if (new_cells[i1] == cells[i1]) { ++i1; continue; };
+
+            size_t start = i1, end = i1 + 1;
+            while (end < count)
+            {
+                if (new_cells[end] != cells[end]) { ++end; continue; };
+
+                size_t gap = end;
+                while (gap < count && gap - end < SPECTATOR_SPAN_MERGE_GAP && new_cells[gap] == cells[gap]) ++gap;
+                if (gap < count && gap - end < SPECTATOR_SPAN_MERGE_GAP)
+                    end = gap;
+                else
+                    break;
+            }
+
+            put_varint(&payload, (ui32) (start - last_end));
+            put_varint(&payload, (ui32) (end - start));
+            put_runs(&payload, &new_cells[start], end - start);
+            last_end = end;
+            i1 = end;
+        }
+    }
+
+    cells = new_cells;
+    width = w;
+    height = h;
+
+    delta = WebSocketSession::makeFrame(payload);
+    delta_payload = SP<const string>(new string(payload));
+    keyframe.reset();
+    keyframe_payload.reset();
+    if (resized)
+    {
+        keyframe = delta;
+        keyframe_payload = delta_payload;
+    }
+
+    return true;
+}
+
+bool SpectatorFeed::captureMirrorFrame(SP<SlotMirror> mirror)
+{
+    ui32 new_generation, w, h;
+    vector<ui32> new_cells;
+    SP<const string> frame;
+    mirror->getFrame(&new_generation, &w, &h, &new_cells, &frame);
+    if (new_generation == 0 || new_generation == generation || !frame) return false;
+
+    ui32 expected = generation + 1;
+    if (expected == 0) expected = 1;
+    bool keyframe_received = ((*frame)[0] == 1);
+
+    cells.swap(new_cells);
+    width = w;
+    height = h;
+    generation = new_generation;
+    keyframe.reset();
+    keyframe_payload.reset();
+
+    if (keyframe_received || new_generation == expected)
+        delta_payload = frame;
+    else
+        delta_payload = getKeyframePayload();
+    delta = WebSocketSession::makeFrame(*delta_payload);
+
+    if ((*delta_payload)[0] == 1)
+    {
+        keyframe = delta;
+        keyframe_payload = delta_payload;
+    }
+    return true;
+}
+
+SP<const string> SpectatorFeed::getKeyframePayload()
+{
+    if (keyframe_payload || generation == 0) return keyframe_payload;
+
+    string payload;
+    payload.push_back((char) 1);
+    appendLittleEndian32(&payload, generation);
+    appendLittleEndian16(&payload, width);
+    appendLittleEndian16(&payload, height);
+    put_runs(&payload, cells.empty() ? (const ui32*) 0 : &cells[0], cells.size());
+
+    keyframe_payload = SP<const string>(new string(payload));
+    return keyframe_payload;
+}
+
+SP<const string> SpectatorFeed::getKeyframe()
+{
+    if (keyframe || generation == 0) return keyframe;
+
+    keyframe = WebSocketSession::makeFrame(*getKeyframePayload());
+    return keyframe;
+}
+
+Spectator::Spectator(SP<Socket> s, SP<SpectatorFeed> feed)
+{
+    assert(s && feed);
+    ws.setSocket(s);
+    this->feed = feed;
+    sent_generation = 0;
+    unacked_frames = 0;
+    behind = false;
+
+    ws.queueFrame(feed->getNameFrame());
+}
+
+void Spectator::feedInput(const string &data)
+{
+    vector<string> messages;
+    ws.feed(data.data(), data.size(), &messages);
+}
+
+void Spectator::sendKeyframe()
+{
+    if (feed->getGeneration() == 0) return;
+
+    ws.queueFrame(feed->getKeyframe());
+    sent_generation = feed->getGeneration();
+    ++unacked_frames;
+    behind = false;
+}
+
+void Spectator::frameReady()
+{
+    if (!ws.isActive()) return;
+
+    ui32 generation = feed->getGeneration();
+    if (sent_generation == 0)
+        sendKeyframe();
+    else if (!behind && sent_generation == generation - 1 &&
+             unacked_frames < MAX_UNACKED_SPECTATOR_FRAMES &&
+             ws.getQueuedFrames() < MAX_QUEUED_SPECTATOR_FRAMES)
+    {
+        ws.queueFrame(feed->getDelta());
+        sent_generation = generation;
+        ++unacked_frames;
+    }
+    else
+        behind = true;
+
+    ws.flush();
+}
+
+void Spectator::cycle()
+{
+    vector<string> messages;
+    ws.readMessages(&messages);
+
+    vector<string>::iterator i1, messages_end = messages.end();
+    for (i1 = messages.begin(); i1 != messages_end; ++i1)
+    {
+        const string &m = (*i1);
+        if (m.size() < 5 || m[0] != 1) continue;
+
+        ui32 generation = readLittleEndian32(m.data() + 1);
+        /* Frames sent after the acknowledged one. Ignore nonsense. */
+        ui32 after = sent_generation - generation;
+        if (after < unacked_frames) unacked_frames = after;
+    }
+    ws.flush();
+
+    if (behind && unacked_frames == 0 && ws.getQueuedFrames() == 0 && ws.isActive())
+    {
+        if (sent_generation != feed->getGeneration())
+            sendKeyframe();
+        else
+            behind = false;
+        ws.flush();
+    }
+}
+
+void Spectator::close(ui16 code)
+{
+    ws.close(code);
+    ws.flush();
+}
+
+bool SpectatorServer::addSpectator(SP<Socket> s, SP<Slot> slot, const string &leftover)
+{
+    assert(s && slot);
+
+    if (spectators.size() >= MAX_SPECTATORS)
+    {
+        LOG(Note, "Spectator connection from " << s->getAddress().getHumanReadablePlainUTF8() << " closed, as maximum number (" << MAX_SPECTATORS << ") of spectators has been reached.");
+        s->close();
+        return false;
+    }
+
+    /* A feed left from a closed slot may have the same address. */
+    SP<SpectatorFeed> &feed = feeds[slot.get()];
+    if (!feed || feed->getSlot().lock() != slot)
+        feed = SP<SpectatorFeed>(new SpectatorFeed(slot));
+
+    SP<Spectator> spectator(new Spectator(s, feed));
+    spectators[s] = spectator;
+    feed->viewers.push_back(spectator);
+
+    LOG(Note, "Spectator from " << s->getAddress().getHumanReadablePlainUTF8() << " is watching slot " << slot->getNameUTF8());
+
+    spectator->feedInput(leftover);
+    if (feed->getGeneration() == 0)
+        feed->captureFrame();
+    spectator->frameReady();
+    spectator->cycle();
+
+    if (!s->active())
+    {
+        spectators.erase(s);
+        return false;
+    }
+    return true;
+}
+
+bool SpectatorServer::socketEvent(SP<Socket> s)
+{
+    map<SP<Socket>, SP<Spectator> >::iterator i1 = spectators.find(s);
+    if (i1 == spectators.end()) return false;
+
+    SP<Spectator> spectator = i1->second;
+    spectator->cycle();
+    if (!s->active())
+        spectators.erase(s);
+    return true;
+}
+
+SP<SpectatorFeed> SpectatorServer::slotData(SP<Slot> slot)
+{
+    map<const Slot*, SP<SpectatorFeed> >::iterator i1 = feeds.find(slot.get());
+    if (i1 == feeds.end()) return SP<SpectatorFeed>();
+    SP<SpectatorFeed> feed = i1->second;
+
+    /* Forget viewers that are gone. */
+    vector<WP<Spectator> > &viewers = feed->viewers;
+    size_t i2, live = 0, viewers_size = viewers.size();
+    for (i2 = 0; i2 < viewers_size; ++i2)
+        if (!viewers[i2].expired())
+            viewers[live++] = viewers[i2];
+    viewers.resize(live);
+
+    if (viewers.empty() && feed->links == 0)
+    {
+        feeds.erase(i1);
+        return SP<SpectatorFeed>();
+    }
+
+    /* This is done once, no matter how many are watching. */
+    if (!feed->captureFrame()) return SP<SpectatorFeed>();
+
+    for (i2 = 0; i2 < live; ++i2)
+    {
+        SP<Spectator> spectator = viewers[i2].lock();
+        if (!spectator) continue;
+
+        spectator->frameReady();
+        SP<Socket> s = spectator->getSocket();
+        if (!s->active())
+            spectators.erase(s);
+    }
+    return feed;
+}
+
+SP<SpectatorFeed> SpectatorServer::linkFeed(SP<Slot> slot)
+{
+    assert(slot);
+
+    SP<SpectatorFeed> &feed = feeds[slot.get()];
+    if (!feed || feed->getSlot().lock() != slot)
+        feed = SP<SpectatorFeed>(new SpectatorFeed(slot));
+
+    ++feed->links;
+    if (feed->getGeneration() == 0)
+        feed->captureFrame();
+    return feed;
+}
+
+void SpectatorServer::unlinkFeed(SP<SpectatorFeed> feed)
+{
+    assert(feed && feed->links > 0);
+    --feed->links;
+    /* The feed is forgotten in slotData() if no one is watching it either. */
+}
+
+void SpectatorServer::closeSlot(const Slot* slot, ui16 code)
+{
+    map<const Slot*, SP<SpectatorFeed> >::iterator i1 = feeds.find(slot);
+    if (i1 == feeds.end()) return;
+    SP<SpectatorFeed> feed = i1->second;
+    feeds.erase(i1);
+
+    vector<WP<Spectator> >::iterator i2, viewers_end = feed->viewers.end();
+    for (i2 = feed->viewers.begin(); i2 != viewers_end; ++i2)
+    {
+        SP<Spectator> spectator = i2->lock();
+        if (!spectator) continue;
+
+        spectator->close(code);
+        SP<Socket> s = spectator->getSocket();
+        if (!s->active())
+            spectators.erase(s);
+    }
+}
+
+vector<SP<Slot> > SpectatorServer::getWatchedSlots()
+{
+    vector<SP<Slot> > result;
+    map<const Slot*, SP<SpectatorFeed> >::iterator i1, feeds_end = feeds.end();
+    for (i1 = feeds.begin(); i1 != feeds_end; ++i1)
+    {
+        SP<Slot> slot = i1->second->getSlot().lock();
+        if (slot) result.push_back(slot);
+    }
+    return result;
+}
+
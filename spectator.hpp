@@ -0,0 +1,223 @@
+/*
+
+Read-only viewers of slots, connected with WebSocket (see
+HTTPServer::serveWebSocket()). The screen of a slot is captured and
+encoded once per change, and the same encoded frame is sent to every
+viewer of the slot, so a viewer costs little more than the bytes sent to it.
+
+Protocol. Messages are binary WebSocket messages; numbers are little endian,
+"varint" is an unsigned LEB128 number. A cell is a 32-bit number: bits 0-20
+are the unicode symbol, 21-23 the foreground color, 24-26 the background
+color and bit 27 is set for bold. Colors are the curses color numbers.
+
+Server to viewer:
+  1 (u8), generation (u32), width (u16), height (u16), runs
+     Keyframe. The whole screen as runs; a run is a count (varint)
+     and a cell (u32) repeated that many times. Cells go left to right,
+     top to bottom.
+  2 (u8), generation (u32), width (u16), height (u16), spans
+     Delta from the frame 'generation - 1'. A span is the number of
+     unchanged cells before it (varint), the number of cells in it (varint)
+     and runs (as above) that cover those cells. Spans continue to the
+     end of the message.
+  3 (u8), name (UTF-8)
+     Name of the slot being watched. Sent first.
+
+Viewer to server:
+  1 (u8), generation (u32)
+     Acknowledges a frame. The server stops sending deltas to viewers
+     that fall too many frames behind, and sends them a keyframe when they
+     have acknowledged everything they were sent.
+
+*/
+
+#ifndef spectator_hpp
+#define spectator_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include "types.hpp"
+#include "interface.hpp"
+#include "sockets.hpp"
+#include "websocket.hpp"
+
+namespace dfterm
+{
+
+class Slot;
+class SlotMirror;
+class Spectator;
+
+/* A 2D window that just keeps what a slot draws to it, as cells of
+   the spectator protocol. */
+class SpectatorCaptureWindow : public trankesbel::Interface2DWindow
+{
+    private:
+        trankesbel::ui32 width, height;
+        std::vector<trankesbel::ui32> cells;
+
+    public:
+        SpectatorCaptureWindow() { width = height = 0; };
+
+        const std::vector<trankesbel::ui32>& getCells() const { return cells; };
+
+        void setTitle(UnicodeString title) { };
+        void setTitleUTF8(std::string title) { };
+        UnicodeString getTitle() const { return UnicodeString(); };
+        std::string getTitleUTF8() const { return std::string(); };
+        void gainFocus() { };
+
+        /* The window is always exactly the minimum size. */
+        void setMinimumSize(trankesbel::ui32 width, trankesbel::ui32 height);
+        void getSize(trankesbel::ui32* width, trankesbel::ui32* height) { (*width) = this->width; (*height) = this->height; };
+        trankesbel::ui32 getWidth() { return width; };
+        trankesbel::ui32 getHeight() { return height; };
+
+        void setInputCallback(boost::function1<void, const trankesbel::KeyPress&> input_callback) { };
+        void setResizeCallback(boost::function2<void, trankesbel::ui32, trankesbel::ui32> resize_callback) { };
+        trankesbel::KeyPress getKeyPress();
+
+        void setScreenDisplay(const trankesbel::ui32* elements, trankesbel::ui32 element_pitch, trankesbel::ui32 width, trankesbel::ui32 height, trankesbel::ui32 x = 0, trankesbel::ui32 y = 0);
+        void setScreenDisplayNewElements(const void* elements, size_t element_size,
+                                         trankesbel::ui32 element_pitch, trankesbel::ui32 width, trankesbel::ui32 height, trankesbel::ui32 x = 0, trankesbel::ui32 y = 0);
+        void setScreenDisplayFill(trankesbel::ui32 element_index, trankesbel::ui32 width, trankesbel::ui32 height, trankesbel::ui32 x = 0, trankesbel::ui32 y = 0);
+        void setScreenDisplayFillNewElement(const void* element, size_t element_size, trankesbel::ui32 width, trankesbel::ui32 height, trankesbel::ui32 x = 0, trankesbel::ui32 y = 0);
+};
+
+/* Frames of one slot and the viewers watching it. */
+class SpectatorFeed
+{
+    private:
+        WP<Slot> slot;
+        SP<SpectatorCaptureWindow> capture;
+
+        /* Current frame. Generation 0 means there is no frame yet. */
+        trankesbel::ui32 generation;
+        trankesbel::ui32 width, height;
+        std::vector<trankesbel::ui32> cells;
+
+        /* Frame (WebSocket frame, ready to send) that takes a viewer from
+           the previous generation to this one, and a keyframe of this
+           generation, built when someone needs it. The payloads are the
+           same messages without WebSocket framing, for server-to-server links. */
+        SP<const std::string> delta;
+        SP<const std::string> keyframe;
+        SP<const std::string> delta_payload;
+        SP<const std::string> keyframe_payload;
+        SP<const std::string> name_frame;
+
+        /* No copies */
+        SpectatorFeed(const SpectatorFeed &sf) { };
+        SpectatorFeed& operator=(const SpectatorFeed &sf) { return (*this); };
+
+        /* captureFrame() for mirrors. The frames the mirror received are
+           used as they are; a keyframe is made only if some were missed. */
+        bool captureMirrorFrame(SP<SlotMirror> mirror);
+
+    public:
+        SpectatorFeed(SP<Slot> slot);
+
+        std::vector<WP<Spectator> > viewers;
+        /* Number of server-to-server links mirroring the slot. */
+        size_t links;
+
+        WP<Slot> getSlot() const { return slot; };
+
+        /* Captures the screen of the slot. Returns true if it changed,
+           in which case there's a new generation. */
+        bool captureFrame();
+
+        trankesbel::ui32 getGeneration() const { return generation; };
+        SP<const std::string> getDelta() const { return delta; };
+        SP<const std::string> getKeyframe();
+        SP<const std::string> getDeltaPayload() const { return delta_payload; };
+        SP<const std::string> getKeyframePayload();
+        SP<const std::string> getNameFrame() const { return name_frame; };
+};
+
+/* One viewer. */
+class Spectator
+{
+    private:
+        trankesbel::WebSocketSession ws;
+        SP<SpectatorFeed> feed;
+
+        /* Last generation sent to the viewer, and how many frames
+           it hasn't acknowledged. */
+        trankesbel::ui32 sent_generation;
+        trankesbel::ui32 unacked_frames;
+        /* Set when the viewer missed a frame; it'll get a keyframe. */
+        bool behind;
+
+        /* No copies */
+        Spectator(const Spectator &s) { };
+        Spectator& operator=(const Spectator &s) { return (*this); };
+
+        void sendKeyframe();
+
+    public:
+        Spectator(SP<trankesbel::Socket> s, SP<SpectatorFeed> feed);
+
+        SP<trankesbel::Socket> getSocket() const { return ws.getSocket(); };
+        SP<SpectatorFeed> getFeed() const { return feed; };
+        bool isActive() const { return ws.isActive(); };
+
+        /* Feeds data received before the viewer was created. */
+        void feedInput(const std::string &data);
+
+        /* Called when the feed has a new generation. */
+        void frameReady();
+
+        /* Reads acknowledgements and sends what's queued. */
+        void cycle();
+
+        /* Closes the connection with a WebSocket status code. */
+        void close(trankesbel::ui16 code);
+};
+
+/* All viewers and the feeds of the slots they watch. Not thread-safe;
+   State calls this with its cycle mutex locked. */
+class SpectatorServer
+{
+    private:
+        std::map<SP<trankesbel::Socket>, SP<Spectator> > spectators;
+        std::map<const Slot*, SP<SpectatorFeed> > feeds;
+
+        /* No copies */
+        SpectatorServer(const SpectatorServer &ss) { };
+        SpectatorServer& operator=(const SpectatorServer &ss) { return (*this); };
+
+    public:
+        SpectatorServer() { };
+
+        /* Starts sending 'slot' to the WebSocket connection 's'. 'leftover' is
+           data that was received after the HTTP upgrade request. */
+        bool addSpectator(SP<trankesbel::Socket> s, SP<Slot> slot, const std::string &leftover);
+
+        /* Handles an event on socket 's'. Returns false if it's not a viewer's socket. */
+        bool socketEvent(SP<trankesbel::Socket> s);
+
+        /* Called when 'slot' has new screen data. Does nothing if no one is watching.
+           Returns the feed of the slot if it has a new frame. */
+        SP<SpectatorFeed> slotData(SP<Slot> slot);
+
+        /* Returns the feed of 'slot' for a server-to-server link and keeps it
+           captured until unlinkFeed() is called as many times. */
+        SP<SpectatorFeed> linkFeed(SP<Slot> slot);
+        void unlinkFeed(SP<SpectatorFeed> feed);
+
+        /* Closes the viewers of 'slot', e.g. when the slot is gone or can't be
+           watched anymore. */
+        void closeSlot(const Slot* slot, trankesbel::ui16 code);
+
+        /* Returns the slots that have viewers. */
+        std::vector<SP<Slot> > getWatchedSlots();
+
+        size_t getNumberOfSpectators() const { return spectators.size(); };
+};
+
+}
+
+#endif
+
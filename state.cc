@@ -1,10 +1,15 @@
 #include "state.hpp"
 #include <iostream>
 #include <sstream>
+#include <cctype>
+#include <cstdlib>
 #include "nanoclock.hpp"
+#include "resolver.hpp"
 #include "logger.hpp"
 
 #include "dfterm2_limits.hpp"
+#include "slot_mirror.hpp"
+#include "metrics.hpp"
 
 using namespace dfterm;
 using namespace std;
@@ -13,16 +18,34 @@ using namespace trankesbel;
 
 static bool state_initialized = false;
 
+/* Clients with more than this many bytes waiting to be written are counted as backlogged in /metrics. */
+static const ui64 CLIENT_BACKLOG_BYTES = 65536;
+
 static ui64 running_counter = 1;
 
 State::State()
 {
     maximum_slots = 0xffffffff;
+    /* About 24 kilobytes of zlib state per connection. */
+    telnet_compression_memory_level = 4;
+    telnet_compression_window_bits = 12;
     state_initialized = true;
     global_chat = SP<Logger>(new Logger);
     close = false;
     
     default_address_allowance = true;
+    address_restrictions_changed = false;
+    lock_statistics_enabled = false;
+    /* Starts from 1 so that zero-initialized caches are never valid. */
+    slot_permission_generation = 1;
+    spectator_permission_generation = slot_permission_generation;
+    export_permission_generation = 0;
+    mirror_subscriptions_time = 0;
+    disconnected_clients_bytes_sent = 0;
+    server_to_server_exporter.setSpectatorServer(&spectator_server);
+
+    event_server.setChat(global_chat);
+    event_server.setSnapshotCallback(boost::bind(&State::eventSnapshot, this));
     
     stringstream ss;
     ss << "Welcome. This is a dfterm2 server. Take off your shoes and wipe your nose. "
@@ -52,17 +75,23 @@ bool State::getDefaultConnectionAllowance() const
 
 void State::setAllowedAddresses(const SocketAddressRange &allowed_addresses)
 {
+    if (this->allowed_addresses == allowed_addresses) return;
     this->allowed_addresses = allowed_addresses;
+    address_restrictions_changed = true;
 }
 
 void State::setForbiddenAddresses(const SocketAddressRange &forbidden_addresses)
 {
+    if (this->forbidden_addresses == forbidden_addresses) return;
     this->forbidden_addresses = forbidden_addresses;
+    address_restrictions_changed = true;
 }
 
 void State::setDefaultConnectionAllowance(bool allowance)
 {
+    if (default_address_allowance == allowance) return;
     default_address_allowance = allowance;
+    address_restrictions_changed = true;
 }
 
 void State::saveAddressRestrictions()
@@ -75,7 +104,7 @@ void State::loadAddressRestrictions()
 {
     assert(configuration);
     configuration->loadAllowedAndForbiddenSocketAddressRanges(&default_address_allowance, &allowed_addresses, &forbidden_addresses);
-    checkAddressRestrictions();
+    address_restrictions_changed = true;
 }
 
 void State::saveUser(SP<User> user)
@@ -132,7 +161,7 @@ SP<User> State::getUser(const ID& id)
 
     vector<SP<Client> >::iterator i1, cli_end = cli.end();
     for (i1 = cli.begin(); i1 != cli_end; ++i1)
-        if ( (*i1) && (*i1)->getUser()->getID() == id)
+        if ( (*i1) && (*i1)->getUser()->getIDRef() == id)
             return (*i1)->getUser();
     lo_clients.release();
 
@@ -167,7 +196,7 @@ bool State::forceCloseSlotOfUser(SP<User> user)
     vector<SP<Client> > &cli = *lo_clients.get();
     vector<SP<Client> >::iterator i1, cli_end = cli.end();
     for (i1 = cli.begin(); i1 != cli_end; ++i1)
-        if ( (*i1) && (*i1)->getUser()->getID() == user->getID() )
+        if ( (*i1) && (*i1)->getUser()->getIDRef() == user->getIDRef() )
         {
             slot = (*i1)->getSlot().lock();
             notifyClient(*i1);
@@ -304,6 +333,8 @@ bool State::setDatabaseUTF8(string database_file)
         LOG(Error, "Failed to open database file " << database_file);
         return false;
     }
+    /* Don't make the loop wait for the disk when saving things. */
+    configuration->startWriterThread();
     if (d_result == OkCreatedNewDatabase)
     {
         LOG(Note, "Created a new database from scratch. You should add an admin account to configure dfterm2.");
@@ -401,6 +432,9 @@ bool State::addHTTPService(SocketAddress address, SocketAddress flashpolicy_addr
     http_server.serveFileUTF8("soiled/soiled.txt", "text/plain; charset=UTF-8", "/soiled.txt", empty);
     http_server.serveFileUTF8("soiled/beep.mp3", "audio/mp3", "/beep.mp3", empty);
     http_server.serveFileUTF8("soiled/AC_OETags.js", "application/javascript", "/AC_OETags.js", empty);
+    http_server.serveWebSocket("/spectate", boost::bind(&State::newSpectator, this, _1, _2, _3));
+    http_server.serveStream(boost::bind(&State::newEventSubscriber, this, _1, _2, _3), "text/event-stream", "/events");
+    http_server.serveUpgrade(SERVER_TO_SERVER_TARGET, SERVER_TO_SERVER_PROTOCOL, boost::bind(&State::newServerToServerLink, this, _1, _2, _3));
 
     http_server.addListeningSocket(s);
 
@@ -425,20 +459,64 @@ bool State::addHTTPService(SocketAddress address, SocketAddress flashpolicy_addr
     return true;
 }
 
-bool State::addTelnetService(SocketAddress address)
+bool State::addMetricsService(SocketAddress address)
 {
     SP<Socket> s(new Socket);
     bool result = s->listen(address);
     if (!result)
     {
-        LOG(Error, "Listening as telnet service at address " << address.getHumanReadablePlainUTF8() << " failed. " << s->getError());
+        LOG(Error, "Listening as metrics service at address " << address.getHumanReadablePlainUTF8() << " failed. " << s->getError());
         return false;
     }
-    LOG(Note, "Telnet service started on address " << address.getHumanReadablePlainUTF8());
-    listening_sockets.insert(s);
+    LOG(Note, "Metrics service started on address " << address.getHumanReadablePlainUTF8());
+
+    metrics_server.serveDynamicUTF8(boost::bind(&State::metricsPage, this), "text/plain; version=0.0.4", "/metrics");
+    metrics_server.addListeningSocket(s);
+
+    LockedObject<SocketEvents> lo = socketevents.lock();
+    SocketEvents* se = lo.get();
+    assert(se);
+
+    se->addSocket(s);
+    return true;
+}
+
+bool State::addTelnetService(SocketAddress address, ui32 listeners)
+{
+    if (listeners < 1) listeners = 1;
+    if (listeners > MAX_TELNET_LISTENERS) listeners = MAX_TELNET_LISTENERS;
+
+    /* With more than one listener, each gets its own accept queue
+       and the kernel spreads incoming connections between them. */
+    vector<SP<Socket> > new_listeners;
+    ui32 i1;
+    for (i1 = 0; i1 < listeners; ++i1)
+    {
+        SP<Socket> s(new Socket);
+        bool result = s->listen(address, listeners > 1);
+        if (!result)
+        {
+            LOG(Error, "Listening as telnet service at address " << address.getHumanReadablePlainUTF8() << " failed. " << s->getError());
+            return false;
+        }
+        new_listeners.push_back(s);
+    }
+    if (listeners > 1)
+    {
+        LOG(Note, "Telnet service started on address " << address.getHumanReadablePlainUTF8() << " with " << listeners << " listening sockets.");
+    }
+    else
+    {
+        LOG(Note, "Telnet service started on address " << address.getHumanReadablePlainUTF8());
+    }
 
     LockedObject<SocketEvents> lo = socketevents.lock();
-    lo->addSocket(s);
+    vector<SP<Socket> >::iterator i2, new_listeners_end = new_listeners.end();
+    for (i2 = new_listeners.begin(); i2 != new_listeners_end; ++i2)
+    {
+        listening_sockets.insert(*i2);
+        lo->addSocket(*i2);
+    }
 
     return true;
 }
@@ -476,6 +554,11 @@ void State::destroyClient(const ID &user_id, SP<Client> exclude)
 
         if (cli[i1] && (cli[i1]->getUser()->getIDRef() == user_id || cli[i1]->getIDRef() == user_id))
         {
+            ui64 bytes_sent, bytes_queued;
+            cli[i1]->getTransferStatistics(&bytes_sent, &bytes_queued);
+            disconnected_clients_bytes_sent += bytes_sent;
+
+            clients_by_socket.erase(cli[i1]->getSocket());
             cli.erase(cli.begin() + i1);
             weak_cli.erase(weak_cli.begin() + i1);
             LOG(Note, "Disconnected connection for user " << cli[i1]->getUser()->getNameUTF8());
@@ -522,6 +605,8 @@ void State::deleteSlotProfile(SP<SlotProfile> slotprofile)
         --i1;
     };
 
+    invalidateSlotPermissions();
+
     len = slotprofiles.size();
     for (i1 = 0; i1 < len; ++i1)
     {
@@ -539,6 +624,7 @@ void State::updateSlotProfile(SP<SlotProfile> target, const SlotProfile &source)
     assert(target);
 
     (*target.get()) = source;
+    invalidateSlotPermissions();
 
     size_t i1, len = slots.size();
     for (i1 = 0; i1 < len; ++i1)
@@ -597,9 +683,9 @@ bool State::isAllowedForceCloser(SP<User> closer, SP<Slot> slot)
         if (!allowed_closers.hasLauncher())
             not_allowed_by_being_launcher = true;
     }
-    if (forbidden_closers.hasUser(closer->getIDRef()))
+    if (forbidden_closers.hasUser(*closer))
         return false;
-    if (!allowed_closers.hasUser(closer->getIDRef()) && (not_allowed_by_being_launcher || launcher != closer))
+    if (!allowed_closers.hasUser(*closer) && (not_allowed_by_being_launcher || launcher != closer))
         return false;
     return true;
 }
@@ -609,9 +695,9 @@ bool State::isAllowedLauncher(SP<User> launcher, SP<SlotProfile> slot_profile)
     UserGroup allowed_launchers = slot_profile->getAllowedLaunchers();
     UserGroup forbidden_launchers = slot_profile->getForbiddenLaunchers();
     
-    if (forbidden_launchers.hasUser(launcher->getIDRef()))
+    if (forbidden_launchers.hasUser(*launcher))
         return false;
-    if (!allowed_launchers.hasUser(launcher->getIDRef()) && !allowed_launchers.hasLauncher())
+    if (!allowed_launchers.hasUser(*launcher) && !allowed_launchers.hasLauncher())
         return false;
     return true;
 }
@@ -636,9 +722,9 @@ bool State::isAllowedPlayer(SP<User> user, SP<Slot> slot)
         if (!allowed_players.hasLauncher())
             not_allowed_by_being_launcher = true;
     }
-    if (forbidden_players.hasUser(user->getIDRef()))
+    if (forbidden_players.hasUser(*user))
         return false;
-    if (!allowed_players.hasUser(user->getIDRef()) && (not_allowed_by_being_launcher || launcher != user))
+    if (!allowed_players.hasUser(*user) && (not_allowed_by_being_launcher || launcher != user))
         return false;
     return true;
 };
@@ -663,13 +749,39 @@ bool State::isAllowedWatcher(SP<User> user, SP<Slot> slot)
         if (!allowed_watchers.hasLauncher())
             not_allowed_by_being_launcher = true;
     }
-    if (forbidden_watchers.hasUser(user->getIDRef()))
+    if (forbidden_watchers.hasUser(*user))
         return false;
-    if (!allowed_watchers.hasUser(user->getIDRef()) && (not_allowed_by_being_launcher || launcher != user))
+    if (!allowed_watchers.hasUser(*user) && (not_allowed_by_being_launcher || launcher != user))
         return false;
     return true;
 };
 
+bool State::isAllowedSpectator(SP<Slot> slot)
+{
+    SP<SlotProfile> sp_slotprofile = slot->getSlotProfile().lock();
+    if (!sp_slotprofile)
+    {
+        LOG(Error, "State::isAllowedSpectator(), no slot profile associated with slot " << slot->getNameUTF8());
+        return false;
+    }
+
+    /* Spectators are nobody in particular, so only 'anybody' counts. */
+    if (sp_slotprofile->getForbiddenWatchers().hasAnybody())
+        return false;
+    return sp_slotprofile->getAllowedWatchers().hasAnybody();
+}
+
+ui32 State::getSlotPermissions(SP<User> user, SP<Slot> slot)
+{
+    ui32 permissions = 0;
+    if (!user || !slot) return permissions;
+
+    if (isAllowedWatcher(user, slot)) permissions |= PermissionWatch;
+    if (isAllowedPlayer(user, slot)) permissions |= PermissionPlay;
+    if (isAllowedForceCloser(user, slot)) permissions |= PermissionForceClose;
+    return permissions;
+}
+
 void State::setUserToNoSlot(SP<User> user)
 {
     assert(user);
@@ -741,6 +853,8 @@ bool State::setUserToSlot(SP<User> user, const ID &slot_id)
 
     client->setSlot(sp_slot);
     LOG(Note, "User " << user->getNameUTF8() << " is now watching slot " << sp_slot->getNameUTF8());
+    if (sp_slot->isMirror())
+        updateMirrorSubscriptions();
     return true;
 }
 
@@ -888,6 +1002,7 @@ bool State::launchSlotNoCheck(SP<SlotProfile> slot_profile, SP<User> launcher)
     slot->setState(self);
     slot->setSlotProfile(slot_profile);
     slot->setLauncher(launcher);
+    invalidateSlotPermissions();
     string name_utf8 = slot_profile->getNameUTF8() + string(" - ") + launcher->getNameUTF8() + string(":") + rcs.str();
     slot->setNameUTF8(name_utf8);
 
@@ -938,6 +1053,7 @@ bool State::launchSlotNoCheck(SP<SlotProfile> slot_profile, SP<User> launcher)
     stringstream ss;
     ss << time_c << " " << launcher->getNameUTF8() << " has launched slot " << slot->getNameUTF8();
     global_chat->logMessageUTF8(ss.str());
+    publishEvent("launch", slot->getNameUTF8());
     notifyAllClients();
 
     return true;
@@ -1079,6 +1195,7 @@ void State::pruneInactiveSlots()
             {
                 ss << time_c << " Slot " << slots[i2]->getNameUTF8() << " has closed.";
                 global_chat->logMessageUTF8(ss.str());
+                publishEvent("close", slots[i2]->getNameUTF8());
             }
                 
             LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
@@ -1096,7 +1213,9 @@ void State::pruneInactiveSlots()
             }
             lo_clients.release();
 
+            spectator_server.closeSlot(slots[i2].get(), 1001);
             slots.erase(slots.begin() + i2);
+            invalidateSlotPermissions();
             --len;
             --i2;
             continue;
@@ -1104,6 +1223,203 @@ void State::pruneInactiveSlots()
     }
 }
 
+/* Decodes %XX escapes and '+' of an URL query value. */
+static string url_decode(const string &value)
+{
+    string result;
+    result.reserve(value.size());
+    size_t i1, value_size = value.size();
+    for (i1 = 0; i1 < value_size; ++i1)
+    {
+        if (value[i1] == '+')
+            result.push_back(' ');
+        else if (value[i1] == '%' && i1 + 2 < value_size && isxdigit((unsigned char) value[i1+1]) && isxdigit((unsigned char) value[i1+2]))
+        {
+            result.push_back((char) strtol(value.substr(i1+1, 2).c_str(), 0, 16));
+            i1 += 2;
+        }
+        else
+            result.push_back(value[i1]);
+    }
+    return result;
+}
+
+void State::newSpectator(SP<Socket> s, string target, string leftover)
+{
+    string slot_name;
+    size_t query = target.find('?');
+    if (query != string::npos)
+    {
+        string q = "&" + target.substr(query + 1);
+        size_t pos = q.find("&slot=");
+        if (pos != string::npos)
+        {
+            pos += 6;
+            slot_name = url_decode(q.substr(pos, q.find('&', pos) - pos));
+        }
+    }
+
+    SP<Slot> slot;
+    {
+        lock_guard<recursive_mutex> lock(slots_mutex);
+        vector<SP<Slot> >::iterator i1, slots_end = slots.end();
+        for (i1 = slots.begin(); i1 != slots_end; ++i1)
+            if ((*i1) && (*i1)->isAlive() && (*i1)->getNameUTF8() == slot_name)
+            {
+                slot = (*i1);
+                break;
+            }
+    }
+
+    /* The handshake is done, so refusals go as WebSocket close frames. */
+    WebSocketSession ws;
+    ws.setSocket(s);
+    if (!slot)
+    {
+        LOG(Note, "Spectator from " << s->getAddress().getHumanReadablePlainUTF8() << " asked for slot \"" << slot_name << "\" that does not exist.");
+        ws.close(1008);
+        ws.flush();
+        s->close();
+        return;
+    }
+    if (!isAllowedSpectator(slot))
+    {
+        LOG(Note, "Spectator from " << s->getAddress().getHumanReadablePlainUTF8() << " is not allowed to watch slot " << slot->getNameUTF8());
+        ws.close(1008);
+        ws.flush();
+        s->close();
+        return;
+    }
+
+    spectator_server.addSpectator(s, slot, leftover);
+    if (slot->isMirror())
+        updateMirrorSubscriptions();
+}
+
+void State::checkSpectators()
+{
+    if (spectator_permission_generation == slot_permission_generation) return;
+    spectator_permission_generation = slot_permission_generation;
+
+    vector<SP<Slot> > watched = spectator_server.getWatchedSlots();
+    vector<SP<Slot> >::iterator i1, watched_end = watched.end();
+    for (i1 = watched.begin(); i1 != watched_end; ++i1)
+        if (!isAllowedSpectator(*i1))
+        {
+            LOG(Note, "Slot " << (*i1)->getNameUTF8() << " can't be watched anonymously anymore, closing its spectators.");
+            spectator_server.closeSlot(i1->get(), 1008);
+        }
+}
+
+string State::metricsPage()
+{
+    MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+
+    stringstream ss;
+    metrics_write_prometheus(ss, snapshot);
+
+    LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
+    vector<SP<Client> > cli = *lo_clients.get();
+    ui64 sent_before = disconnected_clients_bytes_sent;
+    lo_clients.release();
+
+    ss << "# HELP dfterm2_clients Connected telnet clients.\n";
+    ss << "# TYPE dfterm2_clients gauge\n";
+    ss << "dfterm2_clients " << cli.size() << "\n";
+
+    /* Only totals; series per connection would tell who is connected from
+       where, and come and go with the connections. */
+    ui64 total_sent = 0, total_queued = 0, backlogged = 0;
+    vector<SP<Client> >::iterator i1, cli_end = cli.end();
+    for (i1 = cli.begin(); i1 != cli_end; ++i1)
+    {
+        if (!(*i1)) continue;
+
+        ui64 bytes_sent, bytes_queued;
+        (*i1)->getTransferStatistics(&bytes_sent, &bytes_queued);
+        total_sent += bytes_sent;
+        total_queued += bytes_queued;
+        if (bytes_queued > CLIENT_BACKLOG_BYTES) ++backlogged;
+    }
+
+    ss << "# HELP dfterm2_client_sent_bytes_total Bytes written to clients.\n";
+    ss << "# TYPE dfterm2_client_sent_bytes_total counter\n";
+    ss << "dfterm2_client_sent_bytes_total " << total_sent + sent_before << "\n";
+    ss << "# HELP dfterm2_client_queued_bytes Bytes waiting to be written to clients.\n";
+    ss << "# TYPE dfterm2_client_queued_bytes gauge\n";
+    ss << "dfterm2_client_queued_bytes " << total_queued << "\n";
+    ss << "# HELP dfterm2_clients_backlogged Clients with more than " << CLIENT_BACKLOG_BYTES << " bytes waiting to be written.\n";
+    ss << "# TYPE dfterm2_clients_backlogged gauge\n";
+    ss << "dfterm2_clients_backlogged " << backlogged << "\n";
+
+    lock_guard<recursive_mutex> lock(slots_mutex);
+    ss << "# HELP dfterm2_slots Running slots.\n";
+    ss << "# TYPE dfterm2_slots gauge\n";
+    ss << "dfterm2_slots " << slots.size() << "\n";
+    ss << "# HELP dfterm2_slot_read_bytes_total Bytes read from the program of a slot.\n";
+    ss << "# TYPE dfterm2_slot_read_bytes_total counter\n";
+    vector<SP<Slot> >::iterator i2, slots_end = slots.end();
+    for (i2 = slots.begin(); i2 != slots_end; ++i2)
+    {
+        if (!(*i2)) continue;
+        ss << "dfterm2_slot_read_bytes_total{slot=\"" << metric_label_escape((*i2)->getNameUTF8()) << "\"} " << (*i2)->getBytesRead() << "\n";
+    }
+
+    ss << "# HELP dfterm2_spectators Connected spectators.\n";
+    ss << "# TYPE dfterm2_spectators gauge\n";
+    ss << "dfterm2_spectators " << spectator_server.getNumberOfSpectators() << "\n";
+    ss << "# HELP dfterm2_server_to_server_links Servers receiving slots of this server.\n";
+    ss << "# TYPE dfterm2_server_to_server_links gauge\n";
+    ss << "dfterm2_server_to_server_links " << server_to_server_exporter.getNumberOfLinks() << "\n";
+    ss << "# HELP dfterm2_event_subscribers Connections to the event stream.\n";
+    ss << "# TYPE dfterm2_event_subscribers gauge\n";
+    ss << "dfterm2_event_subscribers " << event_server.getNumberOfSubscribers() << "\n";
+
+    return ss.str();
+}
+
+void State::publishEvent(const string &type, const string &data)
+{
+    lock_guard<recursive_mutex> lock(cycle_mutex);
+    event_server.publish(type, data);
+}
+
+void State::newEventSubscriber(SP<Socket> s, string target, string last_event_id)
+{
+    event_server.addSubscriber(s, last_event_id);
+}
+
+string State::eventSnapshot()
+{
+    string users, slot_names;
+
+    LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
+    vector<SP<Client> > &cli = *lo_clients.get();
+    vector<SP<Client> >::iterator i1, cli_end = cli.end();
+    for (i1 = cli.begin(); i1 != cli_end; ++i1)
+    {
+        if (!(*i1) || !(*i1)->isActive()) continue;
+        SP<User> u = (*i1)->getUser();
+        if (!u || u->getNameUTF8().empty()) continue;
+        if (!users.empty()) users.push_back('\n');
+        users.append(u->getNameUTF8());
+    }
+    lo_clients.release();
+
+    lock_guard<recursive_mutex> lock(slots_mutex);
+    vector<SP<Slot> >::iterator i2, slots_end = slots.end();
+    for (i2 = slots.begin(); i2 != slots_end; ++i2)
+    {
+        if (!(*i2) || !(*i2)->isAlive()) continue;
+        if (!slot_names.empty()) slot_names.push_back('\n');
+        slot_names.append((*i2)->getNameUTF8());
+    }
+
+    return EventStreamServer::serializeEvent("users", users) +
+           EventStreamServer::serializeEvent("slots", slot_names);
+}
+
 void State::pruneInactiveClients()
 {
     LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
@@ -1136,8 +1452,14 @@ void State::pruneInactiveClients()
             {
                 ss << time_c << " " << cli[i2]->getUser()->getNameUTF8() << " has disconnected from the server.";
                 global_chat->logMessageUTF8(ss.str());
+                publishEvent("leave", cli[i2]->getUser()->getNameUTF8());
             }
 
+            ui64 bytes_sent, bytes_queued;
+            cli[i2]->getTransferStatistics(&bytes_sent, &bytes_queued);
+            disconnected_clients_bytes_sent += bytes_sent;
+
+            clients_by_socket.erase(cli[i2]->getSocket());
             cli.erase(cli.begin() + i2);
             weak_cli.erase(weak_cli.begin() + i2);
             --len;
@@ -1156,8 +1478,13 @@ void State::pruneInactiveClients()
     notifyAllClients();
 }
 
+/* Any change to the rules checks every client again. The ranges can
+   have host name regexes in them, so there's no cheap way to tell which
+   clients a change touches; rule changes are rare, connections aren't. */
 void State::checkAddressRestrictions()
 {
+    address_restrictions_changed = false;
+
     LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
     vector<SP<Client> > &cli = *lo_clients.get();
 
@@ -1227,6 +1554,41 @@ bool State::checkSocketAllowance(SP<Socket> s)
     return true;
 }
 
+void State::setLockStatisticsEnabled(bool enabled)
+{
+    lock_statistics_enabled = enabled;
+    clients.setStatisticsEnabled(enabled);
+    clients_weak.setStatisticsEnabled(enabled);
+    socketevents.setStatisticsEnabled(enabled);
+}
+
+static void log_lock_statistics(const char* name, const LockStatistics &ls)
+{
+    LOG(Note, "Lock statistics for " << name << ": " << ls.locks << " locks, " << ls.contended_locks << " contended. "
+              "Waited " << ls.wait_time / 1000ULL << " us (longest " << ls.max_wait_time / 1000ULL << " us), "
+              "held " << ls.hold_time / 1000ULL << " us (longest " << ls.max_hold_time / 1000ULL << " us).");
+}
+
+void State::logLockStatistics()
+{
+    log_lock_statistics("clients", clients.getStatistics());
+    log_lock_statistics("clients_weak", clients_weak.getStatistics());
+    log_lock_statistics("socketevents", socketevents.getStatistics());
+    clients.resetStatistics();
+    clients_weak.resetStatistics();
+    socketevents.resetStatistics();
+}
+
+void State::socketHostnameResolved(WP<Socket> socket)
+{
+    /* Hostnames only matter to hostname regexes. */
+    SP<Socket> s = socket.lock();
+    if (!s || !s->active()) return;
+
+    lock_guard<recursive_mutex> lock(cycle_mutex);
+    checkSocketAllowance(s);
+}
+
 void State::client_signal_function(WP<Client> client, SP<Socket> from_where)
 {
     SP<Client> sp_cli = client.lock();
@@ -1240,28 +1602,38 @@ bool State::new_connection(SP<Socket> listening_socket)
 {
     assert(listening_socket);
 
-    /* Check for incoming connections. */
-    SP<Socket> new_connection(new Socket);
-    bool got_connection = listening_socket->accept(new_connection.get());
-    if (got_connection)
+    /* Check for incoming connections. Take a batch of them at once,
+       so nick lists and socket events are updated once per batch
+       instead of once per connection. */
+    vector<SP<Socket> > new_connections;
+    if (!listening_socket->acceptBatch(new_connections, ACCEPT_BATCH_SIZE))
+        return false;
+
+    vector<SP<Socket> > accepted_connections;
+    accepted_connections.reserve(new_connections.size());
+
+    LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
+    vector<SP<Client> > &cli = *lo_clients.get();
+    LockedObject<vector<WP<Client> > > lo_weak_clients = clients_weak.lock();
+    vector<WP<Client> > &weak_cli = *lo_weak_clients.get();
+
+    vector<SP<Socket> >::iterator i1, new_connections_end = new_connections.end();
+    for (i1 = new_connections.begin(); i1 != new_connections_end; ++i1)
     {
-        new_connection->startAsynchronousReverseResolve();
+        SP<Socket> new_connection = *i1;
+        new_connection->startAsynchronousReverseResolve(boost::bind(&State::socketHostnameResolved, this, WP<Socket>(new_connection)));
 
         SP<Client> new_client = Client::createClient(new_connection);
         new_client->setState(self);
+        new_client->offerTelnetCompression(telnet_compression_memory_level, telnet_compression_window_bits);
         
         /* Do early check of banned/allowed addresses. Hostname is probably not resolved yet at this point though. */
         if (checkClientAllowance(new_client))
-            return true;
+            continue;
 
         new_client->setConfigurationDatabase(configuration);
         new_client->setGlobalChatLogger(global_chat);
 
-        LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
-        vector<SP<Client> > &cli = *lo_clients.get();
-        LockedObject<vector<WP<Client> > > lo_weak_clients = clients_weak.lock();
-        vector<WP<Client> > &weak_cli = *lo_weak_clients.get();
-
         if (cli.size() >= MAX_CONNECTIONS)
         {
             pruneInactiveClients();
@@ -1269,51 +1641,84 @@ bool State::new_connection(SP<Socket> listening_socket)
             {
                 new_connection->send("Maximum number of connections reached.\n");
                 LOG(Note, "New connection from " << new_connection->getAddress().getHumanReadablePlainUTF8() << " but disconnected because maximum number of connections has been reached.");
-                return true;
+                continue;
             }
         }
 
         cli.push_back(new_client);
         weak_cli.push_back(new_client);
+        clients_by_socket[new_connection] = new_client;
         
         LOG(Note, "New connection from " << new_connection->getAddress().getHumanReadablePlainUTF8());
         
         new_client->sendPrivateChatMessage(MOTD);
-        
-        size_t i1, len = cli.size();
-        for (i1 = 0; i1 < len; ++i1)
-            if (cli[i1])
-                cli[i1]->updateClientNicklist(&cli);
 
-        lo_clients.release();
-        lo_weak_clients.release();
+        accepted_connections.push_back(new_connection);
+    }
 
-        LockedObject<SocketEvents> se = socketevents.lock();
-        se->addSocket(new_connection);
-        se->forceEvent(new_connection);
-        se.release();
+    if (!accepted_connections.empty())
+    {
+        size_t i2, len = cli.size();
+        for (i2 = 0; i2 < len; ++i2)
+            if (cli[i2])
+                cli[i2]->updateClientNicklist(&cli);
+    }
 
-        return true;
+    lo_clients.release();
+    lo_weak_clients.release();
+
+    LockedObject<SocketEvents> se = socketevents.lock();
+    vector<SP<Socket> >::iterator i3, accepted_connections_end = accepted_connections.end();
+    for (i3 = accepted_connections.begin(); i3 != accepted_connections_end; ++i3)
+    {
+        se->addSocket(*i3);
+        se->forceEvent(*i3);
     }
+    se.release();
 
-    return false;
+    return true;
 }
 
 void State::loop()
 {
-    /* 10 seconds. */
-    ui64 address_restriction_check_time = 10000000000ULL + nanoclock();;
-    
+    /* Resolver threads wake the loop up when there are results.
+       The raw pointer is used because the loop keeps socketevents locked
+       while it waits for events. */
+    LockedObject<SocketEvents> lo_wakeup = socketevents.lock();
+    Resolver::getInstance()->setWakeUpFunction(boost::bind(&SocketEvents::wakeUp, lo_wakeup.get()));
+    lo_wakeup.release();
+
+    /* 1 minute. */
+    ui64 lock_statistics_time = nanoclock() + 60000000000ULL;
+    /* 5 seconds. */
+    ui64 configuration_check_time = nanoclock() + 5000000000ULL;
+
     unique_lock<recursive_mutex> lock(cycle_mutex);
     close = false;
     while(!close)
     {
-        if (nanoclock() > address_restriction_check_time)
+        metric_increment(MetricLoopIterations);
+        Resolver::getInstance()->dispatchCompleted();
+
+        if (lock_statistics_enabled && nanoclock() > lock_statistics_time)
         {
-            checkAddressRestrictions();
-            address_restriction_check_time = nanoclock() + 10000000000ULL;
+            logLockStatistics();
+            lock_statistics_time = nanoclock() + 60000000000ULL;
         }
 
+        /* Users added with dfterm2_configure while we run. */
+        if (nanoclock() > configuration_check_time)
+        {
+            if (configuration)
+                configuration->checkForChanges();
+            configuration_check_time = nanoclock() + 5000000000ULL;
+        }
+
+        /* Clients are checked when they connect and when their hostname
+           is resolved, so a sweep is only needed when the rules change. */
+        if (address_restrictions_changed)
+            checkAddressRestrictions();
+
         ui64 next_event_time = 5000000000LL; // 5 seconds
         if (!pending_delayed_notifications.empty())
         {
@@ -1324,6 +1729,17 @@ void State::loop()
 
         pruneInactiveClients();
         pruneInactiveSlots();
+        checkSpectators();
+        checkServerToServerExports();
+        ui64 server_to_server_time = checkServerToServerSessions();
+        if (server_to_server_time < next_event_time)
+            next_event_time = server_to_server_time;
+        if (nanoclock() >= mirror_subscriptions_time)
+            updateMirrorSubscriptions();
+        event_server.cycle();
+        http_server.expireConnections();
+        http_server.checkFileChanges();
+        metrics_server.expireConnections();
         flush_messages();
         cycle_mutex.unlock();
 
@@ -1350,20 +1766,7 @@ void State::loop()
 
             if (!s) continue;
         }
-
-        /* Test server-to-server sockets for events. */
-        multimap<ServerToServerConfigurationPair, SP<ServerToServerSession> >::iterator i3, server_to_server_connections_end;
-        server_to_server_connections_end = server_to_server_connections.end();
-        for (i3 = server_to_server_connections.begin(); i3 != server_to_server_connections_end; ++i3)
-        {
-            SP<ServerToServerSession> session = i3->second;
-            if (!session) continue;
-            if (session->getSocket() == s)
-            {
-                session->cycle();
-                continue;
-            }
-        }
+        metric_increment(MetricSocketEvents);
 
         /* Test if it's a listening socket */
         set<SP<Socket> >::iterator i2 = listening_sockets.find(s);
@@ -1372,38 +1775,57 @@ void State::loop()
             while (new_connection(s)) { };
             continue;
         }
-        LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
-        vector<SP<Client> > cli = *lo_clients.get();
 
-        bool got_socket = false;
-
-        vector<SP<Client> >::iterator i1, cli_end = cli.end();
-        for (i1 = cli.begin(); i1 != cli_end; ++i1)
+        /* HTTP, WebSocket, event feed and link sockets are each looked up
+           in their own server. */
+        vector<SP<Socket> > new_http_sockets;
+        if (http_server.socketEvent(s, &new_http_sockets) || metrics_server.socketEvent(s, &new_http_sockets))
         {
-            if (!(*i1)) continue;
-            if ((*i1)->getSocket() == s)
+            if (!new_http_sockets.empty())
             {
-                (*i1)->cycle();
-                if ((*i1)->shouldShutdown()) close = true;
-                got_socket = true;
-                break;
+                LockedObject<SocketEvents> se = socketevents.lock();
+                vector<SP<Socket> >::iterator i4, new_http_sockets_end = new_http_sockets.end();
+                for (i4 = new_http_sockets.begin(); i4 != new_http_sockets_end; ++i4)
+                    se->addSocket(*i4);
             }
+            continue;
         }
+        if (spectator_server.socketEvent(s) || event_server.socketEvent(s) || server_to_server_exporter.socketEvent(s))
+            continue;
 
-        if (!got_socket)
+        /* Telnet clients */
+        LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
+        map<SP<Socket>, WP<Client> >::iterator i1 = clients_by_socket.find(s);
+        if (i1 != clients_by_socket.end())
         {
-            while(true)
+            SP<Client> c = i1->second.lock();
+            if (!c)
+                clients_by_socket.erase(i1);
+            else
             {
-                SP<Socket> s = http_server.cycle();
-                if (!s)
-                    break;
-
-                LockedObject<SocketEvents> se = socketevents.lock();
-                se->addSocket(s);
+                c->cycle();
+                if (c->shouldShutdown()) close = true;
             }
-        };
+            continue;
+        }
+        lo_clients.release();
 
+        /* Server-to-server sessions; there are only a few of them. */
+        multimap<ServerToServerConfigurationPair, SP<ServerToServerSession> >::iterator i3, server_to_server_connections_end;
+        server_to_server_connections_end = server_to_server_connections.end();
+        for (i3 = server_to_server_connections.begin(); i3 != server_to_server_connections_end; ++i3)
+        {
+            SP<ServerToServerSession> session = i3->second;
+            if (!session) continue;
+            if (session->getSocket() == s)
+            {
+                session->cycle();
+                break;
+            }
+        }
     }
+
+    Resolver::getInstance()->setWakeUpFunction(function0<void>());
 }
 
 void State::signalSlotData(SP<Slot> who)
@@ -1424,6 +1846,12 @@ void State::signalSlotData(SP<Slot> who)
             if ((*i1)->shouldShutdown()) close = true;
         }
     }
+    lo_clients.release();
+
+    /* Server-to-server links get the frame spectators got. */
+    SP<SpectatorFeed> feed = spectator_server.slotData(who);
+    if (feed)
+        server_to_server_exporter.frameReady(feed);
 }
 
 void State::callback_ServerToServerSocketReady(SP<Socket> s)
@@ -1431,9 +1859,10 @@ void State::callback_ServerToServerSocketReady(SP<Socket> s)
     assert(s);
     assert(s->active());
 
-    /* This callback is called from another thread so lock up. */
     LockedObject<SocketEvents> se = socketevents.lock();
     se->addSocket(s);
+    /* The session checks if it's connected when it gets the event. */
+    se->forceEvent(s);
 }
 
 void State::addServerToServerConnection(const ServerToServerConfigurationPair &c_pair)
@@ -1442,6 +1871,7 @@ void State::addServerToServerConnection(const ServerToServerConfigurationPair &c
 
     SP<ServerToServerSession> session = ServerToServerSession::create(c_pair, callback_function);
     assert(session);
+    session->setMirrorCallback(boost::bind(&State::addMirrorSlot, this, _1));
 
     server_to_server_connections.insert(std::pair<ServerToServerConfigurationPair, SP<ServerToServerSession> >(c_pair, session));
 }
@@ -1472,3 +1902,99 @@ vector<ServerToServerConfigurationPair> State::getServerToServerConnections() co
     return result;
 }
 
+void State::addMirrorSlot(SP<Slot> slot)
+{
+    assert(slot);
+
+    lock_guard<recursive_mutex> lock(slots_mutex);
+    if (slots.size() >= MAX_SLOTS || slots.size() >= maximum_slots)
+    {
+        LOG(Error, "Slot " << slot->getNameUTF8() << " of another server is not mirrored, as maximum number of slots has been reached.");
+        return;
+    }
+
+    slot->setState(self);
+    slots.push_back(slot);
+    invalidateSlotPermissions();
+    LOG(Note, "Mirroring slot " << slot->getNameUTF8());
+    publishEvent("launch", slot->getNameUTF8());
+}
+
+void State::updateMirrorSubscriptions()
+{
+    /* 1 second */
+    mirror_subscriptions_time = nanoclock() + 1000000000ULL;
+    if (server_to_server_connections.empty()) return;
+
+    set<const Slot*> watched;
+
+    LockedObject<vector<SP<Client> > > lo_clients = clients.lock();
+    vector<SP<Client> > &cli = *lo_clients.get();
+    vector<SP<Client> >::iterator i1, cli_end = cli.end();
+    for (i1 = cli.begin(); i1 != cli_end; ++i1)
+    {
+        if (!(*i1)) continue;
+        SP<Slot> slot = (*i1)->getSlot().lock();
+        if (slot && slot->isMirror()) watched.insert(slot.get());
+    }
+    lo_clients.release();
+
+    /* Mirrors relayed to other servers are watched there. */
+    vector<SP<Slot> > spectated = spectator_server.getWatchedSlots();
+    vector<SP<Slot> > relayed = server_to_server_exporter.getSubscribedSlots();
+    spectated.insert(spectated.end(), relayed.begin(), relayed.end());
+    vector<SP<Slot> >::iterator i2, spectated_end = spectated.end();
+    for (i2 = spectated.begin(); i2 != spectated_end; ++i2)
+        if ((*i2)->isMirror()) watched.insert(i2->get());
+
+    multimap<ServerToServerConfigurationPair, SP<ServerToServerSession> >::iterator i3, server_to_server_connections_end;
+    server_to_server_connections_end = server_to_server_connections.end();
+    for (i3 = server_to_server_connections.begin(); i3 != server_to_server_connections_end; ++i3)
+        if (i3->second) i3->second->updateSubscriptions(watched);
+}
+
+ui64 State::checkServerToServerSessions()
+{
+    ui64 next_time = 5000000000ULL; // 5 seconds
+
+    multimap<ServerToServerConfigurationPair, SP<ServerToServerSession> >::iterator i1, server_to_server_connections_end;
+    server_to_server_connections_end = server_to_server_connections.end();
+    for (i1 = server_to_server_connections.begin(); i1 != server_to_server_connections_end; ++i1)
+    {
+        if (!i1->second) continue;
+        ui64 session_time = i1->second->checkTimers();
+        if (session_time < next_time) next_time = session_time;
+    }
+    return next_time;
+}
+
+void State::newServerToServerLink(SP<Socket> s, string target, string leftover)
+{
+    server_to_server_exporter.addLink(s, leftover);
+}
+
+void State::checkServerToServerExports()
+{
+    if (export_permission_generation == slot_permission_generation) return;
+    export_permission_generation = slot_permission_generation;
+
+    /* Slots are exported to anyone who links, so only the ones
+       spectators could watch. Mirrors are passed on only from relay
+       upstreams, and only so far. */
+    vector<SP<Slot> > exported;
+    lock_guard<recursive_mutex> lock(slots_mutex);
+    vector<SP<Slot> >::iterator i1, slots_end = slots.end();
+    for (i1 = slots.begin(); i1 != slots_end; ++i1)
+    {
+        if (!(*i1) || !(*i1)->isAlive() || !isAllowedSpectator(*i1)) continue;
+        if ((*i1)->isMirror())
+        {
+            SP<SlotMirror> mirror = boost::static_pointer_cast<SlotMirror>(*i1);
+            if (!mirror->isRelayed() || mirror->getHops() >= MAX_SERVER_TO_SERVER_HOPS) continue;
+        }
+        exported.push_back(*i1);
+    }
+
+    server_to_server_exporter.setSlots(exported);
+}
+
@@ -17,6 +17,8 @@ class State;
 #include "lockedresource.hpp"
 #include "minimal_http_server.hpp"
 #include "server_to_server.hpp"
+#include "spectator.hpp"
+#include "event_stream.hpp"
 #include <map>
 
 namespace dfterm {
@@ -41,17 +43,65 @@ class State
         /* Maximum slots */
         trankesbel::ui32 maximum_slots;
 
+        /* zlib parameters for MCCP2 compression of telnet
+           connections. Memory level 0 turns compression off. */
+        int telnet_compression_memory_level;
+        int telnet_compression_window_bits;
+
         std::set<SP<trankesbel::Socket> > listening_sockets;
         HTTPServer http_server;
+        /* Anonymous read-only viewers of slots, over WebSocket. */
+        SpectatorServer spectator_server;
+        /* Value of slot_permission_generation when spectators were last checked. */
+        trankesbel::ui64 spectator_permission_generation;
+
+        /* Called by the HTTP server when a connection to /spectate is upgraded to WebSocket. */
+        void newSpectator(SP<trankesbel::Socket> s, std::string target, std::string leftover);
+        /* Closes spectators of slots that can't be watched anonymously anymore. */
+        void checkSpectators();
+
+        /* Serves only /metrics, on its own address (see addMetricsService()). It
+           tells who is connected, so it's not served with the rest of HTTP. */
+        HTTPServer metrics_server;
+        /* Makes the /metrics page. */
+        std::string metricsPage();
+        /* Bytes sent to clients that have since disconnected. Protected by the 'clients' lock. */
+        trankesbel::ui64 disconnected_clients_bytes_sent;
+
+        /* Server-Sent Events feed at /events. */
+        EventStreamServer event_server;
+        void newEventSubscriber(SP<trankesbel::Socket> s, std::string target, std::string last_event_id);
+        /* Makes the users and slots events for new subscribers. */
+        std::string eventSnapshot();
 
         /* This one holds all server-to-server connections. */
         /* Key is the configuration pair and value is the actual session derived from it. */
         std::multimap<ServerToServerConfigurationPair, SP<ServerToServerSession> > server_to_server_connections;
+        /* Next time mirrored slots are subscribed to or unsubscribed from. */
+        trankesbel::ui64 mirror_subscriptions_time;
+        /* Tells the sessions which mirrored slots are being watched. */
+        void updateMirrorSubscriptions();
+        /* Called by sessions with new mirrored slots. */
+        void addMirrorSlot(SP<Slot> slot);
+
+        /* Servers that link to this one, at /link. */
+        ServerToServerExporter server_to_server_exporter;
+        /* Value of slot_permission_generation when exported slots were last set. */
+        trankesbel::ui64 export_permission_generation;
+        void newServerToServerLink(SP<trankesbel::Socket> s, std::string target, std::string leftover);
+        /* Exports the slots anyone can watch. */
+        void checkServerToServerExports();
+        /* Lets server-to-server sessions (re)connect. Returns the number of
+           nanoseconds until they need to be checked again. */
+        trankesbel::ui64 checkServerToServerSessions();
 
         /* This is the list of connected clients. */
         LockedResource<std::vector<SP<Client> > > clients;
         /* And weak pointers to them. */
         LockedResource<std::vector<WP<Client> > > clients_weak;
+        /* Clients by their sockets, so socket events go straight to their
+           client. Protected by the 'clients' lock. */
+        std::map<SP<trankesbel::Socket>, WP<Client> > clients_by_socket;
         
         /* The global chat logger */
         SP<Logger> global_chat;
@@ -68,12 +118,17 @@ class State
         /* If true, by default anyone can connect. If false,
            only those in 'allowed_addresses' can connect. */
         bool default_address_allowance;
+        /* Set when any of the above change. All clients are checked
+           again in the next loop iteration. */
+        bool address_restrictions_changed;
 
         /* Checks a client if it should be banned and disconnects it if this is the case.
            Returns true if a client was disconnected. */
         bool checkClientAllowance(SP<Client> client);
         /* Same but directly for socket. */
         bool checkSocketAllowance(SP<trankesbel::Socket> s);
+        /* Called from the loop when the reverse lookup of a connection is ready. */
+        void socketHostnameResolved(WP<trankesbel::Socket> socket);
 
         /* Running slots */
         std::vector<SP<Slot> > slots;
@@ -86,6 +141,9 @@ class State
 
         bool launchSlotNoCheck(SP<SlotProfile> slot_profile, SP<User> launcher);
 
+        /* Incremented whenever permissions may have changed. See getSlotPermissions(). */
+        trankesbel::ui64 slot_permission_generation;
+
         void pruneInactiveSlots();
         void pruneInactiveClients();
 
@@ -93,6 +151,10 @@ class State
 
         LockedResource<trankesbel::SocketEvents> socketevents;
 
+        /* If true, lock statistics of the resources above are logged once a minute. */
+        bool lock_statistics_enabled;
+        void logLockStatistics();
+
         bool new_connection(SP<trankesbel::Socket> listening_socket);
         void client_signal_function(WP<Client> client, SP<trankesbel::Socket> from_where);
 
@@ -107,8 +169,8 @@ class State
         std::vector<AddressSettings32> settings;
 
 
-        /* Called by ServerToServerSession class to signal a new ready
-           server to server socket. */
+        /* Called by ServerToServerSession class to signal a new
+           server to server socket, which is still connecting. */
         void callback_ServerToServerSocketReady(SP<trankesbel::Socket> s);
 
     public:
@@ -139,6 +201,9 @@ class State
         /* Make client notify itself after a time period (in nanoseconds) */
         void delayedNotifyClient(SP<Client> client, trankesbel::ui64 nanoseconds);
 
+        /* Sends an event to the /events feed. See event_stream.hpp for the types. */
+        void publishEvent(const std::string &type, const std::string &data);
+
         /* Called by slots to inform the state that slot has new data on it. */
         void signalSlotData(SP<Slot> who);
 
@@ -147,7 +212,7 @@ class State
         /* Returns currently available slot profiles. */
         std::vector<WP<SlotProfile> > getSlotProfiles();
 
-        /* Launches a slot. Returns bool if that can't be done (and logs to admin_logger) */
+        /* Launches a slot. Returns bool if that can't be done (and logs the reason) */
         /* If called with a slot profile, that slot profile must be in the list of slot profiles
          * this state knows about. This method checks for allowed launchers and returns false if it's not allowed for this user. */
         bool launchSlot(SP<SlotProfile> slot_profile, SP<User> launcher);
@@ -161,6 +226,8 @@ class State
 
         /* Checks if given user is allowed to watch given slot. */
         bool isAllowedWatcher(SP<User> user, SP<Slot> slot);
+        /* Checks if anyone, without logging in, is allowed to watch given slot. */
+        bool isAllowedSpectator(SP<Slot> slot);
         /* Checks if given user is allowed to launch given slot profile. */
         bool isAllowedLauncher(SP<User> user, SP<SlotProfile> slot_profile);
         /* Checks if given user is allowed to play in a given slot */
@@ -168,6 +235,17 @@ class State
         /* Checks if given user is allowed to force close a slot */
         bool isAllowedForceCloser(SP<User> closer, SP<Slot> slot);
 
+        /* Bits returned by getSlotPermissions(). */
+        enum SlotPermission { PermissionWatch = 1, PermissionPlay = 2, PermissionForceClose = 4 };
+        /* Returns what the user is allowed to do in the slot, as SlotPermission bits.
+           The result stays valid until getSlotPermissionGeneration() changes, so
+           callers can cache it for the same user and slot. */
+        trankesbel::ui32 getSlotPermissions(SP<User> user, SP<Slot> slot);
+        trankesbel::ui64 getSlotPermissionGeneration() const { return slot_permission_generation; };
+        /* Makes all cached slot permissions invalid. Called when slot
+           profiles, slots or users change. */
+        void invalidateSlotPermissions() { ++slot_permission_generation; };
+
         /* Returns if a slot by given name exists and returns true if it does.
          * Also returns true for empty string. */
         bool hasSlotProfile(const ID &id);
@@ -191,17 +269,28 @@ class State
         /* Sets ticks per second. */
         void setTicksPerSecond(uint64_t ticks_per_second);
 
+        /* Sets zlib memory level and window bits for telnet compression (MCCP2).
+           Memory level 0 turns compression off. Applies to new connections. */
+        void setTelnetCompression(int memory_level, int window_bits)
+        { telnet_compression_memory_level = memory_level; telnet_compression_window_bits = window_bits; };
+
         /* Sets configuration database to use. */
         bool setDatabase(UnicodeString database_file);
         bool setDatabaseUTF8(std::string database_file);
 
         /* Add a new telnet port to listen to. */
-        bool addTelnetService(trankesbel::SocketAddress address);
+        bool addTelnetService(trankesbel::SocketAddress address) { return addTelnetService(address, 1); };
+        /* Same as above, but opens 'listeners' sockets on the same port 
+           (with SO_REUSEPORT) if it's larger than 1. */
+        bool addTelnetService(trankesbel::SocketAddress address, trankesbel::ui32 listeners);
         /* Add a new HTTP/Flash plugin serving port to listen to. 
            The second address is from where flash policy file should be served.
            Set the httpconnectaddress to IP or hostname that points
            to the listening machine in the outside world. */
         bool addHTTPService(trankesbel::SocketAddress address, trankesbel::SocketAddress flashpolicy_address, const std::string &httpconnectaddress);
+        /* Serves /metrics (Prometheus text format) at the address. Nothing else is
+           served there, so use a localhost or otherwise private address. */
+        bool addMetricsService(trankesbel::SocketAddress address);
 
         /* Sets and gets the maximum number of slots that can run at a time. */
         void setMaximumNumberOfSlots(trankesbel::ui32 max_slots);
@@ -236,7 +325,8 @@ class State
         /* Returns if default action is to allow or forbid connection. True
            means allowed, and false is forbidden. */
         bool getDefaultConnectionAllowance() const;
-        /* And setters for all above */
+        /* And setters for all above. If the setting changes, connected clients
+           are checked against the new setting in the next loop iteration. */
         void setAllowedAddresses(const trankesbel::SocketAddressRange &allowed_addresses);
         void setForbiddenAddresses(const trankesbel::SocketAddressRange &forbidden_addresses);
         void setDefaultConnectionAllowance(bool allowance);
@@ -249,6 +339,10 @@ class State
         /* Checks all currently connected clients for restrictions. */
         void checkAddressRestrictions();
 
+        /* Turns recording of lock wait and hold times on or off for
+           the shared resources of the state. */
+        void setLockStatisticsEnabled(bool enabled);
+
 
         /* Creates a new server-to-server configuration pair. The
            connection attempts will immediately start after creating one. */
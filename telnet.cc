@@ -1,20 +1,60 @@
 #include "telnet.hpp"
+#include "nanoclock.hpp"
 #include <cstring>
+#include <cassert>
+#include <zlib.h>
 
 using namespace trankesbel;
 using namespace std;
 
-TelnetSession::TelnetSession()
+/* Size of the receive buffer. */
+static const size_t receive_buffer_size = 65536;
+/* Longest subnegotiation we keep. Longer ones are thrown away. */
+static const size_t max_subnegotiation_size = 512;
+
+/* Telnet command bytes (RFC 854) */
+static const unsigned char IAC = 255;
+static const unsigned char DONT = 254;
+static const unsigned char DO = 253;
+static const unsigned char WILL = 251;
+static const unsigned char SB = 250;
+static const unsigned char SE = 240;
+
+/* Telnet options */
+static const unsigned char OPTION_NAWS = 31;
+static const unsigned char OPTION_COMPRESS2 = 86;
+
+TelnetSession::TelnetSession() : recv_buffer(receive_buffer_size)
 {
     terminal_size_known = false;
     terminal_w = 80;
     terminal_h = 24;
+    terminal_resized = true;
+    parse_state = ParseData;
+    parse_command = 0;
+    subnegotiation_option = 0;
+    subnegotiation_overflow = false;
     packet_index_number = 1;
     closed = false;
+    zero_copy_threshold = 0;
+    receive_stalled = false;
+    compression_state = CompressionOff;
+    compression_start_packet = 0;
+    compression_offered = false;
+    compression_memory_level = 0;
+    compression_window_bits = 15;
+    compression_stream = (z_stream_s*) 0;
+    compressed_data_sent = 0;
+    bytes_sent = 0;
 }
 
 TelnetSession::~TelnetSession()
 {
+    if (compression_stream)
+    {
+        deflateEnd(compression_stream);
+        delete compression_stream;
+    }
 }
 
 void TelnetSession::cycle()
@@ -23,148 +63,355 @@ void TelnetSession::cycle()
 
     /* First reading */
     size_t read_size;
-    char buf[1000];
-    bool result;
+    char buf[4096];
+    bool result = true;
 
+    receive_stalled = false;
     do
     {
-        read_size = 1000;
+        /* Telnet commands are stripped, so what we read
+           always fits if we don't read more than there's room for. */
+        read_size = min(sizeof(buf), recv_buffer.freeSpace());
+        if (read_size == 0)
+        {
+            receive_stalled = true;
+            break;
+        }
         result = readRawData((void*) buf, &read_size);
         if (read_size > 0)
+            processReceivedData(buf, read_size);
+    } while (result && read_size > 0);
+
+    if (!result) { closed = true; return; };
+
+    sendPendingData();
+}
+
+void TelnetSession::processReceivedData(const char* buf, size_t read_size)
+{
+    size_t i1 = 0;
+    while (i1 < read_size)
+    {
+        /* Copy runs of plain data at once; only stop at IACs. */
+        if (parse_state == ParseData || parse_state == ParseSubnegotiationData)
         {
-            /* Process telnet commands */
-            /* This code conveniently assumes telnet commands are not
-               broken up at packet boundary. */
-            ui32 i1;
-            for (i1 = 0; i1 < read_size; ++i1)
+            const char* iac = (const char*) memchr(&buf[i1], IAC, read_size - i1);
+            size_t run_end = iac ? (size_t) (iac - buf) : read_size;
+            if (run_end > i1)
             {
-                // Telnet command?
-                if ((unsigned char) buf[i1] == 255 && i1 < read_size-1)
+                if (parse_state == ParseData)
+                    recv_buffer.write(&buf[i1], run_end - i1);
+                else if (subnegotiation_data.size() + (run_end - i1) <= max_subnegotiation_size)
+                    subnegotiation_data.append(&buf[i1], run_end - i1);
+                else
+                    subnegotiation_overflow = true;
+            }
+            if (!iac) return;
+
+            i1 = run_end + 1;
+            parse_state = (parse_state == ParseData) ? ParseCommand : ParseSubnegotiationIAC;
+            continue;
+        }
+
+        unsigned char c = (unsigned char) buf[i1++];
+        switch(parse_state)
+        {
+            case ParseCommand:
+                if (c == IAC) // Double IAC == just 255
+                {
+                    recv_buffer.push((char) IAC);
+                    parse_state = ParseData;
+                }
+                else if (c >= WILL && c <= DONT)
                 {
-                    if ((unsigned char) buf[i1+1] == 255) // Double IAC == just 255
-                    {
-                        ++i1;
-                        recv_buffer.push_back((char) 255);
-                        continue;
-                    }
+                    parse_command = c;
+                    parse_state = ParseOption;
+                }
+                else if (c == SB)
+                    parse_state = ParseSubnegotiationOption;
+                else // Some 2-byte command, ignore it
+                    parse_state = ParseData;
+            break;
+            case ParseOption:
+                parse_state = ParseData;
+                processOptionCommand(parse_command, c);
+            break;
+            case ParseSubnegotiationOption:
+                subnegotiation_option = c;
+                subnegotiation_data.clear();
+                subnegotiation_overflow = false;
+                parse_state = ParseSubnegotiationData;
+            break;
+            case ParseSubnegotiationIAC:
+                if (c == IAC)
+                {
+                    if (subnegotiation_data.size() < max_subnegotiation_size)
+                        subnegotiation_data.push_back((char) IAC);
                     else
-                    {
-                        // option command? then it should be a three-byte sequence that we'll happily ignore
-                        if ((unsigned char) buf[i1+1] >= 251 && (unsigned char) buf[i1+1] <= 254 && i1 < read_size-2)
-                        {
-                            i1 += 2;
-                            continue;
-                        }
-                        else if (i1 < read_size-2)
-                        {
-                            // Subcommand? We are only performing NAWS
-                            if ((unsigned char) buf[i1+1] == 250 && (unsigned char) buf[i1+2] == 31)
-                            {
-                                ui32 po = i1+3;
-                                if (po >= read_size) continue;
-
-                                unsigned char w1 = buf[po++];
-                                if (w1 == 255)
-                                    ++po;
-                                if (po >= read_size) continue;
-                                unsigned char w2 = buf[po++];
-                                if (w2 == 255)
-                                    ++po;
-                                if (po >= read_size) continue;
-                                unsigned char h1 = buf[po++];
-                                if (h1 == 255)
-                                    ++po;
-                                if (po >= read_size) continue;
-                                unsigned char h2 = buf[po++];
-                                if (h2 == 255)
-                                    ++po;
-                                if (po+1 >= read_size) continue;
-
-                                // Next should IAC and SE
-                                if ((unsigned char) buf[po] != 255 || (unsigned char) buf[po+1] != 240)
-                                    continue;
-
-                                // The numbers are in big endian.
-                                short w = (w1 << 8) + w2;
-                                short h = (h1 << 8) + h2;
-                                
-                                terminal_size_known = true;
-                                terminal_w = w;
-                                terminal_h = h;
-
-                                i1 = po+1;
-                                continue;
-                            }
-                            // Then it's a 2-byte command
-                            ++i1;
-                            continue;
-                        }
-                    }
+                        subnegotiation_overflow = true;
+                    parse_state = ParseSubnegotiationData;
+                }
+                else if (c == SE)
+                {
+                    parse_state = ParseData;
+                    if (!subnegotiation_overflow)
+                        processSubnegotiation(subnegotiation_option, subnegotiation_data);
+                    subnegotiation_data.clear();
                 }
                 else
-                    recv_buffer.push_back(buf[i1]);
-            }
+                {
+                    /* Broken subnegotiation. Drop it and
+                       treat this as a normal command. */
+                    subnegotiation_data.clear();
+                    parse_state = ParseCommand;
+                    --i1;
+                }
+            break;
+            default:
+                parse_state = ParseData;
+            break;
         }
-    } while (result && read_size > 0);
+    }
+}
 
-    if (!result) { closed = true; return; };
+void TelnetSession::processOptionCommand(ui8 command, ui8 option)
+{
+    if (option == OPTION_COMPRESS2 && compression_offered)
+    {
+        /* Client agreed to compression. Tell it that compression
+           starts and start compressing right after that. */
+        if (command == DO && compression_state == CompressionOff)
+        {
+            compression_start_packet = sendPacket("\xff\xfa\x56\xff\xf0", 5);
+            compression_state = CompressionStarting;
+        }
+        return;
+    }
 
-    sendPendingData();
+    handleOptionCommand(command, option);
+}
+
+void TelnetSession::processSubnegotiation(ui8 option, const string &data)
+{
+    if (option == OPTION_NAWS)
+    {
+        if (data.size() != 4) return;
+
+        // The numbers are in big endian.
+        ui32 w = ((ui32) (unsigned char) data[0] << 8) + (ui32) (unsigned char) data[1];
+        ui32 h = ((ui32) (unsigned char) data[2] << 8) + (ui32) (unsigned char) data[3];
+        /* Zero means the client doesn't know. */
+        if (w == 0 || h == 0) return;
+
+        if (!terminal_size_known || w != terminal_w || h != terminal_h)
+            terminal_resized = true;
+        terminal_size_known = true;
+        terminal_w = w;
+        terminal_h = h;
+        return;
+    }
+
+    handleSubnegotiation(option, data);
+}
+
+bool TelnetSession::writeRawDataVector(const DataSpan* spans, size_t spans_count, size_t* size)
+{
+    size_t total = 0;
+    size_t i1;
+    for (i1 = 0; i1 < spans_count; ++i1)
+    {
+        size_t chunk_size = spans[i1].size;
+        bool result = writeRawData(spans[i1].data, &chunk_size);
+        total += chunk_size;
+        if (!result) { (*size) = total; return false; };
+        if (chunk_size < spans[i1].size) break;
+    }
+    (*size) = total;
+    return true;
+}
+
+bool TelnetSession::writeRawDataVectorZeroCopy(const DataSpan* spans, size_t spans_count, const vector<SP<const void> > &owners, size_t* size)
+{
+    return writeRawDataVector(spans, spans_count, size);
 }
 
 void TelnetSession::sendPendingData()
 {
-    size_t got_bytes = 0;
+    if (compression_state == CompressionOn)
+    {
+        sendPendingCompressedData();
+        return;
+    }
 
-    do
+    /* Hand the queued packets over as they are, without gathering
+       them into one buffer first. */
+    DataSpan spans[16];
+
+    while(!packets.empty())
     {
-        /* Collect at least 1000 bytes, unless queue is shorter. */
-        string sbuf;
+        size_t spans_count = 0;
+        size_t total_size = 0;
         map<ui32, TelnetPacket>::iterator i1, packets_end = packets.end();
-        map<ui32, size_t> used_packets;  /* index to number of bytes used */
-        for (i1 = packets.begin(); i1 != packets_end; ++i1)
+        for (i1 = packets.begin(); i1 != packets_end && spans_count < 16; ++i1)
         {
-            sbuf.append(i1->second.getRemainingData());
-            used_packets[i1->first] = i1->second.getDataLength();
-            if (sbuf.size() >= 1000)
+            /* Packets after the compression start marker are compressed. */
+            if (compression_state == CompressionStarting && i1->first > compression_start_packet)
                 break;
+
+            spans[spans_count].data = i1->second.getRemainingDataPointer();
+            spans[spans_count].size = i1->second.getDataLength();
+            total_size += spans[spans_count].size;
+            ++spans_count;
         }
-        if (sbuf.size() == 0) return;
+        if (total_size == 0) return;
 
-        size_t bufsize = sbuf.size();
-        size_t result = writeRawData((void*) sbuf.c_str(), &bufsize);
-        got_bytes = bufsize;
+        size_t bufsize = 0;
+        bool result;
+        if (zero_copy_threshold > 0 && total_size >= zero_copy_threshold)
+        {
+            vector<SP<const void> > owners;
+            owners.reserve(spans_count);
+            size_t i2;
+            for (i1 = packets.begin(), i2 = 0; i2 < spans_count; ++i1, ++i2)
+                owners.push_back(i1->second.getBuffer());
+            result = writeRawDataVectorZeroCopy(spans, spans_count, owners, &bufsize);
+        }
+        else
+            result = writeRawDataVector(spans, spans_count, &bufsize);
         if (!result) closed = true;
+        bytes_sent += bufsize;
 
-        map<ui32, size_t>::iterator i2, used_packets_end = used_packets.end();
+        bool all_sent = (bufsize == total_size);
 
-        if (bufsize == sbuf.size())
+        /* Advance the packets by what was written. */
+        i1 = packets.begin();
+        while (i1 != packets.end() && bufsize > 0)
         {
-            for (i2 = used_packets.begin(); i2 != used_packets_end; ++i2)
-                packets.erase(i2->first);
-            return;
+            size_t len = i1->second.getDataLength();
+            if (len <= bufsize)
+            {
+                bufsize -= len;
+                packets.erase(i1++);
+                continue;
+            }
+            i1->second.addUsedBytes(bufsize);
+            bufsize = 0;
         }
 
-        for (i2 = used_packets.begin(); i2 != used_packets_end && bufsize > 0; ++i2)
+        if (!all_sent || closed) return;
+
+        if (compression_state == CompressionStarting &&
+            packets.find(compression_start_packet) == packets.end())
         {
-            if (i2->second <= bufsize)
+            startCompression();
+            if (compression_state == CompressionOn)
             {
-                packets.erase(i2->first);
-                bufsize -= i2->second;
-                continue;
+                sendPendingCompressedData();
+                return;
             }
+        }
+    }
+}
 
-            TelnetPacket &tp = packets[i2->first];
-            tp.addUsedBytes(bufsize);
-            break;
+ui64 TelnetSession::getQueuedBytes() const
+{
+    ui64 queued = compressed_data.size() - compressed_data_sent;
+    map<ui32, TelnetPacket>::const_iterator i1, packets_end = packets.end();
+    for (i1 = packets.begin(); i1 != packets_end; ++i1)
+        queued += i1->second.getDataLength();
+    return queued;
+}
+
+void TelnetSession::offerCompression(int memory_level, int window_bits)
+{
+    if (compression_offered) return;
+    if (memory_level <= 0) return;
+
+    compression_memory_level = (memory_level > 9) ? 9 : memory_level;
+    compression_window_bits = (window_bits > 15) ? 15 : window_bits;
+    compression_window_bits = (compression_window_bits < 9) ? 9 : compression_window_bits;
+    compression_offered = true;
+
+    /* IAC WILL COMPRESS2 */
+    sendPacket("\xff\xfb\x56", 3);
+}
+
+void TelnetSession::startCompression()
+{
+    assert(!compression_stream);
+
+    compression_stream = new z_stream;
+    memset(compression_stream, 0, sizeof(z_stream));
+    if (deflateInit2(compression_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                     compression_window_bits, compression_memory_level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        /* We already told the client compression starts.
+           Can't continue uncompressed. */
+        delete compression_stream;
+        compression_stream = (z_stream_s*) 0;
+        compression_state = CompressionOff;
+        closed = true;
+        return;
+    }
+
+    compression_state = CompressionOn;
+    compression_statistics.active = true;
+}
+
+void TelnetSession::sendPendingCompressedData()
+{
+    while(!closed)
+    {
+        /* Send what's left of the last frame first. Until it's
+           out, the queued packets stay cancellable. */
+        if (compressed_data_sent < compressed_data.size())
+        {
+            size_t bufsize = compressed_data.size() - compressed_data_sent;
+            bool result = writeRawData(compressed_data.data() + compressed_data_sent, &bufsize);
+            if (!result) closed = true;
+            compressed_data_sent += bufsize;
+            bytes_sent += bufsize;
+            if (compressed_data_sent < compressed_data.size()) return;
         }
+        compressed_data.clear();
+        compressed_data_sent = 0;
+
+        if (packets.empty()) return;
 
-    } while(got_bytes > 0);
+        /* Compress everything queued as one frame. The frame ends
+           with a sync flush so the client can show it right away. */
+        ui64 start_time = nanoclock();
+        char outbuf[16384];
+        map<ui32, TelnetPacket>::iterator i1 = packets.begin();
+        while (i1 != packets.end())
+        {
+            map<ui32, TelnetPacket>::iterator next = i1;
+            ++next;
+
+            compression_stream->next_in = (Bytef*) i1->second.getRemainingDataPointer();
+            compression_stream->avail_in = i1->second.getDataLength();
+            compression_statistics.uncompressed_bytes += i1->second.getDataLength();
+            int flush = (next == packets.end()) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+            do
+            {
+                compression_stream->next_out = (Bytef*) outbuf;
+                compression_stream->avail_out = sizeof(outbuf);
+                deflate(compression_stream, flush);
+                compressed_data.append(outbuf, sizeof(outbuf) - compression_stream->avail_out);
+            } while (compression_stream->avail_out == 0);
+
+            packets.erase(i1);
+            i1 = next;
+        }
+        compression_statistics.compressed_bytes += compressed_data.size();
+        compression_statistics.compression_nanoseconds += nanoclock() - start_time;
+    }
 }
 
 void TelnetSession::handShake()
 {
     /* IAC WILL ECHO - IAC WILL SUPPRESS_GO_AHEAD - IAC WONT LINEMODE - IAC DO NAWS */
+    /* (MCCP2 is offered separately with offerCompression().) */
     /* and \x1b[2J to clear the terminal. */
     string handshake_material("\xff\xfb\x01\xff\xfb\x03"
                               "\xff\xfc\x22\xff\xfd\x1f"
@@ -213,14 +460,9 @@ bool TelnetSession::cancelPacket(ui32 packet_index)
 
 bool TelnetSession::receive(void* data, size_t* datasize)
 {
-    const char* recv_buf_cstr = recv_buffer.c_str();
-    size_t read_bytes = min(*datasize, recv_buffer.size());
-    (*datasize) = read_bytes;
-    memcpy(data, recv_buf_cstr, read_bytes);
+    (*datasize) = recv_buffer.read(data, *datasize);
 
-    recv_buffer = recv_buffer.substr(read_bytes);
-    if (recv_buffer.size() > 0) return true;
+    if (!recv_buffer.empty()) return true;
     if (closed) return false;
     return true;
 }
-
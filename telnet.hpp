@@ -4,6 +4,9 @@
  There's is not much to it, but this implementation
  supports client terminal size information (NAWS).
 
+ Also supports MCCP2 (option 86), compressing the outgoing
+ stream with zlib if the client agrees to it.
+
  Does *not* handle connections or sockets. They need to be
  provided by something else.
 
@@ -20,45 +23,86 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include "types.hpp"
+#include "ring_buffer.hpp"
+
+/* From zlib.h */
+struct z_stream_s;
 
 namespace trankesbel {
 
-/* A packet */
+/* Statistics on MCCP2 compression of a session. */
+struct TelnetCompressionStatistics
+{
+    /* Is outgoing data being compressed right now? */
+    bool active;
+    /* Bytes that went in to compression and
+       bytes that came out of it. */
+    ui64 uncompressed_bytes;
+    ui64 compressed_bytes;
+    /* Time spent compressing. */
+    ui64 compression_nanoseconds;
+
+    TelnetCompressionStatistics()
+    {
+        active = false;
+        uncompressed_bytes = compressed_bytes = compression_nanoseconds = 0;
+    }
+};
+
+/* A packet. The data is held in a reference counted buffer, so
+   copying packets around (or sending the same data to many sessions) 
+   does not copy the data itself. */
 class TelnetPacket
 {
     private:
-        std::string packet_data;
+        SP<const std::string> packet_data;
         size_t sent_data;
 
     public:
         TelnetPacket()
         { sent_data = 0; };
         TelnetPacket(std::string data)
-        { packet_data = data; sent_data = 0; };
+        { packet_data = SP<const std::string>(new std::string(data)); sent_data = 0; };
         TelnetPacket(const void* data, size_t datasize)
-        { packet_data = std::string((const char*) data, datasize); sent_data = 0; };
+        { packet_data = SP<const std::string>(new std::string((const char*) data, datasize)); sent_data = 0; };
+        /* Shares the buffer instead of copying it. */
+        TelnetPacket(SP<const std::string> data)
+        { packet_data = data; sent_data = 0; };
 
         /* Returns remaining data as a new string. */
         std::string getRemainingData() const
         {
-            return packet_data.substr(sent_data);
+            if (!packet_data) return std::string();
+            return packet_data->substr(sent_data);
+        }
+        /* Returns a pointer to remaining data. Valid as long as this packet
+           or the buffer from getBuffer() is alive. */
+        const char* getRemainingDataPointer() const
+        {
+            if (!packet_data) return (const char*) 0;
+            return packet_data->data() + sent_data;
         }
-        ui32 getDataLength() const { return packet_data.size() - sent_data; };
+        ui32 getDataLength() const { if (!packet_data) return 0; return packet_data->size() - sent_data; };
+        /* Returns the buffer holding the data of this packet. */
+        SP<const std::string> getBuffer() const { return packet_data; };
 
         /* Returns true if there is no more data in this packet to send. */
         bool empty() const
         {
-            if (packet_data.size() == 0) return true;
-            if (sent_data >= packet_data.size()) return true;
+            if (!packet_data) return true;
+            if (packet_data->size() == 0) return true;
+            if (sent_data >= packet_data->size()) return true;
             return false;
         }
         /* Inform this packet class that some bytes were used from
            getRemainingData(). */
         void addUsedBytes(size_t used_bytes)
         {
+            if (!packet_data) return;
             sent_data += used_bytes;
-            if (sent_data > packet_data.size()) sent_data = packet_data.size();
+            if (sent_data > packet_data->size()) sent_data = packet_data->size();
         }
         /* Returns true if no data have been used from this packet yet. */
         bool isUnTouched() const
@@ -78,6 +122,41 @@ class TelnetSession
            fields will be filled. */
         bool terminal_size_known;
         ui32 terminal_w, terminal_h;
+        /* Set when terminal size changes, cleared by checkTerminalResize(). */
+        bool terminal_resized;
+
+        /* Where the command parser is. Commands and subnegotiations
+           can be split between reads, so this is kept between them. */
+        enum ParseState { ParseData, ParseCommand, ParseOption,
+                          ParseSubnegotiationOption, ParseSubnegotiationData,
+                          ParseSubnegotiationIAC };
+        ParseState parse_state;
+        /* WILL/WONT/DO/DONT of the option command being parsed. */
+        ui8 parse_command;
+        /* Option and data of the subnegotiation being parsed. */
+        ui8 subnegotiation_option;
+        std::string subnegotiation_data;
+        bool subnegotiation_overflow;
+
+        void processSubnegotiation(ui8 option, const std::string &data);
+        void processOptionCommand(ui8 command, ui8 option);
+
+        /* MCCP2. Compression starts after the packet with index
+           'compression_start_packet' (IAC SB COMPRESS2 IAC SE) has been sent. */
+        enum CompressionState { CompressionOff, CompressionStarting, CompressionOn };
+        CompressionState compression_state;
+        ui32 compression_start_packet;
+        bool compression_offered;
+        int compression_memory_level;
+        int compression_window_bits;
+        z_stream_s* compression_stream;
+        /* Compressed data that hasn't been written yet. */
+        std::string compressed_data;
+        size_t compressed_data_sent;
+        TelnetCompressionStatistics compression_statistics;
+
+        void startCompression();
+        void sendPendingCompressedData();
 
         /* Packets we are sending. The first number is an index number
            and the order in which packets are sent. */
@@ -85,11 +164,24 @@ class TelnetSession
         /* Running index number for packets */
         ui32 packet_index_number;
 
-        /* Receive bufffer */
-        std::string recv_buffer;
+        /* Bytes written to the connection, after compression. */
+        ui64 bytes_sent;
+
+        /* Receive buffer. Fixed size; when it's full, we stop reading
+           and leave the rest in the connection until receive() makes room. */
+        RingBuffer recv_buffer;
+        bool receive_stalled;
+
+        /* Strips telnet commands from data read from connection
+           and puts the rest to receive buffer. */
+        void processReceivedData(const char* data, size_t datasize);
 
         /* Is the connection closed? */
         bool closed;
+
+        /* Writes of at least this many bytes are sent with 
+           writeRawDataVectorZeroCopy(). 0 if never. */
+        size_t zero_copy_threshold;
         
         void sendPendingData();
 
@@ -108,6 +200,24 @@ class TelnetSession
            terminated, true if successful. If data could not be sent at 
            this time, supply 0 for size and return true. */
         virtual bool writeRawData(const void* data, size_t* size) = 0;
+        /* Same as writeRawData, but writes several chunks in order. 'size' is
+           set to the total number of bytes written. The default implementation
+           calls writeRawData for each chunk; override it if the connection
+           can take them all at once. */
+        virtual bool writeRawDataVector(const DataSpan* spans, size_t spans_count, size_t* size);
+        /* Same as above, but the data may be sent without copying it.
+           'owners' hold the memory of the spans, keep references to them
+           if the data is used after returning. Default implementation calls
+           writeRawDataVector. */
+        virtual bool writeRawDataVectorZeroCopy(const DataSpan* spans, size_t spans_count, const std::vector<SP<const void> > &owners, size_t* size);
+
+        /* Called for each option command (WILL, WONT, DO, DONT) from
+           remote side. 'command' is the command byte (251-254). Does nothing by default. */
+        virtual void handleOptionCommand(ui8 command, ui8 option) { };
+        /* Called for each subnegotiation from remote side, with IAC
+           escapes removed from 'data'. NAWS is handled before this is called. 
+           Does nothing by default. */
+        virtual void handleSubnegotiation(ui8 option, const std::string &data) { };
 
     public:
         TelnetSession();
@@ -118,6 +228,25 @@ class TelnetSession
            setting one-character mode. */
         void handShake();
 
+        /* Offers MCCP2 compression to the client. Compression will be used
+           if the client agrees to it. 'memory_level' (1-9) and 'window_bits' (9-15) are
+           passed to zlib; zlib will use about 2^(window_bits+2) + 2^(memory_level+9)
+           bytes of memory for the session. Memory level 0 doesn't offer compression. 
+           Call this right after handShake(). */
+        void offerCompression(int memory_level, int window_bits);
+        TelnetCompressionStatistics getCompressionStatistics() const { return compression_statistics; };
+
+        /* Returns the number of bytes written to the connection. */
+        ui64 getBytesSent() const { return bytes_sent; };
+        /* Returns the number of bytes waiting to be written. Queued packets
+           are counted before compression. */
+        ui64 getQueuedBytes() const;
+
+        /* Sets the size at which writes are done through 
+           writeRawDataVectorZeroCopy(). 0 turns it off, which is the default.
+           Zero copy only pays off with large writes. */
+        void setZeroCopyThreshold(size_t bytes) { zero_copy_threshold = bytes; };
+
         /* Returns true if session has been closed. */
         bool isClosed() const;
 
@@ -147,6 +276,10 @@ class TelnetSession
            Set the size of your buffer to 'datasize', this will
            be then filled with bytes read from remote side. */
         bool receive(void* data, size_t* datasize);
+        /* Returns true if the last cycle() stopped reading because the 
+           receive buffer was full. Once you have received the data, 
+           cycle() again to read the rest. */
+        bool isReceiveStalled() const { return receive_stalled; };
 
         /* If client terminal is using NAWS (terminal size information), then
            isTerminalSizeKnown() returns true. The terminal size can then
@@ -160,6 +293,16 @@ class TelnetSession
             (*w) = terminal_w;
             (*h) = terminal_h;
         }
+        /* Returns true if terminal size has changed since last call, and
+           puts the new size to 'w' and 'h'. Returns true on the first call,
+           so that you get the initial size. */
+        bool checkTerminalResize(ui32 *w, ui32 *h)
+        {
+            if (!terminal_resized) return false;
+            terminal_resized = false;
+            getTerminalSize(w, h);
+            return true;
+        }
 };
 
 }
@@ -79,5 +79,28 @@ int main(int argc, char* argv[])
     if (lo_copied.get() != copy_addr)
         return 6;
 
+    /* Shared locks. Readers can hold the lock at the same time,
+       and copying moves the lock. */
+    SharedLockedResource<data> slr;
+    slr.setStatisticsEnabled(true);
+    {
+    SharedLockedObject<data> w = slr.lock();
+    w->mushValue(1);
+    }
+    {
+    SharedLockedObject<const data> r1 = slr.lockShared();
+    SharedLockedObject<const data> r2 = slr.lockShared();
+    if (r1->values.size() != 1 || r1.get() != r2.get())
+        return 7;
+
+    SharedLockedObject<const data> r3(r1);
+    if (r1.get() != (const data*) 0 || r3.get() != r2.get())
+        return 8;
+    }
+
+    LockStatistics ls = slr.getStatistics();
+    if (ls.locks != 3 || ls.contended_locks != 0)
+        return 9;
+
     return 0;
 }
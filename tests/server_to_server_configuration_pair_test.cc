@@ -41,6 +41,16 @@ int main(int argc, char* argv[])
     if (pair.getServerTimeout() != 12345678987654321ULL)
         return 1;
 
+    cout << "Checking that the link is not a relay at start." << endl;
+    if (pair.isRelay())
+        return 1;
+
+    cout << "Checking that relay survives serialization." << endl;
+    pair.setRelay(true);
+    ServerToServerConfigurationPair pair2;
+    if (!pair2.unSerialize(pair.serialize()) || !pair2.isRelay() || pair2.getServerTimeout() != 12345678987654321ULL)
+        return 1;
+
     cout << "Everything ok." << endl;
 
     return 0;
@@ -0,0 +1,99 @@
+/*
+   Test that SocketAddressRange matches IPv4 and IPv6 ranges and
+   single addresses, including numbers of 128 and above, which were
+   once sign extended when addresses were split into parts.
+*/
+
+#include "sockets.hpp"
+#include <iostream>
+
+using namespace trankesbel;
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const SocketAddressRange &sar, const char* address, bool expected)
+{
+    bool success = false;
+    SocketAddress sa = SocketAddress::resolvePlainUTF8(address, "0", &success, NULL);
+    if (!success)
+    {
+        cout << "Could not parse address " << address << "." << endl;
+        ++failures;
+        return;
+    }
+
+    if (sar.testAddress(sa) != expected)
+    {
+        cout << address << " should " << (expected ? "" : "not ") << "match, but it does" << (expected ? " not." : ".") << endl;
+        ++failures;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    initializeSockets();
+
+    SocketAddressRange sar;
+    expect(sar, "127.0.0.1", false);
+    expect(sar, "::1", false);
+
+    /* 192.168.*.200-255 */
+    sar.addIPv4Range(192, 168, NumberRange(0, 255), NumberRange(200, 255));
+    /* 10.128-255.0.0 */
+    sar.addIPv4Range(10, NumberRange(128, 255), 0, 0);
+
+    expect(sar, "192.168.0.200", true);
+    expect(sar, "192.168.255.255", true);
+    expect(sar, "192.168.130.199", false);
+    expect(sar, "192.169.0.200", false);
+    expect(sar, "10.128.0.0", true);
+    expect(sar, "10.255.0.0", true);
+    expect(sar, "10.127.0.0", false);
+    expect(sar, "10.200.0.1", false);
+
+    /* Single addresses */
+    bool success = false;
+    SocketAddress single4 = SocketAddress::resolvePlainUTF8("200.201.202.203", "1234", &success, NULL);
+    SocketAddress single6 = SocketAddress::resolvePlainUTF8("fe80::ffff:8000", "1234", &success, NULL);
+    sar.addSocketAddress(single4);
+    sar.addSocketAddress(single6);
+
+    expect(sar, "200.201.202.203", true);
+    expect(sar, "200.201.202.204", false);
+    expect(sar, "fe80::ffff:8000", true);
+    expect(sar, "fe80::ffff:8001", false);
+
+    /* 2001:db8:ff00-ffff:* */
+    sar.addIPv6Range(0x2001, 0xdb8, NumberRange(0xff00, 0xffff), NumberRange(0, 0xffff),
+                     NumberRange(0, 0xffff), NumberRange(0, 0xffff), NumberRange(0, 0xffff), NumberRange(0, 0xffff));
+
+    expect(sar, "2001:db8:ff00::", true);
+    expect(sar, "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff", true);
+    expect(sar, "2001:db8:feff::1", false);
+    expect(sar, "2001:db9:ff00::", false);
+    expect(sar, "::ffff", false);
+
+    /* Deleting a single address only removes that one. */
+    sar.deleteSocketAddress(single4);
+    expect(sar, "200.201.202.203", false);
+    expect(sar, "fe80::ffff:8000", true);
+    expect(sar, "192.168.0.200", true);
+
+    /* Everything */
+    SocketAddressRange all;
+    all.addIPv4Range(NumberRange(0, 255), NumberRange(0, 255), NumberRange(0, 255), NumberRange(0, 255));
+    expect(all, "0.0.0.0", true);
+    expect(all, "255.255.255.255", true);
+    expect(all, "::", false);
+
+    shutdownSockets();
+
+    if (failures)
+    {
+        cout << failures << " failures." << endl;
+        return 1;
+    }
+    cout << "All tests passed." << endl;
+    return 0;
+}
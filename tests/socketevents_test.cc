@@ -0,0 +1,74 @@
+/*
+   Test that SocketEvents::getEvent() returns after wakeUp(), and that
+   the wake-up doesn't keep later calls from waiting.
+   Assumes 127.0.0.1:23458 is a free port and can be listened on.
+*/
+
+#include "sockets.hpp"
+#include "nanoclock.hpp"
+#include <iostream>
+#include <unistd.h>
+
+using namespace trankesbel;
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    initializeSockets();
+
+    /* getEvent() that never returns would hang the test; fail it instead. */
+    alarm(10);
+
+    bool success = false;
+    SocketAddress sa = SocketAddress::resolvePlainUTF8("127.0.0.1", "23458", &success, NULL);
+    if (!success)
+    {
+        cout << "Resolving 127.0.0.1:23458 failed." << endl;
+        shutdownSockets();
+        return 1;
+    }
+
+    SP<Socket> s(new Socket);
+    if (!s->listen(sa))
+    {
+        cout << "Listening on 127.0.0.1:23458 failed. " << s->getError() << endl;
+        shutdownSockets();
+        return 1;
+    }
+
+    SocketEvents events;
+    events.addSocket(s);
+
+    int i1;
+    for (i1 = 0; i1 < 3; ++i1)
+    {
+        events.wakeUp();
+        events.wakeUp();
+
+        ui64 start = nanoclock();
+        SP<Socket> result = events.getEvent(5000000000ULL); /* 5 seconds */
+        ui64 took = nanoclock() - start;
+        if (result || took > 1000000000ULL)
+        {
+            cout << "getEvent() did not return right away after wakeUp(). (failure)" << endl;
+            shutdownSockets();
+            return 1;
+        }
+
+        /* The wake-up is used up, so this one should wait for the timeout. */
+        start = nanoclock();
+        result = events.getEvent(100000000ULL); /* 100 milliseconds */
+        took = nanoclock() - start;
+        if (result || took < 50000000ULL || took > 1000000000ULL)
+        {
+            cout << "getEvent() did not wait for the timeout after a wake-up. (failure)" << endl;
+            shutdownSockets();
+            return 1;
+        }
+    }
+
+    cout << "Everything ok." << endl;
+    shutdownSockets();
+    return 0;
+}
+
@@ -0,0 +1,118 @@
+/*
+   Test to check TelnetSession strips telnet commands and
+   parses NAWS, even when they are split between reads.
+*/
+
+#include <string>
+#include <cstring>
+#include <iostream>
+#include "telnet.hpp"
+
+using namespace trankesbel;
+using namespace std;
+
+/* Feeds the session from a string, at most 'chunk' bytes per read. */
+class TestTelnetSession : public TelnetSession
+{
+    public:
+        string input;
+        size_t input_pos;
+        size_t chunk;
+
+        TestTelnetSession() { input_pos = 0; chunk = 1000; };
+
+        bool readRawData(void* data, size_t* size)
+        {
+            size_t n = input.size() - input_pos;
+            if (n > chunk) n = chunk;
+            if (n > (*size)) n = (*size);
+            memcpy(data, input.data() + input_pos, n);
+            input_pos += n;
+            (*size) = n;
+            return true;
+        }
+        bool writeRawData(const void* data, size_t* size)
+        {
+            return true;
+        }
+
+        /* Cycles once per chunk and returns everything received. */
+        string feed(const string &s)
+        {
+            input.append(s);
+            string result;
+            while (input_pos < input.size())
+            {
+                cycle();
+                char buf[100];
+                size_t buf_size;
+                do
+                {
+                    buf_size = 100;
+                    receive(buf, &buf_size);
+                    result.append(buf, buf_size);
+                } while(buf_size > 0);
+            }
+            return result;
+        }
+};
+
+int main(int argc, char* argv[])
+{
+    /* Plain data, doubled IAC, an option command and a NAWS for 80x25. */
+    const string stream("ab\xff\xff" "c\xff\xfb\x01" "d"
+                        "\xff\xfa\x1f\x00\x50\x00\x19\xff\xf0" "e", 19);
+    const string expected("ab\xff" "cde");
+
+    size_t chunk;
+    for (chunk = 1; chunk <= stream.size(); ++chunk)
+    {
+        TestTelnetSession ts;
+        ts.chunk = chunk;
+
+        ui32 w, h;
+        if (!ts.checkTerminalResize(&w, &h) || w != 80 || h != 24)
+        {
+            cout << "Initial size was not reported as 80x24." << endl;
+            return 1;
+        }
+
+        if (ts.feed(stream) != expected)
+        {
+            cout << "Wrong data received with " << chunk << " byte reads." << endl;
+            return 2;
+        }
+
+        if (!ts.isTerminalSizeKnown() || !ts.checkTerminalResize(&w, &h) || w != 80 || h != 25)
+        {
+            cout << "NAWS was not parsed with " << chunk << " byte reads." << endl;
+            return 3;
+        }
+
+        /* Same size again is not a resize. */
+        ts.feed(string("\xff\xfa\x1f\x00\x50\x00\x19\xff\xf0", 9));
+        if (ts.checkTerminalResize(&w, &h))
+        {
+            cout << "Same size was reported as resize with " << chunk << " byte reads." << endl;
+            return 4;
+        }
+    }
+
+    /* 255 in NAWS is doubled. */
+    {
+        TestTelnetSession ts;
+        ui32 w, h;
+        ts.checkTerminalResize(&w, &h);
+        ts.feed(string("\xff\xfa\x1f\x00\xff\xff\x00\x30\xff\xf0", 10));
+        if (!ts.checkTerminalResize(&w, &h) || w != 255 || h != 48)
+        {
+            cout << "NAWS with escaped 255 was not parsed." << endl;
+            return 5;
+        }
+    }
+
+    cout << "Everything ok." << endl;
+
+    return 0;
+}
+
@@ -0,0 +1,96 @@
+/*
+   Test to check WebSocketSession computes the handshake key and
+   parses masked and fragmented frames, even when they are split
+   between reads.
+*/
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "websocket.hpp"
+
+using namespace trankesbel;
+using namespace std;
+
+/* Builds a masked client frame. */
+static string client_frame(const string &payload, ui8 opcode, bool fin)
+{
+    const unsigned char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+    string frame;
+    frame.push_back((char) ((fin ? 0x80 : 0) | opcode));
+    frame.push_back((char) (0x80 | payload.size()));
+    frame.append((const char*) mask, 4);
+    size_t i1;
+    for (i1 = 0; i1 < payload.size(); ++i1)
+        frame.push_back((char) (payload[i1] ^ mask[i1 & 3]));
+    return frame;
+}
+
+int main(int argc, char* argv[])
+{
+    /* The example from RFC 6455 */
+    if (WebSocketSession::acceptKey("dGhlIHNhbXBsZSBub25jZQ==") != "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+    {
+        cout << "Wrong Sec-WebSocket-Accept value." << endl;
+        return 1;
+    }
+
+    /* A message, a ping in the middle of a fragmented message and the rest. */
+    const string stream = client_frame("hello", WebSocketBinary, true) +
+                          client_frame("wor", WebSocketText, false) +
+                          client_frame("", WebSocketPing, true) +
+                          client_frame("ld", WebSocketContinuation, true);
+
+    size_t chunk;
+    for (chunk = 1; chunk <= stream.size(); ++chunk)
+    {
+        WebSocketSession ws;
+        vector<string> messages;
+
+        size_t i1;
+        for (i1 = 0; i1 < stream.size(); i1 += chunk)
+            ws.feed(stream.data() + i1, min(chunk, stream.size() - i1), &messages);
+
+        if (messages.size() != 2 || messages[0] != "hello" || messages[1] != "world")
+        {
+            cout << "Wrong messages with " << chunk << " byte reads." << endl;
+            return 2;
+        }
+
+        /* The pong */
+        if (ws.getQueuedFrames() != 1)
+        {
+            cout << "Ping was not answered with " << chunk << " byte reads." << endl;
+            return 3;
+        }
+    }
+
+    /* Server frames are unmasked and use the extended length when needed. */
+    SP<const string> frame = WebSocketSession::makeFrame(string(300, 'x'));
+    if (frame->size() != 304 || (unsigned char) (*frame)[0] != 0x82 ||
+        (unsigned char) (*frame)[1] != 126 || (unsigned char) (*frame)[2] != 1 || (unsigned char) (*frame)[3] != 44)
+    {
+        cout << "Wrong frame header." << endl;
+        return 4;
+    }
+
+    /* Unmasked frames from a client are an error and nothing is parsed after them. */
+    {
+        WebSocketSession ws;
+        vector<string> messages;
+        string unmasked("\x82\x01" "a", 3);
+        string more = client_frame("b", WebSocketBinary, true);
+        ws.feed(unmasked.data(), unmasked.size(), &messages);
+        ws.feed(more.data(), more.size(), &messages);
+        if (!messages.empty() || ws.getQueuedFrames() != 1)
+        {
+            cout << "Unmasked frame was not refused." << endl;
+            return 5;
+        }
+    }
+
+    cout << "Everything ok." << endl;
+
+    return 0;
+}
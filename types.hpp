@@ -44,6 +44,14 @@ typedef float float32;
 #define UnorderedMap std::map
 #define UnorderedSet std::set
 
+/* A pointer to a chunk of memory and its size. Used
+   to pass several buffers at once for scatter-gather I/O. */
+struct DataSpan
+{
+    const void* data;
+    size_t size;
+};
+
 /* some basic enums */
 enum Direction { Left = 4, Top = 8, Right = 6, Bottom = 2, Up = 5, Down = 10,
                  TopRight = 9, TopLeft = 7,
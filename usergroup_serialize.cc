@@ -1,5 +1,7 @@
 #include <sstream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include "configuration_primitives.hpp"
 
 using namespace std;
@@ -12,8 +14,16 @@ data1D UserGroup::serialize() const
     ss << (has_anybody ? 'Y' : 'N');
     ss << (has_launcher ? 'Y' : 'N');
 
-    set<ID>::iterator i1, has_user_end = has_user.end();
-    for (i1 = has_user.begin(); i1 != has_user_end; ++i1)
+    /* Sorted by ID, so the result doesn't depend on the order handles were given out. */
+    vector<ID> users;
+    users.reserve(has_user.size());
+    set<IDHandle>::const_iterator i3, has_user_end = has_user.end();
+    for (i3 = has_user.begin(); i3 != has_user_end; ++i3)
+        users.push_back(ID::getByHandle(*i3));
+    sort(users.begin(), users.end());
+
+    vector<ID>::iterator i1, users_end = users.end();
+    for (i1 = users.begin(); i1 != users_end; ++i1)
     {
         string user_utf8 = (*i1).serialize();
 
@@ -55,7 +65,7 @@ UserGroup UserGroup::unSerialize(data1D data)
         }
         if (c == ';')
         {
-            ug.has_user.insert(ID::getUnSerialized(name_utf8));
+            ug.has_user.insert(ID::getUnSerialized(name_utf8).getHandle());
             name_utf8.clear();
             continue;
         }
@@ -0,0 +1,228 @@
+#include "websocket.hpp"
+#include <openssl/sha.h>
+#include <cstring>
+
+using namespace trankesbel;
+using namespace std;
+
+static const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static string base64_encode(const unsigned char* data, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string result;
+    result.reserve((len + 2) / 3 * 4);
+    size_t i1;
+    for (i1 = 0; i1 + 2 < len; i1 += 3)
+    {
+        ui32 v = (data[i1] << 16) | (data[i1+1] << 8) | data[i1+2];
+        result.push_back(alphabet[(v >> 18) & 0x3F]);
+        result.push_back(alphabet[(v >> 12) & 0x3F]);
+        result.push_back(alphabet[(v >> 6) & 0x3F]);
+        result.push_back(alphabet[v & 0x3F]);
+    }
+    if (i1 < len)
+    {
+        ui32 v = data[i1] << 16;
+        if (i1 + 1 < len) v |= data[i1+1] << 8;
+        result.push_back(alphabet[(v >> 18) & 0x3F]);
+        result.push_back(alphabet[(v >> 12) & 0x3F]);
+        result.push_back((i1 + 1 < len) ? alphabet[(v >> 6) & 0x3F] : '=');
+        result.push_back('=');
+    }
+    return result;
+}
+
+WebSocketSession::WebSocketSession()
+{
+    in_message = false;
+    close_sent = false;
+    close_received = false;
+    failed = false;
+}
+
+string WebSocketSession::acceptKey(const string &key)
+{
+    string k = key + websocket_guid;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char*) k.data(), k.size(), digest);
+    return base64_encode(digest, SHA_DIGEST_LENGTH);
+}
+
+SP<const string> WebSocketSession::makeFrame(const string &payload, WebSocketOpcode opcode)
+{
+    string* frame = new string;
+    SP<const string> sp_frame(frame);
+
+    frame->reserve(payload.size() + 10);
+    frame->push_back((char) (0x80 | opcode));
+    ui64 len = payload.size();
+    if (len < 126)
+        frame->push_back((char) len);
+    else if (len < 65536)
+    {
+        frame->push_back((char) 126);
+        frame->push_back((char) (len >> 8));
+        frame->push_back((char) len);
+    }
+    else
+    {
+        frame->push_back((char) 127);
+        int i1;
+        for (i1 = 7; i1 >= 0; --i1)
+            frame->push_back((char) (len >> (i1 * 8)));
+    }
+    frame->append(payload);
+
+    return sp_frame;
+}
+
+void WebSocketSession::fail(ui16 code)
+{
+    failed = true;
+    close(code);
+}
+
+void WebSocketSession::close(ui16 code)
+{
+    if (close_sent) return;
+    close_sent = true;
+
+    string payload;
+    payload.push_back((char) (code >> 8));
+    payload.push_back((char) code);
+    output.push(makeFrame(payload, WebSocketClose));
+}
+
+bool WebSocketSession::isActive() const
+{
+    return (s && s->active() && !close_sent);
+}
+
+void WebSocketSession::feed(const char* data, size_t len, vector<string>* messages)
+{
+    if (close_received || failed) return;
+    input.append(data, len);
+
+    size_t pos = 0;
+    while (!close_received && !failed)
+    {
+        size_t avail = input.size() - pos;
+        if (avail < 2) break;
+
+        const unsigned char* h = (const unsigned char*) input.data() + pos;
+        bool fin = (h[0] & 0x80) != 0;
+        ui8 opcode = h[0] & 0x0F;
+        bool masked = (h[1] & 0x80) != 0;
+        ui64 payload_len = h[1] & 0x7F;
+        size_t header_len = 2;
+
+        /* No extensions were agreed on, so reserved bits must be zero. */
+        if (h[0] & 0x70) { fail(1002); break; };
+        /* Frames from clients are always masked. */
+        if (!masked) { fail(1002); break; };
+
+        if (payload_len == 126)
+        {
+            if (avail < 4) break;
+            payload_len = (h[2] << 8) | h[3];
+            header_len = 4;
+        }
+        else if (payload_len == 127)
+        {
+            if (avail < 10) break;
+            payload_len = 0;
+            int i1;
+            for (i1 = 0; i1 < 8; ++i1)
+                payload_len = (payload_len << 8) | h[2+i1];
+            header_len = 10;
+        }
+        if (payload_len > MAX_WEBSOCKET_MESSAGE_SIZE) { fail(1009); break; };
+        if (avail < header_len + 4 + payload_len) break;
+
+        const unsigned char* mask = h + header_len;
+        string payload((const char*) h + header_len + 4, (size_t) payload_len);
+        size_t i1, payload_size = payload.size();
+        for (i1 = 0; i1 < payload_size; ++i1)
+            payload[i1] ^= mask[i1 & 3];
+        pos += header_len + 4 + (size_t) payload_len;
+
+        /* Control frames can come in the middle of a fragmented message. */
+        if (opcode & 0x8)
+        {
+            if (!fin || payload_len > 125) { fail(1002); break; };
+
+            if (opcode == WebSocketPing)
+                queueFrame(makeFrame(payload, WebSocketPong));
+            else if (opcode == WebSocketClose)
+            {
+                close_received = true;
+                ui16 code = 1000;
+                if (payload.size() >= 2)
+                    code = (ui16) ((((unsigned char) payload[0]) << 8) | ((unsigned char) payload[1]));
+                close(code);
+            }
+            else if (opcode != WebSocketPong)
+            { fail(1002); break; };
+            continue;
+        }
+
+        if (opcode == WebSocketContinuation)
+        {
+            if (!in_message) { fail(1002); break; };
+        }
+        else if (opcode == WebSocketText || opcode == WebSocketBinary)
+        {
+            if (in_message) { fail(1002); break; };
+            in_message = true;
+            message.clear();
+        }
+        else
+        { fail(1002); break; };
+
+        if (message.size() + payload.size() > MAX_WEBSOCKET_MESSAGE_SIZE) { fail(1009); break; };
+        message.append(payload);
+        if (fin)
+        {
+            messages->push_back(message);
+            message.clear();
+            in_message = false;
+        }
+    }
+
+    input.erase(0, pos);
+}
+
+void WebSocketSession::readMessages(vector<string>* messages)
+{
+    if (!s) return;
+
+    char buf[4096];
+    while (!close_received && !failed)
+    {
+        size_t result = s->recv(buf, 4096);
+        if (result == 0) break;
+        feed(buf, result, messages);
+    }
+}
+
+void WebSocketSession::queueFrame(SP<const string> frame)
+{
+    if (!frame) return;
+    /* Nothing goes after a close frame. */
+    if (close_sent) return;
+    output.push(frame);
+}
+
+void WebSocketSession::flush()
+{
+    if (!s || !s->active()) return;
+
+    if (!output.flush(s.get())) return;
+
+    /* Close frame is out, we're done. */
+    if (close_sent)
+        s->close();
+}
+
@@ -0,0 +1,96 @@
+/*
+
+Server side of the WebSocket protocol (RFC 6455), for connections that
+have been upgraded from HTTP. See HTTPServer::serveWebSocket().
+
+Frames sent by the server are not masked, so a frame is the same bytes for
+every connection. Frames are built once with makeFrame() and the same
+buffer can be queued to any number of sessions.
+
+*/
+
+#ifndef websocket_hpp
+#define websocket_hpp
+
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "sockets.hpp"
+#include "send_queue.hpp"
+
+namespace trankesbel {
+
+/* Frame opcodes */
+enum WebSocketOpcode { WebSocketContinuation = 0x0,
+                       WebSocketText = 0x1,
+                       WebSocketBinary = 0x2,
+                       WebSocketClose = 0x8,
+                       WebSocketPing = 0x9,
+                       WebSocketPong = 0xA };
+
+/* Largest message we accept from the other end. */
+const size_t MAX_WEBSOCKET_MESSAGE_SIZE = 65536;
+
+class WebSocketSession
+{
+    private:
+        SP<Socket> s;
+
+        /* Received data that is not a complete frame yet. */
+        std::string input;
+        /* Fragments of a message that is not complete yet. */
+        std::string message;
+        bool in_message;
+
+        /* Frames waiting to be sent. */
+        SendQueue output;
+
+        bool close_sent;
+        bool close_received;
+        /* Set on protocol errors; the connection is closed after sending what's queued. */
+        bool failed;
+
+        /* No copies */
+        WebSocketSession(const WebSocketSession &ws) { };
+        WebSocketSession& operator=(const WebSocketSession &ws) { return (*this); };
+
+        /* Queues a close frame with status 'code' and stops reading. */
+        void fail(ui16 code);
+
+    public:
+        WebSocketSession();
+
+        /* Computes the Sec-WebSocket-Accept value for a Sec-WebSocket-Key. */
+        static std::string acceptKey(const std::string &key);
+        /* Builds an unmasked frame with 'payload'. */
+        static SP<const std::string> makeFrame(const std::string &payload, WebSocketOpcode opcode = WebSocketBinary);
+
+        void setSocket(SP<Socket> s) { this->s = s; };
+        SP<Socket> getSocket() const { return s; };
+
+        /* Parses received data. Complete text and binary messages are
+           appended to 'messages'. Pings are answered and a close frame is
+           answered with a close frame. */
+        void feed(const char* data, size_t len, std::vector<std::string>* messages);
+        /* Reads from the socket and feeds the data, until there is nothing to read. */
+        void readMessages(std::vector<std::string>* messages);
+
+        /* Queues a frame made with makeFrame(). */
+        void queueFrame(SP<const std::string> frame);
+        /* Returns the number of frames not completely sent. */
+        size_t getQueuedFrames() const { return output.size(); };
+        /* Sends queued frames as far as the socket allows. Closes the
+           socket once a closing handshake or an error is done. */
+        void flush();
+
+        /* Starts closing the connection with a close frame. */
+        void close(ui16 code);
+
+        /* Returns true if the connection is open and not closing. */
+        bool isActive() const;
+};
+
+}
+
+#endif
+